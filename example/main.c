@@ -23,6 +23,10 @@ void uni_on_join(void *server, void *player) {
     free(player);
 }
 
+bool uni_on_packet_received(void *server, void *player, int packet_id, void *pkt_struct) {
+    return true;
+}
+
 void uni_on_write_finish(void *user_ptr) {
 }
 
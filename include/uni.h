@@ -7,6 +7,9 @@
 typedef struct UniServerImpl UniServer;
 typedef struct UniConnectionImpl UniConnection;
 
+// See uni_play.h
+typedef struct UniInPluginChunk UniInPluginChunk;
+
 typedef enum {
     // A socket with the same address and port is already being used.
     UNI_ERR_IN_USE,
@@ -21,6 +24,142 @@ typedef enum {
     UNI_ERR_UNKNOWN,
 } UniError;
 
+typedef enum {
+    // Submissions and completions both go through a plain io_uring_enter()
+    // call in uni_poll()/uni_try_poll(). Works on every supported kernel.
+    UNI_RING_DEFAULT,
+
+    // A kernel thread polls the submission queue, so submitting I/O usually
+    // doesn't need a system call at all. Costs one (optionally pinned) CPU
+    // core while the server is busy. Requires Linux 5.11.
+    UNI_RING_SQPOLL,
+
+    // Completions are not delivered by interrupting the polling thread, but
+    // are batched until it next enters the kernel. Requires Linux 5.19.
+    UNI_RING_COOP_TASKRUN,
+
+    // Like UNI_RING_COOP_TASKRUN, but completion work is deferred entirely
+    // until the polling thread asks for events. The ring may only be used
+    // from the thread which called uni_create(). Requires Linux 6.1.
+    UNI_RING_DEFER_TASKRUN,
+} UniRingMode;
+
+typedef enum {
+    // io_uring if the kernel supports it, epoll otherwise.
+    UNI_BACKEND_AUTO,
+
+    // io_uring. Requires Linux 5.7.
+    UNI_BACKEND_URING,
+
+    // Edge-triggered epoll with non-blocking sockets. Works wherever io_uring
+    // is unavailable or disabled, e.g. in many container sandboxes.
+    UNI_BACKEND_EPOLL,
+} UniBackend;
+
+typedef struct {
+    // The I/O interface to use. If UNI_BACKEND_URING or UNI_BACKEND_EPOLL is
+    // requested but not available, uni_create() fails with
+    // UNI_ERR_UNSUPPORTED. Use uni_backend() to find out which one
+    // UNI_BACKEND_AUTO picked.
+    UniBackend backend;
+
+    // How the io_uring backend should process I/O. If the requested mode isn't
+    // supported, the server falls back to the next cheaper mode that is
+    // (DEFER_TASKRUN -> COOP_TASKRUN -> DEFAULT, SQPOLL -> DEFAULT). Use
+    // uni_ring_mode() to find out which mode is actually in use.
+    UniRingMode ring_mode;
+
+    // The CPU to pin the UNI_RING_SQPOLL kernel thread to, or -1 to let the
+    // scheduler decide.
+    int sqpoll_cpu;
+
+    // How long the UNI_RING_SQPOLL kernel thread keeps polling an idle
+    // submission queue before going to sleep.
+    int sqpoll_idle_ms;
+
+    // If greater than zero, uni_poll() spins waiting for events for up to
+    // this many microseconds before blocking. Lowers latency at the cost of
+    // CPU time.
+    int busy_poll_us;
+
+    // Whether to record latency histograms. See uni_get_histogram().
+    bool latency_histograms;
+
+    // If not NULL, every inbound frame is recorded to a capture file at this
+    // path, along with when connections open and close. The file is written by
+    // a background thread. See uni_capture.h for the format and tools/replay
+    // for playing captures back. Only supported on Linux.
+    const char *capture_path;
+
+    // Outbound backpressure. Packets passed to uni_write() are queued until the
+    // client has received them, and a client which reads slower than the
+    // server writes makes its queue grow. See uni_pending_bytes().
+    //
+    // Once a PLAY connection has more than 'write_high_watermark' bytes
+    // pending, on_write_pressure() is called with 'throttle' set, and once its
+    // queue has drained to 'write_low_watermark' bytes or less, it is called
+    // again with 'throttle' cleared. A server can use this to hold back data
+    // that can be sent later, such as chunks. May be NULL.
+    uint64_t write_high_watermark;
+    uint64_t write_low_watermark;
+    void (*on_write_pressure)(void *server_user_ptr, void *conn_user_ptr, bool throttle);
+
+    // A connection which has had more than 'write_hard_cap' bytes pending for
+    // 'write_hard_cap_ms' is disconnected and its queue freed, whether or not
+    // anything is written to it in the meantime. Polling wakes up for this.
+    // A hard cap of 0 disables the check.
+    uint64_t write_hard_cap;
+    int write_hard_cap_ms;
+
+    // If greater than 0, PLAY packets longer than 'stream_threshold' bytes
+    // aren't buffered whole. Instead, they are read 'stream_chunk_size' bytes
+    // at a time, which must be at least 512, and plugin messages are passed to
+    // on_plugin_chunk() piece by piece as they arrive. Other streamed packets
+    // are skipped. This bounds the memory a connection can pin to about
+    // max(stream_threshold, stream_chunk_size), so packets up to the
+    // protocol's limit of 2 MiB are accepted rather than 16 KiB. Streamed
+    // packets aren't recorded to capture_path.
+    //
+    // on_plugin_chunk() may be NULL, in which case large plugin messages are
+    // skipped, too. Returning false from it disconnects the client.
+    int stream_threshold;
+    int stream_chunk_size;
+    bool (*on_plugin_chunk)(void *server_user_ptr, void *conn_user_ptr, const UniInPluginChunk *chunk);
+
+    // Admission control, which smooths out bursts of logins, e.g. when a proxy
+    // restarts and all of its players reconnect at once. Accepted connections
+    // start logging in at no more than 'login_rate' per second, allowing bursts
+    // of up to 'login_burst', and with no more than 'max_concurrent_logins'
+    // logins in progress at a time. A rate or cap of 0 disables that limit.
+    // Connections over the limits wait in a FIFO queue of up to
+    // 'login_queue_size' connections, and are disconnected if it is full. A
+    // connection may wait for up to 'login_queue_timeout_ms'. Its login
+    // timeout only starts once it is admitted. With a rate limit, the queue
+    // is also capped at the number of connections which can be admitted
+    // within that time. See UniStats.logins_queued and logins_rejected.
+    int login_rate;
+    int login_burst;
+    int max_concurrent_logins;
+    int login_queue_size;
+    int login_queue_timeout_ms;
+
+    // If greater than 0, packets received in PLAY are handed to a pool of
+    // 'worker_threads' threads (at most 15), so slow packet handlers don't
+    // hold up I/O. uni_on_packet_received(), the handlers of registered
+    // channels and on_plugin_chunk() are then called on a worker. All packets
+    // of a connection go to the same worker and are handled in the order they
+    // arrived, and what is passed to the handler stays valid until it
+    // returns. Returning false still disconnects the client, once the polling
+    // thread picks up the result. The other callbacks are still called on the
+    // polling thread. Functions which aren't thread-safe, such as uni_write(),
+    // may only be called from a worker if the application synchronizes with
+    // the polling thread. Ignored on Windows.
+    int worker_threads;
+} UniConfig;
+
+// Fills *config with the settings uni_create() uses.
+void uni_default_config(UniConfig *config);
+
 // Initializes a uni server.
 // 'secret' is the shared secret configured in the proxy. It must be null-
 // terminated.
@@ -32,6 +171,19 @@ typedef enum {
 // be made.
 UniServer *uni_create(uint16_t port, const char *secret, void *user_ptr, UniError *err);
 
+// Same as uni_create(), but with the settings in *config. See UniConfig.
+UniServer *uni_create_with_config(
+    uint16_t port, const char *secret, void *user_ptr, const UniConfig *config, UniError *err
+);
+
+// Returns the ring mode the server is actually running in. May differ from the
+// requested UniConfig.ring_mode if the system doesn't support it. Always
+// UNI_RING_DEFAULT if the server doesn't use io_uring.
+UniRingMode uni_ring_mode(UniServer *server);
+
+// Returns the backend the server is running on. Never UNI_BACKEND_AUTO.
+UniBackend uni_backend(UniServer *server);
+
 // Cleans up memory related to a server handle. Only needs to be called if
 // uni_create() succeeds.
 void uni_free(UniServer *server);
@@ -39,6 +191,43 @@ void uni_free(UniServer *server);
 // Starts accepting connections.
 bool uni_listen(UniServer *server);
 
+// The most a UniHandoffSaver may write per connection.
+#define UNI_HANDOFF_STATE_MAX 4096
+
+// Writes what the new process needs to take over a connection's player, e.g.
+// its entity ID, into 'buf', which holds UNI_HANDOFF_STATE_MAX bytes. Returns
+// the number of bytes written, or -1 to disconnect the client instead.
+typedef int (*UniHandoffSaver)(void *server_user_ptr, void *conn_user_ptr, void *buf, int cap);
+
+// Takes over a connection's player from what UniHandoffSaver wrote. Returns
+// the connection's user pointer, like uni_on_login(), or NULL to disconnect
+// the client. May write to the connection, and the client receives that after
+// everything the old process had queued.
+typedef void *(*UniAdoptHandler)(void *server_user_ptr, UniConnection *conn, const void *state, int state_len);
+
+// Hands the listening socket and all connections in PLAY over to another
+// process, which resumes them with uni_adopt(), e.g. to restart the server
+// without disconnecting its players. Packets in flight in either direction
+// are passed along. Connections which are still logging in are disconnected.
+// 'sock_fd' is a connected, blocking Unix domain stream socket to the other
+// process. Must be called from the polling thread instead of polling, which
+// this does itself until pending I/O is cancelled, so callbacks may run.
+// Returns true once everything was sent. The server then has no connections
+// left, their user pointers must not be used anymore, and the only call left
+// to make is uni_free(). Returns false if the handoff failed, in which case
+// the connections which hadn't been sent yet go on as before.
+// Linux only; always fails elsewhere.
+bool uni_handoff(UniServer *server, int sock_fd, UniHandoffSaver save);
+
+// Same as uni_create_with_config() followed by uni_listen(), but takes over the
+// listening socket and connections sent by uni_handoff() on 'sock_fd' instead
+// of binding a port. 'restore' is called for every connection. Returns once
+// the other process is done, after which 'sock_fd' should be closed.
+// Linux only; always fails with UNI_ERR_UNSUPPORTED elsewhere.
+UniServer *uni_adopt(
+    int sock_fd, const char *secret, void *user_ptr, const UniConfig *config, UniAdoptHandler restore, UniError *err
+);
+
 // Polls the server for new I/O events. Should be called repeatedly and will
 // block until a new event occurs.
 // See also uni_try_poll()
@@ -48,6 +237,219 @@ void uni_poll(UniServer *server);
 // events.
 void uni_try_poll(UniServer *server);
 
+// Similar to uni_poll(), but blocks at most until 'deadline_ns' (a point in time
+// as returned by uni_clock_ns()) and handles at most 'max_events' events. Any
+// events beyond that are left for the next call. A max_events of 0 or less
+// means there is no limit. Returns the number of events handled.
+// This lets a tick-based game loop bound how much time it spends on I/O:
+//     uni_poll_timeout(server, tick_start + 50000000, 1024);
+int uni_poll_timeout(UniServer *server, uint64_t deadline_ns, int max_events);
+
+// The following functions are for running a server inside an existing event
+// loop (epoll, poll, select, ...) instead of calling uni_poll() on a thread of
+// its own. A loop iteration then looks like:
+//     wait until uni_event_fd(server) is readable (along with other fds)
+//     uni_process_completions(server, 0);
+//     uni_submit(server);
+// uni_process_completions() and uni_submit() must be called from the same
+// thread. Don't mix them with the uni_poll*() functions.
+
+// Returns a file descriptor which becomes readable whenever the server has
+// events to process. Returns -1 if it could not be created. It is owned by the
+// server and must not be read from or closed by the caller.
+int uni_event_fd(UniServer *server);
+
+// Handles at most 'max_events' pending events without blocking. A max_events
+// of 0 or less means there is no limit. I/O requested while handling the events
+// (including by callbacks such as uni_on_packet_received()) is queued, but not
+// handed to the operating system until uni_submit() is called. Returns the
+// number of events handled.
+int uni_process_completions(UniServer *server, int max_events);
+
+// Hands all queued I/O to the operating system without waiting for anything.
+void uni_submit(UniServer *server);
+
+// Returns the current time of the monotonic clock used by uni_poll_timeout() in
+// nanoseconds.
+uint64_t uni_clock_ns(void);
+
+// The stage of the protocol a connection is in.
+typedef enum {
+    UNI_STAGE_HANDSHAKE,
+    UNI_STAGE_LOGIN_START,
+    UNI_STAGE_PLUGIN_RES,
+    UNI_STAGE_LOGIN_SUCCESS,
+    UNI_STAGE_PLAY,
+
+    UNI_NUM_STAGES,
+} UniConnStage;
+
+// Serverbound PLAY packets with an ID below this are counted individually in
+// UniStats.packets_in_by_id.
+#define UNI_STATS_PACKET_IDS 128
+
+// Errors with an errno value below this are counted individually in
+// UniStats.errors_by_errno. Index 0 counts all other errors.
+#define UNI_STATS_ERRNOS 134
+
+typedef struct {
+    // Connections accepted since the server was created.
+    uint64_t accepts;
+
+    // Currently open connections, by the stage they are in.
+    int64_t active_conns[UNI_NUM_STAGES];
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t packets_in;
+    uint64_t packets_out;
+
+    // Packets received in the PLAY stage, by packet ID.
+    uint64_t packets_in_by_id[UNI_STATS_PACKET_IDS];
+
+    // I/O operations handed to and completed by the operating system.
+    uint64_t sqes;
+    uint64_t cqes;
+
+    // Times queued I/O operations were handed to the operating system.
+    uint64_t submit_calls;
+
+    // Heap allocations the server made on its own behalf (connections, I/O
+    // operations, packet buffers).
+    uint64_t allocs;
+
+    // Packets passed to uni_write() which haven't been fully written yet, and
+    // their unwritten bytes.
+    int64_t write_queue_depth;
+    int64_t write_queue_bytes;
+
+    // Connections disconnected for exceeding UniConfig.write_hard_cap.
+    uint64_t write_cap_disconnects;
+
+    // Plugin messages dropped because their channel wasn't registered. See
+    // uni_register_channel().
+    uint64_t plugin_msgs_dropped;
+
+    // Capture records dropped because the capture writer couldn't keep up.
+    // See UniConfig.capture_path.
+    uint64_t capture_records_dropped;
+
+    // Connections which had to wait for admission, those disconnected because
+    // the queue was full, and those waiting right now. See
+    // UniConfig.login_rate.
+    uint64_t logins_queued;
+    uint64_t logins_rejected;
+    int64_t login_queue_depth;
+
+    // Failed network operations, by errno value. See UNI_STATS_ERRNOS.
+    uint64_t errors_by_errno[UNI_STATS_ERRNOS];
+} UniStats;
+
+// Fills *stats with the server's counters. Counting costs next to nothing on
+// the polling thread, and this function can be called from any thread.
+// However, the counters are not read atomically as a whole, so a snapshot may
+// be slightly inconsistent while the server is busy.
+void uni_get_stats(UniServer *server, UniStats *stats);
+
+typedef enum {
+    // Connection accepted -> Handshake received.
+    UNI_HIST_HANDSHAKE,
+
+    // Handshake received -> Login Start received and plugin request sent.
+    UNI_HIST_LOGIN_START,
+
+    // Plugin request sent -> plugin response received. Mostly the round trip
+    // to the proxy.
+    UNI_HIST_PLUGIN_RES,
+
+    // Time taken to verify the forwarding data's HMAC.
+    UNI_HIST_HMAC_VERIFY,
+
+    // Time spent in uni_on_login().
+    UNI_HIST_ON_LOGIN,
+
+    // Login Success sent -> fully written.
+    UNI_HIST_LOGIN_SUCCESS,
+
+    // Time spent in uni_on_join().
+    UNI_HIST_ON_JOIN,
+
+    // Connection accepted -> uni_on_join() returned.
+    UNI_HIST_LOGIN_TOTAL,
+
+    // Time spent handling events per uni_poll*() call which had any.
+    UNI_HIST_POLL,
+
+    // Time spent handling a single completed accept, read, write or timeout
+    // operation.
+    UNI_HIST_EVENT_ACCEPT,
+    UNI_HIST_EVENT_READ,
+    UNI_HIST_EVENT_WRITE,
+    UNI_HIST_EVENT_TIMEOUT,
+
+    UNI_NUM_HISTOGRAMS,
+} UniHistogramId;
+
+// Values are sorted into buckets on a log-linear scale: every power of two is
+// divided into 16 equally sized buckets, which keeps the error of any value read
+// back below ~6%. Values of 2^36 ns (~69 s) or more all end up in the last
+// bucket.
+#define UNI_HIST_BUCKETS 528
+
+typedef struct {
+    // Number of recorded values.
+    uint64_t count;
+
+    uint64_t sum_ns;
+    uint64_t max_ns;
+
+    uint64_t buckets[UNI_HIST_BUCKETS];
+} UniHistogram;
+
+// Copies a latency histogram into *hist. Can be called from any thread. Like
+// uni_get_stats(), the snapshot is not taken atomically.
+void uni_get_histogram(UniServer *server, UniHistogramId id, UniHistogram *hist);
+
+// Clears all of the server's latency histograms. Can be called from any thread,
+// but the histograms are only cleared once the polling thread next polls.
+void uni_reset_histograms(UniServer *server);
+
+// Returns the value in nanoseconds below which 'percentile' (0 - 100) percent
+// of the histogram's values fall, e.g. 99 for p99. Returns 0 for an empty
+// histogram.
+uint64_t uni_histogram_percentile(const UniHistogram *hist, double percentile);
+
+typedef enum {
+    UNI_LOG_DEBUG,
+    UNI_LOG_INFO,
+    UNI_LOG_WARN,
+    UNI_LOG_ERROR,
+} UniLogLevel;
+
+// Receives log messages. 'msg' is not null-terminated; use 'msg_len'.
+// 'time_ns' is when the message was logged, as returned by uni_clock_ns().
+typedef void (*UniLogSink)(void *user_ptr, UniLogLevel level, uint64_t time_ns, const char *msg, int msg_len);
+
+// uni never writes log messages out on the thread which logs them. Each thread
+// formats its messages into a buffer of its own, and a background thread passes
+// them on to the sink. If a thread logs faster than the sink can keep up, its
+// messages are dropped, and a call site which logs the same message over and
+// over is muted for the rest of the second after a few repeats. Both are
+// reported to the sink once it catches up. On Windows, messages are still
+// passed to the sink on the thread which logs them.
+
+// Sets where log messages go. The sink is only ever called from uni's logging
+// thread, one message at a time. A NULL sink restores the default, which prints
+// to stdout. Applies to all servers in the process.
+void uni_set_log_sink(UniLogSink sink, void *user_ptr);
+
+// Messages below 'level' are discarded without being formatted. Defaults to
+// UNI_LOG_INFO (UNI_LOG_DEBUG in debug builds).
+void uni_set_log_level(UniLogLevel level);
+
+// Blocks until every message logged so far has been passed to the sink.
+void uni_flush_log(void);
+
 // Note: All the strings in UniLoginProperty and UniLoginData with the exception
 // of player_name are pointing to data within a received packet. Be sure to copy
 // away if you need to keep them. None of the strings are null-terminated. Use
@@ -98,6 +500,7 @@ extern void uni_on_join(void *server_user_ptr, void *conn_user_ptr);
 // can be inferred from packet_id. See uni_play.h for a list of packets.
 // Warning: Unless otherwise noted, the pkt_struct and it's fields point to
 // stack-allocated data. Be sure to copy any data before the function returns.
+// Called on a worker thread if UniConfig.worker_threads is set.
 extern bool uni_on_packet_received(
     void *server_user_ptr, void *conn_user_ptr, int packet_id, void *pkt_struct
 );
@@ -108,14 +511,64 @@ typedef struct {
     int write_idx;
 } UniPacketOut;
 
-// Writes a packet to the connection. Warning: This function is not thread-safe,
-// nor will it attempt to queue packets if the previous packet hasn't been
-// fully written. Synchronization is the responsibility of the caller. See also
-// uni_on_write_finish()
+// How urgently a packet has to reach the client. See uni_write_priority().
+typedef enum {
+    // Packets the player notices the latency of, e.g. keep alives, teleports
+    // and combat.
+    UNI_PRIORITY_HIGH,
+
+    // Everything else. The priority of uni_write().
+    UNI_PRIORITY_NORMAL,
+
+    // Large transfers which may take a while, e.g. chunk data.
+    UNI_PRIORITY_BULK,
+
+    UNI_NUM_PRIORITIES,
+} UniPriority;
+
+// Writes a packet to the connection and takes ownership of packet->buf, which
+// is freed with free() once written. Packets written while a previous one
+// hasn't been fully written yet are queued and written in order. Packets
+// written after writing failed or the connection was disconnected are freed
+// right away. Warning: This function is not thread-safe. Synchronization is the
+// responsibility of the caller. See also uni_on_write_finish() and
+// UniConfig.write_high_watermark.
 void uni_write(UniConnection *conn, UniPacketOut *packet);
 
-// Called when a write operation concludes. This function is guaranteed to be
-// called from the same thread which called uni_poll() or uni_try_poll().
+// Same as uni_write(), but queues the packet in the lane for 'priority'. Once a
+// packet is written, the next one is taken from the most urgent lane which
+// isn't empty, so a high priority packet waits for at most the rest of one bulk
+// packet. Packets of the same priority are written in order, but packets of
+// different priorities may overtake each other. Split bulk data into packets
+// of a few KB (e.g. one chunk each) for urgent packets to get through.
+void uni_write_priority(UniConnection *conn, UniPacketOut *packet, UniPriority priority);
+
+// Returns the number of bytes passed to uni_write() which haven't been written
+// yet.
+uint64_t uni_pending_bytes(UniConnection *conn);
+
+// Sets the chunk a connection's player is in and the view distance it was sent
+// in Join Game. The connection then receives the packets broadcast with
+// uni_broadcast_area() for chunks at most 'view_distance' chunks away along
+// each axis. Call it again whenever the player moves into another chunk or the
+// view distance changes. Returns false if memory couldn't be allocated, in
+// which case the connection doesn't receive broadcasts until the next
+// successful call. Not thread-safe, like uni_write().
+bool uni_set_view(UniConnection *conn, int chunk_x, int chunk_z, int view_distance);
+
+// Stops broadcasts to a connection, e.g. while its player is changing worlds.
+// Connections are removed automatically when they are freed.
+void uni_clear_view(UniConnection *conn);
+
+// Writes a packet to every connection which can see the chunk at 'chunk_x',
+// 'chunk_z', as set with uni_set_view(). Takes ownership of packet->buf, which
+// all of them share and which is freed once the last one has written it.
+// Returns the number of connections it was written to. Not thread-safe, like
+// uni_write().
+int uni_broadcast_area(UniServer *server, int chunk_x, int chunk_z, UniPacketOut *packet);
+
+// Called whenever a packet has been fully written. This function is guaranteed
+// to be called from the same thread which called uni_poll() or uni_try_poll().
 extern void uni_on_write_finish(void *user_ptr);
 
 // Mark a connection as "to-be-closed". Note that this will not disconnect the
@@ -0,0 +1,53 @@
+#ifndef UNI_CAPTURE_H
+#define UNI_CAPTURE_H
+
+// Format of the capture files written when UniConfig.capture_path is set, and
+// read by tools/replay.
+//
+// A capture starts with a header:
+//     "UNICAP"                magic
+//     u8                      format version (UNI_CAPTURE_VERSION)
+//     u8                      reserved, 0
+//     u64 (little-endian)     wall clock time the capture started, in
+//                             nanoseconds since the Unix epoch
+//
+// followed by records until the end of the file:
+//     u8                      record type (UniCaptureRecord)
+//     uvarint                 nanoseconds since the previous record (or the
+//                             start of the capture)
+//     uvarint                 connection ID, unique within the capture
+//     UNI_CAPTURE_FRAME only:
+//         uvarint             frame length
+//         bytes               frame, without its length prefix
+//
+// uvarints are unsigned LEB128 of up to 64 bits, the same encoding as protocol
+// varints but without sign handling.
+//
+// Frames are recorded as soon as they have been read in full, before they are
+// handled. Records are dropped if the writer can't keep up. The connection
+// then gets a UNI_CAPTURE_GAP record, right before its next record that makes
+// it into the capture, or after its last one if its close record was dropped
+// too. See also UniStats.capture_records_dropped.
+
+#define UNI_CAPTURE_MAGIC "UNICAP"
+#define UNI_CAPTURE_MAGIC_LEN 6
+#define UNI_CAPTURE_VERSION 2
+#define UNI_CAPTURE_HEADER_LEN 16
+
+typedef enum {
+    // A connection was accepted.
+    UNI_CAPTURE_OPEN = 1,
+
+    // A complete inbound frame was received.
+    UNI_CAPTURE_FRAME = 2,
+
+    // The connection was closed and freed.
+    UNI_CAPTURE_CLOSE = 3,
+
+    // Records of the connection were dropped since its previous record, so
+    // its traffic can't be replayed faithfully from here on. Added in version
+    // 2.
+    UNI_CAPTURE_GAP = 4,
+} UniCaptureRecord;
+
+#endif // !UNI_CAPTURE_H
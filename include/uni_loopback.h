@@ -0,0 +1,45 @@
+#ifndef UNI_LOOPBACK_H
+#define UNI_LOOPBACK_H
+
+// In-process connections which bypass the network entirely. The server handles
+// them exactly like connections accepted from its socket (same packet handlers,
+// same callbacks), except that they have no login timeout. This makes it
+// possible to measure the cost of parsing and dispatching packets on its own,
+// or to simulate thousands of clients deterministically in a single process.
+//
+// Loopback I/O never blocks and is only performed by uni_loopback_run(). The
+// uni_poll*() functions don't touch it. Like everything else involving a
+// server, loopback functions must be called from the polling thread.
+
+#include <stdbool.h>
+
+#include "uni.h"
+
+typedef struct UniLoopbackImpl UniLoopback;
+
+// Connects a new virtual client to the server. Returns NULL if out of memory.
+UniLoopback *uni_loopback_connect(UniServer *server);
+
+// Queues 'len' bytes of data for the server to read. The data is copied.
+// Returns false if the server already closed the connection or memory ran out.
+bool uni_loopback_send(UniLoopback *client, const void *data, int len);
+
+// Copies up to 'max_len' bytes the server has written to the client into
+// 'buf'. Returns the number of bytes copied, which is 0 if there are none.
+int uni_loopback_recv(UniLoopback *client, void *buf, int max_len);
+
+// Returns whether the server has closed the connection. Data it wrote before
+// that can still be received.
+bool uni_loopback_closed(UniLoopback *client);
+
+// Closes the client's end of the connection, which the server sees as the end
+// of the stream. The client must not be used afterwards. Its memory is freed
+// once the server has let go of the connection as well.
+void uni_loopback_close(UniLoopback *client);
+
+// Performs pending loopback I/O until no more progress can be made, or until
+// 'max_events' reads and writes completed. A max_events of 0 or less means
+// there is no limit. Returns the number of completed reads and writes.
+int uni_loopback_run(UniServer *server, int max_events);
+
+#endif // !UNI_LOOPBACK_H
@@ -0,0 +1,89 @@
+#ifndef UNI_NBT_H_
+#define UNI_NBT_H_
+
+#include <stdint.h>
+
+// A streaming NBT writer. Tags are written straight to a buffer in the order
+// the functions are called, without building a tree first, e.g. to encode the
+// registry codec passed to uni_pkt_join_game():
+//
+//     static void write_codec(UniNbt *nbt) {
+//         uni_nbt_compound(nbt, "", 0);
+//         uni_nbt_compound(nbt, "minecraft:dimension_type", 24);
+//         uni_nbt_string(nbt, "type", 4, "minecraft:dimension_type", 24);
+//         uni_nbt_list(nbt, "value", 5, UNI_NBT_COMPOUND, 1);
+//         uni_nbt_compound(nbt, NULL, 0);
+//         ...
+//         uni_nbt_end(nbt);
+//         uni_nbt_end(nbt);
+//         uni_nbt_end(nbt);
+//     }
+//
+//     UniNbt nbt;
+//     uni_nbt_init(&nbt, NULL);
+//     write_codec(&nbt);
+//     char *buf = malloc(nbt.len);
+//     uni_nbt_init(&nbt, buf);
+//     write_codec(&nbt);
+//
+// The first pass only measures how long the encoding is, so the same function
+// is used to size the buffer and to fill it.
+//
+// Every value function takes the name of the tag. Inside a list, the elements
+// have neither a type nor a name, so NULL is passed as the name. Names and
+// strings are written as given and must be in Java's modified UTF-8, which is
+// the same as UTF-8 unless they contain NUL or characters outside the BMP.
+
+typedef enum {
+    UNI_NBT_END = 0,
+    UNI_NBT_BYTE = 1,
+    UNI_NBT_SHORT = 2,
+    UNI_NBT_INT = 3,
+    UNI_NBT_LONG = 4,
+    UNI_NBT_FLOAT = 5,
+    UNI_NBT_DOUBLE = 6,
+    UNI_NBT_BYTE_ARRAY = 7,
+    UNI_NBT_STRING = 8,
+    UNI_NBT_LIST = 9,
+    UNI_NBT_COMPOUND = 10,
+    UNI_NBT_INT_ARRAY = 11,
+    UNI_NBT_LONG_ARRAY = 12,
+} UniNbtType;
+
+typedef struct {
+    // Where the next tag is written, or NULL while measuring.
+    char *cursor;
+
+    // Bytes written, or that would have been written while measuring.
+    int len;
+} UniNbt;
+
+// Starts writing to 'buf', which must be large enough for everything written
+// to it. If 'buf' is NULL, nothing is written and only 'len' is counted.
+static inline void uni_nbt_init(UniNbt *nbt, char *buf) {
+    nbt->cursor = buf;
+    nbt->len = 0;
+}
+
+void uni_nbt_byte(UniNbt *nbt, const char *name, int name_len, int8_t val);
+void uni_nbt_short(UniNbt *nbt, const char *name, int name_len, int16_t val);
+void uni_nbt_int(UniNbt *nbt, const char *name, int name_len, int32_t val);
+void uni_nbt_long(UniNbt *nbt, const char *name, int name_len, int64_t val);
+void uni_nbt_float(UniNbt *nbt, const char *name, int name_len, float val);
+void uni_nbt_double(UniNbt *nbt, const char *name, int name_len, double val);
+void uni_nbt_string(UniNbt *nbt, const char *name, int name_len, const char *str, int str_len);
+
+void uni_nbt_byte_array(UniNbt *nbt, const char *name, int name_len, const int8_t *vals, int count);
+void uni_nbt_int_array(UniNbt *nbt, const char *name, int name_len, const int32_t *vals, int count);
+void uni_nbt_long_array(UniNbt *nbt, const char *name, int name_len, const int64_t *vals, int count);
+
+// Starts a list of 'count' elements of type 'type'. The elements are written
+// next with a NULL name. An empty list should have type UNI_NBT_END.
+void uni_nbt_list(UniNbt *nbt, const char *name, int name_len, UniNbtType type, int count);
+
+// Starts a compound. Its tags are written next, followed by uni_nbt_end().
+// The root of a network NBT value is a compound named "".
+void uni_nbt_compound(UniNbt *nbt, const char *name, int name_len);
+void uni_nbt_end(UniNbt *nbt);
+
+#endif // !UNI_NBT_H_
@@ -17,6 +17,56 @@ typedef struct {
     int data_len;
 } UniInPluginMessage;
 
+// A piece of a plugin message streamed to UniConfig.on_plugin_chunk(). The
+// pieces of a message are passed in order, without any other packet of the
+// connection in between. 'channel' and 'data' point into a buffer which is
+// reused for the next piece.
+struct UniInPluginChunk {
+    const char *channel;
+    int channel_len;
+
+    // This piece of the message's data, which starts 'data_offset' bytes into
+    // it. The whole data is 'total_len' bytes long.
+    unsigned char *data;
+    int data_len;
+    int data_offset;
+    int total_len;
+
+    // Whether this is the last piece of the message.
+    bool last;
+
+    // The channel's ID if channels are registered, -1 otherwise. See
+    // uni_register_channel().
+    int channel_id;
+};
+
+// Handles a plugin message on a registered channel. 'data' points into the
+// connection's read buffer and must be copied to be kept. Returning false
+// disconnects the client.
+typedef bool (*UniChannelHandler)(
+    void *server_user_ptr, void *conn_user_ptr, int channel_id, unsigned char *data, int data_len
+);
+
+// Registers a plugin message channel and returns its ID, or -1 if the name is
+// empty or longer than 255 bytes or memory ran out. IDs count up from 0 in the
+// order channels are registered. Registering a channel again replaces its
+// handler and returns the same ID. Must be called from the polling thread,
+// usually before uni_listen().
+//
+// Once any channel is registered, inbound plugin messages are routed by
+// channel: messages on registered channels go to their handler instead of
+// uni_on_packet_received(), and messages on other channels, or on channels
+// with a NULL handler, are dropped without reading their data. Streamed
+// messages still go to UniConfig.on_plugin_chunk(), with their channel ID set,
+// but only if their channel is registered.
+int uni_register_channel(UniServer *server, const char *name, int name_len, UniChannelHandler handler);
+
+// Builds a plugin message on a registered channel. The packet ID and channel
+// name are encoded once at registration and copied into the packet.
+UniPacketOut uni_pkt_plugin_msg(UniServer *server, int channel_id, const void *data, int data_len);
+
+// 'registry_codec' is the encoded NBT of the registry codec, which can be
+// written with uni_nbt.h. It is copied into the packet.
 UniPacketOut uni_pkt_join_game(
     int entity_id,
     bool hardcore,
@@ -45,4 +95,107 @@ UniPacketOut uni_pkt_join_game(
     int64_t death_loc
 );
 
+// Bits per entry of the global block state palette.
+#define UNI_BLOCK_STATE_BITS 15
+
+// A 16x16x16 block section of a chunk.
+typedef struct {
+    // 4096 global block state IDs, indexed by (y * 16 + z) * 16 + x.
+    const uint16_t *block_states;
+
+    // 64 biome IDs of the section's 4x4x4 cells, indexed by (y * 4 + z) * 4 + x.
+    // IDs are the biomes' indices in the registry codec sent with Join Game.
+    const uint16_t *biomes;
+
+    // Number of blocks in the section which aren't air.
+    int block_count;
+} UniChunkSection;
+
+typedef struct {
+    int x;
+    int z;
+
+    // The sections, from the bottom of the world up.
+    const UniChunkSection *sections;
+    int num_sections;
+
+    // Bits per entry of the global biome palette, i.e. ceil(log2(n)) for n
+    // biomes in the registry codec.
+    int biome_bits;
+
+    // 256 heights, indexed by z * 16 + x, of the block above the highest
+    // motion blocking block, counted from the bottom of the world. May be
+    // NULL.
+    const uint16_t *motion_blocking;
+
+    // Light levels of the sections, with one extra section below and one above
+    // the world (num_sections + 2 entries). Each entry is 2048 bytes, two
+    // nibbles per block indexed like block_states, or NULL if the section is
+    // completely dark. Either array may be NULL to not send that kind of light.
+    const unsigned char *const *sky_light;
+    const unsigned char *const *block_light;
+
+    // Whether the client may skip recalculating light at the chunk's edges.
+    bool trust_edges;
+} UniChunk;
+
+// Builds a Chunk Data and Update Light packet. Each section's blocks and biomes
+// are encoded with the smallest palette that fits: a single value, an indirect
+// palette, or the global palette. Block entities aren't supported.
+UniPacketOut uni_pkt_chunk(const UniChunk *chunk);
+
+// State of entities at the end of a tick, as parallel arrays of 'count'
+// entries each. Positions are in blocks and rotations in degrees. The 'prev_'
+// arrays hold the state last sent to viewers.
+typedef struct {
+    int count;
+
+    const int *ids;
+
+    const double *prev_x;
+    const double *prev_y;
+    const double *prev_z;
+    const double *x;
+    const double *y;
+    const double *z;
+
+    const float *prev_yaw;
+    const float *prev_pitch;
+    const float *yaw;
+    const float *pitch;
+
+    const bool *on_ground;
+} UniEntityMoves;
+
+// Maximum length of an encoded movement packet, including its length prefix.
+#define UNI_MOVE_FRAME_MAX 40
+
+// The movement packets of one tick. Each entity's packet is encoded once and
+// then copied into the writes of all viewers which can see it. Zero-initialize
+// before the first use; the memory is reused by the following ticks.
+typedef struct {
+    // The packet of entity i starts at frames[i * UNI_MOVE_FRAME_MAX] and is
+    // lens[i] bytes long, or 0 if the entity neither moved nor turned.
+    char *frames;
+    unsigned char *lens;
+
+    // Which packet each entity needs. Only used while encoding.
+    unsigned char *kinds;
+
+    int count;
+    int cap;
+} UniMoveBatch;
+
+// Encodes a movement packet for each entity in 'moves' into 'batch': a relative
+// move, rotation, or both, or a teleport if the entity moved 8 blocks or more
+// along an axis. Returns false if memory couldn't be allocated.
+bool uni_encode_moves(UniMoveBatch *batch, const UniEntityMoves *moves);
+
+void uni_move_batch_free(UniMoveBatch *batch);
+
+// Builds a single write holding the movement packets of the entities at
+// 'indices' in 'batch', e.g. those within a viewer's view distance. If none of
+// them moved, 'buf' is NULL and 'len' is 0.
+UniPacketOut uni_pkt_entity_moves(const UniMoveBatch *batch, const int *indices, int count);
+
 #endif // !UNI_PLAY_H_
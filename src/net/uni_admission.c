@@ -0,0 +1,188 @@
+#include "uni_admission.h"
+
+#include "uni_connection.h"
+#include "uni_log.h"
+#include "uni_server.h"
+#include "uni_time.h"
+
+// The token bucket is kept as the time at which it will be full again
+// ('login_tat_ns', as in the generic cell rate algorithm), so refilling it
+// doesn't need a timer. Every login moves that point 1/login_rate seconds
+// further into the future, and a login is only admitted if it isn't more than
+// login_burst - 1 intervals ahead.
+static inline uint64_t uni_login_interval(const UniConfig *config) {
+    return 1000000000ull / (uint64_t) config->login_rate;
+}
+
+static inline uint64_t uni_login_tolerance(const UniConfig *config) {
+    int burst = config->login_burst > 1 ? config->login_burst : 1;
+    return (uint64_t) (burst - 1) * uni_login_interval(config);
+}
+
+static bool uni_admission_full(UniServer *server) {
+    int max = server->config.max_concurrent_logins;
+    return max > 0 && server->logins_in_progress >= max;
+}
+
+// Takes a token and a login slot, if available.
+static bool uni_admission_take(UniServer *server) {
+    const UniConfig *config = &server->config;
+
+    if (uni_admission_full(server)) {
+        return false;
+    }
+
+    if (config->login_rate > 0) {
+        uint64_t now = uni_time_ns();
+        uint64_t tat = server->login_tat_ns > now ? server->login_tat_ns : now;
+        if (tat - now > uni_login_tolerance(config)) {
+            return false;
+        }
+        server->login_tat_ns = tat + uni_login_interval(config);
+    }
+
+    server->logins_in_progress++;
+    return true;
+}
+
+// The number of connections which may wait for admission.
+static int uni_login_queue_cap(const UniConfig *config) {
+    int cap = config->login_queue_size;
+    if (config->login_rate > 0) {
+        int64_t admittable = (int64_t) config->login_rate * config->login_queue_timeout_ms / 1000;
+        if (admittable < cap) {
+            cap = (int) admittable;
+        }
+    }
+    return cap;
+}
+
+static void uni_admission_start(UniConnection *conn) {
+    // The time spent in the queue doesn't count towards the login timeout.
+    if (conn->admission == UNI_ADMISSION_QUEUED && conn->transport->reset_timeout != NULL) {
+        conn->transport->reset_timeout(conn, UNI_LOGIN_TIMEOUT_SECS * 1000);
+    }
+
+    conn->admission = UNI_ADMISSION_ADMITTED;
+    uni_conn_start(conn);
+}
+
+void uni_admission_init(UniServer *server) {
+    server->login_queue_head = NULL;
+    server->login_queue_tail = NULL;
+    server->login_queue_len = 0;
+    server->logins_in_progress = 0;
+    server->login_tat_ns = 0;
+}
+
+void uni_conn_admit(UniConnection *conn) {
+    UniServer *server = conn->server;
+
+    // Connections still being logged in aren't handed over, so there's no
+    // point in starting any.
+    if (server->handing_off) {
+        uni_conn_shutdown(conn);
+        return;
+    }
+
+    // Connections which are already waiting go first.
+    if (server->login_queue_head == NULL && uni_admission_take(server)) {
+        uni_admission_start(conn);
+        return;
+    }
+
+    if (server->login_queue_len >= uni_login_queue_cap(&server->config)) {
+        UNI_DLOG(
+            "Disconnect: conn %llu rejected, %d logins queued", (unsigned long long) conn->id, server->login_queue_len
+        );
+        UNI_STAT_INC(server, logins_rejected);
+        uni_conn_shutdown(conn);
+        return;
+    }
+
+    conn->admission = UNI_ADMISSION_QUEUED;
+    conn->admit_next = NULL;
+    conn->admit_prev = server->login_queue_tail;
+    if (server->login_queue_tail == NULL) {
+        server->login_queue_head = conn;
+    } else {
+        server->login_queue_tail->admit_next = conn;
+    }
+    server->login_queue_tail = conn;
+    server->login_queue_len++;
+    UNI_STAT_INC(server, logins_queued);
+    UNI_STAT_INC(server, login_queue_depth);
+
+    if (conn->transport->reset_timeout != NULL) {
+        conn->transport->reset_timeout(conn, server->config.login_queue_timeout_ms);
+    }
+}
+
+static void uni_admission_unlink(UniServer *server, UniConnection *conn) {
+    if (conn->admit_prev == NULL) {
+        server->login_queue_head = conn->admit_next;
+    } else {
+        conn->admit_prev->admit_next = conn->admit_next;
+    }
+
+    if (conn->admit_next == NULL) {
+        server->login_queue_tail = conn->admit_prev;
+    } else {
+        conn->admit_next->admit_prev = conn->admit_prev;
+    }
+
+    server->login_queue_len--;
+    UNI_STAT_DEC(server, login_queue_depth);
+}
+
+void uni_admission_release(UniConnection *conn) {
+    UniServer *server = conn->server;
+
+    switch (conn->admission) {
+        case UNI_ADMISSION_QUEUED:
+            uni_admission_unlink(server, conn);
+            conn->admission = UNI_ADMISSION_NONE;
+            break;
+
+        case UNI_ADMISSION_ADMITTED:
+            server->logins_in_progress--;
+            conn->admission = UNI_ADMISSION_NONE;
+            uni_admit_queued(server);
+            break;
+
+        case UNI_ADMISSION_NONE:
+            break;
+    }
+}
+
+void uni_admit_queued(UniServer *server) {
+    while (server->login_queue_head != NULL) {
+        UniConnection *conn = server->login_queue_head;
+
+        // Connections which are already being closed don't take a slot.
+        if (conn->closing) {
+            uni_admission_unlink(server, conn);
+            conn->admission = UNI_ADMISSION_NONE;
+            continue;
+        }
+
+        if (!uni_admission_take(server)) {
+            break;
+        }
+        uni_admission_unlink(server, conn);
+        uni_admission_start(conn);
+    }
+}
+
+uint64_t uni_admission_deadline(UniServer *server) {
+    const UniConfig *config = &server->config;
+
+    // Without a rate limit, or while all slots are taken, only a login
+    // finishing can make room for more.
+    if (server->login_queue_head == NULL || config->login_rate <= 0 || uni_admission_full(server)) {
+        return UNI_NO_DEADLINE;
+    }
+
+    uint64_t tolerance = uni_login_tolerance(config);
+    return server->login_tat_ns > tolerance ? server->login_tat_ns - tolerance : 0;
+}
@@ -0,0 +1,52 @@
+#ifndef UNI_ADMISSION_H
+#define UNI_ADMISSION_H
+
+// Admission control of new connections. When a proxy restarts, all of its
+// players reconnect within seconds, and every login costs an HMAC verification
+// and a call to uni_on_login() on the polling thread. To keep that from
+// stalling the game, accepted connections only start their login once they
+// are admitted: at most UniConfig.login_rate per second (with bursts of up to
+// UniConfig.login_burst), and no more than UniConfig.max_concurrent_logins at
+// a time. Connections which can't be admitted yet wait in a FIFO queue of up
+// to UniConfig.login_queue_size connections without being read from, and
+// connections arriving at a full queue are disconnected.
+//
+// While a connection is queued, its transport's login timeout is replaced by
+// UniConfig.login_queue_timeout_ms, and the login timeout starts over once it
+// is admitted. With a rate limit, the queue only takes as many connections as
+// can be admitted before their wait runs out. Connections beyond that are
+// rejected right away instead of timing out later.
+
+#include <stdint.h>
+
+typedef struct UniServerImpl UniServer;
+typedef struct UniConnectionImpl UniConnection;
+
+typedef enum {
+    // Not counted towards the limits, either because the connection hasn't
+    // been through admission or because it already joined.
+    UNI_ADMISSION_NONE,
+    UNI_ADMISSION_QUEUED,
+    UNI_ADMISSION_ADMITTED,
+} UniAdmission;
+
+void uni_admission_init(UniServer *server);
+
+// Starts the login of a newly accepted connection, or queues or rejects it if
+// it can't be admitted right now. Transports call this instead of
+// uni_conn_start().
+void uni_conn_admit(UniConnection *conn);
+
+// Gives up the connection's place in the queue or its admission, e.g. because
+// it joined or is being closed, and admits queued connections in its stead.
+void uni_admission_release(UniConnection *conn);
+
+// Admits as many queued connections as the limits allow. Called by the poll
+// functions, since tokens for UniConfig.login_rate accumulate over time.
+void uni_admit_queued(UniServer *server);
+
+// Returns when the next queued connection can be admitted (see uni_time_ns()),
+// or UNI_NO_DEADLINE if nothing is waiting for time to pass.
+uint64_t uni_admission_deadline(UniServer *server);
+
+#endif // !UNI_ADMISSION_H
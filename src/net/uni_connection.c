@@ -0,0 +1,652 @@
+#include "uni_connection.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol/uni_packet_handler.h"
+#include "uni_login_arena.h"
+#include "uni_grid.h"
+#include "uni_log.h"
+#include "uni_probe.h"
+
+void uni_dump_conn(UniConnection *conn) {
+#ifdef UNI_OS_LINUX
+    int fd = conn->fd;
+#else // UNI_OS_LINUX
+    int fd = -1;
+#endif // !UNI_OS_LINUX
+
+    UNI_LOG(
+        "UniConnection %llu: { fd = %d, state = %d, handler = %d, packet buf, len = %p, %d, "
+        "header_len_limit = %d, header_buf [0], [1] = %x, %x, header_size = %d, read/write idx = %d }",
+        (unsigned long long) conn->id, fd, conn->state, conn->handler, (void *) conn->packet_buf,
+        conn->packet_len, conn->header_len_limit, conn->header_buf[0], conn->header_buf[1],
+        conn->header_size, conn->write_idx
+    );
+}
+
+void uni_dump_net_err(const char *type, int res) {
+    int err = errno;
+    UNI_LOG("-- UNI %s ERROR -- res: %d (%s), errno: %d (%s)", type, res, strerror(-res), err, strerror(err));
+}
+
+static void uni_dump_conn_err(const char *type, UniConnection *conn, int res) {
+    UNI_LOG(
+        "-- UNI %s ERROR -- conn %llu, res: %d (%s), state = %d, handler = %d",
+        type, (unsigned long long) conn->id, res, strerror(-res), conn->state, conn->handler
+    );
+}
+
+void uni_conn_start(UniConnection *conn) {
+    uni_conn_prep_header(conn);
+    uni_conn_read(conn, conn->header_buf, sizeof(conn->header_buf));
+}
+
+// Whether the connection is being handed over, in which case its state must
+// not be changed by further reads and writes.
+static inline bool uni_conn_paused(UniConnection *conn) {
+    return conn->server->handing_off && conn->transport->cancel != NULL && !conn->closing;
+}
+
+void uni_conn_resume(UniConnection *conn) {
+    if (conn->state == UNI_READING_HEADER) {
+        uni_conn_read(conn, conn->header_buf, 1);
+    } else {
+        uni_conn_read(conn, &conn->packet_buf[conn->write_idx], conn->packet_len - conn->write_idx);
+    }
+
+    if (conn->out_busy) {
+        uni_conn_write(conn);
+    }
+}
+
+void uni_conn_read(UniConnection *conn, unsigned char *buf, int len) {
+    if (uni_conn_paused(conn)) {
+        return;
+    }
+
+    conn->refcount++;
+    conn->transport->read(conn, buf, len);
+}
+
+void uni_conn_write(UniConnection *conn) {
+    if (uni_conn_paused(conn)) {
+        return;
+    }
+
+    UNI_PROBE2(write, conn->id, conn->out_pkt.len - conn->out_pkt.write_idx);
+    conn->refcount++;
+    conn->transport->write(conn);
+}
+
+void uni_conn_shutdown(UniConnection *conn) {
+    UNI_PROBE1(shutdown, conn->id);
+    conn->closing = true;
+
+    // A connection being closed won't log in, so its place in the queue or
+    // its login slot goes to the next one right away.
+    uni_admission_release(conn);
+    conn->transport->shutdown(conn);
+}
+
+void uni_shared_buf_release(UniSharedBuf *shared) {
+    if (--shared->refcount == 0) {
+        free(shared->buf);
+        free(shared);
+    }
+}
+
+static void uni_free_out_buf(char *buf, UniSharedBuf *shared) {
+    if (shared != NULL) {
+        uni_shared_buf_release(shared);
+    } else {
+        free(buf);
+    }
+}
+
+// Frees the packet being written. Must not be called while a write of it is
+// pending.
+static void uni_conn_drop_out_pkt(UniConnection *conn) {
+    int unwritten = conn->out_pkt.len - conn->out_pkt.write_idx;
+    uni_free_out_buf(conn->out_pkt.buf, conn->out_shared);
+    conn->out_busy = false;
+    conn->out_bytes -= unwritten;
+    UNI_STAT_DEC(conn->server, write_queue_depth);
+    UNI_STAT_ADD(conn->server, write_queue_bytes, -unwritten);
+}
+
+// Puts the connection on the server's list of connections above
+// UniConfig.write_hard_cap, which is ordered by out_over_cap_ns.
+static void uni_conn_link_over_cap(UniConnection *conn, uint64_t now) {
+    UniServer *server = conn->server;
+
+    conn->out_over_cap_ns = now;
+    conn->over_cap_next = NULL;
+    conn->over_cap_prev = server->over_cap_tail;
+    if (server->over_cap_tail == NULL) {
+        server->over_cap_head = conn;
+    } else {
+        server->over_cap_tail->over_cap_next = conn;
+    }
+    server->over_cap_tail = conn;
+}
+
+// Takes the connection off the list of connections above the hard cap, if it
+// is on it.
+static void uni_conn_unlink_over_cap(UniConnection *conn) {
+    UniServer *server = conn->server;
+    if (conn->out_over_cap_ns == 0) {
+        return;
+    }
+
+    if (conn->over_cap_prev == NULL) {
+        server->over_cap_head = conn->over_cap_next;
+    } else {
+        conn->over_cap_prev->over_cap_next = conn->over_cap_next;
+    }
+    if (conn->over_cap_next == NULL) {
+        server->over_cap_tail = conn->over_cap_prev;
+    } else {
+        conn->over_cap_next->over_cap_prev = conn->over_cap_prev;
+    }
+    conn->out_over_cap_ns = 0;
+}
+
+// Frees all queued packets. Nothing is written anymore after this, except for
+// the rest of a pending write.
+static void uni_conn_close_output(UniConnection *conn) {
+    UniServer *server = conn->server;
+
+    for (int priority = 0; priority < UNI_NUM_PRIORITIES; priority++) {
+        UniOutQueue *queue = &conn->out_queues[priority];
+        for (int i = 0; i < queue->len; i++) {
+            UniOutEntry *entry = &queue->packets[(queue->start + i) % queue->cap];
+            conn->out_bytes -= entry->packet.len;
+            UNI_STAT_ADD(server, write_queue_bytes, -entry->packet.len);
+            uni_free_out_buf(entry->packet.buf, entry->shared);
+        }
+        UNI_STAT_ADD(server, write_queue_depth, -queue->len);
+        queue->len = 0;
+    }
+    conn->out_closed = true;
+    uni_conn_unlink_over_cap(conn);
+}
+
+UniConnection *uni_conn_alloc(UniServer *server) {
+    UniConnection *conn = server->free_conns;
+    if (conn != NULL) {
+        server->free_conns = conn->all_next;
+        server->num_free_conns--;
+        return conn;
+    }
+
+    conn = malloc(server->conn_size);
+    UNI_STAT_INC(server, allocs);
+    return conn;
+}
+
+void uni_conns_free(UniServer *server) {
+    while (server->free_conns != NULL) {
+        UniConnection *conn = server->free_conns;
+        server->free_conns = conn->all_next;
+        free(conn);
+    }
+    server->num_free_conns = 0;
+}
+
+bool uni_conn_gc(UniConnection *conn) {
+    if (conn->refcount == 0) {
+        UNI_PROBE1(gc, conn->id);
+        UNI_STAT_DEC(conn->server, active_conns[conn->handler]);
+        if (conn->server->capture != NULL) {
+            uni_capture_record(conn->server, UNI_CAPTURE_CLOSE, conn, NULL, 0);
+        }
+        conn->transport->close(conn);
+        uni_admission_release(conn);
+        if (conn->all_prev == NULL) {
+            conn->server->conns = conn->all_next;
+        } else {
+            conn->all_prev->all_next = conn->all_next;
+        }
+        if (conn->all_next != NULL) {
+            conn->all_next->all_prev = conn->all_prev;
+        }
+        if (conn->in_grid) {
+            uni_grid_remove(conn);
+        }
+        uni_conn_close_output(conn);
+        if (conn->out_busy) {
+            uni_conn_drop_out_pkt(conn);
+        }
+        for (int priority = 0; priority < UNI_NUM_PRIORITIES; priority++) {
+            free(conn->out_queues[priority].packets);
+        }
+        uni_login_arena_release(conn);
+        free(conn->packet_buf);
+
+        UniServer *server = conn->server;
+        if (server->num_free_conns >= UNI_CONN_POOL_MAX) {
+            free(conn);
+        } else {
+            conn->all_next = server->free_conns;
+            server->free_conns = conn;
+            server->num_free_conns++;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Handles bytes read into the connection's header buffer.
+static void uni_conn_read_header(UniConnection *conn, int len) {
+    UniServer *server = conn->server;
+
+    for (int i = 0; i < len; i++) {
+        unsigned char b = conn->header_buf[i];
+        conn->packet_len |= (b & 0b01111111) << (7 * conn->header_size++);
+
+        if (conn->header_size > conn->header_len_limit) {
+            UNI_DLOG("Disconnect: Header size %d > %d", conn->header_size, conn->header_len_limit);
+        #ifdef UNI_DEBUG
+            uni_dump_conn(conn);
+        #endif // UNI_DEBUG
+
+            uni_conn_shutdown(conn);
+            return;
+        } else if ((b & 0b10000000) == 0) {
+            UNI_PROBE2(header, conn->id, conn->packet_len);
+
+            // Large packets are read in chunks, the first of which starts
+            // with the header fields.
+            int threshold = server->config.stream_threshold;
+            if (conn->handler == UNI_HANDLER_PLAY && threshold > 0 && conn->packet_len > threshold) {
+                conn->streaming = true;
+                conn->stream_len = conn->packet_len;
+                conn->stream_hdr_len = 0;
+                if (conn->packet_len > server->config.stream_chunk_size) {
+                    conn->packet_len = server->config.stream_chunk_size;
+                }
+                conn->stream_done = conn->packet_len;
+            }
+
+            // Login frames are small and only needed until the next one
+            // arrives, so they're read into the login arena.
+            unsigned char *buf = NULL;
+            if (conn->handler <= UNI_HANDLER_PLUGIN_RES && uni_login_arena_acquire(conn)) {
+                buf = uni_login_alloc(conn, conn->packet_len);
+            }
+
+            if (buf != NULL) {
+                if (!conn->packet_buf_in_arena) {
+                    free(conn->packet_buf);
+                    conn->packet_cap = 0;
+                }
+                conn->packet_buf = buf;
+                conn->packet_buf_in_arena = true;
+            } else {
+                if (conn->packet_buf_in_arena) {
+                    conn->packet_buf = NULL;
+                    conn->packet_buf_in_arena = false;
+                }
+
+                if (conn->packet_len > conn->packet_cap) {
+                    unsigned char *grown = realloc(conn->packet_buf, conn->packet_len);
+                    UNI_STAT_INC(server, allocs);
+                    if (grown == NULL) {
+                        UNI_DLOG("Disconnect: realloc(%d) failed", conn->packet_len);
+                        uni_dump_conn(conn);
+
+                        uni_conn_shutdown(conn);
+                        return;
+                    }
+                    conn->packet_buf = grown;
+                    conn->packet_cap = conn->packet_len;
+                }
+            }
+
+            if (i == 0 && len == 2) {
+                conn->packet_buf[0] = conn->header_buf[1];
+                uni_conn_prep_body(conn);
+                conn->write_idx++;
+            } else {
+                uni_conn_prep_body(conn);
+            }
+
+            uni_conn_read(conn, &conn->packet_buf[conn->write_idx], conn->packet_len - conn->write_idx);
+            return;
+        }
+    }
+
+    uni_conn_read(conn, conn->header_buf, 1);
+}
+
+// Hands a chunk of a streamed packet to the packet handler and reads the next
+// one into the same buffer, after the header fields.
+static void uni_conn_stream_chunk(UniConnection *conn) {
+    uni_conn_prep_handle(conn);
+    if (!uni_recv_play_chunk(conn)) {
+        uni_conn_shutdown(conn);
+        return;
+    }
+
+    // The worker's job calls uni_conn_stream_next() once it's done.
+    if (!conn->chunk_in_worker) {
+        uni_conn_stream_next(conn);
+    }
+}
+
+void uni_conn_stream_next(UniConnection *conn) {
+    if (conn->stream_done == conn->stream_len) {
+        UNI_STAT_INC(conn->server, packets_in);
+        conn->streaming = false;
+        uni_conn_start(conn);
+        return;
+    }
+
+    int chunk_len = conn->server->config.stream_chunk_size - conn->stream_hdr_len;
+    if (chunk_len <= 0) {
+        UNI_DLOG("Disconnect: header fields of %d bytes fill the stream chunk", conn->stream_hdr_len);
+        uni_conn_shutdown(conn);
+        return;
+    } else if (chunk_len > conn->stream_len - conn->stream_done) {
+        chunk_len = conn->stream_len - conn->stream_done;
+    }
+
+    conn->packet_len = conn->stream_hdr_len + chunk_len;
+    conn->stream_done += chunk_len;
+    uni_conn_prep_body(conn);
+    conn->write_idx = conn->stream_hdr_len;
+    uni_conn_read(conn, &conn->packet_buf[conn->write_idx], chunk_len);
+}
+
+void uni_conn_read_done(UniConnection *conn, int res) {
+    UniServer *server = conn->server;
+
+    conn->refcount--;
+    if (uni_conn_gc(conn)) {
+        return;
+    }
+
+    // Cancelled to hand the connection over. Resumed by uni_conn_resume().
+    if (res == -ECANCELED && uni_conn_paused(conn)) {
+        return;
+    }
+
+    if (res > 0) {
+        UNI_STAT_ADD(server, bytes_in, res);
+
+        if (conn->state == UNI_READING_HEADER) {
+            uni_conn_read_header(conn, res);
+            return;
+        }
+
+        conn->write_idx += res;
+        if (conn->write_idx == conn->packet_len && conn->streaming) {
+            uni_conn_stream_chunk(conn);
+        } else if (conn->write_idx == conn->packet_len) {
+            UNI_STAT_INC(server, packets_in);
+            if (server->capture != NULL) {
+                uni_capture_record(server, UNI_CAPTURE_FRAME, conn, conn->packet_buf, conn->packet_len);
+            }
+            uni_conn_prep_handle(conn);
+
+            if (!uni_handle_packet(conn)) {
+                // Something went wrong trying to process this packet.
+                uni_conn_shutdown(conn);
+            } else {
+                uni_conn_start(conn);
+            }
+        } else {
+            uni_conn_read(conn, &conn->packet_buf[conn->write_idx], conn->packet_len - conn->write_idx);
+        }
+    } else if (res == 0) {
+        uni_conn_shutdown(conn);
+    } else {
+        uni_dump_conn_err("READ", conn, res);
+        UNI_STAT_ERR(server, res);
+    }
+}
+
+// Disconnects a connection which has been above UniConfig.write_hard_cap for
+// too long.
+static void uni_conn_exceed_write_cap(UniConnection *conn) {
+    UniServer *server = conn->server;
+    UNI_WLOG(
+        "Disconnect: conn %llu has had more than %llu bytes pending for %d ms",
+        (unsigned long long) conn->id, (unsigned long long) server->config.write_hard_cap,
+        server->config.write_hard_cap_ms
+    );
+    UNI_STAT_INC(server, write_cap_disconnects);
+    uni_conn_close_output(conn);
+    uni_conn_shutdown(conn);
+}
+
+uint64_t uni_conn_enforce_write_cap(UniServer *server) {
+    uint64_t cap_ns = (uint64_t) server->config.write_hard_cap_ms * 1000000;
+    if (server->over_cap_head == NULL) {
+        return UNI_NO_DEADLINE;
+    }
+
+    uint64_t now = uni_time_ns();
+    while (server->over_cap_head != NULL && now - server->over_cap_head->out_over_cap_ns >= cap_ns) {
+        uni_conn_exceed_write_cap(server->over_cap_head);
+    }
+
+    return server->over_cap_head == NULL ? UNI_NO_DEADLINE : server->over_cap_head->out_over_cap_ns + cap_ns;
+}
+
+// Enforces UniConfig.write_hard_cap and reports watermark crossings. Must only
+// be called once the connection's state is consistent, as it may call back
+// into the application. A connection which stays above the hard cap without
+// being written to is caught by uni_conn_enforce_write_cap().
+static void uni_conn_check_pressure(UniConnection *conn) {
+    UniServer *server = conn->server;
+    const UniConfig *config = &server->config;
+
+    if (conn->out_closed) {
+        return;
+    } else if (config->write_hard_cap == 0 || conn->out_bytes <= config->write_hard_cap) {
+        uni_conn_unlink_over_cap(conn);
+    } else {
+        uint64_t now = uni_time_ns();
+        if (conn->out_over_cap_ns == 0) {
+            uni_conn_link_over_cap(conn, now);
+        }
+
+        if (now - conn->out_over_cap_ns >= (uint64_t) config->write_hard_cap_ms * 1000000) {
+            uni_conn_exceed_write_cap(conn);
+            return;
+        }
+    }
+
+    if (conn->handler != UNI_HANDLER_PLAY || config->on_write_pressure == NULL) {
+        return;
+    }
+
+    if (!conn->out_throttled && conn->out_bytes > config->write_high_watermark) {
+        conn->out_throttled = true;
+        config->on_write_pressure(server->user_ptr, conn->user_ptr, true);
+    } else if (conn->out_throttled && conn->out_bytes <= config->write_low_watermark) {
+        conn->out_throttled = false;
+        config->on_write_pressure(server->user_ptr, conn->user_ptr, false);
+    }
+}
+
+void uni_conn_write_done(UniConnection *conn, int res) {
+    UniServer *server = conn->server;
+
+    conn->refcount--;
+    UNI_PROBE2(write_done, conn->id, res);
+    if (uni_conn_gc(conn)) {
+        return;
+    }
+
+    if (res == -ECANCELED && uni_conn_paused(conn)) {
+        return;
+    }
+
+    if (res <= 0) {
+        uni_dump_conn_err("WRITE", conn, res);
+        UNI_STAT_ERR(server, res);
+        uni_conn_close_output(conn);
+        uni_conn_drop_out_pkt(conn);
+        return;
+    }
+
+    if (conn->out_closed) {
+        uni_conn_drop_out_pkt(conn);
+        return;
+    }
+
+    // Although write_idx is used to determine the first byte after the varint
+    // header, we can re-used it here to determine how much of the packet has
+    // already been written.
+    conn->out_pkt.write_idx += res;
+    conn->out_bytes -= res;
+    UNI_STAT_ADD(server, bytes_out, res);
+    UNI_STAT_ADD(server, write_queue_bytes, -res);
+
+    if (conn->out_pkt.write_idx < conn->out_pkt.len) {
+        uni_conn_write(conn);
+        uni_conn_check_pressure(conn);
+        return;
+    }
+
+    uni_free_out_buf(conn->out_pkt.buf, conn->out_shared);
+    UNI_STAT_INC(server, packets_out);
+    UNI_STAT_DEC(server, write_queue_depth);
+
+    // Packets are never split, so a more urgent packet can only overtake
+    // others here, between two packets.
+    conn->out_busy = false;
+    for (int priority = 0; priority < UNI_NUM_PRIORITIES; priority++) {
+        UniOutQueue *queue = &conn->out_queues[priority];
+        if (queue->len > 0) {
+            conn->out_pkt = queue->packets[queue->start].packet;
+            conn->out_shared = queue->packets[queue->start].shared;
+            queue->start = (queue->start + 1) % queue->cap;
+            queue->len--;
+            conn->out_busy = true;
+            uni_conn_write(conn);
+            break;
+        }
+    }
+
+    switch (conn->handler) {
+        case UNI_HANDLER_LOGIN_SUCCESS:
+            uni_conn_end_stage(conn, UNI_HIST_LOGIN_SUCCESS);
+            conn->transport->login_done(conn);
+            uni_on_join(server->user_ptr, conn->user_ptr);
+            uni_conn_end_stage(conn, UNI_HIST_ON_JOIN);
+
+            // The login packets were written before Login Success, so nothing
+            // refers to the arena anymore.
+            uni_login_arena_release(conn);
+            uni_admission_release(conn);
+            UNI_HIST_SINCE(server, UNI_HIST_LOGIN_TOTAL, conn->accept_ns);
+            uni_conn_set_handler(conn, UNI_HANDLER_PLAY);
+
+            // Packets which are streamed don't need to fit into memory.
+            if (server->config.stream_threshold > 0) {
+                conn->header_len_limit = 3;
+            }
+            break;
+
+        case UNI_HANDLER_PLAY:
+            uni_conn_check_pressure(conn);
+            if (conn->closing || conn->out_closed) {
+                break;
+            }
+            uni_on_write_finish(conn->user_ptr);
+            break;
+
+        default:
+            break;
+    }
+}
+
+// Appends a packet to a write queue. Returns false if out of memory.
+static bool uni_conn_queue_out(
+    UniConnection *conn, UniOutQueue *queue, UniPacketOut *packet, UniSharedBuf *shared
+) {
+    if (queue->len == queue->cap) {
+        int cap = queue->cap == 0 ? 8 : queue->cap * 2;
+        UniOutEntry *packets = malloc(sizeof(UniOutEntry) * cap);
+        UNI_STAT_INC(conn->server, allocs);
+        if (packets == NULL) {
+            return false;
+        }
+
+        for (int i = 0; i < queue->len; i++) {
+            packets[i] = queue->packets[(queue->start + i) % queue->cap];
+        }
+        free(queue->packets);
+        queue->packets = packets;
+        queue->cap = cap;
+        queue->start = 0;
+    }
+
+    UniOutEntry *entry = &queue->packets[(queue->start + queue->len) % queue->cap];
+    entry->packet = *packet;
+    entry->shared = shared;
+    queue->len++;
+    return true;
+}
+
+void uni_conn_write_shared(UniConnection *conn, UniPacketOut *packet, UniSharedBuf *shared, UniPriority priority) {
+    UniServer *server = conn->server;
+
+    if (shared != NULL) {
+        shared->refcount++;
+    }
+
+    if (conn->out_closed) {
+        uni_free_out_buf(packet->buf, shared);
+        return;
+    }
+
+    packet->write_idx = 0;
+    UNI_STAT_INC(server, write_queue_depth);
+    UNI_STAT_ADD(server, write_queue_bytes, packet->len);
+    conn->out_bytes += packet->len;
+
+    if (!conn->out_busy) {
+        conn->out_pkt = *packet;
+        conn->out_shared = shared;
+        conn->out_busy = true;
+        uni_conn_write(conn);
+    } else if (!uni_conn_queue_out(conn, &conn->out_queues[priority], packet, shared)) {
+        // The client would miss a packet, so there's no point in going on.
+        UNI_DLOG("Disconnect: write queue of %d packets couldn't grow", conn->out_queues[priority].len);
+        uni_free_out_buf(packet->buf, shared);
+        UNI_STAT_DEC(server, write_queue_depth);
+        UNI_STAT_ADD(server, write_queue_bytes, -packet->len);
+        conn->out_bytes -= packet->len;
+        uni_conn_close_output(conn);
+        uni_conn_shutdown(conn);
+        return;
+    }
+
+    uni_conn_check_pressure(conn);
+}
+
+void uni_write_priority(UniConnection *conn, UniPacketOut *packet, UniPriority priority) {
+    uni_conn_write_shared(conn, packet, NULL, priority);
+}
+
+void uni_write(UniConnection *conn, UniPacketOut *packet) {
+    uni_write_priority(conn, packet, UNI_PRIORITY_NORMAL);
+}
+
+uint64_t uni_pending_bytes(UniConnection *conn) {
+    return conn->out_bytes;
+}
+
+void uni_release(UniConnection *conn) {
+    conn->refcount--;
+    if (!uni_conn_gc(conn)) {
+        uni_conn_shutdown(conn);
+    }
+}
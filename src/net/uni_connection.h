@@ -2,8 +2,11 @@
 #define UNI_CONNECTION_H
 
 #include <stddef.h>
+#include <string.h>
 
 #include "uni.h"
+#include "uni_admission.h"
+#include "uni_histogram.h"
 #include "uni_networking.h"
 #include "uni_os_constants.h"
 
@@ -11,35 +14,194 @@
 #include "liburing.h"
 #endif // UNI_OS_LINUX
 
+// A packet buffer written to several connections, e.g. by
+// uni_broadcast_area(). Each connection holds a reference until it's done with
+// the buffer, and the last one frees it.
+typedef struct {
+    char *buf;
+    int refcount;
+} UniSharedBuf;
+
+// A packet waiting to be written. If 'shared' isn't NULL, packet.buf belongs to
+// it rather than to the connection.
+typedef struct {
+    UniPacketOut packet;
+    UniSharedBuf *shared;
+} UniOutEntry;
+
+// See uni_login_arena.h
+typedef struct UniLoginArena UniLoginArena;
+
+// A FIFO of packets waiting to be written. A ring buffer of 'cap' entries,
+// grown as needed.
+typedef struct {
+    UniOutEntry *packets;
+    int cap;
+    int start;
+    int len;
+} UniOutQueue;
+
 typedef enum {
     UNI_READING_HEADER,
     UNI_READING_BODY,
 } UniReadState;
 
+// Each handler corresponds to the public UniConnStage of the same name.
 typedef enum {
-    UNI_HANDLER_HANDSHAKE,
-    UNI_HANDLER_LOGIN_START,
-    UNI_HANDLER_PLUGIN_RES,
-    UNI_HANDLER_LOGIN_SUCCESS,
-    UNI_HANDLER_PLAY,
+    UNI_HANDLER_HANDSHAKE = UNI_STAGE_HANDSHAKE,
+    UNI_HANDLER_LOGIN_START = UNI_STAGE_LOGIN_START,
+    UNI_HANDLER_PLUGIN_RES = UNI_STAGE_PLUGIN_RES,
+    UNI_HANDLER_LOGIN_SUCCESS = UNI_STAGE_LOGIN_SUCCESS,
+    UNI_HANDLER_PLAY = UNI_STAGE_PLAY,
 } UniPacketHandler;
 
+// Moves a connection's bytes. Every operation completes asynchronously: once a
+// read or write is done, the transport reports its result (a byte count, 0 for
+// end of stream, or a negative errno value) to uni_conn_read_done() or
+// uni_conn_write_done(). Completions must not be reported from within the
+// call which queued the operation.
+typedef struct {
+    // Reads up to 'len' bytes into 'buf'.
+    void (*read)(UniConnection *conn, unsigned char *buf, int len);
+
+    // Writes (part of) the unwritten remainder of conn->out_pkt, starting at
+    // conn->out_pkt.write_idx.
+    void (*write)(UniConnection *conn);
+
+    // Called once the login completed. The transport may stop enforcing a
+    // login timeout.
+    void (*login_done)(UniConnection *conn);
+
+    // Replaces the login timeout the transport started when the connection
+    // was accepted with one that expires 'ms' milliseconds from now. Does
+    // nothing once it expired or was stopped. NULL if the transport has no
+    // login timeout. See uni_admission.h
+    void (*reset_timeout)(UniConnection *conn, int ms);
+
+    // Stops the connection. Pending and future reads complete with 0.
+    void (*shutdown)(UniConnection *conn);
+
+    // Cancels the pending read and write, which then complete with -ECANCELED
+    // unless they already finished. Used to hand connections over to another
+    // process. NULL if the transport doesn't support that. See uni_handoff.h
+    void (*cancel)(UniConnection *conn);
+
+    // Points *data at bytes the transport received from the socket, but which
+    // haven't been read by the connection yet, and returns their number.
+    int (*unread)(UniConnection *conn, const unsigned char **data);
+
+    // Releases the transport's resources. Called exactly once, when the
+    // connection is freed.
+    void (*close)(UniConnection *conn);
+} UniTransport;
+
 struct UniConnectionImpl {
     UniServer *server;
+    uint64_t id;
+    const UniTransport *transport;
+    void *transport_data;
 
 #ifdef UNI_OS_LINUX
     int fd;
     struct __kernel_timespec timeout;
     void *timeout_usr_data;
+
+    // The io_uring backend's pending read and write, so they can be cancelled.
+    void *read_usr_data;
+    void *write_usr_data;
 #endif // UNI_OS_LINUX
 
+    // Neighbours in the server's list of connections.
+    UniConnection *all_prev;
+    UniConnection *all_next;
+
+    // When the connection was accepted and when it entered its current login
+    // stage. Only set if the server records latency histograms.
+    uint64_t accept_ns;
+    uint64_t stage_ns;
+
     UniReadState state;
     UniPacketHandler handler;
     int refcount;
 
+    // Set once the connection was shut down.
+    bool closing;
+
+    // Set if a capture record of the connection was dropped, and a gap
+    // record is yet to be written. See uni_capture_writer.h
+    bool capture_gap;
+
+    // Whether the connection is queued for or holds one of the server's login
+    // slots, and its neighbours in the queue. See uni_admission.h
+    UniAdmission admission;
+    UniConnection *admit_prev;
+    UniConnection *admit_next;
+
+    // The frame being read. During the login, it usually lives in the login
+    // arena, which is indicated by packet_buf_in_arena. Otherwise it is
+    // 'packet_cap' bytes large and reused for the next frame.
     unsigned char *packet_buf;
     int packet_len;
+    int packet_cap;
+    bool packet_buf_in_arena;
+
+    // Where the connection allocates from until it joined. NULL afterwards or
+    // if no arena could be allocated.
+    UniLoginArena *login_arena;
+
+    // The packet being written, if out_busy is set, and the shared buffer it
+    // belongs to, if any.
     UniPacketOut out_pkt;
+    UniSharedBuf *out_shared;
+    bool out_busy;
+
+    // Set once writing failed or the connection exceeded
+    // UniConfig.write_hard_cap. Nothing is written anymore.
+    bool out_closed;
+
+    // Set when the connection went above UniConfig.write_high_watermark and
+    // hasn't drained to write_low_watermark since.
+    bool out_throttled;
+
+    // Packets to write once out_pkt is done, by UniPriority.
+    UniOutQueue out_queues[UNI_NUM_PRIORITIES];
+
+    // Unwritten bytes of out_pkt and the queued packets.
+    uint64_t out_bytes;
+
+    // When out_bytes went above UniConfig.write_hard_cap, or 0 if it isn't,
+    // and the connection's neighbours in the server's list of connections
+    // above it.
+    uint64_t out_over_cap_ns;
+    UniConnection *over_cap_prev;
+    UniConnection *over_cap_next;
+
+    // Set while a packet longer than UniConfig.stream_threshold is being
+    // streamed. packet_buf then holds 'stream_hdr_len' bytes of the packet's
+    // header fields, followed by the current chunk, and ends at packet_len.
+    // 'stream_done' bytes of the 'stream_len' byte long packet have been read,
+    // including the current chunk. stream_hdr_len is set by the packet handler
+    // once it parsed the first chunk.
+    bool streaming;
+    int stream_len;
+    int stream_done;
+    int stream_hdr_len;
+
+    // Set while a worker handles the current chunk, which the connection
+    // must not read over until then. See uni_executor.h
+    bool chunk_in_worker;
+
+    // Set while the connection is subscribed to the grid cells from
+    // (grid_min_x, grid_min_z) to (grid_max_x, grid_max_z), which its view
+    // distance around chunk (view_x, view_z) overlaps. See uni_grid.h
+    bool in_grid;
+    int view_x;
+    int view_z;
+    int view_distance;
+    int grid_min_x;
+    int grid_min_z;
+    int grid_max_x;
+    int grid_max_z;
 
     int header_len_limit;
     union {
@@ -57,13 +219,61 @@ struct UniConnectionImpl {
     };
 };
 
-static inline void uni_init_conn(UniServer *server, UniConnection *conn) {
+static inline void uni_init_conn(UniServer *server, UniConnection *conn, const UniTransport *transport) {
     conn->server = server;
+    conn->transport = transport;
+    conn->transport_data = NULL;
+    conn->id = ++server->next_conn_id;
+    conn->capture_gap = false;
+    if (server->capture != NULL) {
+        uni_capture_record(server, UNI_CAPTURE_OPEN, conn, NULL, 0);
+    }
     conn->handler = UNI_HANDLER_HANDSHAKE;
+    UNI_STAT_INC(server, active_conns[UNI_HANDLER_HANDSHAKE]);
     conn->refcount = 0;
+    conn->closing = false;
+    conn->admission = UNI_ADMISSION_NONE;
     conn->packet_buf = NULL;
+    conn->packet_cap = 0;
+    conn->packet_buf_in_arena = false;
+    conn->login_arena = NULL;
+    conn->out_busy = false;
+    conn->out_closed = false;
+    conn->out_throttled = false;
+    memset(conn->out_queues, 0, sizeof(conn->out_queues));
+    conn->out_bytes = 0;
+    conn->out_over_cap_ns = 0;
+    conn->over_cap_prev = NULL;
+    conn->over_cap_next = NULL;
+    conn->streaming = false;
+    conn->chunk_in_worker = false;
+    conn->in_grid = false;
     conn->header_len_limit = 1;
     conn->header_size = 0;
+
+    conn->all_prev = NULL;
+    conn->all_next = server->conns;
+    if (server->conns != NULL) {
+        server->conns->all_prev = conn;
+    }
+    server->conns = conn;
+}
+
+// Moves the connection on to the next packet handler.
+static inline void uni_conn_set_handler(UniConnection *conn, UniPacketHandler handler) {
+    UNI_STAT_DEC(conn->server, active_conns[conn->handler]);
+    UNI_STAT_INC(conn->server, active_conns[handler]);
+    conn->handler = handler;
+}
+
+// Records the time the connection spent in its current login stage and starts
+// the next one.
+static inline void uni_conn_end_stage(UniConnection *conn, UniHistogramId id) {
+    if (conn->server->config.latency_histograms) {
+        uint64_t now = uni_time_ns();
+        uni_hist_record(conn->server, id, now - conn->stage_ns);
+        conn->stage_ns = now;
+    }
 }
 
 // Prepares the connection's state so it is ready to read a packet's header.
@@ -85,4 +295,60 @@ static inline void uni_conn_prep_handle(UniConnection *conn) {
     conn->read_idx = 0;
 }
 
+// Starts reading packets from a newly accepted connection.
+void uni_conn_start(UniConnection *conn);
+
+// Queues the read and write a connection was waiting for when it was handed
+// over, either by the process it was handed to or after a failed handoff.
+// While server->handing_off is set, reads and writes of connections which can
+// be handed over aren't queued. See uni_handoff.h
+void uni_conn_resume(UniConnection *conn);
+
+// Reads the next chunk of a streamed packet, or the next packet if it was the
+// last one.
+void uni_conn_stream_next(UniConnection *conn);
+
+// Queues a read or a write of the connection's outgoing packet through its
+// transport. The connection stays alive until the operation completes.
+void uni_conn_read(UniConnection *conn, unsigned char *buf, int len);
+void uni_conn_write(UniConnection *conn);
+
+// Handle the result of a completed read or write. The connection may be freed
+// by the time these return.
+void uni_conn_read_done(UniConnection *conn, int res);
+void uni_conn_write_done(UniConnection *conn, int res);
+
+// Drops a reference to a shared buffer, freeing it if it was the last one.
+void uni_shared_buf_release(UniSharedBuf *shared);
+
+// Same as uni_write_priority(), but if 'shared' isn't NULL, packet->buf belongs
+// to it and the connection takes one of its references instead of the buffer.
+void uni_conn_write_shared(UniConnection *conn, UniPacketOut *packet, UniSharedBuf *shared, UniPriority priority);
+
+// Stops the connection. It is freed once all of its operations have completed.
+void uni_conn_shutdown(UniConnection *conn);
+
+// Free connection objects kept by the server. Objects freed beyond this go
+// back to the heap, so a reconnect storm doesn't pin memory forever.
+#define UNI_CONN_POOL_MAX 256
+
+// Allocates a connection object of UniServer.conn_size bytes, from the
+// server's pool if possible, so logins don't call the allocator once a few
+// connections have come and gone. Returns NULL if out of memory.
+UniConnection *uni_conn_alloc(UniServer *server);
+
+void uni_conns_free(UniServer *server);
+
+// Disconnects connections which have been above UniConfig.write_hard_cap for
+// too long. Called before every poll. Returns when the next one is due, or
+// UNI_NO_DEADLINE.
+uint64_t uni_conn_enforce_write_cap(UniServer *server);
+
+// Attempt to free and close a connection if its reference count is zero.
+// Returns true on success, false otherwise.
+bool uni_conn_gc(UniConnection *conn);
+
+void uni_dump_conn(UniConnection *conn);
+void uni_dump_net_err(const char *type, int res);
+
 #endif // !UNI_CONNECTION_H
@@ -0,0 +1,724 @@
+// For accept4()
+#define _GNU_SOURCE
+
+#include "uni_networking.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "uni_connection.h"
+#include "uni_log.h"
+#include "uni_probe.h"
+#include "uni_time.h"
+
+// Events fetched per epoll_wait() call.
+#define UNI_EPOLL_EVENTS 256
+
+// Reads shorter than this are served from a per-connection buffer, filled with
+// a single recv() of this size. Frame headers and most login and PLAY packets
+// then cost one system call for several reads.
+#define UNI_EPOLL_STAGE_SIZE 1024
+
+// Returned by the I/O helpers when the operation would block.
+#define UNI_EPOLL_AGAIN INT_MIN
+
+// Sockets are registered once, for both directions, in edge-triggered mode.
+// The kernel then only reports when a socket becomes readable or writable, so
+// this is remembered in the connection until a system call would block.
+// Operations requested by the connection code are performed later from the
+// poll loop, by going through the server's ready list.
+struct UniEpollConn {
+    // Must come first. uni_conn_gc() frees the whole struct through it.
+    UniConnection conn;
+
+    // The pending read, if read_pending is set.
+    unsigned char *read_buf;
+    int read_len;
+    bool read_pending;
+    bool write_pending;
+
+    // Set when the pending read or write has been cancelled, and is to
+    // complete with -ECANCELED. See uni_handoff.h
+    bool read_cancelled;
+    bool write_cancelled;
+
+    bool readable;
+    bool writable;
+    bool shut_down;
+
+    // Whether the connection is on the server's ready list.
+    bool queued;
+    UniEpollConn *ready_next;
+
+    // Set while on the server's timeout list, which holds a reference.
+    bool timeout_armed;
+    uint64_t deadline_ns;
+    UniEpollConn *timeout_prev;
+    UniEpollConn *timeout_next;
+
+    UniEpollConn *release_next;
+
+    // Bytes received ahead of the reads asking for them.
+    int staged_start;
+    int staged_end;
+    unsigned char staged[UNI_EPOLL_STAGE_SIZE];
+};
+
+// Puts the connection on the ready list if one of its pending operations can
+// make progress.
+static void uni_epoll_ready(UniEpollConn *ec) {
+    if (ec->queued) {
+        return;
+    }
+
+    bool can_read = ec->read_pending && (
+        ec->readable || ec->shut_down || ec->read_cancelled || ec->staged_start != ec->staged_end
+    );
+    bool can_write = ec->write_pending && (ec->writable || ec->shut_down || ec->write_cancelled);
+    if (!can_read && !can_write) {
+        return;
+    }
+
+    UniServer *server = ec->conn.server;
+    ec->queued = true;
+    ec->ready_next = NULL;
+    if (server->epoll_ready_head == NULL) {
+        server->epoll_ready_head = ec;
+    } else {
+        server->epoll_ready_tail->ready_next = ec;
+    }
+    server->epoll_ready_tail = ec;
+}
+
+static void uni_epoll_read(UniConnection *conn, unsigned char *buf, int len) {
+    UniEpollConn *ec = (UniEpollConn *) conn;
+    ec->read_buf = buf;
+    ec->read_len = len;
+    ec->read_pending = true;
+    uni_epoll_ready(ec);
+}
+
+static void uni_epoll_write(UniConnection *conn) {
+    UniEpollConn *ec = (UniEpollConn *) conn;
+    ec->write_pending = true;
+    uni_epoll_ready(ec);
+}
+
+// Drops a reference to the connection once the current event has been handled.
+// Dropping it right away could free the connection while the caller is still
+// using it.
+static void uni_epoll_release_later(UniEpollConn *ec) {
+    UniServer *server = ec->conn.server;
+    ec->release_next = server->epoll_release;
+    server->epoll_release = ec;
+}
+
+static void uni_epoll_drain_release(UniServer *server) {
+    while (server->epoll_release != NULL) {
+        UniEpollConn *ec = server->epoll_release;
+        server->epoll_release = ec->release_next;
+
+        ec->conn.refcount--;
+        uni_conn_gc(&ec->conn);
+    }
+}
+
+// Sets the timer to fire at the first login deadline, unless it is already
+// set to fire no later. The timeout list is sorted by deadline, so the timer
+// only ever fires early, never late, and is set again once it has fired.
+static void uni_epoll_arm_timer(UniServer *server) {
+    if (
+        server->epoll_timeout_head == NULL ||
+        (server->epoll_timer_ns != 0 && server->epoll_timer_ns <= server->epoll_timeout_head->deadline_ns)
+    ) {
+        return;
+    }
+
+    uint64_t deadline = server->epoll_timeout_head->deadline_ns;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t) (deadline / 1000000000);
+    spec.it_value.tv_nsec = (long) (deadline % 1000000000);
+    if (timerfd_settime(server->epoll_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == 0) {
+        server->epoll_timer_ns = deadline;
+    }
+}
+
+// Puts the connection on the timeout list, to expire 'ms' milliseconds from
+// now. Most connections wait equally long, so the search for its place starts
+// at the end.
+static void uni_epoll_link_timeout(UniServer *server, UniEpollConn *ec, uint64_t ms) {
+    ec->timeout_armed = true;
+    ec->deadline_ns = uni_time_ns() + ms * 1000000;
+
+    UniEpollConn *prev = server->epoll_timeout_tail;
+    while (prev != NULL && prev->deadline_ns > ec->deadline_ns) {
+        prev = prev->timeout_prev;
+    }
+
+    ec->timeout_prev = prev;
+    ec->timeout_next = prev == NULL ? server->epoll_timeout_head : prev->timeout_next;
+    if (prev == NULL) {
+        server->epoll_timeout_head = ec;
+    } else {
+        prev->timeout_next = ec;
+    }
+    if (ec->timeout_next == NULL) {
+        server->epoll_timeout_tail = ec;
+    } else {
+        ec->timeout_next->timeout_prev = ec;
+    }
+    uni_epoll_arm_timer(server);
+}
+
+static void uni_epoll_arm_timeout(UniServer *server, UniEpollConn *ec) {
+    ec->conn.refcount++;
+    uni_epoll_link_timeout(server, ec, (uint64_t) UNI_LOGIN_TIMEOUT_SECS * 1000);
+}
+
+// Takes the connection off the timeout list. The caller is responsible for the
+// reference the list held.
+static void uni_epoll_unlink_timeout(UniServer *server, UniEpollConn *ec) {
+    if (ec->timeout_prev == NULL) {
+        server->epoll_timeout_head = ec->timeout_next;
+    } else {
+        ec->timeout_prev->timeout_next = ec->timeout_next;
+    }
+
+    if (ec->timeout_next == NULL) {
+        server->epoll_timeout_tail = ec->timeout_prev;
+    } else {
+        ec->timeout_next->timeout_prev = ec->timeout_prev;
+    }
+
+    ec->timeout_armed = false;
+}
+
+static void uni_epoll_cancel_timeout(UniEpollConn *ec) {
+    if (!ec->timeout_armed) {
+        return;
+    }
+
+    uni_epoll_unlink_timeout(ec->conn.server, ec);
+    uni_epoll_release_later(ec);
+}
+
+static void uni_epoll_login_done(UniConnection *conn) {
+    uni_epoll_cancel_timeout((UniEpollConn *) conn);
+}
+
+// The reference the timeout list holds carries over.
+static void uni_epoll_reset_timeout(UniConnection *conn, int ms) {
+    UniEpollConn *ec = (UniEpollConn *) conn;
+    if (!ec->timeout_armed) {
+        return;
+    }
+
+    uni_epoll_unlink_timeout(conn->server, ec);
+    uni_epoll_link_timeout(conn->server, ec, (uint64_t) ms);
+}
+
+static void uni_epoll_shutdown(UniConnection *conn) {
+    UniEpollConn *ec = (UniEpollConn *) conn;
+    uni_epoll_cancel_timeout(ec);
+
+    if (!ec->shut_down) {
+        ec->shut_down = true;
+        shutdown(conn->fd, SHUT_RDWR);
+        uni_epoll_ready(ec);
+    }
+}
+
+static void uni_epoll_close(UniConnection *conn) {
+    // Closing the socket only removes it from the epoll instance if this was
+    // its last file descriptor, which isn't the case once it has been handed
+    // over to another process. Events for it would then still come in and
+    // point at a freed connection.
+    epoll_ctl(conn->server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+}
+
+static void uni_epoll_cancel(UniConnection *conn) {
+    UniEpollConn *ec = (UniEpollConn *) conn;
+    ec->read_cancelled = ec->read_pending;
+    ec->write_cancelled = ec->write_pending;
+    uni_epoll_ready(ec);
+}
+
+static int uni_epoll_unread(UniConnection *conn, const unsigned char **data) {
+    UniEpollConn *ec = (UniEpollConn *) conn;
+    *data = &ec->staged[ec->staged_start];
+    return ec->staged_end - ec->staged_start;
+}
+
+static const UniTransport uni_epoll_transport = {
+    .read = uni_epoll_read,
+    .write = uni_epoll_write,
+    .login_done = uni_epoll_login_done,
+    .reset_timeout = uni_epoll_reset_timeout,
+    .shutdown = uni_epoll_shutdown,
+    .close = uni_epoll_close,
+    .cancel = uni_epoll_cancel,
+    .unread = uni_epoll_unread,
+};
+
+static int uni_epoll_recv(UniEpollConn *ec, unsigned char *buf, int len) {
+    UNI_STAT_INC(ec->conn.server, sqes);
+
+    ssize_t res;
+    do {
+        res = recv(ec->conn.fd, buf, len, 0);
+    } while (res == -1 && errno == EINTR);
+
+    if (res >= 0) {
+        return (int) res;
+    }
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        ec->readable = false;
+        return UNI_EPOLL_AGAIN;
+    }
+
+    return -errno;
+}
+
+// Performs the pending read. Returns the result to report, or UNI_EPOLL_AGAIN
+// if there is nothing to read yet.
+static int uni_epoll_do_read(UniEpollConn *ec) {
+    if (ec->read_cancelled) {
+        ec->read_cancelled = false;
+        return -ECANCELED;
+    }
+
+    if (ec->shut_down) {
+        return 0;
+    }
+
+    if (ec->staged_start == ec->staged_end) {
+        if (ec->read_len >= UNI_EPOLL_STAGE_SIZE) {
+            return uni_epoll_recv(ec, ec->read_buf, ec->read_len);
+        }
+
+        int res = uni_epoll_recv(ec, ec->staged, sizeof(ec->staged));
+        if (res <= 0) {
+            return res;
+        }
+
+        // A short read means the socket's receive buffer is empty. The next
+        // recv() would only fail with EAGAIN.
+        if (res < (int) sizeof(ec->staged)) {
+            ec->readable = false;
+        }
+
+        ec->staged_start = 0;
+        ec->staged_end = res;
+    }
+
+    int len = ec->staged_end - ec->staged_start;
+    if (len > ec->read_len) {
+        len = ec->read_len;
+    }
+
+    memcpy(ec->read_buf, &ec->staged[ec->staged_start], len);
+    ec->staged_start += len;
+    return len;
+}
+
+// Performs the pending write. Returns the result to report, or UNI_EPOLL_AGAIN
+// if the socket's send buffer is full.
+static int uni_epoll_do_write(UniEpollConn *ec) {
+    if (ec->write_cancelled) {
+        ec->write_cancelled = false;
+        return -ECANCELED;
+    }
+
+    UniPacketOut *pkt = &ec->conn.out_pkt;
+    int len = pkt->len - pkt->write_idx;
+    UNI_STAT_INC(ec->conn.server, sqes);
+
+    ssize_t res;
+    do {
+        res = send(ec->conn.fd, &pkt->buf[pkt->write_idx], len, MSG_NOSIGNAL);
+    } while (res == -1 && errno == EINTR);
+
+    if (res >= 0) {
+        // As with reads, a short write means the buffer is full.
+        if (res < len) {
+            ec->writable = false;
+        }
+        return (int) res;
+    }
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        ec->writable = false;
+        return UNI_EPOLL_AGAIN;
+    }
+
+    return -errno;
+}
+
+// Runs the connection's pending operations which can make progress. Returns
+// the number of operations completed.
+static unsigned uni_epoll_handle(UniServer *server, UniEpollConn *ec) {
+    unsigned handled = 0;
+
+    // Checked up front: once the read is reported, the connection may be gone
+    // unless a write still holds a reference to it.
+    bool try_write = ec->write_pending && (ec->writable || ec->shut_down || ec->write_cancelled);
+
+    bool can_read = ec->readable || ec->shut_down || ec->read_cancelled || ec->staged_start != ec->staged_end;
+    if (ec->read_pending && can_read) {
+        uint64_t event_start = UNI_HIST_NOW(server);
+        int res = uni_epoll_do_read(ec);
+        if (res != UNI_EPOLL_AGAIN) {
+            ec->read_pending = false;
+            handled++;
+            UNI_STAT_INC(server, cqes);
+            uni_conn_read_done(&ec->conn, res);
+            UNI_HIST_SINCE(server, UNI_HIST_EVENT_READ, event_start);
+        }
+    }
+
+    if (try_write) {
+        uint64_t event_start = UNI_HIST_NOW(server);
+        int res = uni_epoll_do_write(ec);
+        if (res != UNI_EPOLL_AGAIN) {
+            ec->write_pending = false;
+            handled++;
+            UNI_STAT_INC(server, cqes);
+            uni_conn_write_done(&ec->conn, res);
+            UNI_HIST_SINCE(server, UNI_HIST_EVENT_WRITE, event_start);
+        }
+    }
+
+    return handled;
+}
+
+// Sets up a connection for a connected, non-blocking socket and registers it
+// with epoll. Its first reads return the 'len' bytes at 'data'. Returns NULL on
+// failure, in which case the socket is closed.
+static UniEpollConn *uni_epoll_new_conn(UniServer *server, int fd, const unsigned char *data, int len) {
+    UniEpollConn *ec = (UniEpollConn *) uni_conn_alloc(server);
+    if (ec == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    UniConnection *conn = &ec->conn;
+    uni_init_conn(server, conn, &uni_epoll_transport);
+    conn->fd = fd;
+
+    ec->read_pending = false;
+    ec->write_pending = false;
+    ec->read_cancelled = false;
+    ec->write_cancelled = false;
+    // Clients usually send their handshake right away, so the first read is
+    // tried without waiting for epoll to report the socket.
+    ec->readable = true;
+    ec->writable = true;
+    ec->shut_down = false;
+    ec->queued = false;
+    ec->timeout_armed = false;
+    ec->staged_start = 0;
+    ec->staged_end = len;
+    if (len > 0) {
+        memcpy(ec->staged, data, len);
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = ec;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        uni_dump_net_err("EPOLL_CTL", -errno);
+        UNI_STAT_ERR(server, -errno);
+        uni_conn_gc(conn);
+        return NULL;
+    }
+
+    return ec;
+}
+
+// Accepts a connection. Returns false if there was none waiting.
+static bool uni_epoll_accept(UniServer *server) {
+    uint64_t event_start = UNI_HIST_NOW(server);
+    UNI_STAT_INC(server, sqes);
+
+    int fd = accept4(server->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            server->epoll_accept_ready = false;
+            return false;
+        }
+
+        if (errno != EINTR && errno != ECONNABORTED) {
+            uni_dump_net_err("ACCEPT", -errno);
+            UNI_STAT_ERR(server, -errno);
+
+            // Out of file descriptors or memory. Waiting for the next
+            // connection to come in is better than spinning.
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                server->epoll_accept_ready = false;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    UNI_STAT_INC(server, cqes);
+
+    UniEpollConn *ec = uni_epoll_new_conn(server, fd, NULL, 0);
+    if (ec == NULL) {
+        return true;
+    }
+
+    UniConnection *conn = &ec->conn;
+    UNI_STAT_INC(server, accepts);
+    conn->accept_ns = event_start;
+    conn->stage_ns = event_start;
+    UNI_PROBE2(accept, conn->id, conn->fd);
+
+    uni_epoll_arm_timeout(server, ec);
+    uni_conn_admit(conn);
+
+    UNI_HIST_SINCE(server, UNI_HIST_EVENT_ACCEPT, event_start);
+    return true;
+}
+
+// Shuts down connections whose login timed out. Returns the number of
+// connections handled.
+static unsigned uni_epoll_expire(UniServer *server, unsigned budget) {
+    unsigned handled = 0;
+    uint64_t now = uni_time_ns();
+
+    while (handled < budget && server->epoll_timeout_head != NULL && server->epoll_timeout_head->deadline_ns <= now) {
+        uint64_t event_start = UNI_HIST_NOW(server);
+        UniEpollConn *ec = server->epoll_timeout_head;
+        uni_epoll_unlink_timeout(server, ec);
+        handled++;
+
+        UNI_PROBE1(timeout, ec->conn.id);
+        ec->conn.refcount--;
+        if (!uni_conn_gc(&ec->conn)) {
+            uni_conn_shutdown(&ec->conn);
+        }
+
+        UNI_HIST_SINCE(server, UNI_HIST_EVENT_TIMEOUT, event_start);
+    }
+
+    uni_epoll_arm_timer(server);
+
+    return handled;
+}
+
+// Whether there is work which doesn't need to wait for epoll.
+static bool uni_epoll_has_work(UniServer *server) {
+    bool can_accept = server->epoll_accept_ready && !server->handing_off;
+    return server->epoll_ready_head != NULL || can_accept || server->epoll_release != NULL;
+}
+
+// Fetches events from epoll, waiting at most 'timeout_ms', and records which
+// sockets became ready. Returns the number of events.
+static int uni_epoll_fetch(UniServer *server, int timeout_ms) {
+    struct epoll_event events[UNI_EPOLL_EVENTS];
+    int count = epoll_wait(server->epoll_fd, events, UNI_EPOLL_EVENTS, timeout_ms);
+    UNI_STAT_INC(server, submit_calls);
+
+    for (int i = 0; i < count; i++) {
+        void *ptr = events[i].data.ptr;
+        uint32_t flags = events[i].events;
+
+        if (ptr == &server->fd) {
+            server->epoll_accept_ready = true;
+        } else if (ptr == &server->epoll_wake_fd) {
+            eventfd_t value;
+            eventfd_read(server->epoll_wake_fd, &value);
+        } else if (ptr == &server->epoll_timer_fd) {
+            uint64_t expirations;
+            if (read(server->epoll_timer_fd, &expirations, sizeof(expirations)) > 0) {
+                server->epoll_timer_ns = 0;
+            }
+        } else {
+            UniEpollConn *ec = ptr;
+            if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                ec->readable = true;
+            }
+            if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                ec->writable = true;
+            }
+            uni_epoll_ready(ec);
+        }
+    }
+
+    return count;
+}
+
+// Handles at most 'budget' events which are ready. Returns the number of events
+// handled.
+static unsigned uni_epoll_dispatch(UniServer *server, unsigned budget) {
+    uni_hist_apply_reset(server);
+    uint64_t poll_start = UNI_HIST_NOW(server);
+
+    unsigned handled = uni_epoll_expire(server, budget);
+
+    while (handled < budget && server->epoll_accept_ready && !server->handing_off) {
+        if (uni_epoll_accept(server)) {
+            handled++;
+        }
+    }
+
+    while (handled < budget && server->epoll_ready_head != NULL) {
+        UniEpollConn *ec = server->epoll_ready_head;
+        server->epoll_ready_head = ec->ready_next;
+        ec->queued = false;
+
+        handled += uni_epoll_handle(server, ec);
+    }
+
+    uni_epoll_drain_release(server);
+    uni_capture_tick(server);
+
+    if (handled > 0) {
+        UNI_HIST_SINCE(server, UNI_HIST_POLL, poll_start);
+    }
+
+    return handled;
+}
+
+static unsigned uni_epoll_poll(UniServer *server, uint64_t deadline, unsigned budget) {
+    int timeout_ms = -1;
+    if (uni_epoll_has_work(server) || deadline == 0) {
+        timeout_ms = 0;
+    } else if (deadline != UNI_NO_DEADLINE) {
+        uint64_t now = uni_time_ns();
+        // Rounded up, so the wait doesn't end just before the deadline.
+        timeout_ms = now >= deadline ? 0 : (int) ((deadline - now + 999999) / 1000000);
+    }
+
+    if (timeout_ms != 0 && server->config.busy_poll_us > 0) {
+        uint64_t spin_end = uni_time_ns() + (uint64_t) server->config.busy_poll_us * 1000;
+        if (spin_end > deadline) {
+            spin_end = deadline;
+        }
+
+        do {
+            if (uni_epoll_fetch(server, 0) > 0) {
+                return uni_epoll_dispatch(server, budget);
+            }
+        } while (uni_time_ns() < spin_end);
+    }
+
+    uni_epoll_fetch(server, timeout_ms);
+    return uni_epoll_dispatch(server, budget);
+}
+
+static int uni_epoll_event_fd(UniServer *server) {
+    // An epoll instance is itself readable while it has events.
+    return server->epoll_fd;
+}
+
+// Makes the epoll fd readable if there is work left that epoll doesn't know
+// about.
+static void uni_epoll_wake_if_needed(UniServer *server) {
+    if (uni_epoll_has_work(server)) {
+        eventfd_write(server->epoll_wake_fd, 1);
+    }
+}
+
+static unsigned uni_epoll_process_completions(UniServer *server, unsigned budget) {
+    uni_epoll_fetch(server, 0);
+    unsigned handled = uni_epoll_dispatch(server, budget);
+    uni_epoll_wake_if_needed(server);
+    return handled;
+}
+
+static void uni_epoll_submit(UniServer *server) {
+    // Reads and writes are performed as part of handling events. All there is
+    // to do is make sure the ones requested since are picked up.
+    uni_epoll_wake_if_needed(server);
+}
+
+// Registers 'fd' for readability. 'ptr' identifies it in events.
+static bool uni_epoll_add(UniServer *server, int fd, uint32_t flags, void *ptr) {
+    struct epoll_event event;
+    event.events = EPOLLIN | flags;
+    event.data.ptr = ptr;
+    return epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+static bool uni_epoll_init(UniServer *server) {
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->epoll_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->epoll_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    int flags = fcntl(server->fd, F_GETFL);
+    if (
+        server->epoll_fd == -1 || server->epoll_wake_fd == -1 || server->epoll_timer_fd == -1 ||
+        flags == -1 || fcntl(server->fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        !uni_epoll_add(server, server->epoll_wake_fd, 0, &server->epoll_wake_fd) ||
+        !uni_epoll_add(server, server->epoll_timer_fd, 0, &server->epoll_timer_fd)
+    ) {
+        UNI_DLOG("epoll unavailable: %s", strerror(errno));
+        if (server->epoll_fd != -1) {
+            close(server->epoll_fd);
+        }
+        if (server->epoll_wake_fd != -1) {
+            close(server->epoll_wake_fd);
+        }
+        if (server->epoll_timer_fd != -1) {
+            close(server->epoll_timer_fd);
+        }
+        return false;
+    }
+
+    server->conn_size = sizeof(UniEpollConn);
+    server->epoll_timer_ns = 0;
+    server->epoll_accept_ready = false;
+    server->epoll_ready_head = NULL;
+    server->epoll_ready_tail = NULL;
+    server->epoll_timeout_head = NULL;
+    server->epoll_timeout_tail = NULL;
+    server->epoll_release = NULL;
+    return true;
+}
+
+// Sockets handed over by a process using io_uring may be in blocking mode.
+static UniConnection *uni_epoll_adopt(UniServer *server, int fd, const unsigned char *data, int len) {
+    // Only this backend receives ahead, and never more than it stages.
+    int flags = fcntl(fd, F_GETFL);
+    if (len > UNI_EPOLL_STAGE_SIZE || flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    UniEpollConn *ec = uni_epoll_new_conn(server, fd, data, len);
+    return ec != NULL ? &ec->conn : NULL;
+}
+
+static void uni_epoll_wake(UniServer *server) {
+    eventfd_write(server->epoll_wake_fd, 1);
+}
+
+static bool uni_epoll_listen(UniServer *server) {
+    // Registered only now: a socket which isn't listening yet reports a hangup.
+    return uni_epoll_add(server, server->fd, EPOLLET, &server->fd);
+}
+
+const UniNetBackend uni_epoll_backend = {
+    .id = UNI_BACKEND_EPOLL,
+    .init = uni_epoll_init,
+    .listen = uni_epoll_listen,
+    .poll = uni_epoll_poll,
+    .event_fd = uni_epoll_event_fd,
+    .process_completions = uni_epoll_process_completions,
+    .submit = uni_epoll_submit,
+    .wake = uni_epoll_wake,
+    .adopt = uni_epoll_adopt,
+};
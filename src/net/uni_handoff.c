@@ -0,0 +1,514 @@
+#include "uni_handoff.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "uni_connection.h"
+#include "uni_log.h"
+#include "uni_server.h"
+#include "uni_time.h"
+
+typedef enum {
+    UNI_HANDOFF_SENT,
+    // The application chose to disconnect the client instead.
+    UNI_HANDOFF_DECLINED,
+    UNI_HANDOFF_FAILED,
+} UniHandoffResult;
+
+static bool uni_handoff_send(int sock_fd, const void *data, size_t len) {
+    const char *cursor = data;
+    while (len > 0) {
+        ssize_t res = send(sock_fd, cursor, len, MSG_NOSIGNAL);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            UNI_LOG("HANDOFF SEND FAILED: %s", strerror(errno));
+            return false;
+        }
+        cursor += res;
+        len -= res;
+    }
+    return true;
+}
+
+// Sends a record along with 'fd', unless it's -1.
+static bool uni_handoff_send_record(int sock_fd, const UniHandoffRecord *rec, int fd) {
+    struct iovec iov = {(void *) rec, sizeof(*rec)};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t res;
+    do {
+        res = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+    } while (res == -1 && errno == EINTR);
+
+    if (res == -1) {
+        UNI_LOG("HANDOFF SEND FAILED: %s", strerror(errno));
+        return false;
+    }
+
+    // The socket went with the first byte, the rest is plain data.
+    return uni_handoff_send(sock_fd, (const char *) rec + res, sizeof(*rec) - res);
+}
+
+static bool uni_handoff_recv(int sock_fd, void *data, size_t len) {
+    char *cursor = data;
+    while (len > 0) {
+        ssize_t res = recv(sock_fd, cursor, len, MSG_WAITALL);
+        if (res == 0) {
+            UNI_LOG("HANDOFF RECV FAILED: %s", "end of stream");
+            return false;
+        } else if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            UNI_LOG("HANDOFF RECV FAILED: %s", strerror(errno));
+            return false;
+        }
+        cursor += res;
+        len -= res;
+    }
+    return true;
+}
+
+// Receives a record and the socket that came with it, if any, into *fd.
+// *fd is -1 if there was none, and is owned by the caller even on failure.
+static bool uni_handoff_recv_record(int sock_fd, UniHandoffRecord *rec, int *fd) {
+    *fd = -1;
+
+    struct iovec iov = {rec, sizeof(*rec)};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t res;
+    do {
+        res = recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (res == -1 && errno == EINTR);
+
+    if (res <= 0) {
+        UNI_LOG("HANDOFF RECV FAILED: %s", res == 0 ? "end of stream" : strerror(errno));
+        return false;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (!uni_handoff_recv(sock_fd, (char *) rec + res, sizeof(*rec) - res)) {
+        return false;
+    }
+
+    if (rec->magic != UNI_HANDOFF_MAGIC || rec->check != UNI_HANDOFF_CHECK) {
+        UNI_LOG("HANDOFF RECORD MISMATCH: %08x %08x", rec->magic, rec->check);
+        return false;
+    }
+    return true;
+}
+
+static inline bool uni_handoff_eligible(UniConnection *conn) {
+    return conn->handler == UNI_HANDLER_PLAY && conn->transport->cancel != NULL && !conn->closing;
+}
+
+// Whether accepting stopped and nothing of the connections to hand over is in
+// flight anymore, so only the application's reference is left.
+static bool uni_handoff_quiet(UniServer *server) {
+    if (server->backend->pause_accept != NULL && !server->backend->pause_accept(server)) {
+        return false;
+    }
+
+    for (UniConnection *conn = server->conns; conn != NULL; conn = conn->all_next) {
+        if (uni_handoff_eligible(conn) && conn->refcount > 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lets the connections which weren't handed over go on.
+static void uni_handoff_abort(UniServer *server) {
+    server->handing_off = false;
+    if (server->backend->resume_accept != NULL) {
+        server->backend->resume_accept(server);
+    }
+
+    for (UniConnection *conn = server->conns; conn != NULL; conn = conn->all_next) {
+        if (!uni_handoff_eligible(conn)) {
+            continue;
+        }
+
+        // Operations which are still being cancelled would complete as
+        // errors, so the connection is beyond saving.
+        if (conn->refcount > 1) {
+            UNI_LOG("HANDOFF: conn %llu still busy, disconnecting", (unsigned long long) conn->id);
+            uni_conn_shutdown(conn);
+        } else {
+            uni_conn_resume(conn);
+        }
+    }
+}
+
+// Sends the packets queued at one priority back to back.
+static bool uni_handoff_send_queue(int sock_fd, const UniOutQueue *queue) {
+    for (int i = 0; i < queue->len; i++) {
+        const UniPacketOut *packet = &queue->packets[(queue->start + i) % queue->cap].packet;
+        if (!uni_handoff_send(sock_fd, packet->buf, packet->len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static UniHandoffResult uni_handoff_conn(UniServer *server, int sock_fd, UniConnection *conn, UniHandoffSaver save) {
+    unsigned char state[UNI_HANDOFF_STATE_MAX];
+    int state_len = save(server->user_ptr, conn->user_ptr, state, sizeof(state));
+    if (state_len < 0 || state_len > (int) sizeof(state)) {
+        return UNI_HANDOFF_DECLINED;
+    }
+
+    const unsigned char *unread = NULL;
+    UniHandoffRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = UNI_HANDOFF_MAGIC;
+    rec.check = UNI_HANDOFF_CHECK;
+    rec.kind = UNI_HANDOFF_CONN;
+    rec.state = conn->state;
+    rec.header_len_limit = conn->header_len_limit;
+    rec.packet_len = conn->packet_len;
+    if (conn->state == UNI_READING_HEADER) {
+        rec.header_size = conn->header_size;
+    } else {
+        rec.write_idx = conn->write_idx;
+    }
+    rec.streaming = conn->streaming;
+    rec.stream_len = conn->stream_len;
+    rec.stream_done = conn->stream_done;
+    rec.stream_hdr_len = conn->stream_hdr_len;
+    rec.in_grid = conn->in_grid;
+    rec.view_x = conn->view_x;
+    rec.view_z = conn->view_z;
+    rec.view_distance = conn->view_distance;
+    rec.unread_len = conn->transport->unread(conn, &unread);
+    if (conn->out_busy) {
+        rec.out_len = conn->out_pkt.len - conn->out_pkt.write_idx;
+    }
+    for (int priority = 0; priority < UNI_NUM_PRIORITIES; priority++) {
+        const UniOutQueue *queue = &conn->out_queues[priority];
+        for (int i = 0; i < queue->len; i++) {
+            rec.queued_len[priority] += queue->packets[(queue->start + i) % queue->cap].packet.len;
+        }
+    }
+    rec.state_len = state_len;
+
+    bool sent =
+        uni_handoff_send_record(sock_fd, &rec, conn->fd) &&
+        uni_handoff_send(sock_fd, unread, rec.unread_len) &&
+        uni_handoff_send(sock_fd, conn->packet_buf, rec.write_idx) &&
+        (rec.out_len == 0 || uni_handoff_send(sock_fd, &conn->out_pkt.buf[conn->out_pkt.write_idx], rec.out_len));
+    for (int priority = 0; sent && priority < UNI_NUM_PRIORITIES; priority++) {
+        sent = uni_handoff_send_queue(sock_fd, &conn->out_queues[priority]);
+    }
+    sent = sent && uni_handoff_send(sock_fd, state, state_len);
+
+    return sent ? UNI_HANDOFF_SENT : UNI_HANDOFF_FAILED;
+}
+
+bool uni_handoff(UniServer *server, int sock_fd, UniHandoffSaver save) {
+    server->handing_off = true;
+
+    // Connections which can't be handed over are disconnected, and the others
+    // stop reading and writing.
+    for (UniConnection *conn = server->conns; conn != NULL; conn = conn->all_next) {
+        if (uni_handoff_eligible(conn)) {
+            conn->transport->cancel(conn);
+        } else if (!conn->closing) {
+            uni_conn_shutdown(conn);
+        }
+    }
+
+    uint64_t deadline = uni_time_ns() + UNI_HANDOFF_QUIESCE_MS * 1000000ull;
+    while (!uni_handoff_quiet(server)) {
+        if (uni_time_ns() >= deadline) {
+            UNI_LOG("HANDOFF: pending I/O wasn't cancelled within %d ms", UNI_HANDOFF_QUIESCE_MS);
+            uni_handoff_abort(server);
+            return false;
+        }
+        server->backend->poll(server, deadline, UINT_MAX);
+    }
+
+    UniHandoffRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = UNI_HANDOFF_MAGIC;
+    rec.check = UNI_HANDOFF_CHECK;
+    rec.kind = UNI_HANDOFF_LISTENER;
+    if (!uni_handoff_send_record(sock_fd, &rec, server->fd)) {
+        uni_handoff_abort(server);
+        return false;
+    }
+
+    UniConnection *next;
+    for (UniConnection *conn = server->conns; conn != NULL; conn = next) {
+        next = conn->all_next;
+        if (!uni_handoff_eligible(conn)) {
+            continue;
+        }
+
+        switch (uni_handoff_conn(server, sock_fd, conn, save)) {
+            case UNI_HANDOFF_SENT:
+                // The other process owns the client now, so the connection is
+                // freed without shutting the socket down.
+                conn->refcount--;
+                uni_conn_gc(conn);
+                break;
+
+            case UNI_HANDOFF_DECLINED:
+                uni_release(conn);
+                break;
+
+            case UNI_HANDOFF_FAILED:
+                uni_handoff_abort(server);
+                return false;
+        }
+    }
+
+    rec.kind = UNI_HANDOFF_END;
+    if (!uni_handoff_send_record(sock_fd, &rec, -1)) {
+        uni_handoff_abort(server);
+        return false;
+    }
+
+    close(server->fd);
+    server->fd = -1;
+    return true;
+}
+
+// Receives 'len' bytes into a new buffer of at least 'cap' bytes, or sets *buf
+// to NULL if 'cap' is 0.
+static bool uni_adopt_recv_buf(UniServer *server, int sock_fd, unsigned char **buf, int64_t len, int64_t cap) {
+    *buf = NULL;
+    if (cap == 0) {
+        return true;
+    }
+
+    *buf = malloc(cap);
+    if (*buf == NULL) {
+        UNI_LOG("HANDOFF ALLOC(%lld) FAILED", (long long) cap);
+        return false;
+    }
+    UNI_STAT_INC(server, allocs);
+    return uni_handoff_recv(sock_fd, *buf, len);
+}
+
+// Queues 'len' bytes at 'buf' as one packet, or frees 'buf' if there are none.
+static void uni_adopt_queue(UniConnection *conn, unsigned char *buf, int len, UniPriority priority) {
+    if (len == 0) {
+        free(buf);
+        return;
+    }
+
+    UniPacketOut packet = {(char *) buf, len, 0};
+    uni_conn_write_shared(conn, &packet, NULL, priority);
+}
+
+static bool uni_adopt_valid(const UniHandoffRecord *rec) {
+    bool valid =
+        (rec->state == UNI_READING_HEADER || rec->state == UNI_READING_BODY) &&
+        rec->header_size >= 0 && rec->header_size <= 5 &&
+        rec->packet_len >= 0 && rec->write_idx >= 0 && rec->write_idx <= rec->packet_len &&
+        rec->unread_len >= 0 && rec->unread_len <= INT_MAX / 2 &&
+        rec->out_len >= 0 && rec->state_len >= 0 && rec->state_len <= UNI_HANDOFF_STATE_MAX;
+    for (int priority = 0; priority < UNI_NUM_PRIORITIES; priority++) {
+        valid = valid && rec->queued_len[priority] >= 0 && rec->queued_len[priority] <= INT_MAX;
+    }
+    return valid;
+}
+
+// Recreates the connection described by 'rec' on the socket 'fd'. Returns
+// false if the rest of the stream can't be read anymore.
+static bool uni_adopt_conn(UniServer *server, int sock_fd, const UniHandoffRecord *rec, int fd, UniAdoptHandler restore) {
+    if (!uni_adopt_valid(rec)) {
+        UNI_LOG("HANDOFF: invalid connection record");
+        close(fd);
+        return false;
+    }
+
+    // Streamed packets reuse their buffer for every chunk.
+    int packet_cap = 0;
+    if (rec->state == UNI_READING_BODY) {
+        packet_cap = rec->packet_len;
+        if (rec->streaming && packet_cap < server->config.stream_chunk_size) {
+            packet_cap = server->config.stream_chunk_size;
+        }
+        if (packet_cap == 0) {
+            packet_cap = 1;
+        }
+    }
+
+    unsigned char *unread, *packet_buf, *out;
+    unsigned char *queued[UNI_NUM_PRIORITIES] = {NULL};
+    unsigned char state[UNI_HANDOFF_STATE_MAX];
+    bool received =
+        uni_adopt_recv_buf(server, sock_fd, &unread, rec->unread_len, rec->unread_len) &&
+        uni_adopt_recv_buf(server, sock_fd, &packet_buf, rec->write_idx, packet_cap) &&
+        uni_adopt_recv_buf(server, sock_fd, &out, rec->out_len, rec->out_len);
+    for (int priority = 0; received && priority < UNI_NUM_PRIORITIES; priority++) {
+        int64_t len = rec->queued_len[priority];
+        received = uni_adopt_recv_buf(server, sock_fd, &queued[priority], len, len);
+    }
+    received = received && uni_handoff_recv(sock_fd, state, rec->state_len);
+
+    // The other process may already consider the client handed over, so the
+    // socket is closed without shutting it down.
+    UniConnection *conn = NULL;
+    if (received) {
+        conn = server->backend->adopt(server, fd, unread, rec->unread_len);
+    } else {
+        close(fd);
+    }
+    free(unread);
+
+    if (conn == NULL) {
+        free(packet_buf);
+        free(out);
+        for (int priority = 0; priority < UNI_NUM_PRIORITIES; priority++) {
+            free(queued[priority]);
+        }
+        return received;
+    }
+
+    conn->packet_buf = packet_buf;
+    conn->packet_cap = packet_cap;
+    conn->packet_len = rec->packet_len;
+    conn->header_len_limit = rec->header_len_limit;
+    if (rec->state == UNI_READING_HEADER) {
+        conn->state = UNI_READING_HEADER;
+        conn->header_size = rec->header_size;
+    } else {
+        conn->state = UNI_READING_BODY;
+        conn->write_idx = rec->write_idx;
+    }
+    conn->streaming = rec->streaming;
+    conn->stream_len = rec->stream_len;
+    conn->stream_done = rec->stream_done;
+    conn->stream_hdr_len = rec->stream_hdr_len;
+    uni_conn_resume(conn);
+
+    // Queued ahead of anything the application writes. The connection only
+    // enters PLAY once the application took it, so until then, writing
+    // doesn't call back into it. Packets of the same priority are merged,
+    // which the client can't tell.
+    uni_adopt_queue(conn, out, rec->out_len, UNI_PRIORITY_HIGH);
+    for (int priority = 0; priority < UNI_NUM_PRIORITIES; priority++) {
+        uni_adopt_queue(conn, queued[priority], (int) rec->queued_len[priority], priority);
+    }
+
+    conn->accept_ns = conn->stage_ns = UNI_HIST_NOW(server);
+    void *user_ptr = restore(server->user_ptr, conn, state, rec->state_len);
+    if (user_ptr == NULL) {
+        uni_conn_shutdown(conn);
+        return true;
+    }
+
+    conn->refcount++;
+    conn->user_ptr = user_ptr;
+    uni_conn_set_handler(conn, UNI_HANDLER_PLAY);
+    if (rec->in_grid) {
+        uni_set_view(conn, rec->view_x, rec->view_z, rec->view_distance);
+    }
+    return true;
+}
+
+UniServer *uni_adopt(
+    int sock_fd, const char *secret, void *user_ptr, const UniConfig *config, UniAdoptHandler restore, UniError *err
+) {
+    UniHandoffRecord rec;
+    int fd;
+    if (!uni_handoff_recv_record(sock_fd, &rec, &fd) || rec.kind != UNI_HANDOFF_LISTENER || fd == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        if (err != NULL) {
+            *err = UNI_ERR_UNKNOWN;
+        }
+        return NULL;
+    }
+
+    UniServer *server = uni_server_alloc(secret, user_ptr, config, err);
+    if (server == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    if (!uni_net_adopt(server, fd, err)) {
+        close(fd);
+        uni_server_discard(server);
+        return NULL;
+    }
+
+    // The socket is listening already, which only needs to be registered.
+    if (!uni_listen(server)) {
+        UNI_LOG("HANDOFF: listening socket couldn't be registered");
+    }
+
+    for (;;) {
+        if (!uni_handoff_recv_record(sock_fd, &rec, &fd)) {
+            if (fd != -1) {
+                close(fd);
+            }
+            break;
+        }
+
+        if (rec.kind == UNI_HANDOFF_END) {
+            if (fd != -1) {
+                close(fd);
+            }
+            break;
+        }
+
+        if (rec.kind != UNI_HANDOFF_CONN || fd == -1) {
+            UNI_LOG("HANDOFF: unexpected record %u", rec.kind);
+            if (fd != -1) {
+                close(fd);
+            }
+            break;
+        }
+
+        if (!uni_adopt_conn(server, sock_fd, &rec, fd, restore)) {
+            break;
+        }
+    }
+
+    return server;
+}
@@ -0,0 +1,76 @@
+#ifndef UNI_HANDOFF_H
+#define UNI_HANDOFF_H
+
+// Handing a server over to another process, so it can be restarted without
+// disconnecting its players. uni_handoff() sets server->handing_off, which
+// makes the connections stop queueing reads and writes, and cancels the ones
+// which are pending (see UniTransport.cancel). Once nothing is in flight, the
+// listening socket and every connection in PLAY are sent over a Unix domain
+// socket, each as a UniHandoffRecord carrying the socket, followed by the
+// data the record announces. uni_adopt() recreates the connections from that
+// in the new process and queues the reads and writes they were waiting for
+// (see uni_conn_resume()).
+//
+// Connections which are still logging in aren't handed over. They are
+// disconnected instead, and the proxy retries them.
+
+#include <stdint.h>
+
+#include "uni.h"
+
+#define UNI_HANDOFF_MAGIC 0x48696e75u // "uniH"
+#define UNI_HANDOFF_VERSION 1
+
+// How long uni_handoff() waits for pending operations to be cancelled.
+#define UNI_HANDOFF_QUIESCE_MS 1000
+
+// Both processes run on the same machine and usually the same build, but the
+// record's size is part of the check anyway.
+#define UNI_HANDOFF_CHECK (UNI_HANDOFF_VERSION << 16 | (uint32_t) sizeof(UniHandoffRecord))
+
+typedef enum {
+    // Carries the listening socket. Always first.
+    UNI_HANDOFF_LISTENER,
+    // Carries a connection's socket.
+    UNI_HANDOFF_CONN,
+    // Marks the end of the connections. Carries no socket.
+    UNI_HANDOFF_END,
+} UniHandoffKind;
+
+// Integers are in native byte order. The fields after 'kind' are only used by
+// UNI_HANDOFF_CONN.
+typedef struct {
+    uint32_t magic;
+    uint32_t check;
+    uint32_t kind;
+
+    // The connection's read state: the header bytes read so far, or the
+    // frame being read.
+    int32_t state;
+    int32_t header_size;
+    int32_t header_len_limit;
+    int32_t packet_len;
+    int32_t write_idx;
+    int32_t streaming;
+    int32_t stream_len;
+    int32_t stream_done;
+    int32_t stream_hdr_len;
+
+    // The view set with uni_set_view(), if in_grid is set.
+    int32_t in_grid;
+    int32_t view_x;
+    int32_t view_z;
+    int32_t view_distance;
+
+    // Lengths of the data following the record, in this order: bytes the
+    // transport received but the connection didn't read yet, the first
+    // 'write_idx' bytes of the frame being read, the unwritten rest of the
+    // packet being written, the packets queued at each priority, and the
+    // application's state.
+    int32_t unread_len;
+    int32_t out_len;
+    int64_t queued_len[UNI_NUM_PRIORITIES];
+    int32_t state_len;
+} UniHandoffRecord;
+
+#endif // !UNI_HANDOFF_H
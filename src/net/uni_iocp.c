@@ -81,6 +81,23 @@ bool uni_listen(UniServer *server) {
     return listen(server->socket, UNI_CONN_BACKLOG) != -1;
 }
 
+bool uni_handoff(UniServer *server, int sock_fd, UniHandoffSaver save) {
+    return false;
+}
+
+UniServer *uni_adopt(
+    int sock_fd, const char *secret, void *user_ptr, const UniConfig *config, UniAdoptHandler restore, UniError *err
+) {
+    if (err != NULL) {
+        *err = UNI_ERR_UNSUPPORTED;
+    }
+    return NULL;
+}
+
+void uni_net_wake(UniServer *server) {
+    // TODO
+}
+
 static void uni_do_poll(UniServer *server) {
     // TODO
 }
@@ -92,3 +109,24 @@ void uni_poll(UniServer *server) {
 void uni_try_poll(UniServer *server) {
     uni_do_poll(server);
 }
+
+int uni_poll_timeout(UniServer *server, uint64_t deadline_ns, int max_events) {
+    uni_do_poll(server);
+    return 0;
+}
+
+int uni_event_fd(UniServer *server) {
+    return -1;
+}
+
+int uni_process_completions(UniServer *server, int max_events) {
+    uni_do_poll(server);
+    return 0;
+}
+
+void uni_submit(UniServer *server) {
+}
+
+UniRingMode uni_ring_mode(UniServer *server) {
+    return UNI_RING_DEFAULT;
+}
@@ -0,0 +1,211 @@
+#include "uni_networking.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "uni_admission.h"
+#include "uni_connection.h"
+#include "uni_executor.h"
+
+// Sets up the backend requested in the server's config. UNI_BACKEND_AUTO
+// prefers io_uring and falls back to epoll.
+static bool uni_net_init_backend(UniServer *server) {
+    switch (server->config.backend) {
+        case UNI_BACKEND_AUTO:
+            if (uni_uring_backend.init(server)) {
+                server->backend = &uni_uring_backend;
+                return true;
+            }
+            break;
+
+        case UNI_BACKEND_URING:
+            server->backend = &uni_uring_backend;
+            return uni_uring_backend.init(server);
+
+        case UNI_BACKEND_EPOLL:
+            break;
+    }
+
+    server->backend = &uni_epoll_backend;
+    server->ring_mode = UNI_RING_DEFAULT;
+    return uni_epoll_backend.init(server);
+}
+
+bool uni_net_init(UniServer *server, uint16_t port, UniError *err) {
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server->server_addr = server_addr;
+    server->addr_len = sizeof(server_addr);
+
+    server->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->fd == -1) {
+        if (err != NULL) {
+            switch (errno) {
+                case EAFNOSUPPORT:
+                case EINVAL:
+                case EPROTONOSUPPORT:
+                    *err = UNI_ERR_UNSUPPORTED;
+                    break;
+
+                case EACCES:
+                case EMFILE:
+                case ENFILE:
+                case ENOBUFS:
+                case ENOMEM:
+                    *err = UNI_ERR_LIMITED;
+                    break;
+
+                default:
+                    *err = UNI_ERR_UNKNOWN;
+                    break;
+            }
+        }
+        return false;
+    }
+
+    int optval = 1;
+    setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    if (bind(server->fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1) {
+        if (err != NULL) {
+            switch (errno) {
+                case EACCES:
+                case EFAULT:
+                case ENOMEM:
+                case EROFS:
+                    *err = UNI_ERR_LIMITED;
+                    break;
+
+                case EADDRINUSE:
+                    *err = UNI_ERR_IN_USE;
+                    break;
+
+                default:
+                    *err = UNI_ERR_UNKNOWN;
+                    break;
+            }
+        }
+        close(server->fd);
+        return false;
+    }
+
+    if (!uni_net_init_backend(server)) {
+        if (err != NULL) {
+            *err = UNI_ERR_UNSUPPORTED;
+        }
+        close(server->fd);
+        return false;
+    }
+
+    return true;
+}
+
+bool uni_net_adopt(UniServer *server, int fd, UniError *err) {
+    // The epoll backend makes the socket non-blocking, which io_uring can't
+    // accept from. Whichever backend is picked sets it up again.
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1) {
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    server->fd = fd;
+    server->addr_len = sizeof(server->server_addr);
+    if (getsockname(fd, (struct sockaddr *) &server->server_addr, &server->addr_len) == -1) {
+        if (err != NULL) {
+            *err = UNI_ERR_UNKNOWN;
+        }
+        return false;
+    }
+
+    if (!uni_net_init_backend(server)) {
+        if (err != NULL) {
+            *err = UNI_ERR_UNSUPPORTED;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+bool uni_listen(UniServer *server) {
+    if (listen(server->fd, UNI_CONN_BACKLOG) == -1) {
+        return false;
+    }
+
+    return server->backend->listen == NULL || server->backend->listen(server);
+}
+
+
+// Admits queued logins before polling, and wakes up in time for the next one
+// that is waiting for the login rate limit, or the next connection due to be
+// disconnected for staying above UniConfig.write_hard_cap. Jobs which workers
+// finished in the meantime are picked up before and after.
+static unsigned uni_net_poll(UniServer *server, uint64_t deadline, unsigned budget) {
+    // Finished jobs count as events, so the poll mustn't wait for more.
+    unsigned handled = uni_executor_complete(server);
+    if (handled > 0) {
+        deadline = 0;
+    }
+
+    uni_admit_queued(server);
+
+    uint64_t admit_ns = uni_admission_deadline(server);
+    if (admit_ns < deadline) {
+        deadline = admit_ns;
+    }
+
+    uint64_t cap_ns = uni_conn_enforce_write_cap(server);
+    if (cap_ns < deadline) {
+        deadline = cap_ns;
+    }
+
+    handled += server->backend->poll(server, deadline, budget);
+    return handled + uni_executor_complete(server);
+}
+
+void uni_net_wake(UniServer *server) {
+    server->backend->wake(server);
+}
+
+void uni_poll(UniServer *server) {
+    uni_net_poll(server, UNI_NO_DEADLINE, UINT_MAX);
+}
+
+void uni_try_poll(UniServer *server) {
+    uni_net_poll(server, 0, UINT_MAX);
+}
+
+int uni_poll_timeout(UniServer *server, uint64_t deadline_ns, int max_events) {
+    return (int) uni_net_poll(server, deadline_ns, max_events > 0 ? (unsigned) max_events : UINT_MAX);
+}
+
+int uni_event_fd(UniServer *server) {
+    return server->backend->event_fd(server);
+}
+
+int uni_process_completions(UniServer *server, int max_events) {
+    unsigned handled = uni_executor_complete(server);
+    uni_admit_queued(server);
+    uni_conn_enforce_write_cap(server);
+    handled += server->backend->process_completions(server, max_events > 0 ? (unsigned) max_events : UINT_MAX);
+    return (int) (handled + uni_executor_complete(server));
+}
+
+void uni_submit(UniServer *server) {
+    server->backend->submit(server);
+}
+
+UniRingMode uni_ring_mode(UniServer *server) {
+    return server->ring_mode;
+}
+
+UniBackend uni_backend(UniServer *server) {
+    return server->backend->id;
+}
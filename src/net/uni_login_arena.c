@@ -0,0 +1,88 @@
+#include "uni_login_arena.h"
+
+#include <stdlib.h>
+
+#include "protocol/uni_packet.h"
+#include "uni_server.h"
+
+bool uni_login_arena_acquire(UniConnection *conn) {
+    UniServer *server = conn->server;
+
+    if (conn->login_arena != NULL) {
+        return true;
+    }
+
+    UniLoginArena *arena = server->login_arenas;
+    if (arena != NULL) {
+        server->login_arenas = arena->next;
+        server->num_login_arenas--;
+    } else {
+        arena = malloc(sizeof(UniLoginArena));
+        UNI_STAT_INC(server, allocs);
+        if (arena == NULL) {
+            return false;
+        }
+        arena->out_ref.buf = NULL;
+        arena->out_ref.refcount = 1;
+    }
+
+    arena->used = 0;
+    conn->login_arena = arena;
+    return true;
+}
+
+void uni_login_arena_release(UniConnection *conn) {
+    UniServer *server = conn->server;
+    UniLoginArena *arena = conn->login_arena;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    if (conn->packet_buf_in_arena) {
+        conn->packet_buf = NULL;
+        conn->packet_buf_in_arena = false;
+    }
+    conn->login_arena = NULL;
+
+    if (arena->out_ref.refcount > 1) {
+        uni_shared_buf_release(&arena->out_ref);
+        return;
+    }
+
+    if (server->num_login_arenas >= UNI_LOGIN_ARENA_POOL_MAX) {
+        free(arena);
+        return;
+    }
+
+    arena->next = server->login_arenas;
+    server->login_arenas = arena;
+    server->num_login_arenas++;
+}
+
+void uni_login_arenas_free(UniServer *server) {
+    while (server->login_arenas != NULL) {
+        UniLoginArena *arena = server->login_arenas;
+        server->login_arenas = arena->next;
+        free(arena);
+    }
+    server->num_login_arenas = 0;
+}
+
+UniPacketOut uni_login_alloc_packet(UniConnection *conn, int size, UniSharedBuf **shared) {
+    UniPacketOut packet;
+
+    int header_size = uni_varint_size(size);
+    packet.buf = uni_login_alloc(conn, header_size + size);
+    if (packet.buf == NULL) {
+        *shared = NULL;
+        UNI_STAT_INC(conn->server, allocs);
+        return uni_alloc_packet(size);
+    }
+
+    packet.len = header_size + size;
+    packet.write_idx = header_size;
+    uni_write_varint(packet.buf, size);
+    *shared = &conn->login_arena->out_ref;
+    return packet;
+}
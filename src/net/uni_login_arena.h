@@ -0,0 +1,70 @@
+#ifndef UNI_LOGIN_ARENA_H
+#define UNI_LOGIN_ARENA_H
+
+// Everything a connection allocates between its handshake and uni_on_join()
+// comes from a small bump arena: the frames it reads, the forwarded properties
+// and the packets it writes. Arenas are taken from a free list on the server
+// when a connection starts logging in and returned once it joined or was
+// freed, so a login doesn't call the allocator at all once a few arenas exist.
+// Anything which doesn't fit falls back to the heap.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "uni_connection.h"
+
+typedef struct UniServerImpl UniServer;
+
+#define UNI_LOGIN_ARENA_SIZE 4096
+
+// Free arenas kept by the server. Arenas returned beyond this are freed, so a
+// reconnect storm doesn't pin memory forever.
+#define UNI_LOGIN_ARENA_POOL_MAX 256
+
+struct UniLoginArena {
+    // Packets written from the arena reference this instead of owning their
+    // buffer. The arena holds a reference of its own while a connection uses
+    // it. If it's released while packets from it are still queued, the last
+    // of them frees the arena through this, which is why it comes first.
+    UniSharedBuf out_ref;
+
+    // Next free arena in the server's pool.
+    UniLoginArena *next;
+
+    int used;
+    unsigned char buf[UNI_LOGIN_ARENA_SIZE];
+};
+
+// Gives the connection an arena, if it doesn't have one yet. Returns false if
+// out of memory, in which case the connection uses the heap.
+bool uni_login_arena_acquire(UniConnection *conn);
+
+// Returns the connection's arena to the server. If packets written from it
+// are still queued, it is freed once they are done instead. The connection's
+// packet buffer is dropped if it is in the arena.
+void uni_login_arena_release(UniConnection *conn);
+
+void uni_login_arenas_free(UniServer *server);
+
+// Allocates 'size' bytes, aligned for any type, from the connection's arena.
+// Returns NULL if the connection has no arena or it is full.
+static inline void *uni_login_alloc(UniConnection *conn, int size) {
+    UniLoginArena *arena = conn->login_arena;
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    int start = arena->used + (int) (-(uintptr_t) &arena->buf[arena->used] & 15);
+    if (start > UNI_LOGIN_ARENA_SIZE || size > UNI_LOGIN_ARENA_SIZE - start) {
+        return NULL;
+    }
+
+    arena->used = start + size;
+    return &arena->buf[start];
+}
+
+// Allocates a packet like uni_alloc_packet(), from the connection's arena if
+// possible. *shared is set to what to pass to uni_conn_write_shared().
+UniPacketOut uni_login_alloc_packet(UniConnection *conn, int size, UniSharedBuf **shared);
+
+#endif // !UNI_LOGIN_ARENA_H
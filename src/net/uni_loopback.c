@@ -0,0 +1,398 @@
+#include "uni_loopback.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uni_connection.h"
+#include "uni_executor.h"
+#include "uni_server.h"
+
+// Bytes travelling in one direction. Unread data is data[start..len).
+typedef struct {
+    unsigned char *data;
+    int start;
+    int len;
+    int cap;
+} UniLoopbackBuf;
+
+struct UniLoopbackImpl {
+    UniServer *server;
+
+    // The server's end of the connection. NULL once it has been freed.
+    UniConnection *conn;
+
+    UniLoopbackBuf to_server;
+    UniLoopbackBuf to_client;
+
+    // The server's outstanding read, if any.
+    unsigned char *read_buf;
+    int read_len;
+    bool read_pending;
+
+    // Whether the server has an outstanding write of conn->out_pkt.
+    bool write_pending;
+
+    // The client holds a reference to the connection until it has logged in or
+    // is shut down, like the login timeout of a socket connection does.
+    // Releasing it is deferred to uni_loopback_run() like any other
+    // completion.
+    bool holds_ref;
+    bool drop_ref;
+
+    // Set by the server's shutdown and the client's uni_loopback_close().
+    bool shut_down;
+    bool client_closed;
+
+    // Set while one of the connection's operations is being completed, during
+    // which it must not be freed.
+    bool busy;
+
+    // Whether the client is in the server's queue of ready connections.
+    bool queued;
+    UniLoopback *next;
+};
+
+static bool uni_loopback_buf_append(UniLoopbackBuf *buf, const void *data, int len) {
+    if (buf->start == buf->len) {
+        buf->start = 0;
+        buf->len = 0;
+    }
+
+    if (buf->len + len > buf->cap) {
+        // Make room by discarding what has already been read before growing.
+        if (buf->start > 0) {
+            memmove(buf->data, &buf->data[buf->start], buf->len - buf->start);
+            buf->len -= buf->start;
+            buf->start = 0;
+        }
+
+        if (buf->len + len > buf->cap) {
+            int cap = buf->cap > 0 ? buf->cap : 256;
+            while (cap < buf->len + len) {
+                cap *= 2;
+            }
+
+            unsigned char *grown = realloc(buf->data, cap);
+            if (grown == NULL) {
+                return false;
+            }
+
+            buf->data = grown;
+            buf->cap = cap;
+        }
+    }
+
+    memcpy(&buf->data[buf->len], data, len);
+    buf->len += len;
+    return true;
+}
+
+// Moves up to 'max_len' unread bytes out of the buffer. Returns the number of
+// bytes moved.
+static int uni_loopback_buf_take(UniLoopbackBuf *buf, void *dest, int max_len) {
+    int len = buf->len - buf->start;
+    if (len > max_len) {
+        len = max_len;
+    }
+    if (len <= 0) {
+        return 0;
+    }
+
+    memcpy(dest, &buf->data[buf->start], len);
+    buf->start += len;
+    return len;
+}
+
+// Buffers of closed clients which grew beyond this are freed rather than kept.
+#define UNI_LOOPBACK_KEEP_CAP 4096
+
+static void uni_loopback_buf_reset(UniLoopbackBuf *buf) {
+    if (buf->cap > UNI_LOOPBACK_KEEP_CAP) {
+        free(buf->data);
+        buf->data = NULL;
+        buf->cap = 0;
+    }
+    buf->start = 0;
+    buf->len = 0;
+}
+
+static void uni_loopback_destroy(UniLoopback *client) {
+    free(client->to_server.data);
+    free(client->to_client.data);
+    free(client);
+}
+
+// Puts the client into the server's pool, like connection objects.
+static void uni_loopback_free(UniLoopback *client) {
+    UniServer *server = client->server;
+    if (server->num_free_loopbacks >= UNI_CONN_POOL_MAX) {
+        uni_loopback_destroy(client);
+        return;
+    }
+
+    uni_loopback_buf_reset(&client->to_server);
+    uni_loopback_buf_reset(&client->to_client);
+    client->next = server->free_loopbacks;
+    server->free_loopbacks = client;
+    server->num_free_loopbacks++;
+}
+
+void uni_loopbacks_free(UniServer *server) {
+    while (server->free_loopbacks != NULL) {
+        UniLoopback *client = server->free_loopbacks;
+        server->free_loopbacks = client->next;
+        uni_loopback_destroy(client);
+    }
+    server->num_free_loopbacks = 0;
+}
+
+// Whether one of the server's operations on the connection can complete.
+static bool uni_loopback_ready(UniLoopback *client) {
+    if (client->conn == NULL) {
+        return false;
+    }
+
+    if (client->write_pending || client->drop_ref) {
+        return true;
+    }
+
+    bool readable =
+        client->to_server.len > client->to_server.start ||
+        client->client_closed ||
+        client->shut_down;
+
+    return client->read_pending && readable;
+}
+
+// Adds the client to the server's ready queue if it has an operation which can
+// complete.
+static void uni_loopback_wake(UniLoopback *client) {
+    if (client->queued || !uni_loopback_ready(client)) {
+        return;
+    }
+
+    UniServer *server = client->server;
+    client->queued = true;
+    client->next = NULL;
+    if (server->loopback_head == NULL) {
+        server->loopback_head = client;
+    } else {
+        server->loopback_tail->next = client;
+    }
+    server->loopback_tail = client;
+}
+
+static void uni_loopback_read(UniConnection *conn, unsigned char *buf, int len) {
+    UniLoopback *client = conn->transport_data;
+    client->read_buf = buf;
+    client->read_len = len;
+    client->read_pending = true;
+    uni_loopback_wake(client);
+}
+
+static void uni_loopback_write(UniConnection *conn) {
+    UniLoopback *client = conn->transport_data;
+    client->write_pending = true;
+    uni_loopback_wake(client);
+}
+
+static void uni_loopback_release_ref(UniLoopback *client) {
+    if (client->holds_ref) {
+        client->holds_ref = false;
+        client->drop_ref = true;
+    }
+}
+
+static void uni_loopback_login_done(UniConnection *conn) {
+    UniLoopback *client = conn->transport_data;
+    uni_loopback_release_ref(client);
+    uni_loopback_wake(client);
+}
+
+static void uni_loopback_shutdown(UniConnection *conn) {
+    UniLoopback *client = conn->transport_data;
+    client->shut_down = true;
+    uni_loopback_release_ref(client);
+    uni_loopback_wake(client);
+}
+
+static void uni_loopback_close_conn(UniConnection *conn) {
+    UniLoopback *client = conn->transport_data;
+    client->conn = NULL;
+
+    if (client->client_closed && !client->busy) {
+        uni_loopback_free(client);
+    }
+}
+
+static const UniTransport uni_loopback_transport = {
+    .read = uni_loopback_read,
+    .write = uni_loopback_write,
+    .login_done = uni_loopback_login_done,
+    .shutdown = uni_loopback_shutdown,
+    .close = uni_loopback_close_conn,
+};
+
+// Takes a client from the server's pool, or allocates one. Returns NULL if out
+// of memory.
+static UniLoopback *uni_loopback_alloc(UniServer *server) {
+    UniLoopback *client = server->free_loopbacks;
+    if (client == NULL) {
+        client = calloc(1, sizeof(UniLoopback));
+        UNI_STAT_INC(server, allocs);
+        if (client == NULL) {
+            return NULL;
+        }
+    } else {
+        server->free_loopbacks = client->next;
+        server->num_free_loopbacks--;
+
+        UniLoopbackBuf to_server = client->to_server;
+        UniLoopbackBuf to_client = client->to_client;
+        memset(client, 0, sizeof(UniLoopback));
+        client->to_server = to_server;
+        client->to_client = to_client;
+    }
+
+    client->server = server;
+    return client;
+}
+
+UniLoopback *uni_loopback_connect(UniServer *server) {
+    UniLoopback *client = uni_loopback_alloc(server);
+    if (client == NULL) {
+        return NULL;
+    }
+
+    UniConnection *conn = uni_conn_alloc(server);
+    if (conn == NULL) {
+        uni_loopback_free(client);
+        return NULL;
+    }
+
+    UNI_STAT_INC(server, accepts);
+    uni_init_conn(server, conn, &uni_loopback_transport);
+    conn->transport_data = client;
+#ifdef UNI_OS_LINUX
+    conn->fd = -1;
+#endif // UNI_OS_LINUX
+    conn->accept_ns = UNI_HIST_NOW(server);
+    conn->stage_ns = conn->accept_ns;
+
+    client->server = server;
+    client->conn = conn;
+    client->holds_ref = true;
+    conn->refcount++;
+
+    uni_conn_admit(conn);
+    return client;
+}
+
+bool uni_loopback_send(UniLoopback *client, const void *data, int len) {
+    if (uni_loopback_closed(client)) {
+        return false;
+    }
+
+    if (!uni_loopback_buf_append(&client->to_server, data, len)) {
+        return false;
+    }
+
+    uni_loopback_wake(client);
+    return true;
+}
+
+int uni_loopback_recv(UniLoopback *client, void *buf, int max_len) {
+    return uni_loopback_buf_take(&client->to_client, buf, max_len);
+}
+
+bool uni_loopback_closed(UniLoopback *client) {
+    return client->conn == NULL || client->shut_down;
+}
+
+void uni_loopback_close(UniLoopback *client) {
+    client->client_closed = true;
+
+    if (client->conn == NULL) {
+        uni_loopback_free(client);
+    } else {
+        uni_loopback_wake(client);
+    }
+}
+
+// Completes one of the server's pending operations on the connection.
+static void uni_loopback_complete(UniLoopback *client) {
+    UniConnection *conn = client->conn;
+
+    if (client->drop_ref) {
+        client->drop_ref = false;
+        conn->refcount--;
+        uni_conn_gc(conn);
+        return;
+    }
+
+    if (client->write_pending) {
+        client->write_pending = false;
+
+        int res;
+        if (client->shut_down) {
+            res = -EPIPE;
+        } else {
+            UniPacketOut *pkt = &conn->out_pkt;
+            res = pkt->len - pkt->write_idx;
+
+            // Once the client is gone, its data is simply dropped.
+            if (!client->client_closed &&
+                !uni_loopback_buf_append(&client->to_client, &pkt->buf[pkt->write_idx], res)) {
+                res = -ENOMEM;
+            }
+        }
+
+        uni_conn_write_done(conn, res);
+        return;
+    }
+
+    client->read_pending = false;
+
+    int res = 0;
+    if (!client->shut_down) {
+        res = uni_loopback_buf_take(&client->to_server, client->read_buf, client->read_len);
+    }
+
+    uni_conn_read_done(conn, res);
+}
+
+int uni_loopback_run(UniServer *server, int max_events) {
+    unsigned budget = max_events > 0 ? (unsigned) max_events : UINT_MAX;
+    unsigned handled = 0;
+
+    uni_executor_complete(server);
+    uni_admit_queued(server);
+    uni_conn_enforce_write_cap(server);
+    while (server->loopback_head != NULL && handled < budget) {
+        UniLoopback *client = server->loopback_head;
+        server->loopback_head = client->next;
+        client->queued = false;
+
+        if (!uni_loopback_ready(client)) {
+            continue;
+        }
+
+        client->busy = true;
+        uni_loopback_complete(client);
+        client->busy = false;
+        handled++;
+
+        if (client->conn == NULL) {
+            if (client->client_closed) {
+                uni_loopback_free(client);
+            }
+        } else {
+            uni_loopback_wake(client);
+        }
+    }
+
+    uni_capture_tick(server);
+    return (int) handled;
+}
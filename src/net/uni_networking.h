@@ -6,8 +6,81 @@
 
 #include "uni_server.h"
 
-#define UNI_CONN_BACKLOG 16
+// Length of the listening socket's queue of connections which haven't been
+// accepted yet. Linux caps it at net.core.somaxconn. A short queue makes the
+// kernel drop SYNs during a burst of connections, and clients then wait a
+// second or more before retrying, long after the connections could have been
+// admitted. See uni_admission.h
+#define UNI_CONN_BACKLOG 4096
+
+// Connections which haven't finished logging in after this long are shut down.
+#define UNI_LOGIN_TIMEOUT_SECS 2
+
+#define UNI_NO_DEADLINE UINT64_MAX
 
 bool uni_net_init(UniServer *server, uint16_t port, UniError *err);
 
+// Makes a poll function which is waiting for events return. May be called
+// from any thread.
+void uni_net_wake(UniServer *server);
+
+// Frees the closed loopback clients the server keeps for reuse. See
+// uni_loopback.c
+void uni_loopbacks_free(UniServer *server);
+
+#ifdef UNI_OS_LINUX
+
+// Same as uni_net_init(), but with a listening socket handed over by another
+// process. See uni_handoff.h
+bool uni_net_adopt(UniServer *server, int fd, UniError *err);
+
+// An I/O interface. uni_net_init() binds the listening socket (server->fd) and
+// hands it to the backend selected by UniConfig.backend. The public polling
+// functions are then forwarded to the backend's implementations.
+struct UniNetBackend {
+    UniBackend id;
+
+    // Prepares the backend to accept connections on server->fd once
+    // uni_listen() is called. Returns false if the system doesn't support the
+    // backend, in which case nothing may be left behind.
+    bool (*init)(UniServer *server);
+
+    // Called once server->fd is listening. May be NULL.
+    bool (*listen)(UniServer *server);
+
+    // Waits until there is at least one event to handle or until 'deadline'
+    // (see uni_time_ns()) has passed, then handles at most 'budget' events. A
+    // deadline of UNI_NO_DEADLINE waits indefinitely. Returns the number of
+    // events handled.
+    unsigned (*poll)(UniServer *server, uint64_t deadline, unsigned budget);
+
+    // See uni_event_fd(), uni_process_completions() and uni_submit().
+    int (*event_fd)(UniServer *server);
+    unsigned (*process_completions)(UniServer *server, unsigned budget);
+    void (*submit)(UniServer *server);
+
+    // See uni_net_wake(). Only needs to work if UniConfig.worker_threads is
+    // set.
+    void (*wake)(UniServer *server);
+
+    // Stops accepting connections while server->handing_off is set. Returns
+    // false while an accept is still in progress, in which case it is called
+    // again. May be NULL if checking server->handing_off is enough.
+    bool (*pause_accept)(UniServer *server);
+
+    // Starts accepting again after a failed handoff. May be NULL.
+    void (*resume_accept)(UniServer *server);
+
+    // Creates a connection for a socket handed over by another process. The
+    // connection's first reads return the 'len' bytes at 'data', which the
+    // other process had already received. Returns NULL on failure, in which
+    // case the socket is closed.
+    UniConnection *(*adopt)(UniServer *server, int fd, const unsigned char *data, int len);
+};
+
+extern const UniNetBackend uni_uring_backend;
+extern const UniNetBackend uni_epoll_backend;
+
+#endif // UNI_OS_LINUX
+
 #endif // !UNI_NETWORKING_H
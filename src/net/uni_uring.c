@@ -5,12 +5,43 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include "liburing.h"
 #include <unistd.h>
 
 #include "uni_connection.h"
-#include "protocol/uni_packet_handler.h"
 #include "uni_log.h"
+#include "uni_probe.h"
+#include "uni_time.h"
+
+// These may be missing from older kernel headers. The kernel rejects flags it
+// doesn't know with -EINVAL, which is handled by falling back to another mode.
+#ifndef IORING_SETUP_COOP_TASKRUN
+#define IORING_SETUP_COOP_TASKRUN (1U << 8)
+#endif // !IORING_SETUP_COOP_TASKRUN
+#ifndef IORING_SETUP_TASKRUN_FLAG
+#define IORING_SETUP_TASKRUN_FLAG (1U << 9)
+#endif // !IORING_SETUP_TASKRUN_FLAG
+#ifndef IORING_SETUP_SINGLE_ISSUER
+#define IORING_SETUP_SINGLE_ISSUER (1U << 12)
+#endif // !IORING_SETUP_SINGLE_ISSUER
+#ifndef IORING_SETUP_DEFER_TASKRUN
+#define IORING_SETUP_DEFER_TASKRUN (1U << 13)
+#endif // !IORING_SETUP_DEFER_TASKRUN
+#ifndef IORING_SQ_TASKRUN
+#define IORING_SQ_TASKRUN (1U << 2)
+#endif // !IORING_SQ_TASKRUN
+
+#define UNI_RING_ENTRIES 2048 /* TODO: Is this a good amount? */
+
+// The completion queue is made larger than the submission queue since a burst
+// of submissions can complete all at once while older operations (reads,
+// timeouts) are still outstanding.
+#define UNI_RING_CQ_ENTRIES (UNI_RING_ENTRIES * 4)
+
+#define UNI_MIN_SUBMIT_BATCH 16
 
 typedef enum {
     UNI_ACT_READ,
@@ -18,343 +49,625 @@ typedef enum {
     UNI_ACT_ACCEPT,
     UNI_ACT_TIMEOUT,
     UNI_ACT_TIMEOUT_CANCEL,
+
+    // Cancels a read, write or accept. See uni_handoff.h
+    UNI_ACT_CANCEL,
+
+    // A read served from the bytes a connection was handed over with. Goes
+    // through the ring as a no-op, since it must not complete right away.
+    UNI_ACT_READ_INBOUND,
+
+    // Waits for server->wake_fd to become readable, which happens when a
+    // worker wakes up the polling thread. See uni_executor.h
+    UNI_ACT_WAKE,
 } UniUringAction;
 
+// Bytes the process a connection was handed over from had already received.
+// They are read before anything else. Kept in conn->transport_data.
 typedef struct {
+    int start;
+    int len;
+    unsigned char data[];
+} UniUringInbound;
+
+struct UniUringEntry {
     UniUringAction action;
     UniConnection *conn;
-} UniUringEntry;
 
-void uni_dump_conn(UniConnection *conn) {
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wformat-extra-args"
-    UNI_LOG("UniConnection: {", 0);
-    UNI_LOG("  fd = %d", conn->fd);
-    UNI_LOG("  state = %d", conn->state);
-    UNI_LOG("  handler = %d", conn->handler);
-    UNI_LOG("  packet buf, len = %p, %d", conn->packet_buf, conn->packet_len);
-    UNI_LOG("  header_len_limit = %d", conn->header_len_limit);
-    UNI_LOG("  header_buf [0], [1] = %x, %x", conn->header_buf[0], conn->header_buf[1]);
-    UNI_LOG("  header_size = %d", conn->header_size);
-    UNI_LOG("  read/write idx = %d", conn->write_idx);
-    UNI_LOG("}", 0);
-#pragma clang diagnostic pop
+    // Parameters of read operations. Kept so that the operation can still be
+    // queued later if the submission queue is full.
+    unsigned char *buf;
+    int len;
+
+    // The operation removed by a UNI_ACT_TIMEOUT_CANCEL or UNI_ACT_CANCEL
+    // operation.
+    UniUringEntry *target;
+
+    // Next operation in the server's backlog, or next entry kept for reuse.
+    UniUringEntry *next;
+};
+
+// Fills in a submission queue entry for the operation described by 'entry'.
+static void uni_uring_prep(UniServer *server, struct io_uring_sqe *sqe, UniUringEntry *entry) {
+    UniConnection *conn = entry->conn;
+
+    switch (entry->action) {
+        case UNI_ACT_ACCEPT:
+            io_uring_prep_accept(sqe, server->fd, (struct sockaddr *) &server->server_addr, &server->addr_len, 0);
+            break;
+
+        case UNI_ACT_READ:
+            io_uring_prep_recv(sqe, conn->fd, entry->buf, entry->len, 0);
+            break;
+
+        case UNI_ACT_WRITE:
+            io_uring_prep_send(
+                sqe, conn->fd, &conn->out_pkt.buf[conn->out_pkt.write_idx],
+                conn->out_pkt.len - conn->out_pkt.write_idx, 0
+            );
+            break;
+
+        case UNI_ACT_TIMEOUT:
+            io_uring_prep_timeout(sqe, &conn->timeout, 0, 0);
+            break;
+
+        case UNI_ACT_TIMEOUT_CANCEL:
+            io_uring_prep_timeout_remove(sqe, (__u64) entry->target, 0);
+            break;
+
+        case UNI_ACT_CANCEL:
+            io_uring_prep_cancel(sqe, entry->target, 0);
+            break;
+
+        case UNI_ACT_READ_INBOUND:
+            io_uring_prep_nop(sqe);
+            break;
+
+        case UNI_ACT_WAKE:
+            io_uring_prep_poll_add(sqe, server->wake_fd, POLLIN);
+            break;
+    }
+
+    sqe->user_data = (__u64) entry;
+    server->cycle_sqes++;
+    UNI_STAT_INC(server, sqes);
 }
 
-static void uni_dump_net_err(const char *type, int res) {
-    UNI_LOG("-- UNI %s ERROR --", type);
-    UNI_LOG("res: %d, res string: %s, errno: %d, errno string: %s", res, strerror(-res), errno, strerror(errno));
+// Submits everything in the submission queue.
+static void uni_uring_submit(UniServer *server) {
+    io_uring_submit(&server->ring);
+    UNI_STAT_INC(server, submit_calls);
 }
 
-static void uni_dump_conn_err(const char *type, UniConnection *conn, int res) {
-    uni_dump_net_err(type, res);
-    uni_dump_conn(conn);
+// Submits everything in the submission queue and waits for at least one
+// completion.
+static void uni_uring_submit_and_wait(UniServer *server) {
+    io_uring_submit_and_wait(&server->ring, 1);
+    UNI_STAT_INC(server, submit_calls);
 }
 
-void uni_uring_accept(UniServer *server, int socket, struct sockaddr *addr, socklen_t *addr_len) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&server->ring);
-    io_uring_prep_accept(sqe, socket, addr, addr_len, 0);
+// Queues an operation. If the submission queue is full, its contents are
+// submitted to make room. If that still doesn't free up an entry (e.g. the
+// SQPOLL thread hasn't caught up yet), the operation is put into the backlog
+// and queued by the next call to uni_uring_drain_backlog().
+// While server->inhibit_submit is set, nothing is submitted. Operations which
+// don't fit go straight into the backlog.
+static void uni_uring_queue(UniServer *server, UniUringEntry *entry) {
+    entry->next = NULL;
+
+    struct io_uring_sqe *sqe = NULL;
+    if (server->backlog_head == NULL) {
+        sqe = io_uring_get_sqe(&server->ring);
+        if (sqe == NULL && !server->inhibit_submit) {
+            uni_uring_submit(server);
+            sqe = io_uring_get_sqe(&server->ring);
+        }
+    }
 
-    UniUringEntry *entry = malloc(sizeof(UniUringEntry));
-    entry->action = UNI_ACT_ACCEPT;
-    sqe->user_data = (__u64) entry;
+    if (sqe == NULL) {
+        // Operations are kept in order, so once something is in the backlog,
+        // everything after it has to go there as well.
+        if (server->backlog_head == NULL) {
+            server->backlog_head = entry;
+        } else {
+            server->backlog_tail->next = entry;
+        }
+        server->backlog_tail = entry;
+        return;
+    }
+
+    uni_uring_prep(server, sqe, entry);
+
+    if (!server->inhibit_submit && io_uring_sq_ready(&server->ring) >= server->submit_batch) {
+        uni_uring_submit(server);
+    }
 }
 
-// Queue a read operation.
-void uni_uring_read(UniServer *server, UniConnection *conn, unsigned char* buf, int max_len) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&server->ring);
-    io_uring_prep_recv(sqe, conn->fd, buf, max_len, 0);
+// Moves as many operations as possible from the backlog into the submission
+// queue.
+static void uni_uring_drain_backlog(UniServer *server) {
+    while (server->backlog_head != NULL) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&server->ring);
+        if (sqe == NULL) {
+            uni_uring_submit(server);
+            sqe = io_uring_get_sqe(&server->ring);
+            if (sqe == NULL) {
+                return;
+            }
+        }
 
-    UniUringEntry *entry = malloc(sizeof(UniUringEntry));
-    entry->action = UNI_ACT_READ;
-    entry->conn = conn;
-    sqe->user_data = (__u64) entry;
-    conn->refcount++;
+        UniUringEntry *entry = server->backlog_head;
+        server->backlog_head = entry->next;
+        uni_uring_prep(server, sqe, entry);
+    }
+}
+
+// Adapts the number of queued operations which trigger a submission in the
+// middle of a poll to the recent load. Under light load everything is
+// submitted at once at the end of the poll. Under heavy load, operations are
+// handed to the kernel in chunks so it can start on them earlier.
+static void uni_uring_adapt_batch(UniServer *server) {
+    server->sq_load_avg = (server->sq_load_avg * 7 + server->cycle_sqes) / 8;
+    server->cycle_sqes = 0;
+
+    unsigned batch = server->sq_load_avg / 4;
+    if (batch < UNI_MIN_SUBMIT_BATCH) {
+        batch = UNI_MIN_SUBMIT_BATCH;
+    } else if (batch > UNI_RING_ENTRIES / 2) {
+        batch = UNI_RING_ENTRIES / 2;
+    }
+    server->submit_batch = batch;
 }
 
-// Queue a write operation.
-void uni_uring_write(UniServer *server, UniConnection *conn) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&server->ring);
-    io_uring_prep_send(sqe, conn->fd, conn->out_pkt.buf, conn->out_pkt.len, 0);
+// Entries are reused once their operation completed, so that steady traffic
+// doesn't allocate. At most one entry per submission queue slot is kept.
+static UniUringEntry *uni_uring_new_entry(UniServer *server, UniUringAction action, UniConnection *conn) {
+    UniUringEntry *entry = server->free_entries;
+    if (entry != NULL) {
+        server->free_entries = entry->next;
+        server->num_free_entries--;
+    } else {
+        entry = malloc(sizeof(UniUringEntry));
+        UNI_STAT_INC(server, allocs);
+    }
 
-    UniUringEntry *entry = malloc(sizeof(UniUringEntry));
-    entry->action = UNI_ACT_WRITE;
+    entry->action = action;
     entry->conn = conn;
-    sqe->user_data = (__u64) entry;
-    conn->refcount++;
+    return entry;
+}
+
+static void uni_uring_free_entry(UniServer *server, UniUringEntry *entry) {
+    if (server->num_free_entries >= UNI_RING_ENTRIES) {
+        free(entry);
+        return;
+    }
+
+    entry->next = server->free_entries;
+    server->free_entries = entry;
+    server->num_free_entries++;
+}
+
+static void uni_uring_accept(UniServer *server) {
+    UniUringEntry *entry = uni_uring_new_entry(server, UNI_ACT_ACCEPT, NULL);
+    server->accept_usr_data = entry;
+    uni_uring_queue(server, entry);
+}
+
+static void uni_uring_poll_wake(UniServer *server) {
+    uni_uring_queue(server, uni_uring_new_entry(server, UNI_ACT_WAKE, NULL));
+}
+
+static void uni_uring_wake(UniServer *server) {
+    eventfd_write(server->wake_fd, 1);
+}
+
+// Queue a read operation.
+static void uni_uring_read(UniConnection *conn, unsigned char* buf, int max_len) {
+    UniUringAction action = conn->transport_data != NULL ? UNI_ACT_READ_INBOUND : UNI_ACT_READ;
+    UniUringEntry *entry = uni_uring_new_entry(conn->server, action, conn);
+    entry->buf = buf;
+    entry->len = max_len;
+    conn->read_usr_data = entry;
+    uni_uring_queue(conn->server, entry);
+}
+
+// Queue a write of the unwritten part of the connection's outgoing packet.
+static void uni_uring_write(UniConnection *conn) {
+    UniUringEntry *entry = uni_uring_new_entry(conn->server, UNI_ACT_WRITE, conn);
+    conn->write_usr_data = entry;
+    uni_uring_queue(conn->server, entry);
+}
+
+// Queues the cancellation of an operation. Holds a reference to 'conn', if
+// there is one.
+static void uni_uring_queue_cancel(UniServer *server, UniConnection *conn, UniUringEntry *target) {
+    UniUringEntry *entry = uni_uring_new_entry(server, UNI_ACT_CANCEL, conn);
+    entry->target = target;
+    if (conn != NULL) {
+        conn->refcount++;
+    }
+    uni_uring_queue(server, entry);
 }
 
 // Set a timeout and await its completion.
-void uni_uring_timeout(UniServer *server, UniConnection *conn, int secs) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&server->ring);
-    conn->timeout.tv_sec = secs;
-    conn->timeout.tv_nsec = 0;
-    io_uring_prep_timeout(sqe, &conn->timeout, 0, 0);
-
-    UniUringEntry *entry = malloc(sizeof(UniUringEntry));
-    entry->action = UNI_ACT_TIMEOUT;
-    entry->conn = conn;
-    sqe->user_data = (__u64) entry;
+static void uni_uring_timeout(UniServer *server, UniConnection *conn, int ms) {
+    conn->timeout.tv_sec = ms / 1000;
+    conn->timeout.tv_nsec = (long long) (ms % 1000) * 1000000;
+
+    UniUringEntry *entry = uni_uring_new_entry(server, UNI_ACT_TIMEOUT, conn);
     conn->timeout_usr_data = entry;
     conn->refcount++;
+    uni_uring_queue(server, entry);
 }
 
 // Cancel an ongoing timeout. This will result in both the timeout completing
 // with code -ECANCELED and the cancellation operation itself reporting that it
-// has completed.
-void uni_uring_cancel_timeout(UniServer *server, UniConnection *conn) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&server->ring);
-    io_uring_prep_timeout_remove(sqe, (__u64) conn->timeout_usr_data, 0);
+// has completed. Does nothing if the timeout already completed or is being
+// cancelled.
+static void uni_uring_cancel_timeout(UniServer *server, UniConnection *conn) {
+    if (conn->timeout_usr_data == NULL) {
+        return;
+    }
 
-    UniUringEntry *entry = malloc(sizeof(UniUringEntry));
-    entry->action = UNI_ACT_TIMEOUT_CANCEL;
-    entry->conn = conn;
-    sqe->user_data = (__u64) entry;
+    UniUringEntry *entry = uni_uring_new_entry(server, UNI_ACT_TIMEOUT_CANCEL, conn);
+    entry->target = conn->timeout_usr_data;
+    conn->timeout_usr_data = NULL;
     conn->refcount++;
+    uni_uring_queue(server, entry);
+}
+
+static void uni_uring_login_done(UniConnection *conn) {
+    uni_uring_cancel_timeout(conn->server, conn);
+}
+
+static void uni_uring_reset_timeout(UniConnection *conn, int ms) {
+    if (conn->timeout_usr_data == NULL) {
+        return;
+    }
+
+    uni_uring_cancel_timeout(conn->server, conn);
+    uni_uring_timeout(conn->server, conn, ms);
 }
 
 // Shutdown all read/write operations and cancel the current timeout on a
 // connection.
-static void uni_conn_shutdown(UniServer *server, UniConnection *conn) {
-    uni_uring_cancel_timeout(server, conn);
+static void uni_uring_shutdown(UniConnection *conn) {
+    uni_uring_cancel_timeout(conn->server, conn);
     shutdown(conn->fd, SHUT_RDWR);
 }
 
-// Attempt to free and close a connection if its reference count is zero.
-// Returns true on success, false otherwise.
-static bool uni_conn_gc(UniConnection *conn) {
-    if (conn->refcount == 0) {
-        close(conn->fd);
-        free(conn->packet_buf);
-        free(conn);
+static void uni_uring_close(UniConnection *conn) {
+    free(conn->transport_data);
+    close(conn->fd);
+}
+
+// Only called once per handoff, and no new operations are queued in the
+// meantime, so each operation is cancelled at most once.
+static void uni_uring_cancel(UniConnection *conn) {
+    if (conn->read_usr_data != NULL) {
+        uni_uring_queue_cancel(conn->server, conn, conn->read_usr_data);
+    }
+    if (conn->write_usr_data != NULL) {
+        uni_uring_queue_cancel(conn->server, conn, conn->write_usr_data);
+    }
+}
+
+static int uni_uring_unread(UniConnection *conn, const unsigned char **data) {
+    UniUringInbound *inbound = conn->transport_data;
+    if (inbound == NULL) {
+        return 0;
+    }
+
+    *data = &inbound->data[inbound->start];
+    return inbound->len - inbound->start;
+}
+
+static const UniTransport uni_uring_transport = {
+    .read = uni_uring_read,
+    .write = uni_uring_write,
+    .login_done = uni_uring_login_done,
+    .reset_timeout = uni_uring_reset_timeout,
+    .shutdown = uni_uring_shutdown,
+    .close = uni_uring_close,
+    .cancel = uni_uring_cancel,
+    .unread = uni_uring_unread,
+};
+
+// Creates a connection for a connected socket. Returns NULL if out of memory.
+static UniConnection *uni_uring_new_conn(UniServer *server, int fd) {
+    UniConnection *conn = uni_conn_alloc(server);
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    uni_init_conn(server, conn, &uni_uring_transport);
+    conn->fd = fd;
+    conn->timeout_usr_data = NULL;
+    conn->read_usr_data = NULL;
+    conn->write_usr_data = NULL;
+    return conn;
+}
+
+// Stops accepting until uni_uring_resume_accept(). Returns true once the
+// pending accept has been cancelled.
+static bool uni_uring_pause_accept(UniServer *server) {
+    if (server->accept_usr_data == NULL) {
         return true;
     }
 
+    if (!server->accept_cancelling) {
+        server->accept_cancelling = true;
+        uni_uring_queue_cancel(server, NULL, server->accept_usr_data);
+    }
     return false;
 }
 
-bool uni_net_init(UniServer *server, uint16_t port, UniError *err) {
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server->server_addr = server_addr;
-    server->addr_len = sizeof(server_addr);
-
-    server->fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server->fd == -1) {
-        if (err != NULL) {
-            switch (errno) {
-                case EAFNOSUPPORT:
-                case EINVAL:
-                case EPROTONOSUPPORT:
-                    *err = UNI_ERR_UNSUPPORTED;
-                    break;
-
-                case EACCES:
-                case EMFILE:
-                case ENFILE:
-                case ENOBUFS:
-                case ENOMEM:
-                    *err = UNI_ERR_LIMITED;
-                    break;
-
-                default:
-                    *err = UNI_ERR_UNKNOWN;
-                    break;
-            }
-        }
-        return false;
+static void uni_uring_resume_accept(UniServer *server) {
+    if (server->accept_usr_data == NULL) {
+        uni_uring_accept(server);
     }
+}
 
-    int optval = 1;
-    setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+// Sockets handed over by a process using epoll are in non-blocking mode, which
+// would make io_uring fail reads with -EAGAIN instead of waiting for data.
+static UniConnection *uni_uring_adopt(UniServer *server, int fd, const unsigned char *data, int len) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        close(fd);
+        return NULL;
+    }
 
-    if (bind(server->fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1) {
-        if (err != NULL) {
-            switch (errno) {
-                case EACCES:
-                case EFAULT:
-                case ENOMEM:
-                case EROFS:
-                    *err = UNI_ERR_LIMITED;
-                    break;
+    UniUringInbound *inbound = NULL;
+    if (len > 0) {
+        inbound = malloc(sizeof(UniUringInbound) + len);
+        if (inbound == NULL) {
+            close(fd);
+            return NULL;
+        }
+        inbound->start = 0;
+        inbound->len = len;
+        memcpy(inbound->data, data, len);
+    }
 
-                case EADDRINUSE:
-                    *err = UNI_ERR_IN_USE;
-                    break;
+    UniConnection *conn = uni_uring_new_conn(server, fd);
+    if (conn == NULL) {
+        free(inbound);
+        close(fd);
+        return NULL;
+    }
 
-                default:
-                    *err = UNI_ERR_UNKNOWN;
-                    break;
-            }
-        }
-        return false;
+    conn->transport_data = inbound;
+    return conn;
+}
+
+// Returns the mode to try if setting up a ring in 'mode' fails. Returns the same
+// mode if there is nothing left to fall back to.
+static UniRingMode uni_ring_fallback(UniRingMode mode) {
+    switch (mode) {
+        case UNI_RING_DEFER_TASKRUN:
+            return UNI_RING_COOP_TASKRUN;
+
+        case UNI_RING_SQPOLL:
+        case UNI_RING_COOP_TASKRUN:
+        case UNI_RING_DEFAULT:
+            return UNI_RING_DEFAULT;
     }
 
+    UNI_UNREACHABLE();
+}
+
+// Attempts to set up the server's ring in the given mode. Returns true on
+// success, false otherwise. The ring is left uninitialized on failure.
+static bool uni_uring_try_init(UniServer *server, UniRingMode mode) {
     struct io_uring_params params;
     memset(&params, 0, sizeof((params)));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = UNI_RING_CQ_ENTRIES;
+
+    switch (mode) {
+        case UNI_RING_DEFAULT:
+            break;
+
+        case UNI_RING_SQPOLL:
+            params.flags |= IORING_SETUP_SQPOLL;
+            params.sq_thread_idle = server->config.sqpoll_idle_ms;
+            if (server->config.sqpoll_cpu >= 0) {
+                params.flags |= IORING_SETUP_SQ_AFF;
+                params.sq_thread_cpu = server->config.sqpoll_cpu;
+            }
+            break;
 
-    if (io_uring_queue_init_params(2048 /* TODO: Is this a good amount? */, &server->ring, &params) < 0) {
-        // TODO: Determine cause of error
-        if (err != NULL) {
-            *err = UNI_ERR_UNSUPPORTED;
-        }
+        case UNI_RING_COOP_TASKRUN:
+            params.flags |= IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+            break;
+
+        case UNI_RING_DEFER_TASKRUN:
+            params.flags |= IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_TASKRUN_FLAG;
+            break;
+    }
+
+    int res = io_uring_queue_init_params(UNI_RING_ENTRIES, &server->ring, &params);
+    if (res < 0) {
+        UNI_DLOG("Ring mode %d unavailable: %s", mode, strerror(-res));
         return false;
     }
 
-    if (!(params.features & IORING_FEAT_FAST_POLL)) {
-        if (err != NULL) {
-            *err = UNI_ERR_UNSUPPORTED;
-        }
+    // NODROP makes the kernel hold back completions instead of dropping them if
+    // the completion queue is full.
+    unsigned required = IORING_FEAT_FAST_POLL | IORING_FEAT_NODROP;
+    if (mode == UNI_RING_SQPOLL) {
+        // Without this, SQPOLL only works with registered files.
+        required |= IORING_FEAT_SQPOLL_NONFIXED;
+    }
+
+    if ((params.features & required) != required) {
+        UNI_DLOG("Ring mode %d unavailable: features %x missing", mode, required & ~params.features);
+        io_uring_queue_exit(&server->ring);
         return false;
     }
 
-    uni_uring_accept(server, server->fd, (struct sockaddr *) &server->server_addr, &server->addr_len);
+    server->ring_mode = mode;
+    server->backlog_head = NULL;
+    server->backlog_tail = NULL;
+    server->free_entries = NULL;
+    server->num_free_entries = 0;
+    server->accept_usr_data = NULL;
+    server->accept_cancelling = false;
+    server->submit_batch = UNI_MIN_SUBMIT_BATCH;
+    server->sq_load_avg = 0;
+    server->cycle_sqes = 0;
+    server->cq_overflows = 0;
+    server->cq_dropped = 0;
+    server->inhibit_submit = false;
+    server->event_fd = -1;
+    server->wake_fd = -1;
+    return true;
+}
+
+// Sets up the server's ring in the requested mode, or the closest supported
+// one. Returns false if not even UNI_RING_DEFAULT works.
+static bool uni_uring_init_ring(UniServer *server, UniRingMode mode) {
+    while (!uni_uring_try_init(server, mode)) {
+        UniRingMode next = uni_ring_fallback(mode);
+        if (next == mode) {
+            return false;
+        }
+
+        mode = next;
+    }
 
     return true;
 }
 
-bool uni_listen(UniServer *server) {
-    return listen(server->fd, UNI_CONN_BACKLOG) != -1;
+// Runs completion work the kernel is holding back until the ring's owner
+// enters it. Only the TASKRUN modes do this, and only when the kernel flagged
+// that there is work pending.
+static void uni_uring_get_events(UniServer *server) {
+    if (IO_URING_READ_ONCE(*server->ring.sq.kflags) & IORING_SQ_TASKRUN) {
+        io_uring_enter(server->ring.ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL);
+    }
 }
 
-static void uni_do_poll(UniServer *server) {
+// Sets up the ring and queues the first accept. Falls back to cheaper ring
+// modes as needed. Returns false if io_uring is unavailable altogether.
+static bool uni_uring_init(UniServer *server) {
+    if (!uni_uring_init_ring(server, server->config.ring_mode)) {
+        return false;
+    }
+
+    if (server->config.worker_threads > 0) {
+        server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (server->wake_fd == -1) {
+            uni_dump_net_err("EVENTFD", -errno);
+            io_uring_queue_exit(&server->ring);
+            return false;
+        }
+        uni_uring_poll_wake(server);
+    }
+
+    uni_uring_accept(server);
+    return true;
+}
+
+// Handles the completions currently in the completion queue, but no more than
+// 'budget'. Returns the number of completions handled.
+static unsigned uni_uring_process_cqes(UniServer *server, unsigned budget) {
     unsigned head;
     struct io_uring_cqe *cqe;
     unsigned count = 0;
+    unsigned handled = 0;
 
     io_uring_for_each_cqe(&server->ring, head, cqe) {
+        if (handled == budget) {
+            break;
+        }
+
         count++;
 
+        // Posted by liburing itself when waiting with a timeout on kernels
+        // without IORING_FEAT_EXT_ARG.
+        if (cqe->user_data == LIBURING_UDATA_TIMEOUT) {
+            continue;
+        }
+
+        handled++;
+        UNI_STAT_INC(server, cqes);
+
+        uint64_t event_start = UNI_HIST_NOW(server);
+
         UniUringEntry *entry = (UniUringEntry*) cqe->user_data;
         UniConnection *conn = entry->conn;
-        switch (entry->action) {
+        UniUringAction action = entry->action;
+        switch (action) {
             case UNI_ACT_ACCEPT:
-                if (cqe->res >= -1) {
-                    conn = malloc(sizeof(UniConnection));
-                    uni_init_conn(server, conn);
-                    uni_conn_prep_header(conn);
-                    conn->fd = cqe->res;
-
-                    uni_uring_timeout(server, conn, 2);
-                    uni_uring_read(server, conn, conn->header_buf, sizeof(conn->header_buf));
-                } else {
+                server->accept_usr_data = NULL;
+                server->accept_cancelling = false;
+                // Only joined connections are handed over, so a client which
+                // was accepted in the meantime is closed right away.
+                if (cqe->res >= -1 && !server->handing_off) {
+                    conn = uni_uring_new_conn(server, cqe->res);
+                }
+
+                if (conn != NULL) {
+                    UNI_STAT_INC(server, accepts);
+                    conn->accept_ns = event_start;
+                    conn->stage_ns = event_start;
+                    UNI_PROBE2(accept, conn->id, conn->fd);
+
+                    uni_uring_timeout(server, conn, UNI_LOGIN_TIMEOUT_SECS * 1000);
+                    uni_conn_admit(conn);
+                } else if (cqe->res >= 0) {
+                    close(cqe->res);
+                } else if (cqe->res != -ECANCELED) {
                     uni_dump_net_err("ACCEPT", cqe->res);
+                    UNI_STAT_ERR(server, cqe->res);
                 }
 
-                uni_uring_accept(server, server->fd, (struct sockaddr *) &server->server_addr, &server->addr_len);
+                // Accepting stops while connections are handed over.
+                if (!server->handing_off) {
+                    uni_uring_accept(server);
+                }
                 break;
 
             case UNI_ACT_READ:
-                conn->refcount--;
-                if (uni_conn_gc(conn)) {
-                    break;
+                conn->read_usr_data = NULL;
+                uni_conn_read_done(conn, cqe->res);
+                break;
+
+            case UNI_ACT_READ_INBOUND: {
+                UniUringInbound *inbound = conn->transport_data;
+                int len = inbound->len - inbound->start;
+                if (len > entry->len) {
+                    len = entry->len;
                 }
 
-                if (cqe->res > 0) {
-                    if (conn->state == UNI_READING_HEADER) {
-                        for (int i = 0; i < cqe->res; i++) {
-                            unsigned char b = conn->header_buf[i];
-                            conn->packet_len |= (b & 0b01111111) << (7 * conn->header_size++);
-
-                            if (conn->header_size > conn->header_len_limit) {
-                                UNI_DLOG("Disconnect: Header size %d > %d", conn->header_size, conn->header_len_limit);
-                            #ifdef UNI_DEBUG
-                                uni_dump_conn(conn);
-                            #endif // UNI_DEBUG
-
-                                uni_conn_shutdown(server, conn);
-                                goto nothing;
-                            } else if ((b & 0b10000000) == 0) {
-                                conn->packet_buf = realloc(conn->packet_buf, conn->packet_len);
-                                if (conn->packet_buf == NULL) {
-                                    UNI_DLOG("Disconnect: realloc(%d) failed", conn->packet_len);
-                                    uni_dump_conn(conn);
-
-                                    uni_conn_shutdown(server, conn);
-                                    goto nothing;
-                                }
-
-                                if (i == 0 && cqe->res == 2) {
-                                    conn->packet_buf[0] = conn->header_buf[1];
-                                    uni_conn_prep_body(conn);
-                                    conn->write_idx++;
-                                } else {
-                                    uni_conn_prep_body(conn);
-                                }
-
-                                uni_uring_read(server, conn, &conn->packet_buf[conn->write_idx], conn->packet_len - conn->write_idx);
-                                goto nothing;
-                            }
-                        }
-
-                        uni_uring_read(server, conn, conn->header_buf, 1);
-
-                        nothing: ;
-                    } else {
-                        conn->write_idx += cqe->res;
-                        if (conn->write_idx == conn->packet_len) {
-                            uni_conn_prep_handle(conn);
-
-                            if (!uni_handle_packet(conn)) {
-                                // Something went wrong trying to process this packet.
-                                uni_conn_shutdown(server, conn);
-                            } else {
-                                uni_conn_prep_header(conn);
-                                uni_uring_read(server, conn, conn->header_buf, sizeof(conn->header_buf));
-                            }
-                        } else {
-                            uni_uring_read(server, conn, &conn->packet_buf[conn->write_idx], conn->packet_len - conn->write_idx);
-                        }
-                    }
-                } else if (cqe->res == 0) {
-                    uni_conn_shutdown(server, conn);
-                } else {
-                    uni_dump_conn_err("READ", conn, cqe->res);
+                memcpy(entry->buf, &inbound->data[inbound->start], len);
+                inbound->start += len;
+                if (inbound->start == inbound->len) {
+                    free(inbound);
+                    conn->transport_data = NULL;
                 }
+
+                conn->read_usr_data = NULL;
+                uni_conn_read_done(conn, len);
                 break;
+            }
 
             case UNI_ACT_WRITE:
-                conn->refcount--;
-                if (uni_conn_gc(conn)) {
-                    break;
-                }
-
-                if (cqe->res > 0) {
-                    // Although write_idx is used to determine the first byte after the varint
-                    // header, we can re-used it here to determine how much of the packet has
-                    // already been written.
-                    conn->out_pkt.write_idx += cqe->res;
-
-                    if (conn->out_pkt.write_idx == conn->out_pkt.len) {
-                        free(conn->out_pkt.buf);
-
-                        switch (conn->handler) {
-                            case UNI_HANDLER_LOGIN_SUCCESS:
-                                uni_on_join(server->user_ptr, conn->user_ptr);
-                                conn->handler = UNI_HANDLER_PLAY;
-                                break;
-
-                            case UNI_HANDLER_PLAY:
-                                uni_on_write_finish(conn->user_ptr);
-                                break;
-                        }
-                    } else {
-                        uni_uring_write(server, conn);
-                    }
-                } else {
-                    uni_dump_conn_err("WRITE", conn, cqe->res);
-                }
+                conn->write_usr_data = NULL;
+                uni_conn_write_done(conn, cqe->res);
                 break;
 
             case UNI_ACT_TIMEOUT:
                 conn->refcount--;
-                if (cqe->res != -ECANCELED) {
-                    if (!uni_conn_gc(conn)) {
-                        shutdown(conn->fd, SHUT_RDWR);
-                    }
+                // The connection may already have been released while the
+                // timeout was being cancelled, so it has to be collected
+                // either way. A timeout which expired just as it was being
+                // replaced or cancelled is ignored.
+                if (!uni_conn_gc(conn) && cqe->res != -ECANCELED && conn->timeout_usr_data == entry) {
+                    UNI_PROBE1(timeout, conn->id);
+                    conn->timeout_usr_data = NULL;
+                    shutdown(conn->fd, SHUT_RDWR);
                 }
                 break;
 
@@ -362,33 +675,215 @@ static void uni_do_poll(UniServer *server) {
                 conn->refcount--;
                 uni_conn_gc(conn);
                 break;
+
+            case UNI_ACT_CANCEL:
+                if (conn != NULL) {
+                    conn->refcount--;
+                    uni_conn_gc(conn);
+                }
+                break;
+
+            // The finished jobs are picked up after polling.
+            case UNI_ACT_WAKE:
+                if (cqe->res < 0) {
+                    uni_dump_net_err("WAKE", cqe->res);
+                    UNI_STAT_ERR(server, cqe->res);
+                } else {
+                    eventfd_t value;
+                    eventfd_read(server->wake_fd, &value);
+                }
+                uni_uring_poll_wake(server);
+                break;
         }
 
-        free(entry);
+        uni_uring_free_entry(server, entry);
+
+        switch (action) {
+            case UNI_ACT_ACCEPT:
+                UNI_HIST_SINCE(server, UNI_HIST_EVENT_ACCEPT, event_start);
+                break;
+
+            case UNI_ACT_READ:
+            case UNI_ACT_READ_INBOUND:
+                UNI_HIST_SINCE(server, UNI_HIST_EVENT_READ, event_start);
+                break;
+
+            case UNI_ACT_WRITE:
+                UNI_HIST_SINCE(server, UNI_HIST_EVENT_WRITE, event_start);
+                break;
+
+            case UNI_ACT_TIMEOUT:
+            case UNI_ACT_TIMEOUT_CANCEL:
+                UNI_HIST_SINCE(server, UNI_HIST_EVENT_TIMEOUT, event_start);
+                break;
+
+            case UNI_ACT_CANCEL:
+            case UNI_ACT_WAKE:
+                break;
+        }
     }
 
     io_uring_cq_advance(&server->ring, count);
+    return handled;
 }
 
-void uni_poll(UniServer *server) {
-    io_uring_submit_and_wait(&server->ring, 1);
-    uni_do_poll(server);
+// Handles up to 'budget' completions. Returns the number of completions
+// handled.
+static unsigned uni_do_poll(UniServer *server, unsigned budget) {
+    uni_hist_apply_reset(server);
+    uint64_t poll_start = UNI_HIST_NOW(server);
+
+    unsigned handled = uni_uring_process_cqes(server, budget);
+
+    // If the completion queue filled up, the kernel keeps the completions which
+    // didn't fit on an overflow list. They are only moved into the queue once
+    // it is entered again.
+    while (handled < budget && (IO_URING_READ_ONCE(*server->ring.sq.kflags) & IORING_SQ_CQ_OVERFLOW)) {
+        server->cq_overflows++;
+        UNI_DLOG("Completion queue overflowed (%u times)", server->cq_overflows);
+
+        io_uring_enter(server->ring.ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL);
+        handled += uni_uring_process_cqes(server, budget - handled);
+    }
+
+    // Completions are only dropped outright if the kernel couldn't allocate
+    // memory for the overflow list. The affected connections will never be
+    // cleaned up.
+    unsigned dropped = IO_URING_READ_ONCE(*server->ring.cq.koverflow);
+    if (dropped != server->cq_dropped) {
+        UNI_LOG("-- UNI LOST %u COMPLETIONS --", dropped - server->cq_dropped);
+        server->cq_dropped = dropped;
+    }
+
+    uni_uring_adapt_batch(server);
+    uni_capture_tick(server);
+
+    if (handled > 0) {
+        UNI_HIST_SINCE(server, UNI_HIST_POLL, poll_start);
+    }
+
+    return handled;
 }
 
-void uni_try_poll(UniServer *server) {
-    io_uring_submit(&server->ring);
-    uni_do_poll(server);
+// Submits all queued operations and waits until there is at least one
+// completion to handle, or until 'deadline' has passed. A deadline of
+// UNI_NO_DEADLINE waits indefinitely.
+static void uni_uring_wait(UniServer *server, uint64_t deadline) {
+    uni_uring_drain_backlog(server);
+
+    // Completions may have been left over by a previous uni_poll_timeout()
+    // which ran out of budget.
+    if (io_uring_cq_ready(&server->ring) > 0) {
+        uni_uring_submit(server);
+        return;
+    }
+
+    if (server->config.busy_poll_us > 0) {
+        uni_uring_submit(server);
+
+        uint64_t spin_end = uni_time_ns() + (uint64_t) server->config.busy_poll_us * 1000;
+        if (spin_end > deadline) {
+            spin_end = deadline;
+        }
+
+        do {
+            uni_uring_get_events(server);
+            if (io_uring_cq_ready(&server->ring) > 0) {
+                return;
+            }
+        } while (uni_time_ns() < spin_end);
+    }
+
+    if (deadline == UNI_NO_DEADLINE) {
+        uni_uring_submit_and_wait(server);
+        return;
+    }
+
+    uni_uring_submit(server);
+
+    uint64_t now = uni_time_ns();
+    if (now >= deadline) {
+        uni_uring_get_events(server);
+        return;
+    }
+
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = (deadline - now) / 1000000000;
+    timeout.tv_nsec = (deadline - now) % 1000000000;
+
+    struct io_uring_cqe *cqe;
+    io_uring_wait_cqes(&server->ring, &cqe, 1, &timeout, NULL);
 }
 
-void uni_write(UniConnection *conn, UniPacketOut *packet) {
-    packet->write_idx = 0;
-    conn->out_pkt = *packet;
-    uni_uring_write(conn->server, conn);
+static unsigned uni_uring_poll(UniServer *server, uint64_t deadline, unsigned budget) {
+    uni_uring_wait(server, deadline);
+    return uni_do_poll(server, budget);
 }
 
-void uni_release(UniConnection *conn) {
-    conn->refcount--;
-    if (!uni_conn_gc(conn)) {
-        uni_conn_shutdown(conn->server, conn);
+static int uni_uring_event_fd(UniServer *server) {
+    if (server->event_fd != -1) {
+        return server->event_fd;
+    }
+
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        uni_dump_net_err("EVENTFD", -errno);
+        return -1;
+    }
+
+    int res = io_uring_register_eventfd(&server->ring, fd);
+    if (res < 0) {
+        uni_dump_net_err("REGISTER EVENTFD", res);
+        close(fd);
+        return -1;
+    }
+
+    server->event_fd = fd;
+
+    // There may already be completions which arrived before the eventfd was
+    // registered.
+    if (io_uring_cq_ready(&server->ring) > 0) {
+        eventfd_write(fd, 1);
     }
+
+    return fd;
+}
+
+static unsigned uni_uring_process_completions(UniServer *server, unsigned budget) {
+    if (server->event_fd != -1) {
+        eventfd_t value;
+        eventfd_read(server->event_fd, &value);
+    }
+
+    uni_uring_get_events(server);
+
+    server->inhibit_submit = true;
+    unsigned handled = uni_do_poll(server, budget);
+    server->inhibit_submit = false;
+
+    // The counter was reset above, so the fd has to be made readable again if
+    // the budget ran out before the completion queue was empty.
+    if (server->event_fd != -1 && io_uring_cq_ready(&server->ring) > 0) {
+        eventfd_write(server->event_fd, 1);
+    }
+
+    return handled;
 }
+
+static void uni_uring_submit_all(UniServer *server) {
+    uni_uring_drain_backlog(server);
+    uni_uring_submit(server);
+}
+
+const UniNetBackend uni_uring_backend = {
+    .id = UNI_BACKEND_URING,
+    .init = uni_uring_init,
+    .poll = uni_uring_poll,
+    .event_fd = uni_uring_event_fd,
+    .process_completions = uni_uring_process_completions,
+    .submit = uni_uring_submit_all,
+    .wake = uni_uring_wake,
+    .pause_accept = uni_uring_pause_accept,
+    .resume_accept = uni_uring_resume_accept,
+    .adopt = uni_uring_adopt,
+};
@@ -0,0 +1,164 @@
+#include "uni_channel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "uni_packet.h"
+#include "uni_log.h"
+#include "uni_server.h"
+
+#define UNI_POUT_PLUGIN_MSG 0x15
+
+// Channel names are at most this long in 1.13 and later.
+#define UNI_CHANNEL_MAX_LEN 255
+
+#define UNI_CHANNEL_INITIAL_SLOTS 16
+
+// FNV-1a. Channel names are short, so anything fancier wouldn't pay off.
+static inline uint32_t uni_channel_hash(const char *name, int name_len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < name_len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void uni_channels_init(UniServer *server) {
+    server->channels = NULL;
+    server->num_channels = 0;
+    server->channels_cap = 0;
+    server->channel_slots = NULL;
+    server->channel_slots_cap = 0;
+}
+
+void uni_channels_free(UniServer *server) {
+    for (int i = 0; i < server->num_channels; i++) {
+        free(server->channels[i].name);
+        free(server->channels[i].header);
+    }
+    free(server->channels);
+    free(server->channel_slots);
+}
+
+// Returns the slot which holds the channel with the given name and hash, or
+// the empty slot it would go into. Slots hold channel IDs plus one, 0 if
+// empty. There is always at least one empty slot.
+static int *uni_channel_slot(UniServer *server, int *slots, int cap, const char *name, int name_len, uint32_t hash) {
+    uint32_t mask = (uint32_t) cap - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        if (slots[i] == 0) {
+            return &slots[i];
+        }
+
+        UniChannel *channel = &server->channels[slots[i] - 1];
+        if (
+            channel->hash == hash && channel->name_len == name_len &&
+            memcmp(channel->name, name, name_len) == 0
+        ) {
+            return &slots[i];
+        }
+    }
+}
+
+int uni_channel_lookup(UniServer *server, const char *name, int name_len) {
+    if (server->num_channels == 0) {
+        return -1;
+    }
+
+    uint32_t hash = uni_channel_hash(name, name_len);
+    int *slot = uni_channel_slot(server, server->channel_slots, server->channel_slots_cap, name, name_len, hash);
+    return *slot - 1;
+}
+
+// Makes room for one more channel, keeping the hash table at most half full.
+static bool uni_channels_reserve(UniServer *server) {
+    if (server->num_channels == server->channels_cap) {
+        int cap = server->channels_cap == 0 ? UNI_CHANNEL_INITIAL_SLOTS / 2 : server->channels_cap * 2;
+        UniChannel *channels = realloc(server->channels, sizeof(UniChannel) * cap);
+        if (channels == NULL) {
+            return false;
+        }
+        server->channels = channels;
+        server->channels_cap = cap;
+    }
+
+    if ((server->num_channels + 1) * 2 > server->channel_slots_cap) {
+        int cap = server->channel_slots_cap == 0 ? UNI_CHANNEL_INITIAL_SLOTS : server->channel_slots_cap * 2;
+        int *slots = calloc(cap, sizeof(int));
+        if (slots == NULL) {
+            return false;
+        }
+
+        for (int id = 0; id < server->num_channels; id++) {
+            UniChannel *channel = &server->channels[id];
+            *uni_channel_slot(server, slots, cap, channel->name, channel->name_len, channel->hash) = id + 1;
+        }
+        free(server->channel_slots);
+        server->channel_slots = slots;
+        server->channel_slots_cap = cap;
+    }
+
+    return true;
+}
+
+int uni_register_channel(UniServer *server, const char *name, int name_len, UniChannelHandler handler) {
+    if (name_len <= 0 || name_len > UNI_CHANNEL_MAX_LEN) {
+        return -1;
+    }
+
+    int id = uni_channel_lookup(server, name, name_len);
+    if (id != -1) {
+        server->channels[id].handler = handler;
+        return id;
+    }
+
+    if (!uni_channels_reserve(server)) {
+        UNI_LOG("CHANNEL '%.*s' ALLOC FAILED", name_len, name);
+        return -1;
+    }
+
+    int header_len = uni_varint_size(UNI_POUT_PLUGIN_MSG) + uni_str_size(name_len);
+    char *name_copy = malloc(name_len);
+    char *header = malloc(header_len);
+    if (name_copy == NULL || header == NULL) {
+        UNI_LOG("CHANNEL '%.*s' ALLOC FAILED", name_len, name);
+        free(name_copy);
+        free(header);
+        return -1;
+    }
+
+    memcpy(name_copy, name, name_len);
+    char *cursor = uni_write_varint(header, UNI_POUT_PLUGIN_MSG);
+    uni_write_str(cursor, name, name_len);
+
+    id = server->num_channels++;
+    UniChannel *channel = &server->channels[id];
+    channel->name = name_copy;
+    channel->name_len = name_len;
+    channel->hash = uni_channel_hash(name, name_len);
+    channel->handler = handler;
+    channel->header = header;
+    channel->header_len = header_len;
+
+    *uni_channel_slot(
+        server, server->channel_slots, server->channel_slots_cap, name, name_len, channel->hash
+    ) = id + 1;
+    return id;
+}
+
+UniPacketOut uni_pkt_plugin_msg(UniServer *server, int channel_id, const void *data, int data_len) {
+    const UniChannel *channel = &server->channels[channel_id];
+
+    int pkt_size = channel->header_len + data_len;
+    UniPacketOut pkt = uni_alloc_packet(pkt_size);
+    if (pkt.buf == NULL) {
+        UNI_LOG("PACKET '%s' ALLOC(%d) FAILED", "plugin message", pkt_size);
+        return pkt;
+    }
+
+    char *cursor = &pkt.buf[pkt.write_idx];
+    cursor = uni_write_bytes(cursor, (const unsigned char *) channel->header, channel->header_len);
+    uni_write_bytes(cursor, data, data_len);
+    return pkt;
+}
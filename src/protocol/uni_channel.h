@@ -0,0 +1,33 @@
+#ifndef UNI_CHANNEL_H
+#define UNI_CHANNEL_H
+
+// Plugin message channels registered with uni_register_channel(). Channel
+// names are interned in an open addressing hash table, so routing an inbound
+// message costs one hash of its channel name and usually a single compare.
+
+#include <stdint.h>
+
+#include "uni_play.h"
+
+typedef struct UniServerImpl UniServer;
+
+typedef struct {
+    char *name;
+    int name_len;
+    uint32_t hash;
+    UniChannelHandler handler;
+
+    // The packet ID and channel name of outbound messages on the channel,
+    // ready to be copied into packets.
+    char *header;
+    int header_len;
+} UniChannel;
+
+void uni_channels_init(UniServer *server);
+void uni_channels_free(UniServer *server);
+
+// Returns the ID of the channel named 'name', or -1 if no such channel was
+// registered.
+int uni_channel_lookup(UniServer *server, const char *name, int name_len);
+
+#endif // !UNI_CHANNEL_H
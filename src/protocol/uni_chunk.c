@@ -0,0 +1,426 @@
+#include "uni_play.h"
+
+#include <stdlib.h>
+
+#include "uni_nbt.h"
+#include "uni_packet.h"
+#include "uni_log.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define UNI_SSE2
+#endif // __SSE2__
+
+#define UNI_POUT_CHUNK_DATA 0x1F
+
+#define UNI_SECTION_BLOCKS 4096
+#define UNI_SECTION_BIOMES 64
+
+// Indirect palettes of block states use 4 to 8 bits per entry, those of biomes
+// 1 to 3.
+#define UNI_BLOCK_MIN_BITS 4
+#define UNI_BLOCK_MAX_BITS 8
+#define UNI_BIOME_MIN_BITS 1
+#define UNI_BIOME_MAX_BITS 3
+
+// Hash table slots used to build a palette of up to 2^UNI_BLOCK_MAX_BITS and
+// 2^UNI_BIOME_MAX_BITS entries. Kept at 4x the entries so probe chains stay
+// short.
+#define UNI_BLOCK_PALETTE_SLOTS 1024
+#define UNI_BIOME_PALETTE_SLOTS 32
+
+#define UNI_LIGHT_ARRAY_LEN 2048
+
+// Number of longs needed to pack 'count' entries of 'bits' bits. Entries don't
+// straddle two longs.
+static inline int uni_num_longs(int count, int bits) {
+    if (bits == 0) {
+        return 0;
+    }
+
+    int per_long = 64 / bits;
+    return (count + per_long - 1) / per_long;
+}
+
+static inline int uni_ceil_log2(int n) {
+    int bits = 0;
+    while ((1 << bits) < n) {
+        bits++;
+    }
+    return bits;
+}
+
+#ifdef UNI_SSE2
+
+// Reverses the order of the 16-bit lanes of 'v'. Longs are written big-endian,
+// so the first entry of a long ends up in its last byte.
+static inline __m128i uni_reverse_epi16(__m128i v) {
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+// uni_pack_longs() for 8 bits per entry: two longs per 16 entries.
+static char *uni_pack_longs_8(char *dest, const uint16_t *values, int count) {
+    for (int i = 0; i < count; i += 16) {
+        __m128i a = uni_reverse_epi16(_mm_loadu_si128((const __m128i *) &values[i]));
+        __m128i b = uni_reverse_epi16(_mm_loadu_si128((const __m128i *) &values[i + 8]));
+        _mm_storeu_si128((__m128i *) dest, _mm_packus_epi16(a, b));
+        dest += 16;
+    }
+    return dest;
+}
+
+// Combines the 16 4-bit entries of one long into its 8 bytes, as 16-bit lanes
+// in big-endian order.
+static inline __m128i uni_pack_nibbles(const uint16_t *values) {
+    // Each 32-bit lane holds two entries, the second one 16 bits up. Shifting
+    // it down 12 bits leaves it in the high nibble of the lane's first byte.
+    __m128i low_mask = _mm_set1_epi32(0xFFFF);
+    __m128i a = _mm_loadu_si128((const __m128i *) values);
+    __m128i b = _mm_loadu_si128((const __m128i *) &values[8]);
+    a = _mm_or_si128(_mm_and_si128(a, low_mask), _mm_srli_epi32(a, 12));
+    b = _mm_or_si128(_mm_and_si128(b, low_mask), _mm_srli_epi32(b, 12));
+    return uni_reverse_epi16(_mm_packs_epi32(a, b));
+}
+
+// uni_pack_longs() for 4 bits per entry: two longs per 32 entries.
+static char *uni_pack_longs_4(char *dest, const uint16_t *values, int count) {
+    for (int i = 0; i < count; i += 32) {
+        __m128i a = uni_pack_nibbles(&values[i]);
+        __m128i b = uni_pack_nibbles(&values[i + 16]);
+        _mm_storeu_si128((__m128i *) dest, _mm_packus_epi16(a, b));
+        dest += 16;
+    }
+    return dest;
+}
+
+#endif // UNI_SSE2
+
+// uni_pack_longs() without SIMD. Inlined with a constant 'bits' so that the
+// loop over a long's entries is unrolled.
+static inline char *uni_pack_longs_scalar(char *dest, const uint16_t *values, int count, int bits) {
+    int per_long = 64 / bits;
+    uint64_t mask = (1ull << bits) - 1;
+
+    int i = 0;
+    for (; count - i >= per_long; i += per_long) {
+        uint64_t packed = 0;
+        for (int j = 0; j < per_long; j++) {
+            packed |= (values[i + j] & mask) << (j * bits);
+        }
+        dest = uni_write_long(dest, (int64_t) packed);
+    }
+
+    if (i < count) {
+        uint64_t packed = 0;
+        for (int j = 0; i + j < count; j++) {
+            packed |= (values[i + j] & mask) << (j * bits);
+        }
+        dest = uni_write_long(dest, (int64_t) packed);
+    }
+
+    return dest;
+}
+
+// Packs 'count' entries of 'bits' bits each into big-endian longs, as many as
+// fit into a long without straddling the next one. Entries of palette indices
+// must be smaller than 2^bits. Returns the end of the longs.
+static char *uni_pack_longs(char *dest, const uint16_t *values, int count, int bits) {
+    if (bits == 0) {
+        return dest;
+    }
+
+#ifdef UNI_SSE2
+    // 8 and 4 bits per entry are by far the most common, as every section with
+    // 17 to 256 different blocks is packed with the former and every section
+    // with up to 16 the latter.
+    if (bits == 8 && count % 16 == 0) {
+        return uni_pack_longs_8(dest, values, count);
+    } else if (bits == 4 && count % 32 == 0) {
+        return uni_pack_longs_4(dest, values, count);
+    }
+#endif // UNI_SSE2
+
+    switch (bits) {
+        case 1: return uni_pack_longs_scalar(dest, values, count, 1);
+        case 2: return uni_pack_longs_scalar(dest, values, count, 2);
+        case 3: return uni_pack_longs_scalar(dest, values, count, 3);
+        case 4: return uni_pack_longs_scalar(dest, values, count, 4);
+        case 5: return uni_pack_longs_scalar(dest, values, count, 5);
+        case 6: return uni_pack_longs_scalar(dest, values, count, 6);
+        case 7: return uni_pack_longs_scalar(dest, values, count, 7);
+        case 8: return uni_pack_longs_scalar(dest, values, count, 8);
+        case 9: return uni_pack_longs_scalar(dest, values, count, 9);
+        case UNI_BLOCK_STATE_BITS: return uni_pack_longs_scalar(dest, values, count, UNI_BLOCK_STATE_BITS);
+        default: return uni_pack_longs_scalar(dest, values, count, bits);
+    }
+}
+
+// Collects the distinct 'values' into 'palette', in order of appearance, and
+// writes the index of every value in it to 'indices'. Returns the length of
+// the palette, or -1 if there are more than 'max_len' distinct values. 'slots'
+// must be a power of two at least twice 'max_len', and at most
+// UNI_BLOCK_PALETTE_SLOTS.
+static int uni_build_palette(
+    const uint16_t *values, int count, uint16_t *palette, int max_len, uint16_t *indices, int slots
+) {
+    // Open addressing, keyed by value + 1 so that 0 marks an empty slot.
+    uint32_t keys[UNI_BLOCK_PALETTE_SLOTS];
+    uint16_t slot_indices[UNI_BLOCK_PALETTE_SLOTS];
+    memset(keys, 0, sizeof(uint32_t) * slots);
+
+    int len = 0;
+    uint32_t prev_key = 0;
+    uint16_t prev_index = 0;
+
+    for (int i = 0; i < count;) {
+#ifdef UNI_SSE2
+        // Blocks and biomes mostly come in runs, which are skipped over up to 8
+        // entries at a time. Entries past the end of the run get their index
+        // later.
+        if (prev_key != 0) {
+            __m128i run = _mm_set1_epi16((short) (prev_key - 1));
+            __m128i run_index = _mm_set1_epi16((short) prev_index);
+
+            while (count - i >= 8) {
+                __m128i v = _mm_loadu_si128((const __m128i *) &values[i]);
+                unsigned same = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi16(v, run));
+                _mm_storeu_si128((__m128i *) &indices[i], run_index);
+
+                if (same != 0xFFFF) {
+                    i += __builtin_ctz(~same) / 2;
+                    break;
+                }
+                i += 8;
+            }
+
+            if (i == count) {
+                break;
+            }
+        }
+#endif // UNI_SSE2
+
+        uint32_t key = (uint32_t) values[i] + 1;
+        if (key != prev_key) {
+            uint32_t slot = (key * 2654435761u) >> 16 & (slots - 1);
+            while (keys[slot] != 0 && keys[slot] != key) {
+                slot = (slot + 1) & (slots - 1);
+            }
+
+            if (keys[slot] == 0) {
+                if (len == max_len) {
+                    return -1;
+                }
+
+                keys[slot] = key;
+                slot_indices[slot] = (uint16_t) len;
+                palette[len++] = values[i];
+            }
+
+            prev_key = key;
+            prev_index = slot_indices[slot];
+        }
+
+        indices[i++] = prev_index;
+    }
+
+    return len;
+}
+
+// Upper bound of the size of a paletted container written by
+// uni_write_container().
+static int uni_container_bound(int count, int max_bits, int direct_bits) {
+    int indirect = 2 + (1 << max_bits) * 3 + 3 + uni_num_longs(count, max_bits) * 8;
+    int direct = 3 + uni_num_longs(count, direct_bits) * 8;
+    return 1 + (indirect > direct ? indirect : direct);
+}
+
+// Writes a paletted container of at most UNI_SECTION_BLOCKS values. Indirect
+// palettes use 'min_bits' to 'max_bits' bits per entry, and the global palette
+// uses 'direct_bits'.
+static char *uni_write_container(
+    char *cursor, const uint16_t *values, int count, int min_bits, int max_bits, int direct_bits, int slots
+) {
+    uint16_t palette[1 << UNI_BLOCK_MAX_BITS];
+    uint16_t indices[UNI_SECTION_BLOCKS];
+    int palette_len = uni_build_palette(values, count, palette, 1 << max_bits, indices, slots);
+
+    if (palette_len == 1) {
+        cursor = uni_write_byte(cursor, 0);
+        cursor = uni_write_varint(cursor, palette[0]);
+        return uni_write_varint(cursor, 0);
+    }
+
+    int bits = uni_ceil_log2(palette_len);
+    if (bits < min_bits) {
+        bits = min_bits;
+    }
+
+    if (palette_len == -1 || bits > max_bits) {
+        // The client reads any width up to 'max_bits' as an indirect palette.
+        // Global ids are unpacked with the width of its own registry, so only
+        // the byte written here is raised.
+        int width = direct_bits > max_bits ? direct_bits : max_bits + 1;
+        cursor = uni_write_byte(cursor, (unsigned char) width);
+        cursor = uni_write_varint(cursor, uni_num_longs(count, direct_bits));
+        return uni_pack_longs(cursor, values, count, direct_bits);
+    }
+
+    cursor = uni_write_byte(cursor, (unsigned char) bits);
+    cursor = uni_write_varint(cursor, palette_len);
+    for (int i = 0; i < palette_len; i++) {
+        cursor = uni_write_varint(cursor, palette[i]);
+    }
+    cursor = uni_write_varint(cursor, uni_num_longs(count, bits));
+    return uni_pack_longs(cursor, indices, count, bits);
+}
+
+// Writes the heightmaps as an NBT compound. The client only needs
+// MOTION_BLOCKING.
+static char *uni_write_heightmaps(char *cursor, const UniChunk *chunk) {
+    static const char name[] = "MOTION_BLOCKING";
+
+    cursor = uni_write_byte(cursor, UNI_NBT_COMPOUND);
+    cursor = uni_write_short(cursor, 0); // Root name
+
+    if (chunk->motion_blocking != NULL) {
+        int bits = uni_ceil_log2(chunk->num_sections * 16 + 1);
+
+        cursor = uni_write_byte(cursor, UNI_NBT_LONG_ARRAY);
+        cursor = uni_write_short(cursor, sizeof(name) - 1);
+        cursor = uni_write_bytes(cursor, (const unsigned char *) name, sizeof(name) - 1);
+        cursor = uni_write_int(cursor, uni_num_longs(256, bits));
+        cursor = uni_pack_longs(cursor, chunk->motion_blocking, 256, bits);
+    }
+
+    return uni_write_byte(cursor, UNI_NBT_END);
+}
+
+// Writes a BitSet with a bit set for every light array which is present, or if
+// 'empty' is set, for every one which isn't.
+static char *uni_write_light_mask(char *cursor, const unsigned char *const *light, int count, bool empty) {
+    if (light == NULL) {
+        return uni_write_varint(cursor, 0);
+    }
+
+    int last = -1;
+    for (int i = 0; i < count; i++) {
+        if ((light[i] == NULL) == empty) {
+            last = i;
+        }
+    }
+
+    int num_longs = (last + 64) / 64;
+    cursor = uni_write_varint(cursor, num_longs);
+    for (int l = 0; l < num_longs; l++) {
+        uint64_t bits = 0;
+        for (int i = l * 64; i < count && i < l * 64 + 64; i++) {
+            if ((light[i] == NULL) == empty) {
+                bits |= 1ull << (i - l * 64);
+            }
+        }
+        cursor = uni_write_long(cursor, (int64_t) bits);
+    }
+
+    return cursor;
+}
+
+static char *uni_write_light_arrays(char *cursor, const unsigned char *const *light, int count) {
+    if (light == NULL) {
+        return uni_write_varint(cursor, 0);
+    }
+
+    int present = 0;
+    for (int i = 0; i < count; i++) {
+        present += light[i] != NULL;
+    }
+
+    cursor = uni_write_varint(cursor, present);
+    for (int i = 0; i < count; i++) {
+        if (light[i] != NULL) {
+            cursor = uni_write_varint(cursor, UNI_LIGHT_ARRAY_LEN);
+            cursor = uni_write_bytes(cursor, light[i], UNI_LIGHT_ARRAY_LEN);
+        }
+    }
+
+    return cursor;
+}
+
+UniPacketOut uni_pkt_chunk(const UniChunk *chunk) {
+    UniPacketOut pkt;
+    int num_light = chunk->num_sections + 2;
+
+    // The packet is written straight into a buffer large enough for the worst
+    // case. The lengths in front of the packet and the section data are only
+    // known at the end, so they're padded to 3 bytes.
+    int section_bound =
+        sizeof(int16_t) + // block count
+        uni_container_bound(UNI_SECTION_BLOCKS, UNI_BLOCK_MAX_BITS, UNI_BLOCK_STATE_BITS) +
+        uni_container_bound(UNI_SECTION_BIOMES, UNI_BIOME_MAX_BITS, chunk->biome_bits);
+
+    int bound =
+        3 + // packet length
+        uni_varint_size(UNI_POUT_CHUNK_DATA) +
+        sizeof(int32_t) * 2 + // x, z
+        1 + 2 + 1 + 2 + 15 + 4 + 1 + // heightmaps
+        uni_num_longs(256, uni_ceil_log2(chunk->num_sections * 16 + 1)) * 8 +
+        3 + // section data length
+        section_bound * chunk->num_sections +
+        1 + // block entities
+        1 + // trust edges
+        4 * (5 + (num_light + 63) / 64 * 8) + // light masks
+        2 * (5 + num_light * (2 + UNI_LIGHT_ARRAY_LEN));
+
+    pkt.buf = malloc(bound);
+    if (pkt.buf == NULL) {
+        UNI_LOG("PACKET '%s' ALLOC(%d) FAILED", "chunk data", bound);
+        return pkt;
+    }
+
+    char *cursor = &pkt.buf[3];
+    cursor = uni_write_varint(cursor, UNI_POUT_CHUNK_DATA);
+    cursor = uni_write_int(cursor, chunk->x);
+    cursor = uni_write_int(cursor, chunk->z);
+    cursor = uni_write_heightmaps(cursor, chunk);
+
+    char *data_len = cursor;
+    cursor += 3;
+    char *data = cursor;
+    for (int i = 0; i < chunk->num_sections; i++) {
+        const UniChunkSection *section = &chunk->sections[i];
+        cursor = uni_write_short(cursor, (int16_t) section->block_count);
+        cursor = uni_write_container(
+            cursor, section->block_states, UNI_SECTION_BLOCKS, UNI_BLOCK_MIN_BITS, UNI_BLOCK_MAX_BITS,
+            UNI_BLOCK_STATE_BITS, UNI_BLOCK_PALETTE_SLOTS
+        );
+        cursor = uni_write_container(
+            cursor, section->biomes, UNI_SECTION_BIOMES, UNI_BIOME_MIN_BITS, UNI_BIOME_MAX_BITS,
+            chunk->biome_bits, UNI_BIOME_PALETTE_SLOTS
+        );
+    }
+    uni_write_varint_padded(data_len, (int) (cursor - data), 3);
+
+    cursor = uni_write_varint(cursor, 0); // Block entities
+    cursor = uni_write_byte(cursor, chunk->trust_edges);
+    cursor = uni_write_light_mask(cursor, chunk->sky_light, num_light, false);
+    cursor = uni_write_light_mask(cursor, chunk->block_light, num_light, false);
+    cursor = uni_write_light_mask(cursor, chunk->sky_light, num_light, true);
+    cursor = uni_write_light_mask(cursor, chunk->block_light, num_light, true);
+    cursor = uni_write_light_arrays(cursor, chunk->sky_light, num_light);
+    cursor = uni_write_light_arrays(cursor, chunk->block_light, num_light);
+
+    int body_len = (int) (cursor - &pkt.buf[3]);
+    if (uni_varint_size(body_len) > 3) {
+        // Packet length headers can't be longer than 3 bytes.
+        UNI_LOG("PACKET '%s' TOO LARGE (%d)", "chunk data", body_len);
+        free(pkt.buf);
+        pkt.buf = NULL;
+        return pkt;
+    }
+
+    uni_write_varint_padded(pkt.buf, body_len, 3);
+    pkt.len = 3 + body_len;
+    pkt.write_idx = 3;
+    return pkt;
+}
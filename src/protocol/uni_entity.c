@@ -0,0 +1,202 @@
+#include "uni_play.h"
+
+#include <stdlib.h>
+
+#include "uni_packet.h"
+#include "uni_log.h"
+
+// Packet IDs of protocol 1.19.
+#define UNI_POUT_ENTITY_POS 0x26
+#define UNI_POUT_ENTITY_POS_ROT 0x27
+#define UNI_POUT_ENTITY_ROT 0x28
+#define UNI_POUT_TELEPORT_ENTITY 0x63
+
+// Which packet an entity needs. The values are combined from bits for moving
+// and turning.
+typedef enum {
+    UNI_MOVE_NONE = 0,
+    UNI_MOVE_POS = 1,
+    UNI_MOVE_ROT = 2,
+    UNI_MOVE_POS_ROT = 3,
+    UNI_MOVE_TELEPORT = 4,
+} UniMoveKind;
+
+// Relative moves are in 1/4096 blocks, the same precision clients keep
+// positions at. Positions are rounded to that precision in doubles, by adding
+// and subtracting 1.5 * 2^52 (coordinates are far below 2^39 blocks), which
+// compilers can vectorize where a conversion to int64_t can't be. Ties round to
+// even, unlike in vanilla, but the client only ever adds up the deltas.
+static inline double uni_fixed_pos(double pos) {
+    const double magic = 6755399441055744.0;
+    return (pos * 4096.0 + magic) - magic;
+}
+
+// Angles are sent in 1/256 turns.
+static inline unsigned char uni_angle(float degrees) {
+    float scaled = degrees * (256.0f / 360.0f);
+    int angle = (int) scaled;
+    return (unsigned char) (angle - (scaled < (float) angle));
+}
+
+static inline bool uni_fits_short(double delta) {
+    return (delta >= INT16_MIN) & (delta <= INT16_MAX);
+}
+
+static inline char *uni_write_double(char *dest, double val) {
+    int64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    return uni_write_long(dest, bits);
+}
+
+static bool uni_move_batch_reserve(UniMoveBatch *batch, int count) {
+    if (count <= batch->cap) {
+        return true;
+    }
+
+    int cap = batch->cap == 0 ? 256 : batch->cap;
+    while (cap < count) {
+        cap *= 2;
+    }
+
+    char *frames = realloc(batch->frames, (size_t) cap * UNI_MOVE_FRAME_MAX);
+    if (frames == NULL) {
+        return false;
+    }
+    batch->frames = frames;
+
+    unsigned char *lens = realloc(batch->lens, cap);
+    if (lens == NULL) {
+        return false;
+    }
+    batch->lens = lens;
+
+    unsigned char *kinds = realloc(batch->kinds, cap);
+    if (kinds == NULL) {
+        return false;
+    }
+    batch->kinds = kinds;
+
+    batch->cap = cap;
+    return true;
+}
+
+bool uni_encode_moves(UniMoveBatch *batch, const UniEntityMoves *moves) {
+    int count = moves->count;
+
+    if (!uni_move_batch_reserve(batch, count)) {
+        UNI_LOG("ENTITY MOVES ALLOC(%d) FAILED", count);
+        return false;
+    }
+    batch->count = count;
+
+    // Decides on the packet of every entity first. The loop has no branches or
+    // calls, so compilers can vectorize it.
+    const double *x = moves->x, *prev_x = moves->prev_x;
+    const double *y = moves->y, *prev_y = moves->prev_y;
+    const double *z = moves->z, *prev_z = moves->prev_z;
+    const float *yaw = moves->yaw, *prev_yaw = moves->prev_yaw;
+    const float *pitch = moves->pitch, *prev_pitch = moves->prev_pitch;
+    unsigned char *kinds = batch->kinds;
+    for (int i = 0; i < count; i++) {
+        double dx = uni_fixed_pos(x[i]) - uni_fixed_pos(prev_x[i]);
+        double dy = uni_fixed_pos(y[i]) - uni_fixed_pos(prev_y[i]);
+        double dz = uni_fixed_pos(z[i]) - uni_fixed_pos(prev_z[i]);
+
+        bool moved = (dx != 0) | (dy != 0) | (dz != 0);
+        bool far = !uni_fits_short(dx) | !uni_fits_short(dy) | !uni_fits_short(dz);
+        bool turned =
+            (uni_angle(yaw[i]) != uni_angle(prev_yaw[i])) |
+            (uni_angle(pitch[i]) != uni_angle(prev_pitch[i]));
+
+        kinds[i] = (unsigned char) ((moved | turned << 1) * !far + far * UNI_MOVE_TELEPORT);
+    }
+
+    for (int i = 0; i < count; i++) {
+        char *frame = &batch->frames[(size_t) i * UNI_MOVE_FRAME_MAX];
+
+        // Movement packets are shorter than 128 bytes, so their length always
+        // takes one byte.
+        char *cursor = frame + 1;
+
+        switch (kinds[i]) {
+        case UNI_MOVE_NONE:
+            batch->lens[i] = 0;
+            continue;
+        case UNI_MOVE_POS:
+        case UNI_MOVE_POS_ROT:
+            cursor = uni_write_varint(cursor, kinds[i] == UNI_MOVE_POS ? UNI_POUT_ENTITY_POS : UNI_POUT_ENTITY_POS_ROT);
+            cursor = uni_write_varint(cursor, moves->ids[i]);
+            cursor = uni_write_short(cursor, (int16_t) (uni_fixed_pos(moves->x[i]) - uni_fixed_pos(moves->prev_x[i])));
+            cursor = uni_write_short(cursor, (int16_t) (uni_fixed_pos(moves->y[i]) - uni_fixed_pos(moves->prev_y[i])));
+            cursor = uni_write_short(cursor, (int16_t) (uni_fixed_pos(moves->z[i]) - uni_fixed_pos(moves->prev_z[i])));
+            if (kinds[i] == UNI_MOVE_POS_ROT) {
+                cursor = uni_write_byte(cursor, uni_angle(moves->yaw[i]));
+                cursor = uni_write_byte(cursor, uni_angle(moves->pitch[i]));
+            }
+            break;
+        case UNI_MOVE_ROT:
+            cursor = uni_write_varint(cursor, UNI_POUT_ENTITY_ROT);
+            cursor = uni_write_varint(cursor, moves->ids[i]);
+            cursor = uni_write_byte(cursor, uni_angle(moves->yaw[i]));
+            cursor = uni_write_byte(cursor, uni_angle(moves->pitch[i]));
+            break;
+        case UNI_MOVE_TELEPORT:
+            cursor = uni_write_varint(cursor, UNI_POUT_TELEPORT_ENTITY);
+            cursor = uni_write_varint(cursor, moves->ids[i]);
+            cursor = uni_write_double(cursor, moves->x[i]);
+            cursor = uni_write_double(cursor, moves->y[i]);
+            cursor = uni_write_double(cursor, moves->z[i]);
+            cursor = uni_write_byte(cursor, uni_angle(moves->yaw[i]));
+            cursor = uni_write_byte(cursor, uni_angle(moves->pitch[i]));
+            break;
+        }
+        cursor = uni_write_byte(cursor, moves->on_ground[i]);
+
+        frame[0] = (char) (cursor - frame - 1);
+        batch->lens[i] = (unsigned char) (cursor - frame);
+    }
+
+    return true;
+}
+
+void uni_move_batch_free(UniMoveBatch *batch) {
+    free(batch->frames);
+    free(batch->lens);
+    free(batch->kinds);
+    batch->frames = NULL;
+    batch->lens = NULL;
+    batch->kinds = NULL;
+    batch->count = 0;
+    batch->cap = 0;
+}
+
+UniPacketOut uni_pkt_entity_moves(const UniMoveBatch *batch, const int *indices, int count) {
+    UniPacketOut pkt = {NULL, 0, 0};
+
+    int len = 0;
+    for (int i = 0; i < count; i++) {
+        len += batch->lens[indices[i]];
+    }
+
+    if (len == 0) {
+        return pkt;
+    }
+
+    // Whole frame slots are copied, since a constant size copy is cheaper than
+    // one of the exact length. The last one may extend past 'len'.
+    pkt.buf = malloc(len + UNI_MOVE_FRAME_MAX);
+    if (pkt.buf == NULL) {
+        UNI_LOG("PACKET '%s' ALLOC(%d) FAILED", "entity moves", len);
+        return pkt;
+    }
+
+    char *cursor = pkt.buf;
+    for (int i = 0; i < count; i++) {
+        int idx = indices[i];
+        memcpy(cursor, &batch->frames[(size_t) idx * UNI_MOVE_FRAME_MAX], UNI_MOVE_FRAME_MAX);
+        cursor += batch->lens[idx];
+    }
+
+    pkt.len = len;
+    return pkt;
+}
@@ -0,0 +1,211 @@
+#include "uni_nbt.h"
+
+#include <string.h>
+
+#include "uni_packet.h"
+
+// Size of a tag's type and name. Elements of lists don't have either.
+static inline int uni_nbt_header_size(const char *name, int name_len) {
+    return name == NULL ? 0 : 1 + sizeof(uint16_t) + name_len;
+}
+
+static inline char *uni_nbt_write_header(char *dest, UniNbtType type, const char *name, int name_len) {
+    if (name == NULL) {
+        return dest;
+    }
+
+    dest = uni_write_byte(dest, (unsigned char) type);
+    dest = uni_write_short(dest, (int16_t) name_len);
+    return uni_write_bytes(dest, (const unsigned char *) name, name_len);
+}
+
+// Claims the next 'size' bytes of the output. Returns NULL while measuring.
+static inline char *uni_nbt_reserve(UniNbt *nbt, int size) {
+    char *dest = nbt->cursor;
+
+    nbt->len += size;
+    if (dest != NULL) {
+        nbt->cursor += size;
+    }
+
+    return dest;
+}
+
+// Copies 'count' values as big-endian. On little-endian systems the loops are
+// simple enough for compilers to vectorize the byte swaps.
+static char *uni_nbt_copy_be32(char *dest, const int32_t *vals, int count) {
+#if defined(UNI_BIG_ENDIAN)
+    memcpy(dest, vals, count * sizeof(int32_t));
+    return dest + count * sizeof(int32_t);
+#elif defined(__GNUC__)
+    for (int i = 0; i < count; i++) {
+        uint32_t val = __builtin_bswap32((uint32_t) vals[i]);
+        memcpy(dest + i * sizeof(uint32_t), &val, sizeof(uint32_t));
+    }
+    return dest + count * sizeof(int32_t);
+#else
+    for (int i = 0; i < count; i++) {
+        dest = uni_write_int(dest, vals[i]);
+    }
+    return dest;
+#endif
+}
+
+static char *uni_nbt_copy_be64(char *dest, const int64_t *vals, int count) {
+#if defined(UNI_BIG_ENDIAN)
+    memcpy(dest, vals, count * sizeof(int64_t));
+    return dest + count * sizeof(int64_t);
+#elif defined(__GNUC__)
+    for (int i = 0; i < count; i++) {
+        uint64_t val = __builtin_bswap64((uint64_t) vals[i]);
+        memcpy(dest + i * sizeof(uint64_t), &val, sizeof(uint64_t));
+    }
+    return dest + count * sizeof(int64_t);
+#else
+    for (int i = 0; i < count; i++) {
+        dest = uni_write_long(dest, vals[i]);
+    }
+    return dest;
+#endif
+}
+
+void uni_nbt_byte(UniNbt *nbt, const char *name, int name_len, int8_t val) {
+    char *dest = uni_nbt_reserve(nbt, uni_nbt_header_size(name, name_len) + 1);
+    if (dest == NULL) {
+        return;
+    }
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_BYTE, name, name_len);
+    uni_write_byte(dest, (unsigned char) val);
+}
+
+void uni_nbt_short(UniNbt *nbt, const char *name, int name_len, int16_t val) {
+    char *dest = uni_nbt_reserve(nbt, uni_nbt_header_size(name, name_len) + sizeof(int16_t));
+    if (dest == NULL) {
+        return;
+    }
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_SHORT, name, name_len);
+    uni_write_short(dest, val);
+}
+
+void uni_nbt_int(UniNbt *nbt, const char *name, int name_len, int32_t val) {
+    char *dest = uni_nbt_reserve(nbt, uni_nbt_header_size(name, name_len) + sizeof(int32_t));
+    if (dest == NULL) {
+        return;
+    }
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_INT, name, name_len);
+    uni_write_int(dest, val);
+}
+
+void uni_nbt_long(UniNbt *nbt, const char *name, int name_len, int64_t val) {
+    char *dest = uni_nbt_reserve(nbt, uni_nbt_header_size(name, name_len) + sizeof(int64_t));
+    if (dest == NULL) {
+        return;
+    }
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_LONG, name, name_len);
+    uni_write_long(dest, val);
+}
+
+void uni_nbt_float(UniNbt *nbt, const char *name, int name_len, float val) {
+    char *dest = uni_nbt_reserve(nbt, uni_nbt_header_size(name, name_len) + sizeof(int32_t));
+    if (dest == NULL) {
+        return;
+    }
+
+    int32_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_FLOAT, name, name_len);
+    uni_write_int(dest, bits);
+}
+
+void uni_nbt_double(UniNbt *nbt, const char *name, int name_len, double val) {
+    char *dest = uni_nbt_reserve(nbt, uni_nbt_header_size(name, name_len) + sizeof(int64_t));
+    if (dest == NULL) {
+        return;
+    }
+
+    int64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_DOUBLE, name, name_len);
+    uni_write_long(dest, bits);
+}
+
+void uni_nbt_string(UniNbt *nbt, const char *name, int name_len, const char *str, int str_len) {
+    char *dest = uni_nbt_reserve(nbt, uni_nbt_header_size(name, name_len) + sizeof(uint16_t) + str_len);
+    if (dest == NULL) {
+        return;
+    }
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_STRING, name, name_len);
+    dest = uni_write_short(dest, (int16_t) str_len);
+    uni_write_bytes(dest, (const unsigned char *) str, str_len);
+}
+
+void uni_nbt_byte_array(UniNbt *nbt, const char *name, int name_len, const int8_t *vals, int count) {
+    char *dest = uni_nbt_reserve(nbt, uni_nbt_header_size(name, name_len) + sizeof(int32_t) + count);
+    if (dest == NULL) {
+        return;
+    }
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_BYTE_ARRAY, name, name_len);
+    dest = uni_write_int(dest, count);
+    uni_write_bytes(dest, (const unsigned char *) vals, count);
+}
+
+void uni_nbt_int_array(UniNbt *nbt, const char *name, int name_len, const int32_t *vals, int count) {
+    int size = uni_nbt_header_size(name, name_len) + sizeof(int32_t) + count * sizeof(int32_t);
+    char *dest = uni_nbt_reserve(nbt, size);
+    if (dest == NULL) {
+        return;
+    }
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_INT_ARRAY, name, name_len);
+    dest = uni_write_int(dest, count);
+    uni_nbt_copy_be32(dest, vals, count);
+}
+
+void uni_nbt_long_array(UniNbt *nbt, const char *name, int name_len, const int64_t *vals, int count) {
+    int size = uni_nbt_header_size(name, name_len) + sizeof(int32_t) + count * sizeof(int64_t);
+    char *dest = uni_nbt_reserve(nbt, size);
+    if (dest == NULL) {
+        return;
+    }
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_LONG_ARRAY, name, name_len);
+    dest = uni_write_int(dest, count);
+    uni_nbt_copy_be64(dest, vals, count);
+}
+
+void uni_nbt_list(UniNbt *nbt, const char *name, int name_len, UniNbtType type, int count) {
+    char *dest = uni_nbt_reserve(nbt, uni_nbt_header_size(name, name_len) + 1 + sizeof(int32_t));
+    if (dest == NULL) {
+        return;
+    }
+
+    dest = uni_nbt_write_header(dest, UNI_NBT_LIST, name, name_len);
+    dest = uni_write_byte(dest, (unsigned char) type);
+    uni_write_int(dest, count);
+}
+
+void uni_nbt_compound(UniNbt *nbt, const char *name, int name_len) {
+    char *dest = uni_nbt_reserve(nbt, uni_nbt_header_size(name, name_len));
+    if (dest == NULL) {
+        return;
+    }
+
+    uni_nbt_write_header(dest, UNI_NBT_COMPOUND, name, name_len);
+}
+
+void uni_nbt_end(UniNbt *nbt) {
+    char *dest = uni_nbt_reserve(nbt, 1);
+    if (dest == NULL) {
+        return;
+    }
+
+    uni_write_byte(dest, UNI_NBT_END);
+}
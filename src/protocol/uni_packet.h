@@ -10,7 +10,7 @@
 // Read a boolean from the connection's read buffer. On success, true is
 // returned and *result is set with the result. On failure, false is returned.
 static inline bool uni_read_bool(UniConnection *buf, bool *result) {
-    if (buf->read_idx + 1 >= buf->packet_len) {
+    if (buf->read_idx + 1 > buf->packet_len) {
         return false;
     }
 
@@ -27,7 +27,7 @@ bool uni_read_varint(UniConnection *buf, int *result);
 // On success, true is returned and *result is set with the result. On failure,
 // false is returned.
 static inline bool uni_read_ushort(UniConnection *buf, uint16_t *result) {
-    if (buf->read_idx + sizeof(uint16_t) >= buf->packet_len) {
+    if (buf->read_idx + sizeof(uint16_t) > buf->packet_len) {
         return false;
     }
 
@@ -117,6 +117,19 @@ static inline char *uni_write_varint(char *dest, int val) {
     return (char *) dest + i;
 }
 
+// Writes a varint padded with continuation bits to exactly 'size' bytes, for
+// lengths which are only known once the data following them has been written.
+// 'val' must fit into 7 * size bits.
+static inline char *uni_write_varint_padded(char *dest, int val, int size) {
+    for (int i = 0; i < size - 1; i++) {
+        dest[i] = (char) ((val & 0b01111111) | 0b10000000);
+        val >>= 7;
+    }
+    dest[size - 1] = (char) val;
+
+    return dest + size;
+}
+
 // Encodes/writes raw data to the specified buffer.
 static inline char *uni_write_bytes(char *dest, const unsigned char *src, int len) {
     memcpy(dest, src, len);
@@ -130,6 +143,17 @@ static inline char *uni_write_str(char *dest, const char *str, int len) {
     return dest + len;
 }
 
+static inline char *uni_write_short(char *dest, int16_t val) {
+#ifdef UNI_BIG_ENDIAN
+    *((int16_t *) dest) = val;
+#else // UNI_BIG_ENDIAN
+    dest[0] = (unsigned char) (val >> 8);
+    dest[1] = (unsigned char) val;
+#endif // !UNI_BIG_ENDIAN
+
+    return dest + sizeof(int16_t);
+}
+
 static inline char *uni_write_int(char *dest, int32_t val) {
 #ifdef UNI_BIG_ENDIAN
     *((int32_t *) dest) = val;
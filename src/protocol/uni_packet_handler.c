@@ -2,8 +2,10 @@
 
 #include <stdlib.h>
 
+#include "net/uni_login_arena.h"
 #include "uni_packet.h"
 #include "uni_log.h"
+#include "uni_probe.h"
 #include "uni_server.h"
 
 #define UNI_PKT_HANDSHAKE 0x00
@@ -13,6 +15,10 @@
 #define UNI_PKT_LOGIN_SUCCESS 0x02
 
 #define UNI_PLUGIN_REQ_ID "velocity:player_info"
+
+// The channel of the plugin request, encoded as a string. It follows the
+// request's message ID.
+static const char uni_plugin_req_channel[] = "\x14" UNI_PLUGIN_REQ_ID;
 #define UNI_STATE_LOGIN 2
 
 // Note: Similar macro UNI_CHECK_PKT in uni_play.c
@@ -42,7 +48,8 @@ static bool uni_recv_handshake(UniConnection *conn) {
         return false;
     }
 
-    conn->handler = UNI_HANDLER_LOGIN_START;
+    uni_conn_set_handler(conn, UNI_HANDLER_LOGIN_START);
+    uni_conn_end_stage(conn, UNI_HIST_HANDSHAKE);
     return next_state == UNI_STATE_LOGIN;
 }
 
@@ -61,19 +68,21 @@ static bool uni_recv_login_start(UniConnection *conn) {
     int pkt_size =
         uni_varint_size(UNI_PKT_LOGIN_PLUGIN_REQ) +
         uni_varint_size(conn->plugin_req_id) +
-        uni_str_size(sizeof(UNI_PLUGIN_REQ_ID) - 1);
+        sizeof(uni_plugin_req_channel) - 1;
 
-    UniPacketOut pkt = uni_alloc_packet(pkt_size);
+    UniSharedBuf *shared;
+    UniPacketOut pkt = uni_login_alloc_packet(conn, pkt_size, &shared);
     UNI_CHECK_ALLOC(pkt, "login plugin request", pkt_size);
 
     char *cursor = &pkt.buf[pkt.write_idx];
     cursor = uni_write_varint(cursor, UNI_PKT_LOGIN_PLUGIN_REQ);
     cursor = uni_write_varint(cursor, conn->plugin_req_id);
-             uni_write_str(cursor, UNI_PLUGIN_REQ_ID, sizeof(UNI_PLUGIN_REQ_ID) - 1);
+             uni_write_bytes(cursor, (const unsigned char *) uni_plugin_req_channel, sizeof(uni_plugin_req_channel) - 1);
 
-    uni_write(conn, &pkt);
+    uni_conn_write_shared(conn, &pkt, shared, UNI_PRIORITY_NORMAL);
 
-    conn->handler = UNI_HANDLER_PLUGIN_RES;
+    uni_conn_set_handler(conn, UNI_HANDLER_PLUGIN_RES);
+    uni_conn_end_stage(conn, UNI_HIST_LOGIN_START);
     conn->header_len_limit = 2;
     return true;
 }
@@ -102,10 +111,14 @@ static bool uni_recv_plugin_res(UniConnection *conn) {
         return false;
     }
 
+    uni_conn_end_stage(conn, UNI_HIST_PLUGIN_RES);
+
     if (!uni_verify_hmac(conn->server, &conn->packet_buf[conn->read_idx], conn->packet_len - conn->read_idx, hmac)) {
         return false;
     }
 
+    uni_conn_end_stage(conn, UNI_HIST_HMAC_VERIFY);
+
     int protocol_ver;
     if (!uni_read_varint(conn, &protocol_ver)) {
         return false;
@@ -136,7 +149,25 @@ static bool uni_recv_plugin_res(UniConnection *conn) {
         return false;
     }
 
-    data.properties = malloc(sizeof(UniLoginProperty) * data.num_properties);
+    // Every property takes a few bytes, which also keeps props_size from
+    // overflowing.
+    if (data.num_properties > conn->packet_len) {
+        return false;
+    }
+
+    // Properties which don't fit into the login arena are put on the heap.
+    int props_size = (int) sizeof(UniLoginProperty) * data.num_properties;
+    bool props_on_heap = false;
+    data.properties = uni_login_alloc(conn, props_size);
+    if (data.properties == NULL && data.num_properties > 0) {
+        data.properties = malloc(props_size);
+        UNI_STAT_INC(conn->server, allocs);
+        if (data.properties == NULL) {
+            UNI_LOG("LOGIN PROPERTIES ALLOC(%d) FAILED", props_size);
+            return false;
+        }
+        props_on_heap = true;
+    }
 
     for (int i = 0; i < data.num_properties; i++) {
         UniLoginProperty *prop = &data.properties[i];
@@ -165,8 +196,12 @@ static bool uni_recv_plugin_res(UniConnection *conn) {
         }
     }
 
+    conn->stage_ns = UNI_HIST_NOW(conn->server);
     void *user_ptr = uni_on_login(conn->server->user_ptr, conn, &data);
-    free(data.properties);
+    uni_conn_end_stage(conn, UNI_HIST_ON_LOGIN);
+    if (props_on_heap) {
+        free(data.properties);
+    }
 
     if (user_ptr == NULL) {
         return false;
@@ -174,7 +209,7 @@ static bool uni_recv_plugin_res(UniConnection *conn) {
 
     conn->refcount++;
     conn->user_ptr = user_ptr;
-    conn->handler = UNI_HANDLER_LOGIN_SUCCESS;
+    uni_conn_set_handler(conn, UNI_HANDLER_LOGIN_SUCCESS);
 
     name_len = strlen(data.player_name);
     int pkt_size =
@@ -184,7 +219,8 @@ static bool uni_recv_plugin_res(UniConnection *conn) {
         uni_varint_size(0); // TODO: Determine if properties actually need to be
                             // sent
 
-    UniPacketOut pkt = uni_alloc_packet(pkt_size);
+    UniSharedBuf *shared;
+    UniPacketOut pkt = uni_login_alloc_packet(conn, pkt_size, &shared);
     UNI_CHECK_ALLOC(pkt, "login success", pkt_size);
 
     char *cursor = &pkt.buf[pkt.write_idx];
@@ -193,15 +229,19 @@ static bool uni_recv_plugin_res(UniConnection *conn) {
     cursor = uni_write_str(cursor, data.player_name, name_len);
     cursor = uni_write_varint(cursor, 0);
 
-    uni_write(conn, &pkt);
+    uni_conn_write_shared(conn, &pkt, shared, UNI_PRIORITY_NORMAL);
     return true;
 
 property_fail:
-    free(data.properties);
+    if (props_on_heap) {
+        free(data.properties);
+    }
     return false;
 }
 
 bool uni_handle_packet(UniConnection *conn) {
+    UNI_PROBE3(packet, conn->id, conn->handler, conn->packet_len);
+
     switch (conn->handler) {
         case UNI_HANDLER_HANDSHAKE:
             return uni_recv_handshake(conn);
@@ -10,4 +10,8 @@ bool uni_handle_packet(UniConnection *conn);
 
 bool uni_recv_play(UniConnection *conn);
 
+// Processes the current chunk of a streamed PLAY packet. See
+// UniConnection.streaming.
+bool uni_recv_play_chunk(UniConnection *conn);
+
 #endif // !UNI_PACKET_HANDLER_H
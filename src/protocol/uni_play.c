@@ -1,7 +1,11 @@
 #include "uni_play.h"
 
+#include "uni_channel.h"
 #include "uni_packet.h"
 #include "uni_log.h"
+#include "uni_probe.h"
+#include "uni_executor.h"
+#include "uni_server.h"
 
 typedef enum {
     UNI_POUT_JOIN_GAME = 0x23,
@@ -111,6 +115,12 @@ bool uni_recv_play(UniConnection *conn) {
         return false;
     }
 
+    UNI_PROBE3(play_packet, conn->id, id, conn->packet_len);
+
+    if (id >= 0 && id < UNI_STATS_PACKET_IDS) {
+        UNI_STAT_INC(conn->server, packets_in_by_id[id]);
+    }
+
     #define UNI_RECV(data) uni_on_packet_received(conn->server->user_ptr, conn->user_ptr, id, (data))
 
     switch (id) {
@@ -122,15 +132,113 @@ bool uni_recv_play(UniConnection *conn) {
                 return false;
             }
 
+            UniServer *server = conn->server;
+            if (server->num_channels > 0) {
+                int channel_id = uni_channel_lookup(server, packet.channel, packet.channel_len);
+                UniChannelHandler handler = channel_id == -1 ? NULL : server->channels[channel_id].handler;
+                if (handler == NULL) {
+                    UNI_STAT_INC(server, plugin_msgs_dropped);
+                    return true;
+                }
+
+                int data_len = conn->packet_len - conn->read_idx;
+                unsigned char *data = &conn->packet_buf[conn->read_idx];
+                if (server->num_workers == 0) {
+                    return handler(server->user_ptr, conn->user_ptr, channel_id, data, data_len);
+                }
+
+                UniJob *job = uni_job_new(conn, UNI_JOB_CHANNEL);
+                if (job == NULL) {
+                    return false;
+                }
+                job->channel.handler = handler;
+                job->channel.channel_id = channel_id;
+                job->channel.data = data;
+                job->channel.data_len = data_len;
+                uni_job_submit(job);
+                return true;
+            }
+
             packet.data_len = conn->packet_len - conn->read_idx;
             packet.data = uni_read_bytes(conn, packet.data_len);
             if (packet.data == NULL) {
                 return false;
             }
 
-            UNI_RECV(&packet);
+            if (server->num_workers == 0) {
+                UNI_RECV(&packet);
+                break;
+            }
+
+            UniJob *job = uni_job_new(conn, UNI_JOB_PACKET);
+            if (job == NULL) {
+                return false;
+            }
+            job->packet.packet_id = id;
+            job->packet.plugin_msg = packet;
+            uni_job_submit(job);
         } break;
     }
 
     return true;
 }
+
+bool uni_recv_play_chunk(UniConnection *conn) {
+    UniServer *server = conn->server;
+
+    int id;
+    if (!uni_read_varint(conn, &id)) {
+        return false;
+    }
+
+    if (conn->stream_hdr_len == 0) {
+        UNI_PROBE3(play_packet, conn->id, id, conn->stream_len);
+
+        if (id >= 0 && id < UNI_STATS_PACKET_IDS) {
+            UNI_STAT_INC(server, packets_in_by_id[id]);
+        }
+    }
+
+    if (id != UNI_PIN_PLUGIN_MSG) {
+        conn->stream_hdr_len = conn->read_idx;
+        return true;
+    }
+
+    UniInPluginChunk chunk;
+    chunk.channel = uni_read_str(conn, 255, &chunk.channel_len);
+    if (chunk.channel == NULL) {
+        return false;
+    }
+    conn->stream_hdr_len = conn->read_idx;
+
+    chunk.data = &conn->packet_buf[conn->read_idx];
+    chunk.data_len = conn->packet_len - conn->read_idx;
+    chunk.data_offset = conn->stream_done - conn->packet_len;
+    chunk.total_len = conn->stream_len - conn->read_idx;
+    chunk.last = conn->stream_done == conn->stream_len;
+    chunk.channel_id = -1;
+
+    if (server->num_channels > 0) {
+        chunk.channel_id = uni_channel_lookup(server, chunk.channel, chunk.channel_len);
+        if (chunk.channel_id == -1) {
+            if (chunk.last) {
+                UNI_STAT_INC(server, plugin_msgs_dropped);
+            }
+            return true;
+        }
+    }
+
+    if (server->config.on_plugin_chunk == NULL) {
+        return true;
+    } else if (server->num_workers == 0) {
+        return server->config.on_plugin_chunk(server->user_ptr, conn->user_ptr, &chunk);
+    }
+
+    UniJob *job = uni_job_new(conn, UNI_JOB_CHUNK);
+    if (job == NULL) {
+        return false;
+    }
+    job->chunk = chunk;
+    uni_job_submit(job);
+    return true;
+}
@@ -5,19 +5,137 @@
 
 #include "hmac_sha256.h"
 
+#include "net/uni_admission.h"
+#include "net/uni_login_arena.h"
 #include "net/uni_networking.h"
+#include "protocol/uni_channel.h"
+#include "uni_capture_writer.h"
+#include "uni_executor.h"
+#include "uni_grid.h"
+#include "uni_histogram.h"
+#include "uni_time.h"
+
+void uni_default_config(UniConfig *config) {
+    config->backend = UNI_BACKEND_AUTO;
+    config->ring_mode = UNI_RING_DEFAULT;
+    config->sqpoll_cpu = -1;
+    config->sqpoll_idle_ms = 1000;
+    config->busy_poll_us = 0;
+    config->latency_histograms = true;
+    config->capture_path = NULL;
+    config->write_high_watermark = 1 << 20;
+    config->write_low_watermark = 256 << 10;
+    config->on_write_pressure = NULL;
+    config->write_hard_cap = 8 << 20;
+    config->write_hard_cap_ms = 5000;
+    config->stream_threshold = 0;
+    config->stream_chunk_size = 16384;
+    config->on_plugin_chunk = NULL;
+    config->login_rate = 0;
+    config->login_burst = 64;
+    config->max_concurrent_logins = 256;
+    config->login_queue_size = 4096;
+    config->login_queue_timeout_ms = 20000;
+    config->worker_threads = 0;
+}
 
 UniServer *uni_create(uint16_t port, const char *secret, void *user_ptr, UniError *err) {
+    UniConfig config;
+    uni_default_config(&config);
+    return uni_create_with_config(port, secret, user_ptr, &config, err);
+}
+
+UniServer *uni_server_alloc(const char *secret, void *user_ptr, const UniConfig *config, UniError *err) {
     UniServer *server = malloc(sizeof(UniServer));
+    server->config = *config;
 
     server->secret_len = (int) strlen(secret);
     server->secret = malloc(server->secret_len);
     memcpy(server->secret, secret, server->secret_len);
     server->user_ptr = user_ptr;
+    server->loopback_head = NULL;
+    server->loopback_tail = NULL;
+    server->free_loopbacks = NULL;
+    server->num_free_loopbacks = 0;
+    server->capture = NULL;
+    server->conns = NULL;
+    server->conn_size = sizeof(UniConnection);
+    server->free_conns = NULL;
+    server->num_free_conns = 0;
+    server->over_cap_head = NULL;
+    server->over_cap_tail = NULL;
+    server->handing_off = false;
+    server->next_conn_id = 0;
+    uni_grid_init(server);
+    uni_channels_init(server);
+    server->login_arenas = NULL;
+    server->num_login_arenas = 0;
+    uni_admission_init(server);
 
-    if (!uni_net_init(server, port, err)) {
+    if (!uni_stats_init(server)) {
+        if (err != NULL) {
+            *err = UNI_ERR_LIMITED;
+        }
+        free(server->secret);
+        free(server);
+        return NULL;
+    }
+
+    if (!uni_hist_init(server)) {
+        if (err != NULL) {
+            *err = UNI_ERR_LIMITED;
+        }
+        uni_stats_free(server);
+        free(server->secret);
         free(server);
+        return NULL;
+    }
+
+    if (config->capture_path != NULL && !uni_capture_init(server, config->capture_path)) {
+        if (err != NULL) {
+            *err = UNI_ERR_LIMITED;
+        }
+        uni_hist_free(server);
+        uni_stats_free(server);
         free(server->secret);
+        free(server);
+        return NULL;
+    }
+
+    if (!uni_executor_init(server)) {
+        if (err != NULL) {
+            *err = UNI_ERR_LIMITED;
+        }
+        uni_capture_free(server);
+        uni_hist_free(server);
+        uni_stats_free(server);
+        free(server->secret);
+        free(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+void uni_server_discard(UniServer *server) {
+    uni_executor_free(server);
+    uni_capture_free(server);
+    uni_hist_free(server);
+    uni_stats_free(server);
+    free(server->secret);
+    free(server);
+}
+
+UniServer *uni_create_with_config(
+    uint16_t port, const char *secret, void *user_ptr, const UniConfig *config, UniError *err
+) {
+    UniServer *server = uni_server_alloc(secret, user_ptr, config, err);
+    if (server == NULL) {
+        return NULL;
+    }
+
+    if (!uni_net_init(server, port, err)) {
+        uni_server_discard(server);
         return NULL;
     }
 
@@ -25,9 +143,22 @@ UniServer *uni_create(uint16_t port, const char *secret, void *user_ptr, UniErro
 }
 
 void uni_free(UniServer *server) {
+    uni_executor_free(server);
+    uni_grid_free(server);
+    uni_channels_free(server);
+    uni_login_arenas_free(server);
+    uni_conns_free(server);
+    uni_loopbacks_free(server);
+    uni_capture_free(server);
+    uni_hist_free(server);
+    uni_stats_free(server);
     free(server->secret);
 }
 
+uint64_t uni_clock_ns(void) {
+    return uni_time_ns();
+}
+
 bool uni_verify_hmac(UniServer *server, const unsigned char *data, int data_len, const unsigned char* signature) {
     unsigned char out[32];
     if (hmac_sha256(server->secret, server->secret_len, data, data_len, out, 32) != 32) {
@@ -0,0 +1,373 @@
+#include "uni_capture_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net/uni_connection.h"
+#include "uni_log.h"
+#include "uni_server.h"
+#include "uni_time.h"
+
+#define UNI_CAPTURE_BUF_SIZE (256 * 1024)
+#define UNI_CAPTURE_BUFS 8
+
+// Buffered records are handed to the writer thread after at most this long.
+#define UNI_CAPTURE_FLUSH_NS 100000000
+
+// Largest possible record header: type, two uvarints and a frame length.
+#define UNI_CAPTURE_MAX_RECORD_HEADER (1 + 10 + 10 + 5)
+
+typedef struct UniCaptureBuf {
+    unsigned char *data;
+    int len;
+    struct UniCaptureBuf *next;
+} UniCaptureBuf;
+
+struct UniCapture {
+    int fd;
+    pthread_t thread;
+
+    // Protects everything up to and including 'stop'.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UniCaptureBuf *free_bufs;
+    UniCaptureBuf *full_head;
+    UniCaptureBuf *full_tail;
+    bool stop;
+
+    // Only used by the polling thread.
+    UniCaptureBuf *active;
+    uint64_t last_record_ns;
+    uint64_t handoff_ns;
+    uint64_t dropped;
+
+    // IDs of connections which were closed while their records were being
+    // dropped, and which are still owed a gap record.
+    uint64_t *gap_ids;
+    int num_gap_ids;
+    int gap_ids_cap;
+
+    UniCaptureBuf bufs[UNI_CAPTURE_BUFS];
+};
+
+static unsigned char *uni_capture_write_uvarint(unsigned char *dest, uint64_t val) {
+    do {
+        unsigned char temp = val & 0b01111111;
+        val >>= 7;
+        if (val != 0) {
+            temp |= 0b10000000;
+        }
+        *dest++ = temp;
+    } while (val != 0);
+
+    return dest;
+}
+
+static unsigned char *uni_capture_write_header(
+    unsigned char *dest, UniCaptureRecord type, uint64_t delta, uint64_t conn_id
+) {
+    *dest++ = (unsigned char) type;
+    dest = uni_capture_write_uvarint(dest, delta);
+    return uni_capture_write_uvarint(dest, conn_id);
+}
+
+// Writes all of 'len' bytes. Returns false on failure.
+static bool uni_capture_write_all(int fd, const unsigned char *data, int len) {
+    while (len > 0) {
+        ssize_t res = write(fd, data, len);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        data += res;
+        len -= (int) res;
+    }
+
+    return true;
+}
+
+static void *uni_capture_thread(void *arg) {
+    UniCapture *capture = arg;
+    bool failed = false;
+
+    pthread_mutex_lock(&capture->lock);
+    while (true) {
+        while (capture->full_head == NULL && !capture->stop) {
+            pthread_cond_wait(&capture->cond, &capture->lock);
+        }
+
+        UniCaptureBuf *buf = capture->full_head;
+        if (buf == NULL) {
+            break;
+        }
+
+        capture->full_head = buf->next;
+        pthread_mutex_unlock(&capture->lock);
+
+        if (!failed && !uni_capture_write_all(capture->fd, buf->data, buf->len)) {
+            UNI_LOG("-- UNI CAPTURE WRITE FAILED: %s --", strerror(errno));
+            failed = true;
+        }
+
+        pthread_mutex_lock(&capture->lock);
+        buf->len = 0;
+        buf->next = capture->free_bufs;
+        capture->free_bufs = buf;
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    return NULL;
+}
+
+// Passes the active buffer on to the writer thread.
+static void uni_capture_handoff(UniCapture *capture) {
+    UniCaptureBuf *buf = capture->active;
+    if (buf == NULL) {
+        return;
+    }
+
+    capture->active = NULL;
+    capture->handoff_ns = uni_time_ns();
+    buf->next = NULL;
+
+    pthread_mutex_lock(&capture->lock);
+    if (capture->full_head == NULL) {
+        capture->full_head = buf;
+    } else {
+        capture->full_tail->next = buf;
+    }
+    capture->full_tail = buf;
+    pthread_cond_signal(&capture->cond);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+bool uni_capture_init(UniServer *server, const char *path) {
+    UniCapture *capture = calloc(1, sizeof(UniCapture));
+    if (capture == NULL) {
+        return false;
+    }
+
+    capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture->fd == -1) {
+        UNI_LOG("-- UNI CAPTURE: can't open %s: %s --", path, strerror(errno));
+        free(capture);
+        return false;
+    }
+
+    for (int i = 0; i < UNI_CAPTURE_BUFS; i++) {
+        capture->bufs[i].data = malloc(UNI_CAPTURE_BUF_SIZE);
+        if (capture->bufs[i].data == NULL) {
+            for (int j = 0; j < i; j++) {
+                free(capture->bufs[j].data);
+            }
+            close(capture->fd);
+            free(capture);
+            return false;
+        }
+
+        capture->bufs[i].next = capture->free_bufs;
+        capture->free_bufs = &capture->bufs[i];
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t start = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+
+    unsigned char header[UNI_CAPTURE_HEADER_LEN] = UNI_CAPTURE_MAGIC;
+    header[6] = UNI_CAPTURE_VERSION;
+    header[7] = 0;
+    for (int i = 0; i < 8; i++) {
+        header[8 + i] = (unsigned char) (start >> (8 * i));
+    }
+
+    pthread_mutex_init(&capture->lock, NULL);
+    pthread_cond_init(&capture->cond, NULL);
+
+    if (
+        !uni_capture_write_all(capture->fd, header, sizeof(header)) ||
+        pthread_create(&capture->thread, NULL, uni_capture_thread, capture) != 0
+    ) {
+        for (int i = 0; i < UNI_CAPTURE_BUFS; i++) {
+            free(capture->bufs[i].data);
+        }
+        pthread_mutex_destroy(&capture->lock);
+        pthread_cond_destroy(&capture->cond);
+        close(capture->fd);
+        free(capture);
+        return false;
+    }
+
+    capture->last_record_ns = uni_time_ns();
+    capture->handoff_ns = capture->last_record_ns;
+    server->capture = capture;
+    return true;
+}
+
+void uni_capture_free(UniServer *server) {
+    UniCapture *capture = server->capture;
+    if (capture == NULL) {
+        return;
+    }
+
+    uni_capture_handoff(capture);
+
+    pthread_mutex_lock(&capture->lock);
+    capture->stop = true;
+    pthread_cond_signal(&capture->cond);
+    pthread_mutex_unlock(&capture->lock);
+    pthread_join(capture->thread, NULL);
+
+    // Gaps which never found room in a buffer are written out directly.
+    uint64_t delta = uni_time_ns() - capture->last_record_ns;
+    while (capture->num_gap_ids > 0) {
+        unsigned char record[UNI_CAPTURE_MAX_RECORD_HEADER];
+        uint64_t conn_id = capture->gap_ids[--capture->num_gap_ids];
+        unsigned char *end = uni_capture_write_header(record, UNI_CAPTURE_GAP, delta, conn_id);
+        if (!uni_capture_write_all(capture->fd, record, (int) (end - record))) {
+            break;
+        }
+        delta = 0;
+    }
+
+    if (capture->dropped > 0) {
+        UNI_WLOG("-- UNI CAPTURE DROPPED %llu RECORDS --", (unsigned long long) capture->dropped);
+    }
+
+    for (int i = 0; i < UNI_CAPTURE_BUFS; i++) {
+        free(capture->bufs[i].data);
+    }
+    pthread_mutex_destroy(&capture->lock);
+    pthread_cond_destroy(&capture->cond);
+    close(capture->fd);
+    free(capture->gap_ids);
+    free(capture);
+    server->capture = NULL;
+}
+
+// Returns the active buffer if it has room for 'len' more bytes, or NULL if
+// all buffers are full.
+static UniCaptureBuf *uni_capture_reserve(UniCapture *capture, int len) {
+    if (len > UNI_CAPTURE_BUF_SIZE) {
+        return NULL;
+    }
+
+    if (capture->active != NULL && capture->active->len + len > UNI_CAPTURE_BUF_SIZE) {
+        uni_capture_handoff(capture);
+    }
+
+    if (capture->active == NULL) {
+        pthread_mutex_lock(&capture->lock);
+        capture->active = capture->free_bufs;
+        if (capture->active != NULL) {
+            capture->free_bufs = capture->active->next;
+        }
+        pthread_mutex_unlock(&capture->lock);
+    }
+
+    return capture->active;
+}
+
+// Writes the gap records owed to closed connections, as far as there is room.
+static void uni_capture_write_gaps(UniCapture *capture) {
+    while (capture->num_gap_ids > 0) {
+        UniCaptureBuf *buf = uni_capture_reserve(capture, UNI_CAPTURE_MAX_RECORD_HEADER);
+        if (buf == NULL) {
+            return;
+        }
+
+        uint64_t now = uni_time_ns();
+        uint64_t conn_id = capture->gap_ids[--capture->num_gap_ids];
+        unsigned char *cursor = uni_capture_write_header(
+            &buf->data[buf->len], UNI_CAPTURE_GAP, now - capture->last_record_ns, conn_id
+        );
+        buf->len = (int) (cursor - buf->data);
+        capture->last_record_ns = now;
+    }
+}
+
+// Remembers that a record was dropped, so the capture says so later.
+static void uni_capture_drop(UniServer *server, UniCaptureRecord type, UniConnection *conn) {
+    UniCapture *capture = server->capture;
+    capture->dropped++;
+    UNI_STAT_INC(server, capture_records_dropped);
+
+    if (type != UNI_CAPTURE_CLOSE) {
+        conn->capture_gap = true;
+        return;
+    }
+
+    // The connection has no records left to carry the gap.
+    if (capture->num_gap_ids == capture->gap_ids_cap) {
+        int cap = capture->gap_ids_cap == 0 ? 64 : capture->gap_ids_cap * 2;
+        uint64_t *gap_ids = realloc(capture->gap_ids, sizeof(uint64_t) * cap);
+        UNI_STAT_INC(server, allocs);
+        if (gap_ids == NULL) {
+            UNI_LOG("-- UNI CAPTURE: GAP OF CONNECTION %llu LOST --", (unsigned long long) conn->id);
+            return;
+        }
+        capture->gap_ids = gap_ids;
+        capture->gap_ids_cap = cap;
+    }
+    capture->gap_ids[capture->num_gap_ids++] = conn->id;
+}
+
+void uni_capture_record(
+    UniServer *server, UniCaptureRecord type, UniConnection *conn, const unsigned char *frame, int frame_len
+) {
+    UniCapture *capture = server->capture;
+    if (capture->num_gap_ids > 0) {
+        uni_capture_write_gaps(capture);
+    }
+
+    int max_len = UNI_CAPTURE_MAX_RECORD_HEADER + frame_len;
+    if (conn->capture_gap) {
+        max_len += UNI_CAPTURE_MAX_RECORD_HEADER;
+    }
+
+    UniCaptureBuf *buf = uni_capture_reserve(capture, max_len);
+    if (buf == NULL) {
+        uni_capture_drop(server, type, conn);
+        return;
+    }
+
+    uint64_t now = uni_time_ns();
+    uint64_t delta = now - capture->last_record_ns;
+
+    unsigned char *cursor = &buf->data[buf->len];
+    if (conn->capture_gap) {
+        cursor = uni_capture_write_header(cursor, UNI_CAPTURE_GAP, delta, conn->id);
+        conn->capture_gap = false;
+        delta = 0;
+    }
+    cursor = uni_capture_write_header(cursor, type, delta, conn->id);
+    if (type == UNI_CAPTURE_FRAME) {
+        cursor = uni_capture_write_uvarint(cursor, (uint64_t) frame_len);
+        memcpy(cursor, frame, frame_len);
+        cursor += frame_len;
+    }
+
+    buf->len = (int) (cursor - buf->data);
+    capture->last_record_ns = now;
+}
+
+void uni_capture_tick(UniServer *server) {
+    UniCapture *capture = server->capture;
+    if (capture == NULL) {
+        return;
+    }
+
+    if (capture->num_gap_ids > 0) {
+        uni_capture_write_gaps(capture);
+    }
+    if (capture->active != NULL && uni_time_ns() - capture->handoff_ns >= UNI_CAPTURE_FLUSH_NS) {
+        uni_capture_handoff(capture);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef UNI_CAPTURE_WRITER_H
+#define UNI_CAPTURE_WRITER_H
+
+// Records inbound traffic to a capture file (see uni_capture.h). Records are
+// appended to an in-memory buffer by the polling thread. Full buffers are
+// handed to a background thread which writes them out, so the polling thread
+// never waits for the disk. If all buffers are full, records are dropped, and
+// the connection's next record is preceded by a gap record.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "uni.h"
+#include "uni_capture.h"
+
+typedef struct UniServerImpl UniServer;
+typedef struct UniConnectionImpl UniConnection;
+typedef struct UniCapture UniCapture;
+
+// Opens the capture file and starts the writer thread. Returns false on
+// failure.
+bool uni_capture_init(UniServer *server, const char *path);
+
+// Writes out everything which has been recorded, stops the writer thread and
+// closes the file. Does nothing if capturing is disabled.
+void uni_capture_free(UniServer *server);
+
+// Records an event of the connection. Must be called from the polling thread.
+void uni_capture_record(
+    UniServer *server, UniCaptureRecord type, UniConnection *conn, const unsigned char *frame, int frame_len
+);
+
+// Hands the records buffered so far to the writer thread if they have been
+// waiting for a while. Called after every poll.
+void uni_capture_tick(UniServer *server);
+
+#endif // !UNI_CAPTURE_WRITER_H
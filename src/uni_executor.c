@@ -0,0 +1,298 @@
+#include "uni_executor.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "net/uni_connection.h"
+#include "net/uni_networking.h"
+#include "uni_log.h"
+#include "uni_server.h"
+
+// Handled jobs kept for reuse by the polling thread.
+#define UNI_MAX_FREE_JOBS 1024
+
+// Frames of handled jobs which are larger than this are freed rather than kept
+// with the job, so the free jobs don't hold on to much memory.
+#define UNI_KEEP_FRAME_CAP 4096
+
+struct UniWorker {
+    UniServer *server;
+    pthread_t thread;
+    int shard;
+
+    // Protects everything up to and including 'stop'.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UniJob *head;
+    UniJob *tail;
+    bool stop;
+};
+
+static void uni_job_run(UniServer *server, UniJob *job) {
+    switch (job->kind) {
+        case UNI_JOB_PACKET:
+            uni_on_packet_received(server->user_ptr, job->conn_user_ptr, job->packet.packet_id, &job->packet.plugin_msg);
+            job->ok = true;
+            break;
+
+        case UNI_JOB_CHANNEL:
+            job->ok = job->channel.handler(
+                server->user_ptr, job->conn_user_ptr, job->channel.channel_id, job->channel.data, job->channel.data_len
+            );
+            break;
+
+        case UNI_JOB_CHUNK:
+            job->ok = server->config.on_plugin_chunk(server->user_ptr, job->conn_user_ptr, &job->chunk);
+            break;
+    }
+}
+
+// Hands a job back to the polling thread.
+static void uni_job_done(UniServer *server, UniJob *job) {
+    UniJob *head = __atomic_load_n(&server->jobs_done, __ATOMIC_RELAXED);
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(&server->jobs_done, &head, job, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // The polling thread is woken up once per batch. Until it took the stack,
+    // later pushes find it non-empty.
+    if (head == NULL) {
+        uni_net_wake(server);
+    }
+}
+
+static void *uni_worker_thread(void *arg) {
+    UniWorker *worker = arg;
+    UniServer *server = worker->server;
+    uni_stats_set_shard(worker->shard);
+
+    pthread_mutex_lock(&worker->lock);
+    while (true) {
+        while (worker->head == NULL && !worker->stop) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+
+        if (worker->stop) {
+            break;
+        }
+
+        UniJob *job = worker->head;
+        worker->head = NULL;
+        worker->tail = NULL;
+        pthread_mutex_unlock(&worker->lock);
+
+        while (job != NULL) {
+            UniJob *next = job->next;
+            uni_job_run(server, job);
+            uni_job_done(server, job);
+            job = next;
+        }
+
+        pthread_mutex_lock(&worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+static void uni_job_free(UniJob *job) {
+    free(job->frame);
+    free(job);
+}
+
+static void uni_job_free_list(UniJob *job) {
+    while (job != NULL) {
+        UniJob *next = job->next;
+        uni_job_free(job);
+        job = next;
+    }
+}
+
+static void uni_worker_stop(UniWorker *worker) {
+    pthread_mutex_lock(&worker->lock);
+    worker->stop = true;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_join(worker->thread, NULL);
+    uni_job_free_list(worker->head);
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+    free(worker);
+}
+
+bool uni_executor_init(UniServer *server) {
+    server->workers = NULL;
+    server->num_workers = 0;
+    server->jobs_done = NULL;
+    server->free_jobs = NULL;
+    server->num_free_jobs = 0;
+
+    // Shard 0 belongs to the polling thread.
+    int count = server->config.worker_threads;
+    if (count > UNI_MAX_STAT_SHARDS - 1) {
+        count = UNI_MAX_STAT_SHARDS - 1;
+    }
+    if (count <= 0) {
+        return true;
+    }
+
+    server->workers = malloc(sizeof(UniWorker *) * count);
+    if (server->workers == NULL) {
+        return false;
+    }
+
+    // Workers are allocated separately, so their locks don't share cache
+    // lines.
+    for (int i = 0; i < count; i++) {
+        UniWorker *worker = malloc(sizeof(UniWorker));
+        if (worker == NULL) {
+            uni_executor_free(server);
+            return false;
+        }
+
+        worker->server = server;
+        worker->shard = i + 1;
+        worker->head = NULL;
+        worker->tail = NULL;
+        worker->stop = false;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+
+        if (pthread_create(&worker->thread, NULL, uni_worker_thread, worker) != 0) {
+            UNI_LOG("WORKER %d COULDN'T BE STARTED", i);
+            pthread_cond_destroy(&worker->cond);
+            pthread_mutex_destroy(&worker->lock);
+            free(worker);
+            uni_executor_free(server);
+            return false;
+        }
+
+        server->workers[server->num_workers++] = worker;
+    }
+
+    return true;
+}
+
+void uni_executor_free(UniServer *server) {
+    for (int i = 0; i < server->num_workers; i++) {
+        uni_worker_stop(server->workers[i]);
+    }
+    free(server->workers);
+    server->workers = NULL;
+    server->num_workers = 0;
+
+    uni_job_free_list(server->jobs_done);
+    uni_job_free_list(server->free_jobs);
+    server->jobs_done = NULL;
+    server->free_jobs = NULL;
+    server->num_free_jobs = 0;
+}
+
+UniJob *uni_job_new(UniConnection *conn, UniJobKind kind) {
+    UniServer *server = conn->server;
+
+    UniJob *job = server->free_jobs;
+    if (job != NULL) {
+        server->free_jobs = job->next;
+        server->num_free_jobs--;
+    } else {
+        job = malloc(sizeof(UniJob));
+        UNI_STAT_INC(server, allocs);
+        if (job == NULL) {
+            UNI_LOG("JOB ALLOC(%d) FAILED", (int) sizeof(UniJob));
+            return NULL;
+        }
+        job->frame = NULL;
+        job->frame_cap = 0;
+    }
+
+    job->kind = kind;
+    job->conn = conn;
+    job->conn_user_ptr = conn->user_ptr;
+    job->ok = false;
+    if (kind != UNI_JOB_CHUNK) {
+        unsigned char *frame = conn->packet_buf;
+        int frame_cap = conn->packet_cap;
+        conn->packet_buf = job->frame;
+        conn->packet_cap = job->frame_cap;
+        job->frame = frame;
+        job->frame_cap = frame_cap;
+    }
+
+    conn->refcount++;
+    return job;
+}
+
+void uni_job_submit(UniJob *job) {
+    UniConnection *conn = job->conn;
+    UniServer *server = conn->server;
+    UniWorker *worker = server->workers[conn->id % (uint64_t) server->num_workers];
+
+    if (job->kind == UNI_JOB_CHUNK) {
+        conn->chunk_in_worker = true;
+    }
+
+    job->next = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->head == NULL) {
+        worker->head = job;
+        pthread_cond_signal(&worker->cond);
+    } else {
+        worker->tail->next = job;
+    }
+    worker->tail = job;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+unsigned uni_executor_complete(UniServer *server) {
+    if (server->num_workers == 0 || __atomic_load_n(&server->jobs_done, __ATOMIC_RELAXED) == NULL) {
+        return 0;
+    }
+
+    // The stack is newest first.
+    UniJob *stack = __atomic_exchange_n(&server->jobs_done, NULL, __ATOMIC_ACQUIRE);
+    UniJob *jobs = NULL;
+    while (stack != NULL) {
+        UniJob *next = stack->next;
+        stack->next = jobs;
+        jobs = stack;
+        stack = next;
+    }
+
+    unsigned count = 0;
+    while (jobs != NULL) {
+        UniJob *job = jobs;
+        jobs = job->next;
+        count++;
+
+        UniConnection *conn = job->conn;
+        if (job->kind == UNI_JOB_CHUNK) {
+            conn->chunk_in_worker = false;
+        }
+
+        conn->refcount--;
+        if (!uni_conn_gc(conn) && !conn->closing) {
+            if (!job->ok) {
+                uni_conn_shutdown(conn);
+            } else if (job->kind == UNI_JOB_CHUNK) {
+                uni_conn_stream_next(conn);
+            }
+        }
+
+        if (server->num_free_jobs < UNI_MAX_FREE_JOBS) {
+            if (job->frame_cap > UNI_KEEP_FRAME_CAP) {
+                free(job->frame);
+                job->frame = NULL;
+                job->frame_cap = 0;
+            }
+            job->next = server->free_jobs;
+            server->free_jobs = job;
+            server->num_free_jobs++;
+        } else {
+            uni_job_free(job);
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,95 @@
+#ifndef UNI_EXECUTOR_H
+#define UNI_EXECUTOR_H
+
+// Runs the application's PLAY packet handlers on a pool of worker threads (see
+// UniConfig.worker_threads), so slow handlers don't hold up I/O. The polling
+// thread still reads and parses packets. Instead of calling the handler, it
+// wraps the call in a job, which takes over the frame the packet was read
+// into, and queues it to the connection's worker. In exchange, the connection
+// gets the frame of a job which is done, so reading on doesn't need a fresh
+// allocation. Every connection always
+// goes to the same worker, which handles jobs in the order they were queued,
+// so a connection's packets are handled in the order they arrived.
+//
+// Handled jobs are pushed onto a lock-free stack, and the first push onto an
+// empty stack wakes up the polling thread, which acts on the handlers' results
+// and keeps the jobs and their frames for reuse. Each job holds a reference to
+// its connection until then.
+
+#include <stdbool.h>
+
+#include "uni.h"
+#include "uni_play.h"
+
+typedef struct UniServerImpl UniServer;
+typedef struct UniConnectionImpl UniConnection;
+typedef struct UniWorker UniWorker;
+
+typedef enum {
+    // A packet for uni_on_packet_received().
+    UNI_JOB_PACKET,
+    // A plugin message for a registered channel's handler.
+    UNI_JOB_CHANNEL,
+    // A chunk of a streamed plugin message for UniConfig.on_plugin_chunk().
+    // The chunk stays in the connection's buffer, so the connection doesn't
+    // read on until the job is done. See UniConnection.chunk_in_worker
+    UNI_JOB_CHUNK,
+} UniJobKind;
+
+typedef struct UniJob UniJob;
+
+struct UniJob {
+    UniJobKind kind;
+    UniConnection *conn;
+    void *conn_user_ptr;
+
+    // The frame the packet was read into, of 'frame_cap' bytes. Once the job
+    // is done, the frame is kept along with it and handed to the connection
+    // of the next job in exchange for that connection's frame. UNI_JOB_CHUNK
+    // leaves the frame as it is. May be NULL.
+    unsigned char *frame;
+    int frame_cap;
+
+    // What the handler returned. False disconnects the client.
+    bool ok;
+
+    union {
+        struct {
+            int packet_id;
+            UniInPluginMessage plugin_msg;
+        } packet;
+
+        struct {
+            UniChannelHandler handler;
+            int channel_id;
+            unsigned char *data;
+            int data_len;
+        } channel;
+
+        UniInPluginChunk chunk;
+    };
+
+    // Next job in the worker's queue, in the stack of handled jobs, or in the
+    // server's free list.
+    UniJob *next;
+};
+
+// Starts UniConfig.worker_threads workers. Returns false on failure.
+bool uni_executor_init(UniServer *server);
+
+// Stops the workers. Jobs which haven't been handled yet are dropped.
+void uni_executor_free(UniServer *server);
+
+// Creates a job for the packet in the connection's read buffer. Unless 'kind'
+// is UNI_JOB_CHUNK, the job takes the buffer over and the connection gets the
+// job's previous frame. Returns NULL if out of memory.
+UniJob *uni_job_new(UniConnection *conn, UniJobKind kind);
+
+// Queues a job to its connection's worker.
+void uni_job_submit(UniJob *job);
+
+// Finishes the jobs the workers have handled since the last call. Called by
+// the poll functions. Returns the number of jobs finished.
+unsigned uni_executor_complete(UniServer *server);
+
+#endif // !UNI_EXECUTOR_H
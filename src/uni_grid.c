@@ -0,0 +1,261 @@
+#include "uni_grid.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "net/uni_connection.h"
+#include "uni_log.h"
+#include "uni_server.h"
+
+#define UNI_GRID_INITIAL_CAP 64
+
+// Returns the cell coordinate of a chunk coordinate, rounding towards negative
+// infinity. Right shifts of negative values are arithmetic on all supported
+// compilers.
+static inline int uni_grid_coord(int chunk) {
+    return chunk >> UNI_GRID_CELL_SHIFT;
+}
+
+static inline uint32_t uni_grid_hash(int x, int z) {
+    return ((uint32_t) x * 0x9E3779B1u) ^ ((uint32_t) z * 0x85EBCA6Bu);
+}
+
+void uni_grid_init(UniServer *server) {
+    server->grid_cells = NULL;
+    server->grid_cap = 0;
+    server->grid_used = 0;
+    server->grid_scratch = NULL;
+    server->grid_scratch_cap = 0;
+}
+
+void uni_grid_free(UniServer *server) {
+    for (int i = 0; i < server->grid_cap; i++) {
+        free(server->grid_cells[i].conns);
+    }
+    free(server->grid_cells);
+    free(server->grid_scratch);
+}
+
+// Returns the slot of the cell at 'x', 'z', or of the empty slot it would go
+// into. The table must have at least one empty slot.
+static UniGridCell *uni_grid_slot(UniGridCell *cells, int cap, int x, int z) {
+    uint32_t mask = (uint32_t) cap - 1;
+    for (uint32_t i = uni_grid_hash(x, z) & mask;; i = (i + 1) & mask) {
+        UniGridCell *cell = &cells[i];
+        if (!cell->used || (cell->x == x && cell->z == z)) {
+            return cell;
+        }
+    }
+}
+
+// Returns the cell at 'x', 'z', or NULL if it doesn't exist yet.
+static UniGridCell *uni_grid_find(UniServer *server, int x, int z) {
+    if (server->grid_cap == 0) {
+        return NULL;
+    }
+
+    UniGridCell *cell = uni_grid_slot(server->grid_cells, server->grid_cap, x, z);
+    return cell->used ? cell : NULL;
+}
+
+// Returns the cell at 'x', 'z', creating it if needed. Cells are never removed,
+// so the table only grows as players explore more of the world. Returns NULL
+// if out of memory.
+static UniGridCell *uni_grid_get(UniServer *server, int x, int z) {
+    UniGridCell *cell = uni_grid_find(server, x, z);
+    if (cell != NULL) {
+        return cell;
+    }
+
+    // Keeps the table at most half full.
+    if ((server->grid_used + 1) * 2 > server->grid_cap) {
+        int cap = server->grid_cap == 0 ? UNI_GRID_INITIAL_CAP : server->grid_cap * 2;
+        UniGridCell *cells = calloc(cap, sizeof(UniGridCell));
+        if (cells == NULL) {
+            return NULL;
+        }
+
+        for (int i = 0; i < server->grid_cap; i++) {
+            UniGridCell *old = &server->grid_cells[i];
+            if (old->used) {
+                *uni_grid_slot(cells, cap, old->x, old->z) = *old;
+            }
+        }
+        free(server->grid_cells);
+        server->grid_cells = cells;
+        server->grid_cap = cap;
+    }
+
+    cell = uni_grid_slot(server->grid_cells, server->grid_cap, x, z);
+    cell->x = x;
+    cell->z = z;
+    cell->used = true;
+    server->grid_used++;
+    return cell;
+}
+
+static bool uni_grid_cell_add(UniGridCell *cell, UniConnection *conn) {
+    if (cell->len == cell->cap) {
+        int cap = cell->cap == 0 ? 4 : cell->cap * 2;
+        UniConnection **conns = realloc(cell->conns, sizeof(UniConnection *) * cap);
+        if (conns == NULL) {
+            return false;
+        }
+        cell->conns = conns;
+        cell->cap = cap;
+    }
+
+    cell->conns[cell->len++] = conn;
+    return true;
+}
+
+// Removes a connection from a cell, if it's in it.
+static void uni_grid_cell_remove(UniServer *server, int x, int z, UniConnection *conn) {
+    UniGridCell *cell = uni_grid_find(server, x, z);
+    if (cell == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < cell->len; i++) {
+        if (cell->conns[i] == conn) {
+            cell->conns[i] = cell->conns[--cell->len];
+            return;
+        }
+    }
+}
+
+void uni_grid_remove(UniConnection *conn) {
+    for (int x = conn->grid_min_x; x <= conn->grid_max_x; x++) {
+        for (int z = conn->grid_min_z; z <= conn->grid_max_z; z++) {
+            uni_grid_cell_remove(conn->server, x, z, conn);
+        }
+    }
+    conn->in_grid = false;
+}
+
+static inline bool uni_in_rect(int x, int z, int min_x, int min_z, int max_x, int max_z) {
+    return x >= min_x && x <= max_x && z >= min_z && z <= max_z;
+}
+
+bool uni_set_view(UniConnection *conn, int chunk_x, int chunk_z, int view_distance) {
+    UniServer *server = conn->server;
+
+    if (view_distance < 0) {
+        view_distance = 0;
+    }
+
+    int min_x = uni_grid_coord(chunk_x - view_distance);
+    int min_z = uni_grid_coord(chunk_z - view_distance);
+    int max_x = uni_grid_coord(chunk_x + view_distance);
+    int max_z = uni_grid_coord(chunk_z + view_distance);
+
+    conn->view_x = chunk_x;
+    conn->view_z = chunk_z;
+    conn->view_distance = view_distance;
+
+    // Most moves stay within the same cells. Otherwise, only the cells which
+    // the view entered or left are updated.
+    if (conn->in_grid) {
+        if (
+            min_x == conn->grid_min_x && min_z == conn->grid_min_z &&
+            max_x == conn->grid_max_x && max_z == conn->grid_max_z
+        ) {
+            return true;
+        }
+
+        for (int x = conn->grid_min_x; x <= conn->grid_max_x; x++) {
+            for (int z = conn->grid_min_z; z <= conn->grid_max_z; z++) {
+                if (!uni_in_rect(x, z, min_x, min_z, max_x, max_z)) {
+                    uni_grid_cell_remove(server, x, z, conn);
+                }
+            }
+        }
+    }
+
+    bool was_in_grid = conn->in_grid;
+    int old_min_x = conn->grid_min_x;
+    int old_min_z = conn->grid_min_z;
+    int old_max_x = conn->grid_max_x;
+    int old_max_z = conn->grid_max_z;
+
+    conn->in_grid = true;
+    conn->grid_min_x = min_x;
+    conn->grid_min_z = min_z;
+    conn->grid_max_x = max_x;
+    conn->grid_max_z = max_z;
+
+    for (int x = min_x; x <= max_x; x++) {
+        for (int z = min_z; z <= max_z; z++) {
+            if (was_in_grid && uni_in_rect(x, z, old_min_x, old_min_z, old_max_x, old_max_z)) {
+                continue;
+            }
+
+            UniGridCell *cell = uni_grid_get(server, x, z);
+            if (cell == NULL || !uni_grid_cell_add(cell, conn)) {
+                UNI_LOG("GRID CELL (%d, %d) ALLOC FAILED", x, z);
+                uni_grid_remove(conn);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void uni_clear_view(UniConnection *conn) {
+    if (conn->in_grid) {
+        uni_grid_remove(conn);
+    }
+}
+
+int uni_broadcast_area(UniServer *server, int chunk_x, int chunk_z, UniPacketOut *packet) {
+    UniGridCell *cell = uni_grid_find(server, uni_grid_coord(chunk_x), uni_grid_coord(chunk_z));
+
+    // The recipients are collected first, since writing may call
+    // UniConfig.on_write_pressure, which may move connections around the grid.
+    int count = 0;
+    if (cell != NULL) {
+        if (server->grid_scratch_cap < cell->len) {
+            UniConnection **scratch = realloc(server->grid_scratch, sizeof(UniConnection *) * cell->cap);
+            if (scratch == NULL) {
+                UNI_LOG("BROADCAST ALLOC(%d) FAILED", cell->cap);
+                free(packet->buf);
+                return 0;
+            }
+            server->grid_scratch = scratch;
+            server->grid_scratch_cap = cell->cap;
+        }
+
+        for (int i = 0; i < cell->len; i++) {
+            UniConnection *conn = cell->conns[i];
+            int dx = abs(conn->view_x - chunk_x);
+            int dz = abs(conn->view_z - chunk_z);
+            if (dx <= conn->view_distance && dz <= conn->view_distance) {
+                server->grid_scratch[count++] = conn;
+            }
+        }
+    }
+
+    if (count == 0) {
+        free(packet->buf);
+        return 0;
+    }
+
+    UniSharedBuf *shared = malloc(sizeof(UniSharedBuf));
+    if (shared == NULL) {
+        UNI_LOG("BROADCAST ALLOC(%d) FAILED", (int) sizeof(UniSharedBuf));
+        free(packet->buf);
+        return 0;
+    }
+
+    // Holds a reference of its own until every connection took theirs.
+    shared->buf = packet->buf;
+    shared->refcount = 1;
+    for (int i = 0; i < count; i++) {
+        UniPacketOut copy = *packet;
+        uni_conn_write_shared(server->grid_scratch[i], &copy, shared, UNI_PRIORITY_NORMAL);
+    }
+    uni_shared_buf_release(shared);
+
+    return count;
+}
@@ -0,0 +1,37 @@
+#ifndef UNI_GRID_H
+#define UNI_GRID_H
+
+// Connections are indexed by the area of the world they can see. The world is
+// divided into square cells of UNI_GRID_CELL_CHUNKS chunks, and a connection is
+// listed in every cell its view distance overlaps. Finding who can see a chunk
+// is then a lookup of one cell and a distance check of the connections in it,
+// no matter how many are online. Like writing, the grid is only used from the
+// polling thread.
+
+#include <stdbool.h>
+
+typedef struct UniServerImpl UniServer;
+typedef struct UniConnectionImpl UniConnection;
+
+#define UNI_GRID_CELL_SHIFT 4
+#define UNI_GRID_CELL_CHUNKS (1 << UNI_GRID_CELL_SHIFT)
+
+typedef struct {
+    int x;
+    int z;
+    bool used;
+
+    UniConnection **conns;
+    int len;
+    int cap;
+} UniGridCell;
+
+// Creates an empty grid. Cells are only allocated once connections are added.
+void uni_grid_init(UniServer *server);
+
+void uni_grid_free(UniServer *server);
+
+// Removes a connection from all cells it is listed in.
+void uni_grid_remove(UniConnection *conn);
+
+#endif // !UNI_GRID_H
@@ -0,0 +1,79 @@
+#include "uni_histogram.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "uni_server.h"
+
+bool uni_hist_init(UniServer *server) {
+    server->histograms = calloc(UNI_NUM_HISTOGRAMS, sizeof(UniHistogram));
+    server->hist_reset = false;
+    return server->histograms != NULL;
+}
+
+void uni_hist_free(UniServer *server) {
+    free(server->histograms);
+}
+
+void uni_hist_record(UniServer *server, UniHistogramId id, uint64_t ns) {
+    UniHistogram *hist = &server->histograms[id];
+    hist->count++;
+    hist->sum_ns += ns;
+    if (ns > hist->max_ns) {
+        hist->max_ns = ns;
+    }
+    hist->buckets[uni_hist_bucket(ns)]++;
+}
+
+void uni_hist_apply_reset(UniServer *server) {
+    if (__atomic_exchange_n(&server->hist_reset, false, __ATOMIC_ACQUIRE)) {
+        memset(server->histograms, 0, sizeof(UniHistogram) * UNI_NUM_HISTOGRAMS);
+    }
+}
+
+void uni_get_histogram(UniServer *server, UniHistogramId id, UniHistogram *hist) {
+    UniHistogram *src = &server->histograms[id];
+    hist->count = UNI_STAT_LOAD(src->count);
+    hist->sum_ns = UNI_STAT_LOAD(src->sum_ns);
+    hist->max_ns = UNI_STAT_LOAD(src->max_ns);
+    for (int i = 0; i < UNI_HIST_BUCKETS; i++) {
+        hist->buckets[i] = UNI_STAT_LOAD(src->buckets[i]);
+    }
+}
+
+void uni_reset_histograms(UniServer *server) {
+    __atomic_store_n(&server->hist_reset, true, __ATOMIC_RELEASE);
+}
+
+// Returns the largest value which falls into the given bucket.
+static uint64_t uni_hist_bucket_max(int bucket) {
+    if (bucket < UNI_HIST_SUB_BUCKETS) {
+        return (uint64_t) bucket;
+    }
+
+    int shift = bucket / UNI_HIST_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t) (bucket % UNI_HIST_SUB_BUCKETS) | UNI_HIST_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+uint64_t uni_histogram_percentile(const UniHistogram *hist, double percentile) {
+    if (hist->count == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t) (hist->count * (percentile / 100.0));
+    if (target >= hist->count) {
+        target = hist->count - 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < UNI_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > target) {
+            uint64_t max = uni_hist_bucket_max(i);
+            return max < hist->max_ns ? max : hist->max_ns;
+        }
+    }
+
+    return hist->max_ns;
+}
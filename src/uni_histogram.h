@@ -0,0 +1,60 @@
+#ifndef UNI_HISTOGRAM_H
+#define UNI_HISTOGRAM_H
+
+// Latency histograms are only ever written to by the polling thread, so
+// recording a value is a few plain increments. Other threads read them through
+// uni_get_histogram() and ask for them to be cleared through
+// uni_reset_histograms().
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "uni.h"
+#include "uni_time.h"
+
+#define UNI_HIST_SUB_BITS 4
+#define UNI_HIST_SUB_BUCKETS (1 << UNI_HIST_SUB_BITS)
+#define UNI_HIST_MAX_BITS 36
+
+typedef struct UniServerImpl UniServer;
+
+// Returns the index of the bucket 'ns' falls into.
+static inline int uni_hist_bucket(uint64_t ns) {
+    if (ns < UNI_HIST_SUB_BUCKETS) {
+        return (int) ns;
+    }
+
+    if (ns >= (uint64_t) 1 << UNI_HIST_MAX_BITS) {
+        return UNI_HIST_BUCKETS - 1;
+    }
+
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - UNI_HIST_SUB_BITS;
+    return (shift + 1) * UNI_HIST_SUB_BUCKETS + (int) ((ns >> shift) & (UNI_HIST_SUB_BUCKETS - 1));
+}
+
+// Allocates the server's histograms. Returns false if out of memory.
+bool uni_hist_init(UniServer *server);
+
+void uni_hist_free(UniServer *server);
+
+// Records a single value. Only to be called from the polling thread.
+void uni_hist_record(UniServer *server, UniHistogramId id, uint64_t ns);
+
+// Clears the histograms if uni_reset_histograms() was called since the last
+// time. Only to be called from the polling thread.
+void uni_hist_apply_reset(UniServer *server);
+
+// Returns the current time if the server records latency histograms, 0
+// otherwise. Saves the clock reads when nothing is recorded anyway.
+#define UNI_HIST_NOW(server) ((server)->config.latency_histograms ? uni_time_ns() : 0)
+
+// Records the time passed since 'start', which must come from UNI_HIST_NOW().
+#define UNI_HIST_SINCE(server, id, start)                                      \
+    do {                                                                       \
+        if ((server)->config.latency_histograms) {                             \
+            uni_hist_record((server), (id), uni_time_ns() - (start));          \
+        }                                                                      \
+    } while (0)
+
+#endif // !UNI_HISTOGRAM_H
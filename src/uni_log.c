@@ -0,0 +1,282 @@
+#include "uni_log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "uni_stats.h"
+#include "uni_time.h"
+
+// Messages each thread can have waiting for the logging thread. If a thread
+// logs more than this before the logging thread wakes up, the rest is dropped.
+#define UNI_LOG_RING_SLOTS 512
+
+// Longer messages are truncated.
+#define UNI_LOG_MSG_MAX 240
+
+// How long the logging thread sleeps between passes over the rings.
+#define UNI_LOG_FLUSH_NS 20000000
+
+#define UNI_LOG_SITE_WINDOW_NS 1000000000
+
+typedef struct {
+    uint64_t time_ns;
+    UniLogLevel level;
+    int len;
+    char msg[UNI_LOG_MSG_MAX];
+} UniLogEntry;
+
+// A single-producer, single-consumer queue. The owning thread advances 'head'
+// once an entry is written, the logging thread advances 'tail' once it has
+// been passed to the sink. Both only grow; the slot is the index modulo
+// UNI_LOG_RING_SLOTS.
+typedef struct UniLogRing {
+    uint64_t head;
+    char pad0[UNI_CACHE_LINE - sizeof(uint64_t)];
+
+    uint64_t tail;
+    char pad1[UNI_CACHE_LINE - sizeof(uint64_t)];
+
+    // Set when the owning thread exits. The ring is freed once it is empty.
+    bool orphaned;
+
+    // Protected by uni_log_lock.
+    struct UniLogRing *next;
+    uint64_t drain_head;
+    bool drain_orphaned;
+
+    UniLogEntry entries[UNI_LOG_RING_SLOTS];
+} UniLogRing;
+
+#ifdef UNI_DEBUG
+UniLogLevel uni_log_level = UNI_LOG_DEBUG;
+#else // UNI_DEBUG
+UniLogLevel uni_log_level = UNI_LOG_INFO;
+#endif // !UNI_DEBUG
+
+static void uni_log_stdout(void *user_ptr, UniLogLevel level, uint64_t time_ns, const char *msg, int msg_len);
+
+static pthread_once_t uni_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t uni_log_key;
+
+// Held while draining the rings, so the sink is never called concurrently.
+// Also protects everything below it.
+static pthread_mutex_t uni_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static UniLogRing *uni_log_rings;
+static UniLogSink uni_log_sink = uni_log_stdout;
+static void *uni_log_sink_user;
+static uint64_t uni_log_dropped_reported;
+
+// Messages dropped because a ring was full or couldn't be allocated.
+static uint64_t uni_log_dropped;
+
+static UNI_THREAD_LOCAL UniLogRing *uni_log_ring;
+
+static const char *const uni_log_level_names[] = {
+    [UNI_LOG_DEBUG] = "DEBUG",
+    [UNI_LOG_INFO] = "INFO",
+    [UNI_LOG_WARN] = "WARN",
+    [UNI_LOG_ERROR] = "ERROR",
+};
+
+static void uni_log_stdout(void *user_ptr, UniLogLevel level, uint64_t time_ns, const char *msg, int msg_len) {
+    (void) user_ptr;
+    (void) time_ns;
+    printf("[uni %s] %.*s\n", uni_log_level_names[level], msg_len, msg);
+}
+
+// Passes everything queued so far to the sink, oldest message first.
+// uni_log_lock must be held.
+static void uni_log_drain(void) {
+    for (UniLogRing *ring = uni_log_rings; ring != NULL; ring = ring->next) {
+        // Checked before loading 'head', so that no entry written before the
+        // thread exited can be missed.
+        ring->drain_orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        ring->drain_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+
+    // Merges the rings by time. There are only ever a handful of threads which
+    // log, so a linear scan for the oldest entry is good enough.
+    while (true) {
+        UniLogRing *oldest = NULL;
+        for (UniLogRing *ring = uni_log_rings; ring != NULL; ring = ring->next) {
+            if (ring->tail != ring->drain_head && (
+                oldest == NULL ||
+                ring->entries[ring->tail % UNI_LOG_RING_SLOTS].time_ns <
+                    oldest->entries[oldest->tail % UNI_LOG_RING_SLOTS].time_ns
+            )) {
+                oldest = ring;
+            }
+        }
+
+        if (oldest == NULL) {
+            break;
+        }
+
+        UniLogEntry *entry = &oldest->entries[oldest->tail % UNI_LOG_RING_SLOTS];
+        uni_log_sink(uni_log_sink_user, entry->level, entry->time_ns, entry->msg, entry->len);
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+    }
+
+    UniLogRing **link = &uni_log_rings;
+    while (*link != NULL) {
+        UniLogRing *ring = *link;
+        if (ring->drain_orphaned) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+
+    uint64_t dropped = __atomic_load_n(&uni_log_dropped, __ATOMIC_RELAXED);
+    if (dropped != uni_log_dropped_reported) {
+        char msg[64];
+        int len = snprintf(
+            msg, sizeof(msg), "-- UNI LOG DROPPED %llu MESSAGES --",
+            (unsigned long long) (dropped - uni_log_dropped_reported)
+        );
+        uni_log_sink(uni_log_sink_user, UNI_LOG_WARN, uni_time_ns(), msg, len);
+        uni_log_dropped_reported = dropped;
+    }
+
+    if (uni_log_sink == uni_log_stdout) {
+        fflush(stdout);
+    }
+}
+
+static void *uni_log_thread(void *arg) {
+    (void) arg;
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = UNI_LOG_FLUSH_NS};
+
+    while (true) {
+        nanosleep(&interval, NULL);
+        uni_flush_log();
+    }
+
+    return NULL;
+}
+
+// pthread_key_t destructor, runs when a thread which has logged exits.
+static void uni_log_orphan(void *arg) {
+    UniLogRing *ring = arg;
+    uni_log_ring = NULL;
+    __atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static void uni_log_start(void) {
+    pthread_key_create(&uni_log_key, uni_log_orphan);
+
+    // If the thread can't be started, messages are still written out by
+    // uni_flush_log() and at exit.
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, uni_log_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+
+    atexit(uni_flush_log);
+}
+
+// Returns the calling thread's ring, creating it on first use. Returns NULL if
+// out of memory.
+static UniLogRing *uni_log_get_ring(void) {
+    if (uni_log_ring != NULL) {
+        return uni_log_ring;
+    }
+
+    pthread_once(&uni_log_once, uni_log_start);
+
+    UniLogRing *ring = calloc(1, sizeof(UniLogRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&uni_log_lock);
+    ring->next = uni_log_rings;
+    uni_log_rings = ring;
+    pthread_mutex_unlock(&uni_log_lock);
+
+    pthread_setspecific(uni_log_key, ring);
+    uni_log_ring = ring;
+    return ring;
+}
+
+static void uni_log_push(UniLogRing *ring, UniLogLevel level, uint64_t time_ns, const char *fmt, va_list args) {
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == UNI_LOG_RING_SLOTS) {
+        __atomic_fetch_add(&uni_log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    UniLogEntry *entry = &ring->entries[head % UNI_LOG_RING_SLOTS];
+    int len = vsnprintf(entry->msg, sizeof(entry->msg), fmt, args);
+    if (len < 0) {
+        len = 0;
+    } else if (len >= (int) sizeof(entry->msg)) {
+        len = sizeof(entry->msg) - 1;
+    }
+
+    entry->time_ns = time_ns;
+    entry->level = level;
+    entry->len = len;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void uni_log_push_fmt(UniLogRing *ring, UniLogLevel level, uint64_t time_ns, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    uni_log_push(ring, level, time_ns, fmt, args);
+    va_end(args);
+}
+
+void uni_log_write(UniLogSite *site, UniLogLevel level, const char *fmt, ...) {
+    uint64_t now = uni_time_ns();
+
+    // The site may be shared by several threads. Racing threads can let a
+    // message or two more through than UNI_LOG_SITE_BURST, which is fine.
+    uint32_t suppressed = 0;
+    if (now - __atomic_load_n(&site->window_start_ns, __ATOMIC_RELAXED) >= UNI_LOG_SITE_WINDOW_NS) {
+        __atomic_store_n(&site->window_start_ns, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+        suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= UNI_LOG_SITE_BURST) {
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    UniLogRing *ring = uni_log_get_ring();
+    if (ring == NULL) {
+        __atomic_fetch_add(&uni_log_dropped, 1 + suppressed, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (suppressed > 0) {
+        uni_log_push_fmt(ring, level, now, "-- UNI LOG SUPPRESSED %u MESSAGES LIKE \"%s\" --", suppressed, fmt);
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    uni_log_push(ring, level, now, fmt, args);
+    va_end(args);
+}
+
+void uni_set_log_sink(UniLogSink sink, void *user_ptr) {
+    pthread_mutex_lock(&uni_log_lock);
+    uni_log_sink = sink != NULL ? sink : uni_log_stdout;
+    uni_log_sink_user = user_ptr;
+    pthread_mutex_unlock(&uni_log_lock);
+}
+
+void uni_set_log_level(UniLogLevel level) {
+    __atomic_store_n(&uni_log_level, level, __ATOMIC_RELAXED);
+}
+
+void uni_flush_log(void) {
+    pthread_mutex_lock(&uni_log_lock);
+    uni_log_drain();
+    pthread_mutex_unlock(&uni_log_lock);
+}
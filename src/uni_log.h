@@ -1,17 +1,61 @@
 #ifndef UNI_LOG_H
 #define UNI_LOG_H
 
-#include <stdio.h>
+// Logging for uni's own code. The UNI_LOG*() macros check the level, rate
+// limit the call site and format the message into the calling thread's ring
+// buffer. Nothing is written out on the calling thread. See uni_set_log_sink().
+
+#include <stdint.h>
 #include <stdlib.h>
 
-#define UNI_LOG(fmt, ...) printf(fmt "\n", __VA_ARGS__)
+#include "uni.h"
+
+// Every call site may log this many messages per second. Further messages in
+// the same second are counted and reported once the next one gets through.
+#define UNI_LOG_SITE_BURST 10
+
+typedef struct {
+    uint64_t window_start_ns;
+    uint32_t count;
+    uint32_t suppressed;
+} UniLogSite;
+
+extern UniLogLevel uni_log_level;
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((format(printf, 3, 4)))
+#endif
+void uni_log_write(UniLogSite *site, UniLogLevel level, const char *fmt, ...);
+
+#if defined(__GNUC__)
+#define UNI_LOG_LEVEL() __atomic_load_n(&uni_log_level, __ATOMIC_RELAXED)
+#else // __GNUC__
+#define UNI_LOG_LEVEL() (*(volatile UniLogLevel *) &uni_log_level)
+#endif // !__GNUC__
+
+#define UNI_LOG_AT(level, fmt, ...)                                    \
+    do {                                                               \
+        static UniLogSite uni_log_site;                                \
+        if ((level) >= UNI_LOG_LEVEL()) {                              \
+            uni_log_write(&uni_log_site, (level), fmt, ##__VA_ARGS__); \
+        }                                                              \
+    } while (0)
+
+#define UNI_LOG(fmt, ...) UNI_LOG_AT(UNI_LOG_ERROR, fmt, ##__VA_ARGS__)
+#define UNI_WLOG(fmt, ...) UNI_LOG_AT(UNI_LOG_WARN, fmt, ##__VA_ARGS__)
+#define UNI_ILOG(fmt, ...) UNI_LOG_AT(UNI_LOG_INFO, fmt, ##__VA_ARGS__)
 
-#define UNI_UNREACHABLE() UNI_LOG("UNREACHABLE(): %s:%d", __func__, __LINE__); abort()
+#define UNI_UNREACHABLE()                                         \
+    do {                                                          \
+        UNI_LOG("UNREACHABLE(): %s:%d", __func__, __LINE__);      \
+        uni_flush_log();                                          \
+        abort();                                                  \
+    } while (0)
 
 #ifdef UNI_DEBUG
-#define UNI_DLOG(fmt, ...) UNI_LOG(fmt, __VA_ARGS__)
+#define UNI_DLOG(fmt, ...) UNI_LOG_AT(UNI_LOG_DEBUG, fmt, ##__VA_ARGS__)
 #else // UNI_DEBUG
-#define UNI_DLOG
+#define UNI_DLOG(fmt, ...) do {} while (0)
 #endif // !UNI_DEBUG
 
 #endif // !UNI_LOG_H
@@ -0,0 +1,41 @@
+#ifndef UNI_PROBE_H
+#define UNI_PROBE_H
+
+// USDT (user-level statically defined tracing) probes, for attaching bpftrace,
+// perf or SystemTap to a running server. They are compiled in on Linux when
+// systemtap's <sys/sdt.h> is available (UNI_USDT). An unattached probe is a
+// single nop, and its arguments are only evaluated into registers. Example
+// scripts are in tools/bpftrace.
+//
+// All probes are in the "uni" provider. The first argument is always the
+// connection's ID, which is unique for the lifetime of the server.
+//     accept(conn_id, fd)                 connection accepted
+//     header(conn_id, len)                frame length prefix read
+//     packet(conn_id, handler, len)       frame handed to the protocol handler
+//                                         (UniPacketHandler) for the stage
+//     play_packet(conn_id, id, len)       PLAY packet with the given ID
+//                                         dispatched to uni_on_packet_received()
+//     write(conn_id, len)                 write of 'len' bytes queued
+//     write_done(conn_id, res)            write completed, 'res' as in
+//                                         uni_conn_write_done()
+//     timeout(conn_id)                    login timed out
+//     shutdown(conn_id)                   connection shut down
+//     gc(conn_id)                         connection freed
+
+#ifdef UNI_USDT
+
+#include <sys/sdt.h>
+
+#define UNI_PROBE1(name, a) DTRACE_PROBE1(uni, name, a)
+#define UNI_PROBE2(name, a, b) DTRACE_PROBE2(uni, name, a, b)
+#define UNI_PROBE3(name, a, b, c) DTRACE_PROBE3(uni, name, a, b, c)
+
+#else // UNI_USDT
+
+#define UNI_PROBE1(name, a) do {} while (0)
+#define UNI_PROBE2(name, a, b) do {} while (0)
+#define UNI_PROBE3(name, a, b, c) do {} while (0)
+
+#endif // !UNI_USDT
+
+#endif // !UNI_PROBE_H
@@ -6,8 +6,13 @@
 
 #include <stdbool.h>
 
+#include "uni_capture_writer.h"
+#include "uni_grid.h"
 #include "uni_os_constants.h"
+#include "uni_stats.h"
 #include "uni.h"
+#include "uni_loopback.h"
+#include "protocol/uni_channel.h"
 
 #if defined(UNI_OS_WINDOWS)
 #include <WinSock2.h>
@@ -16,22 +21,183 @@
 #include <netinet/in.h>
 #endif // UNI_OS_LINUX
 
+#if defined(UNI_OS_LINUX)
+typedef struct UniNetBackend UniNetBackend;
+typedef struct UniUringEntry UniUringEntry;
+typedef struct UniEpollConn UniEpollConn;
+#endif // UNI_OS_LINUX
+
+typedef struct UniLoginArena UniLoginArena;
+typedef struct UniWorker UniWorker;
+typedef struct UniJob UniJob;
+
 struct UniServerImpl {
     char *secret;
     int secret_len;
     void *user_ptr;
+    UniConfig config;
+
+    // UNI_MAX_STAT_SHARDS shards. See uni_stats.h
+    UniStatsShard *stats;
+    void *stats_alloc;
+
+    // UNI_NUM_HISTOGRAMS histograms. See uni_histogram.h
+    UniHistogram *histograms;
+    bool hist_reset;
+
+    // Loopback connections with an operation that is ready to complete, in
+    // the order they became ready. See uni_loopback.c
+    UniLoopback *loopback_head;
+    UniLoopback *loopback_tail;
+
+    // Closed loopback clients kept for reuse, along with their buffers.
+    UniLoopback *free_loopbacks;
+    int num_free_loopbacks;
+
+    // NULL unless UniConfig.capture_path is set. See uni_capture_writer.h
+    UniCapture *capture;
+
+    // Open addressing hash table of 'grid_cap' cells, 'grid_used' of which are
+    // in use, and room for the recipients of a broadcast. See uni_grid.h
+    UniGridCell *grid_cells;
+    int grid_cap;
+    int grid_used;
+    UniConnection **grid_scratch;
+    int grid_scratch_cap;
+
+    // 'num_channels' registered plugin message channels by ID, and an open
+    // addressing hash table of their IDs by name. See uni_channel.h
+    UniChannel *channels;
+    int num_channels;
+    int channels_cap;
+    int *channel_slots;
+    int channel_slots_cap;
+
+    // Free login arenas. See uni_login_arena.h
+    UniLoginArena *login_arenas;
+    int num_login_arenas;
+
+    // Connections waiting to be admitted, in the order they were accepted, the
+    // number of admitted connections which haven't joined yet, and when the
+    // login token bucket is full again. See uni_admission.h
+    UniConnection *login_queue_head;
+    UniConnection *login_queue_tail;
+    int login_queue_len;
+    int logins_in_progress;
+    uint64_t login_tat_ns;
+
+    // Threads running packet handlers if UniConfig.worker_threads is set,
+    // jobs they have handled, newest first, and handled jobs kept for reuse.
+    // See uni_executor.h
+    UniWorker **workers;
+    int num_workers;
+    UniJob *jobs_done;
+    UniJob *free_jobs;
+    int num_free_jobs;
+
+    // All connections, most recently accepted first.
+    UniConnection *conns;
+
+    // Size of the backend's connection objects, and freed ones kept for reuse.
+    // See uni_conn_alloc()
+    size_t conn_size;
+    UniConnection *free_conns;
+    int num_free_conns;
+
+    // Connections above UniConfig.write_hard_cap, the longest over it first.
+    UniConnection *over_cap_head;
+    UniConnection *over_cap_tail;
+
+    // Set while the server's connections are handed over to another process,
+    // and after it succeeded. See uni_handoff.h
+    bool handing_off;
+
+    // ID of the most recently accepted connection.
+    uint64_t next_conn_id;
 
 #if defined(UNI_OS_WINDOWS)
     SOCKET socket;
     HANDLE iocp;
 #elif defined(UNI_OS_LINUX)
+    // The I/O interface in use. See uni_networking.h
+    const UniNetBackend *backend;
+
+    // io_uring backend. See uni_uring.c
     struct io_uring ring;
+    UniRingMode ring_mode;
+
+    // Operations which couldn't be queued because the submission queue was
+    // full, in the order they were requested.
+    UniUringEntry *backlog_head;
+    UniUringEntry *backlog_tail;
+
+    // Entries of completed operations, kept for reuse.
+    UniUringEntry *free_entries;
+    int num_free_entries;
+
+    // The pending accept, and whether its cancellation has been queued.
+    UniUringEntry *accept_usr_data;
+    bool accept_cancelling;
+
+    // Number of queued operations which trigger a submission. Adjusted to the
+    // load after every poll.
+    unsigned submit_batch;
+    unsigned sq_load_avg;
+    unsigned cycle_sqes;
+
+    unsigned cq_overflows;
+    unsigned cq_dropped;
+
+    // Set while handling completions through uni_process_completions(), which
+    // must not submit anything.
+    bool inhibit_submit;
+
+    // Registered with the ring by uni_event_fd(). -1 until then.
+    int event_fd;
+
+    // Polled by a pending operation, so that workers can wake up the polling
+    // thread. -1 unless UniConfig.worker_threads is set.
+    int wake_fd;
+
+    // epoll backend. See uni_epoll.c
+    int epoll_fd;
+
+    // Registered with epoll to wake up uni_event_fd() users when there is
+    // work left over, and to time out logins.
+    int epoll_wake_fd;
+    int epoll_timer_fd;
+
+    // When epoll_timer_fd is set to expire, or 0 if it isn't armed.
+    uint64_t epoll_timer_ns;
+
+    // Set when the listening socket may have connections waiting.
+    bool epoll_accept_ready;
+
+    // Connections with a pending operation that can make progress.
+    UniEpollConn *epoll_ready_head;
+    UniEpollConn *epoll_ready_tail;
+
+    // Connections which haven't logged in yet, by deadline.
+    UniEpollConn *epoll_timeout_head;
+    UniEpollConn *epoll_timeout_tail;
+
+    // Connections to drop a reference to once the current event is handled.
+    UniEpollConn *epoll_release;
+
     int fd;
     struct sockaddr_in server_addr;
     socklen_t addr_len;
 #endif // UNI_OS_LINUX
 };
 
+// Sets up everything of a server except for networking, which is left to
+// uni_net_init() or uni_net_adopt(). Returns NULL on failure.
+UniServer *uni_server_alloc(const char *secret, void *user_ptr, const UniConfig *config, UniError *err);
+
+// Frees a server returned by uni_server_alloc() whose networking couldn't be
+// set up.
+void uni_server_discard(UniServer *server);
+
 // Verifies that a HMAC-SHA256 digest of the provided data is equal to received signature. The signature must be exactly
 // 32 bytes long.
 bool uni_verify_hmac(UniServer *server, const unsigned char *data, int data_len, const unsigned char* signature);
@@ -0,0 +1,66 @@
+#include "uni_stats.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uni_server.h"
+
+UNI_THREAD_LOCAL int uni_stats_shard = 0;
+
+bool uni_stats_init(UniServer *server) {
+    size_t size = sizeof(UniStatsShard) * UNI_MAX_STAT_SHARDS;
+
+    server->stats_alloc = malloc(size + UNI_CACHE_LINE - 1);
+    if (server->stats_alloc == NULL) {
+        return false;
+    }
+
+    uintptr_t addr = (uintptr_t) server->stats_alloc;
+    server->stats = (UniStatsShard *) ((addr + UNI_CACHE_LINE - 1) & ~(uintptr_t) (UNI_CACHE_LINE - 1));
+    memset(server->stats, 0, size);
+    return true;
+}
+
+void uni_stats_free(UniServer *server) {
+    free(server->stats_alloc);
+}
+
+#define UNI_SUM(field)                                                         \
+    for (int i = 0; i < UNI_MAX_STAT_SHARDS; i++) {                           \
+        stats->field += UNI_STAT_LOAD(server->stats[i].counters.field);       \
+    }
+
+void uni_get_stats(UniServer *server, UniStats *stats) {
+    memset(stats, 0, sizeof(UniStats));
+
+    UNI_SUM(accepts);
+    for (int stage = 0; stage < UNI_NUM_STAGES; stage++) {
+        UNI_SUM(active_conns[stage]);
+    }
+
+    UNI_SUM(bytes_in);
+    UNI_SUM(bytes_out);
+    UNI_SUM(packets_in);
+    UNI_SUM(packets_out);
+    for (int id = 0; id < UNI_STATS_PACKET_IDS; id++) {
+        UNI_SUM(packets_in_by_id[id]);
+    }
+
+    UNI_SUM(sqes);
+    UNI_SUM(cqes);
+    UNI_SUM(submit_calls);
+    UNI_SUM(allocs);
+    UNI_SUM(write_queue_depth);
+    UNI_SUM(write_queue_bytes);
+    UNI_SUM(write_cap_disconnects);
+    UNI_SUM(plugin_msgs_dropped);
+    UNI_SUM(capture_records_dropped);
+    UNI_SUM(logins_queued);
+    UNI_SUM(logins_rejected);
+    UNI_SUM(login_queue_depth);
+
+    for (int err = 0; err < UNI_STATS_ERRNOS; err++) {
+        UNI_SUM(errors_by_errno[err]);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef UNI_STATS_H
+#define UNI_STATS_H
+
+// Counters are kept in one shard per thread that updates them, so that
+// counting is nothing more than an unsynchronized increment on memory which no
+// other thread writes to. uni_get_stats() adds the shards together.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "uni.h"
+
+#define UNI_CACHE_LINE 64
+
+// The polling thread counts into shard 0. Other threads which handle events on
+// behalf of a server have to claim a shard of their own with
+// uni_stats_set_shard().
+#define UNI_MAX_STAT_SHARDS 16
+
+#if defined(_MSC_VER)
+#define UNI_THREAD_LOCAL __declspec(thread)
+#else // _MSC_VER
+#define UNI_THREAD_LOCAL __thread
+#endif // !_MSC_VER
+
+typedef struct {
+    UniStats counters;
+
+    // Keeps neighbouring shards off each other's cache lines. The shard array
+    // itself is cache line aligned by uni_stats_init().
+    char pad[UNI_CACHE_LINE - sizeof(UniStats) % UNI_CACHE_LINE];
+} UniStatsShard;
+
+typedef struct UniServerImpl UniServer;
+
+extern UNI_THREAD_LOCAL int uni_stats_shard;
+
+// Allocates and zeroes the server's shards. Returns false if out of memory.
+bool uni_stats_init(UniServer *server);
+
+void uni_stats_free(UniServer *server);
+
+// Selects the shard the calling thread counts into.
+static inline void uni_stats_set_shard(int shard) {
+    uni_stats_shard = shard;
+}
+
+// Only the owning thread ever writes to a shard, so a relaxed load and store is
+// enough. The atomic builtins only prevent torn values when other threads read
+// the counter.
+#if defined(__GNUC__)
+#define UNI_STAT_ADD(server, field, n)                                              \
+    __atomic_store_n(                                                               \
+        &(server)->stats[uni_stats_shard].counters.field,                          \
+        __atomic_load_n(&(server)->stats[uni_stats_shard].counters.field, __ATOMIC_RELAXED) + (n), \
+        __ATOMIC_RELAXED                                                            \
+    )
+#define UNI_STAT_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#else // __GNUC__
+#define UNI_STAT_ADD(server, field, n) ((server)->stats[uni_stats_shard].counters.field += (n))
+#define UNI_STAT_LOAD(field) (field)
+#endif // !__GNUC__
+
+#define UNI_STAT_INC(server, field) UNI_STAT_ADD(server, field, 1)
+#define UNI_STAT_DEC(server, field) UNI_STAT_ADD(server, field, -1)
+
+// Counts a failed operation which returned -errno.
+#define UNI_STAT_ERR(server, res)                                              \
+    UNI_STAT_INC(server, errors_by_errno[(-(res) > 0 && -(res) < UNI_STATS_ERRNOS) ? -(res) : 0])
+
+#endif // !UNI_STATS_H
@@ -0,0 +1,30 @@
+#ifndef UNI_TIME_H
+#define UNI_TIME_H
+
+#include <stdint.h>
+
+#include "uni_os_constants.h"
+
+#if defined(UNI_OS_WINDOWS)
+#include <Windows.h>
+#elif defined(UNI_OS_LINUX)
+#include <time.h>
+#endif // UNI_OS_LINUX
+
+// Returns the current value of a monotonic clock in nanoseconds. Only useful
+// for measuring the time between two calls.
+static inline uint64_t uni_time_ns(void) {
+#if defined(UNI_OS_WINDOWS)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t) (count.QuadPart / freq.QuadPart) * 1000000000 +
+           (uint64_t) (count.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#elif defined(UNI_OS_LINUX)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif // UNI_OS_LINUX
+}
+
+#endif // !UNI_TIME_H
@@ -0,0 +1,160 @@
+// Windows versions of the modules which are built on pthreads on Linux
+// (uni_log.c, uni_capture_writer.c and uni_executor.c). The Windows backend
+// doesn't poll yet, so these are kept simple: log messages are passed to the
+// sink on the thread which logs them, capturing isn't supported, and packet
+// handlers always run on the polling thread.
+
+#include <WinSock2.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "uni_capture_writer.h"
+#include "uni_executor.h"
+#include "uni_log.h"
+#include "uni_server.h"
+#include "uni_time.h"
+
+#define UNI_LOG_MSG_MAX 240
+#define UNI_LOG_SITE_WINDOW_NS 1000000000
+
+#ifdef UNI_DEBUG
+UniLogLevel uni_log_level = UNI_LOG_DEBUG;
+#else // UNI_DEBUG
+UniLogLevel uni_log_level = UNI_LOG_INFO;
+#endif // !UNI_DEBUG
+
+static void uni_log_stdout(void *user_ptr, UniLogLevel level, uint64_t time_ns, const char *msg, int msg_len);
+
+// Held while a message is passed to the sink, so the sink is never called
+// concurrently. Also protects everything below it and the call sites.
+static SRWLOCK uni_log_lock = SRWLOCK_INIT;
+static UniLogSink uni_log_sink = uni_log_stdout;
+static void *uni_log_sink_user;
+
+static const char *const uni_log_level_names[] = {
+    [UNI_LOG_DEBUG] = "DEBUG",
+    [UNI_LOG_INFO] = "INFO",
+    [UNI_LOG_WARN] = "WARN",
+    [UNI_LOG_ERROR] = "ERROR",
+};
+
+static void uni_log_stdout(void *user_ptr, UniLogLevel level, uint64_t time_ns, const char *msg, int msg_len) {
+    (void) user_ptr;
+    (void) time_ns;
+    printf("[uni %s] %.*s\n", uni_log_level_names[level], msg_len, msg);
+}
+
+// Formats the message and passes it to the sink. uni_log_lock must be held.
+static void uni_log_emit(UniLogLevel level, uint64_t time_ns, const char *fmt, va_list args) {
+    char msg[UNI_LOG_MSG_MAX];
+    int len = vsnprintf(msg, sizeof(msg), fmt, args);
+    if (len < 0) {
+        len = 0;
+    } else if (len >= (int) sizeof(msg)) {
+        len = sizeof(msg) - 1;
+    }
+
+    uni_log_sink(uni_log_sink_user, level, time_ns, msg, len);
+}
+
+static void uni_log_emit_fmt(UniLogLevel level, uint64_t time_ns, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    uni_log_emit(level, time_ns, fmt, args);
+    va_end(args);
+}
+
+void uni_log_write(UniLogSite *site, UniLogLevel level, const char *fmt, ...) {
+    uint64_t now = uni_time_ns();
+
+    AcquireSRWLockExclusive(&uni_log_lock);
+
+    uint32_t suppressed = 0;
+    if (now - site->window_start_ns >= UNI_LOG_SITE_WINDOW_NS) {
+        site->window_start_ns = now;
+        site->count = 0;
+        suppressed = site->suppressed;
+        site->suppressed = 0;
+    }
+
+    if (site->count++ >= UNI_LOG_SITE_BURST) {
+        site->suppressed++;
+        ReleaseSRWLockExclusive(&uni_log_lock);
+        return;
+    }
+
+    if (suppressed > 0) {
+        uni_log_emit_fmt(level, now, "-- UNI LOG SUPPRESSED %u MESSAGES LIKE \"%s\" --", suppressed, fmt);
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    uni_log_emit(level, now, fmt, args);
+    va_end(args);
+
+    ReleaseSRWLockExclusive(&uni_log_lock);
+}
+
+void uni_set_log_sink(UniLogSink sink, void *user_ptr) {
+    AcquireSRWLockExclusive(&uni_log_lock);
+    uni_log_sink = sink != NULL ? sink : uni_log_stdout;
+    uni_log_sink_user = user_ptr;
+    ReleaseSRWLockExclusive(&uni_log_lock);
+}
+
+void uni_set_log_level(UniLogLevel level) {
+    InterlockedExchange((volatile LONG *) &uni_log_level, (LONG) level);
+}
+
+void uni_flush_log(void) {
+    AcquireSRWLockExclusive(&uni_log_lock);
+    if (uni_log_sink == uni_log_stdout) {
+        fflush(stdout);
+    }
+    ReleaseSRWLockExclusive(&uni_log_lock);
+}
+
+bool uni_capture_init(UniServer *server, const char *path) {
+    UNI_LOG("CAPTURING ISN'T SUPPORTED ON WINDOWS");
+    return false;
+}
+
+void uni_capture_free(UniServer *server) {
+}
+
+void uni_capture_record(
+    UniServer *server, UniCaptureRecord type, UniConnection *conn, const unsigned char *frame, int frame_len
+) {
+}
+
+void uni_capture_tick(UniServer *server) {
+}
+
+bool uni_executor_init(UniServer *server) {
+    server->workers = NULL;
+    server->num_workers = 0;
+    server->jobs_done = NULL;
+    server->free_jobs = NULL;
+    server->num_free_jobs = 0;
+
+    if (server->config.worker_threads > 0) {
+        UNI_WLOG("WORKER THREADS AREN'T SUPPORTED ON WINDOWS, HANDLING PACKETS ON THE POLLING THREAD");
+    }
+    return true;
+}
+
+void uni_executor_free(UniServer *server) {
+}
+
+// Jobs are only created while there are workers.
+UniJob *uni_job_new(UniConnection *conn, UniJobKind kind) {
+    return NULL;
+}
+
+void uni_job_submit(UniJob *job) {
+    UNI_UNREACHABLE();
+}
+
+unsigned uni_executor_complete(UniServer *server) {
+    return 0;
+}
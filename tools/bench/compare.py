@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+# Compares two result files written by `uni_bench -o`.
+#
+#     uni_bench -l before -o before.json
+#     (switch commits and rebuild)
+#     uni_bench -l after -o after.json
+#     tools/bench/compare.py before.json after.json
+
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    return data, {b["name"]: b for b in data["benchmarks"]}
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(f"Usage: {sys.argv[0]} <before.json> <after.json>", file=sys.stderr)
+        return 1
+
+    before_data, before = load(sys.argv[1])
+    after_data, after = load(sys.argv[2])
+
+    print(f"{'benchmark':<28} {'before ns/op':>13} {'after ns/op':>13} {'change':>9} {'allocs/op':>15}")
+    for name, new in after.items():
+        old = before.get(name)
+        if old is None:
+            print(f"{name:<28} {'-':>13} {new['ns_per_op']:>13.2f}")
+            continue
+
+        change = (new["ns_per_op"] - old["ns_per_op"]) / old["ns_per_op"] * 100
+        allocs = f"{old['allocs_per_op']:.2f} -> {new['allocs_per_op']:.2f}"
+        print(f"{name:<28} {old['ns_per_op']:>13.2f} {new['ns_per_op']:>13.2f} {change:>+8.1f}% {allocs:>15}")
+
+    if before_data.get("build_type") != after_data.get("build_type"):
+        print("\nWarning: the results come from different build types.", file=sys.stderr)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
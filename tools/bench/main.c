@@ -0,0 +1,1238 @@
+// Microbenchmarks for uni's packet codec and packet builders, and for whole
+// logins and PLAY packets handled through loopback connections. The tcp/
+// benchmarks run the same logins and PLAY packets over real sockets against
+// each I/O backend, for comparing the backends with each other.
+//
+// Each benchmark runs for a warmup period, then for a number of timed
+// repetitions of a fixed iteration count. Results are printed as a table and,
+// with -o, written as JSON so runs on different commits can be compared with
+// tools/bench/compare.py.
+
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "hmac_sha256.h"
+#include "uni.h"
+#include "uni_loopback.h"
+#include "uni_nbt.h"
+#include "uni_play.h"
+#include "uni_server.h"
+#include "uni_time.h"
+#include "protocol/uni_packet.h"
+
+#ifndef UNI_BENCH_BUILD_TYPE
+#define UNI_BENCH_BUILD_TYPE ""
+#endif // !UNI_BENCH_BUILD_TYPE
+
+#define MAX_REPETITIONS 100
+
+// Number of values in the pre-generated inputs. Benchmarks cycle through them.
+#define INPUT_COUNT 4096
+
+// Size of the registry codec sent in Join Game. The 1.19 vanilla codec
+// (dimension types, biomes and chat types) is about this large.
+#define REGISTRY_CODEC_SIZE 32768
+
+// Connections kept in PLAY by the loopback/play_packet benchmark.
+#define LOOPBACK_PLAY_CLIENTS 1000
+
+// Sections of an overworld chunk, from y = -64 to 320.
+#define CHUNK_SECTIONS 24
+
+// Entities moved per tick by the entity_moves benchmarks, and how many of them
+// each viewer sees.
+#define MOVE_ENTITIES 512
+#define MOVE_VISIBLE 256
+
+// Biomes in the registry written by the nbt_codec benchmark.
+#define NBT_BIOMES 64
+
+// Connections kept in PLAY by the tcp/*/play_* benchmarks. play_burst sends
+// one packet from each of them before polling.
+#define TCP_PLAY_CLIENTS 64
+
+#define BENCH_SECRET "your-forwarding-secret"
+
+// Keeps the compiler from optimizing away a value or memory writes.
+#define BENCH_KEEP(val) __asm__ volatile("" : : "g"(val) : "memory")
+
+static uint64_t allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocs++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+// The connection of the player which joined last.
+static UniConnection *joined_conn;
+static uint64_t joins;
+static uint64_t packets_received;
+
+void *uni_on_login(void *server, UniConnection *conn, UniLoginData *data) {
+    return conn;
+}
+
+void uni_on_join(void *server, void *player) {
+    joined_conn = player;
+    joins++;
+}
+
+bool uni_on_packet_received(void *server, void *player, int packet_id, void *pkt_struct) {
+    packets_received++;
+    return true;
+}
+
+void uni_on_write_finish(void *user_ptr) {
+}
+
+// A server for the tcp/ benchmarks of one backend.
+typedef struct {
+    UniServer *server;
+    uint16_t port;
+    int play_clients[TCP_PLAY_CLIENTS];
+    bool has_play_clients;
+} TcpServer;
+
+typedef struct {
+    // Values for the varint benchmarks.
+    int varints[INPUT_COUNT];
+
+    // Varints/strings back to back, as they would appear in a packet.
+    unsigned char varint_buf[INPUT_COUNT * 5];
+    int varint_buf_len;
+    unsigned char str_buf[INPUT_COUNT * 17];
+    int str_buf_len;
+
+    const char *names[INPUT_COUNT];
+    int name_lens[INPUT_COUNT];
+
+    int packet_sizes[INPUT_COUNT];
+
+    unsigned char *registry_codec;
+
+    UniServer server;
+    unsigned char forwarding_small[64];
+    unsigned char *forwarding_large;
+    int forwarding_large_len;
+    unsigned char signature[32];
+
+    char out[REGISTRY_CODEC_SIZE + 1024];
+
+    // An overworld chunk. See init_chunk().
+    uint16_t chunk_blocks[CHUNK_SECTIONS][4096];
+    uint16_t chunk_biomes[CHUNK_SECTIONS][64];
+    UniChunkSection chunk_sections[CHUNK_SECTIONS];
+    uint16_t heightmap[256];
+    unsigned char full_light[2048];
+    const unsigned char *sky_light[CHUNK_SECTIONS + 2];
+    UniChunk chunk;
+
+    // Entities walking around. See init_moves().
+    int move_ids[MOVE_ENTITIES];
+    double move_prev[3][MOVE_ENTITIES];
+    double move_pos[3][MOVE_ENTITIES];
+    float move_prev_rot[2][MOVE_ENTITIES];
+    float move_rot[2][MOVE_ENTITIES];
+    bool move_on_ground[MOVE_ENTITIES];
+    UniEntityMoves moves;
+    UniMoveBatch move_batch;
+    int move_visible[MOVE_VISIBLE];
+
+    // Server for the loopback benchmarks, and what its clients send.
+    UniServer *loopback_server;
+    unsigned char login_start[128];
+    int login_start_len;
+    unsigned char forwarding[128];
+    int forwarding_len;
+    unsigned char forwarding_hmac[32];
+    unsigned char plugin_msg[64];
+    int plugin_msg_len;
+    UniLoopback *play_clients[LOOPBACK_PLAY_CLIENTS];
+    UniConnection *play_conns[LOOPBACK_PLAY_CLIENTS];
+
+    TcpServer tcp_uring;
+    TcpServer tcp_epoll;
+} Inputs;
+
+static Inputs in;
+
+typedef struct {
+    const char *name;
+
+    // Runs the benchmarked code 'iters' times.
+    void (*run)(uint64_t iters);
+
+    // Bytes processed per iteration, for bytes/sec. 0 if not meaningful.
+    double (*bytes_per_op)(void);
+} Benchmark;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15;
+
+static uint64_t rng(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1D;
+}
+
+// Picks a varint value with the size distribution of real traffic: mostly
+// packet IDs, lengths and small counts which fit one byte, some two byte
+// lengths, and the occasional large value. uni_write_varint() only encodes
+// non-negative values, so there are none of the five byte negative ones.
+static int realistic_varint(void) {
+    unsigned roll = rng() % 100;
+    if (roll < 70) {
+        return (int) (rng() % 128);
+    } else if (roll < 92) {
+        return 128 + (int) (rng() % (16384 - 128));
+    } else if (roll < 98) {
+        return 16384 + (int) (rng() % (2097152 - 16384));
+    } else if (roll < 99) {
+        return 2097152 + (int) (rng() % (268435456 - 2097152));
+    } else {
+        return 268435456 + (int) (rng() % (2147483647u - 268435456));
+    }
+}
+
+// Fills a section with runs of blocks along x. The first block in 'palette' is
+// the most common one by far, like stone underground.
+static void fill_section(uint16_t *blocks, const uint16_t *palette, int palette_len) {
+    for (int i = 0; i < 4096;) {
+        uint16_t block = rng() % 4 == 0 ? palette[rng() % palette_len] : palette[0];
+        for (int run = 1 + (int) (rng() % 16); run > 0 && i < 4096; run--) {
+            blocks[i++] = block;
+        }
+    }
+}
+
+// Builds a chunk like a generated overworld chunk: deepslate and stone with
+// ores and caves, a surface section with many different blocks, trees above
+// it, and air up to the build limit. Only the air sections are lit by the sky.
+static void init_chunk(void) {
+    static const uint16_t deepslate[] = {22, 0, 23, 24, 25, 26, 27, 28};
+    static const uint16_t stone[] = {1, 0, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+    static const uint16_t surface[] = {
+        10, 0, 9, 1, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 88, 89, 90, 120, 121, 122,
+        123, 124, 125, 126, 127, 128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139,
+    };
+    static const uint16_t trees[] = {0, 120, 140, 141, 142, 143};
+
+    for (int s = 0; s < CHUNK_SECTIONS; s++) {
+        uint16_t *blocks = in.chunk_blocks[s];
+        if (s < 4) {
+            fill_section(blocks, deepslate, sizeof(deepslate) / sizeof(deepslate[0]));
+        } else if (s < 8) {
+            fill_section(blocks, stone, sizeof(stone) / sizeof(stone[0]));
+        } else if (s == 8) {
+            fill_section(blocks, surface, sizeof(surface) / sizeof(surface[0]));
+        } else if (s == 9) {
+            fill_section(blocks, trees, sizeof(trees) / sizeof(trees[0]));
+        } else {
+            memset(blocks, 0, sizeof(in.chunk_blocks[s]));
+        }
+
+        int block_count = 0;
+        for (int i = 0; i < 4096; i++) {
+            block_count += blocks[i] != 0;
+        }
+
+        for (int i = 0; i < 64; i++) {
+            in.chunk_biomes[s][i] = s < 8 ? (uint16_t) (rng() % 2) : 1;
+        }
+
+        in.chunk_sections[s] = (UniChunkSection) {blocks, in.chunk_biomes[s], block_count};
+    }
+
+    for (int i = 0; i < 256; i++) {
+        in.heightmap[i] = (uint16_t) (10 * 16 - (int) (rng() % 12));
+    }
+
+    memset(in.full_light, 0xFF, sizeof(in.full_light));
+    for (int s = 0; s < CHUNK_SECTIONS + 2; s++) {
+        in.sky_light[s] = s > 10 ? in.full_light : NULL;
+    }
+
+    in.chunk = (UniChunk) {
+        .x = 3,
+        .z = -7,
+        .sections = in.chunk_sections,
+        .num_sections = CHUNK_SECTIONS,
+        .biome_bits = 6,
+        .motion_blocking = in.heightmap,
+        .sky_light = in.sky_light,
+        .block_light = NULL,
+        .trust_edges = true,
+    };
+}
+
+// Most entities walk a short step and some of them turn, a few stand still and
+// one in 64 was moved far enough to need a teleport.
+static void init_moves(void) {
+    for (int i = 0; i < MOVE_ENTITIES; i++) {
+        in.move_ids[i] = 1000 + i * 7;
+        in.move_on_ground[i] = rng() % 4 != 0;
+
+        for (int axis = 0; axis < 3; axis++) {
+            double pos = (double) (rng() % 20000) / 8.0 - 1250.0;
+            double step = rng() % 8 == 0 ? 0.0 : (double) (rng() % 1000) / 2000.0 - 0.25;
+            if (i % 64 == 0) {
+                step = 40.0;
+            }
+            in.move_prev[axis][i] = pos;
+            in.move_pos[axis][i] = pos + step;
+        }
+
+        for (int axis = 0; axis < 2; axis++) {
+            float rot = (float) (rng() % 360);
+            in.move_prev_rot[axis][i] = rot;
+            in.move_rot[axis][i] = rng() % 2 == 0 ? rot : rot + 5.0f;
+        }
+    }
+
+    for (int i = 0; i < MOVE_VISIBLE; i++) {
+        in.move_visible[i] = (int) (rng() % MOVE_ENTITIES);
+    }
+
+    in.moves = (UniEntityMoves) {
+        .count = MOVE_ENTITIES,
+        .ids = in.move_ids,
+        .prev_x = in.move_prev[0],
+        .prev_y = in.move_prev[1],
+        .prev_z = in.move_prev[2],
+        .x = in.move_pos[0],
+        .y = in.move_pos[1],
+        .z = in.move_pos[2],
+        .prev_yaw = in.move_prev_rot[0],
+        .prev_pitch = in.move_prev_rot[1],
+        .yaw = in.move_rot[0],
+        .pitch = in.move_rot[1],
+        .on_ground = in.move_on_ground,
+    };
+    uni_encode_moves(&in.move_batch, &in.moves);
+}
+
+static void init_inputs(void) {
+    static const char *sample_names[] = {
+        "Notch", "jeb_", "Dinnerbone", "Grumm", "xX_Sniper_Xx", "a", "Steve", "Alex",
+        "minecraft:brand", "velocity:player_info", "uni:loadgen", "bungeecord:main",
+    };
+    const int num_sample_names = sizeof(sample_names) / sizeof(sample_names[0]);
+
+    char *cursor = (char *) in.varint_buf;
+    for (int i = 0; i < INPUT_COUNT; i++) {
+        in.varints[i] = realistic_varint();
+        cursor = uni_write_varint(cursor, in.varints[i]);
+    }
+    in.varint_buf_len = (int) (cursor - (char *) in.varint_buf);
+
+    cursor = (char *) in.str_buf;
+    for (int i = 0; i < INPUT_COUNT; i++) {
+        in.names[i] = sample_names[rng() % num_sample_names];
+        in.name_lens[i] = (int) strlen(in.names[i]);
+        cursor = uni_write_str(cursor, in.names[i], in.name_lens[i]);
+    }
+    in.str_buf_len = (int) (cursor - (char *) in.str_buf);
+
+    // Outbound packets are mostly small, with a long tail of chunk and
+    // inventory sized ones.
+    for (int i = 0; i < INPUT_COUNT; i++) {
+        unsigned roll = rng() % 100;
+        if (roll < 80) {
+            in.packet_sizes[i] = 8 + (int) (rng() % 56);
+        } else if (roll < 97) {
+            in.packet_sizes[i] = 64 + (int) (rng() % 1024);
+        } else {
+            in.packet_sizes[i] = 4096 + (int) (rng() % 60000);
+        }
+    }
+
+    in.registry_codec = malloc(REGISTRY_CODEC_SIZE);
+    for (int i = 0; i < REGISTRY_CODEC_SIZE; i++) {
+        in.registry_codec[i] = (unsigned char) rng();
+    }
+
+    static char secret[] = BENCH_SECRET;
+    in.server.secret = secret;
+    in.server.secret_len = sizeof(secret) - 1;
+
+    // Forwarding data without properties, and with a signed textures property
+    // as sent for online-mode players.
+    for (int i = 0; i < (int) sizeof(in.forwarding_small); i++) {
+        in.forwarding_small[i] = (unsigned char) rng();
+    }
+
+    in.forwarding_large_len = 64 + 8 + 400 + 684;
+    in.forwarding_large = malloc(in.forwarding_large_len);
+    for (int i = 0; i < in.forwarding_large_len; i++) {
+        in.forwarding_large[i] = (unsigned char) rng();
+    }
+
+    // Handshake and Login Start, sent back to back like a proxy would.
+    char body[64];
+    char *body_end = uni_write_varint(body, 0x00);
+    body_end = uni_write_varint(body_end, 759);
+    body_end = uni_write_str(body_end, "localhost", 9);
+    *body_end++ = (char) (25565 >> 8);
+    *body_end++ = (char) (25565 & 0xFF);
+    body_end = uni_write_varint(body_end, 2);
+    cursor = uni_write_varint((char *) in.login_start, (int) (body_end - body));
+    cursor = uni_write_bytes(cursor, (unsigned char *) body, (int) (body_end - body));
+
+    body_end = uni_write_varint(body, 0x00);
+    body_end = uni_write_str(body_end, "Notch", 5);
+    *body_end++ = 0;
+    cursor = uni_write_varint(cursor, (int) (body_end - body));
+    cursor = uni_write_bytes(cursor, (unsigned char *) body, (int) (body_end - body));
+    in.login_start_len = (int) (cursor - (char *) in.login_start);
+
+    static const unsigned char uuid[16] = {0x06, 0x9a, 0x79, 0xf4, 0x44, 0xe9, 0x4e, 0x26};
+    cursor = uni_write_varint((char *) in.forwarding, 1);
+    cursor = uni_write_str(cursor, "127.0.0.1", 9);
+    cursor = uni_write_bytes(cursor, uuid, sizeof(uuid));
+    cursor = uni_write_str(cursor, "Notch", 5);
+    cursor = uni_write_varint(cursor, 0);
+    in.forwarding_len = (int) (cursor - (char *) in.forwarding);
+    hmac_sha256(BENCH_SECRET, sizeof(BENCH_SECRET) - 1, in.forwarding, in.forwarding_len, in.forwarding_hmac, 32);
+
+    // A typical small plugin message.
+    body_end = uni_write_varint(body, UNI_PIN_PLUGIN_MSG);
+    body_end = uni_write_str(body_end, "minecraft:brand", 15);
+    body_end = uni_write_str(body_end, "vanilla", 7);
+    cursor = uni_write_varint((char *) in.plugin_msg, (int) (body_end - body));
+    cursor = uni_write_bytes(cursor, (unsigned char *) body, (int) (body_end - body));
+    in.plugin_msg_len = (int) (cursor - (char *) in.plugin_msg);
+
+    init_chunk();
+    init_moves();
+}
+
+static UniConnection reader_for(unsigned char *buf, int len) {
+    UniConnection conn;
+    memset(&conn, 0, sizeof(conn));
+    conn.packet_buf = buf;
+    conn.packet_len = len;
+    conn.read_idx = 0;
+    return conn;
+}
+
+static void run_read_varint(uint64_t iters) {
+    UniConnection conn = reader_for(in.varint_buf, in.varint_buf_len);
+    for (uint64_t i = 0; i < iters; i++) {
+        if (conn.read_idx == conn.packet_len) {
+            conn.read_idx = 0;
+        }
+
+        int val;
+        uni_read_varint(&conn, &val);
+        BENCH_KEEP(val);
+    }
+}
+
+static double bytes_read_varint(void) {
+    return (double) in.varint_buf_len / INPUT_COUNT;
+}
+
+static void run_read_str(uint64_t iters) {
+    UniConnection conn = reader_for(in.str_buf, in.str_buf_len);
+    for (uint64_t i = 0; i < iters; i++) {
+        if (conn.read_idx == conn.packet_len) {
+            conn.read_idx = 0;
+        }
+
+        int len;
+        char *str = uni_read_str(&conn, 32, &len);
+        BENCH_KEEP(str);
+    }
+}
+
+static double bytes_read_str(void) {
+    return (double) in.str_buf_len / INPUT_COUNT;
+}
+
+static void run_write_varint(uint64_t iters) {
+    char *cursor = in.out;
+    for (uint64_t i = 0; i < iters; i++) {
+        if (cursor - in.out > (long) sizeof(in.out) - 5) {
+            cursor = in.out;
+        }
+        cursor = uni_write_varint(cursor, in.varints[i % INPUT_COUNT]);
+        BENCH_KEEP(cursor);
+    }
+}
+
+static void run_write_str(uint64_t iters) {
+    char *cursor = in.out;
+    for (uint64_t i = 0; i < iters; i++) {
+        if (cursor - in.out > (long) sizeof(in.out) - 32) {
+            cursor = in.out;
+        }
+        int n = i % INPUT_COUNT;
+        cursor = uni_write_str(cursor, in.names[n], in.name_lens[n]);
+        BENCH_KEEP(cursor);
+    }
+}
+
+static void run_write_int(uint64_t iters) {
+    char *cursor = in.out;
+    for (uint64_t i = 0; i < iters; i++) {
+        if (cursor - in.out > (long) sizeof(in.out) - 4) {
+            cursor = in.out;
+        }
+        cursor = uni_write_int(cursor, in.varints[i % INPUT_COUNT]);
+        BENCH_KEEP(cursor);
+    }
+}
+
+static double bytes_write_int(void) {
+    return sizeof(int32_t);
+}
+
+static void run_write_long(uint64_t iters) {
+    char *cursor = in.out;
+    for (uint64_t i = 0; i < iters; i++) {
+        if (cursor - in.out > (long) sizeof(in.out) - 8) {
+            cursor = in.out;
+        }
+        cursor = uni_write_long(cursor, (int64_t) in.varints[i % INPUT_COUNT] * 0x10001);
+        BENCH_KEEP(cursor);
+    }
+}
+
+static double bytes_write_long(void) {
+    return sizeof(int64_t);
+}
+
+static void run_alloc_packet(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        UniPacketOut pkt = uni_alloc_packet(in.packet_sizes[i % INPUT_COUNT]);
+        BENCH_KEEP(pkt.buf);
+        free(pkt.buf);
+    }
+}
+
+static double bytes_alloc_packet(void) {
+    double total = 0;
+    for (int i = 0; i < INPUT_COUNT; i++) {
+        total += in.packet_sizes[i];
+    }
+    return total / INPUT_COUNT;
+}
+
+static const char *dim_names[] = {"minecraft:overworld", "minecraft:the_nether", "minecraft:the_end"};
+static int dim_name_lens[] = {19, 20, 17};
+
+static UniPacketOut join_game(void) {
+    return uni_pkt_join_game(
+        1, false, 0, -1,
+        3, dim_name_lens, dim_names,
+        in.registry_codec, REGISTRY_CODEC_SIZE,
+        "minecraft:overworld", 19,
+        "minecraft:overworld", 19,
+        0x1234567890ABCDEF,
+        100, 10, 10,
+        false, true, false, false,
+        false, NULL, 0, 0
+    );
+}
+
+static void run_join_game(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        UniPacketOut pkt = join_game();
+        BENCH_KEEP(pkt.buf);
+        free(pkt.buf);
+    }
+}
+
+static double bytes_join_game(void) {
+    UniPacketOut pkt = join_game();
+    free(pkt.buf);
+    return pkt.len;
+}
+
+static void run_chunk(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        UniPacketOut pkt = uni_pkt_chunk(&in.chunk);
+        BENCH_KEEP(pkt.buf);
+        free(pkt.buf);
+    }
+}
+
+static double bytes_chunk(void) {
+    UniPacketOut pkt = uni_pkt_chunk(&in.chunk);
+    free(pkt.buf);
+    return pkt.len;
+}
+
+static void run_encode_moves(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        bool ok = uni_encode_moves(&in.move_batch, &in.moves);
+        BENCH_KEEP(ok);
+    }
+}
+
+static double bytes_encode_moves(void) {
+    int total = 0;
+    for (int i = 0; i < MOVE_ENTITIES; i++) {
+        total += in.move_batch.lens[i];
+    }
+    return total;
+}
+
+static void run_viewer_moves(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        UniPacketOut pkt = uni_pkt_entity_moves(&in.move_batch, in.move_visible, MOVE_VISIBLE);
+        BENCH_KEEP(pkt.buf);
+        free(pkt.buf);
+    }
+}
+
+static double bytes_viewer_moves(void) {
+    UniPacketOut pkt = uni_pkt_entity_moves(&in.move_batch, in.move_visible, MOVE_VISIBLE);
+    free(pkt.buf);
+    return pkt.len;
+}
+
+// Writes a biome registry shaped like the vanilla one, with a long array for
+// the array fast path.
+static void write_codec(UniNbt *nbt) {
+    static char name[] = "minecraft:biome_00";
+    static int64_t particles[16];
+
+    uni_nbt_compound(nbt, "", 0);
+    uni_nbt_compound(nbt, "minecraft:worldgen/biome", 24);
+    uni_nbt_string(nbt, "type", 4, "minecraft:worldgen/biome", 24);
+    uni_nbt_list(nbt, "value", 5, UNI_NBT_COMPOUND, NBT_BIOMES);
+    for (int i = 0; i < NBT_BIOMES; i++) {
+        name[16] = (char) ('0' + i / 10);
+        name[17] = (char) ('0' + i % 10);
+
+        uni_nbt_compound(nbt, NULL, 0);
+        uni_nbt_string(nbt, "name", 4, name, sizeof(name) - 1);
+        uni_nbt_int(nbt, "id", 2, i);
+        uni_nbt_compound(nbt, "element", 7);
+        uni_nbt_string(nbt, "precipitation", 13, "rain", 4);
+        uni_nbt_float(nbt, "temperature", 11, 0.8f);
+        uni_nbt_float(nbt, "downfall", 8, 0.4f);
+        uni_nbt_compound(nbt, "effects", 7);
+        uni_nbt_int(nbt, "sky_color", 9, 7907327);
+        uni_nbt_int(nbt, "water_fog_color", 15, 329011);
+        uni_nbt_int(nbt, "fog_color", 9, 12638463);
+        uni_nbt_int(nbt, "water_color", 11, 4159204);
+        uni_nbt_long_array(nbt, "particles", 9, particles, 16);
+        uni_nbt_end(nbt);
+        uni_nbt_end(nbt);
+        uni_nbt_end(nbt);
+    }
+    uni_nbt_end(nbt);
+    uni_nbt_end(nbt);
+}
+
+static void run_nbt_codec(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        UniNbt nbt;
+        uni_nbt_init(&nbt, NULL);
+        write_codec(&nbt);
+        uni_nbt_init(&nbt, (char *) in.registry_codec);
+        write_codec(&nbt);
+        BENCH_KEEP(nbt.len);
+    }
+}
+
+static double bytes_nbt_codec(void) {
+    UniNbt nbt;
+    uni_nbt_init(&nbt, NULL);
+    write_codec(&nbt);
+    return nbt.len;
+}
+
+static void run_verify_hmac_small(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        bool ok = uni_verify_hmac(&in.server, in.forwarding_small, sizeof(in.forwarding_small), in.signature);
+        BENCH_KEEP(ok);
+    }
+}
+
+static double bytes_verify_hmac_small(void) {
+    return sizeof(in.forwarding_small);
+}
+
+static void run_verify_hmac_large(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        bool ok = uni_verify_hmac(&in.server, in.forwarding_large, in.forwarding_large_len, in.signature);
+        BENCH_KEEP(ok);
+    }
+}
+
+static double bytes_verify_hmac_large(void) {
+    return in.forwarding_large_len;
+}
+
+// Builds the answer to the plugin request in 'req' into 'frame', which must
+// hold 260 bytes. Returns the answer's length, or -1 if 'req' isn't a complete
+// plugin request.
+static int build_plugin_res(unsigned char *req, int req_len, char *frame) {
+    UniConnection reader = reader_for(req, req_len);
+    int frame_len, id, message_id;
+    if (
+        !uni_read_varint(&reader, &frame_len) ||
+        !uni_read_varint(&reader, &id) ||
+        !uni_read_varint(&reader, &message_id)
+    ) {
+        return -1;
+    }
+
+    char body[256];
+    char *body_end = uni_write_varint(body, 0x02);
+    body_end = uni_write_varint(body_end, message_id);
+    *body_end++ = 1;
+    body_end = uni_write_bytes(body_end, in.forwarding_hmac, 32);
+    body_end = uni_write_bytes(body_end, in.forwarding, in.forwarding_len);
+
+    char *cursor = uni_write_varint(frame, (int) (body_end - body));
+    cursor = uni_write_bytes(cursor, (unsigned char *) body, (int) (body_end - body));
+    return (int) (cursor - frame);
+}
+
+// Answers the plugin request the server sent to a loopback client.
+static bool loopback_send_plugin_res(UniLoopback *client) {
+    unsigned char buf[256];
+    int len = uni_loopback_recv(client, buf, sizeof(buf));
+
+    char frame[260];
+    int frame_len = build_plugin_res(buf, len, frame);
+    return frame_len != -1 && uni_loopback_send(client, frame, frame_len);
+}
+
+// Logs a loopback client in. Returns the client, or NULL if the login failed.
+static UniLoopback *loopback_login(void) {
+    UniServer *server = in.loopback_server;
+
+    UniLoopback *client = uni_loopback_connect(server);
+    uni_loopback_send(client, in.login_start, in.login_start_len);
+    uni_loopback_run(server, 0);
+
+    if (!loopback_send_plugin_res(client)) {
+        uni_loopback_close(client);
+        return NULL;
+    }
+    uni_loopback_run(server, 0);
+
+    // Login Success
+    unsigned char buf[256];
+    uni_loopback_recv(client, buf, sizeof(buf));
+    if (uni_loopback_closed(client)) {
+        uni_loopback_close(client);
+        return NULL;
+    }
+
+    return client;
+}
+
+static void run_loopback_login(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        UniLoopback *client = loopback_login();
+        if (client == NULL) {
+            fprintf(stderr, "loopback login failed\n");
+            exit(1);
+        }
+
+        uni_release(joined_conn);
+        uni_loopback_close(client);
+        uni_loopback_run(in.loopback_server, 0);
+    }
+}
+
+// Logs in the clients kept in PLAY, unless that already happened.
+static void loopback_play_clients(void) {
+    if (in.play_clients[0] == NULL) {
+        for (int i = 0; i < LOOPBACK_PLAY_CLIENTS; i++) {
+            in.play_clients[i] = loopback_login();
+            in.play_conns[i] = joined_conn;
+        }
+    }
+}
+
+static void run_loopback_play_packet(uint64_t iters) {
+    loopback_play_clients();
+
+    for (uint64_t i = 0; i < iters; i++) {
+        uni_loopback_send(in.play_clients[i % LOOPBACK_PLAY_CLIENTS], in.plugin_msg, in.plugin_msg_len);
+        uni_loopback_run(in.loopback_server, 0);
+    }
+}
+
+static double bytes_loopback_play_packet(void) {
+    return in.plugin_msg_len;
+}
+
+// Spreads the players over 256x256 chunks with a view distance of 10, so each
+// chunk is seen by about 7 of them, and broadcasts a small packet (about the
+// size of a block change) to random chunks.
+static void run_loopback_broadcast(uint64_t iters) {
+    loopback_play_clients();
+
+    static bool views_set = false;
+    if (!views_set) {
+        for (int i = 0; i < LOOPBACK_PLAY_CLIENTS; i++) {
+            uni_set_view(in.play_conns[i], (int) (rng() % 256) - 128, (int) (rng() % 256) - 128, 10);
+        }
+        views_set = true;
+    }
+
+    for (uint64_t i = 0; i < iters; i++) {
+        UniPacketOut pkt = {malloc(16), 16, 0};
+        memset(pkt.buf, 0, 16);
+        pkt.buf[0] = 15;
+        uni_broadcast_area(in.loopback_server, (int) (rng() % 256) - 128, (int) (rng() % 256) - 128, &pkt);
+        uni_loopback_run(in.loopback_server, 0);
+
+        // Discards what the clients received every now and then, so their
+        // buffers don't grow without bound.
+        if (i % 1024 == 1023) {
+            char buf[4096];
+            for (int c = 0; c < LOOPBACK_PLAY_CLIENTS; c++) {
+                while (uni_loopback_recv(in.play_clients[c], buf, sizeof(buf)) > 0) {}
+            }
+        }
+    }
+}
+
+// How long the tcp/ benchmarks wait for the server before giving up.
+#define TCP_TIMEOUT_NS 5000000000ull
+
+// Polls the server until '*counter' reaches 'target'.
+static void tcp_poll_until(UniServer *server, uint64_t *counter, uint64_t target) {
+    uint64_t give_up = uni_time_ns() + TCP_TIMEOUT_NS;
+    while (*counter < target) {
+        uint64_t now = uni_time_ns();
+        if (now > give_up) {
+            fprintf(stderr, "tcp benchmark: server stopped responding\n");
+            exit(1);
+        }
+
+        uni_poll_timeout(server, now + 1000000, 0);
+    }
+}
+
+// Logs a client in over a real socket. Returns the client's socket, or -1 if
+// the login failed.
+static int tcp_login(TcpServer *tcp) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // The client's writes are small and must not wait for the server's ACKs.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tcp->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (
+        connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        send(fd, in.login_start, in.login_start_len, 0) != in.login_start_len
+    ) {
+        close(fd);
+        return -1;
+    }
+
+    // Wait for the plugin request.
+    unsigned char buf[256];
+    int len = 0;
+    char frame[260];
+    int frame_len;
+    uint64_t give_up = uni_time_ns() + TCP_TIMEOUT_NS;
+    while ((frame_len = build_plugin_res(buf, len, frame)) == -1) {
+        uint64_t now = uni_time_ns();
+        uni_poll_timeout(tcp->server, now + 1000000, 0);
+
+        ssize_t res = recv(fd, &buf[len], sizeof(buf) - len, MSG_DONTWAIT);
+        if (res > 0) {
+            len += (int) res;
+        } else if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || now > give_up) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (send(fd, frame, frame_len, 0) != frame_len) {
+        close(fd);
+        return -1;
+    }
+
+    tcp_poll_until(tcp->server, &joins, joins + 1);
+    return fd;
+}
+
+static void run_tcp_login(TcpServer *tcp, uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        int fd = tcp_login(tcp);
+        if (fd == -1) {
+            fprintf(stderr, "tcp login failed\n");
+            exit(1);
+        }
+
+        uni_release(joined_conn);
+        close(fd);
+    }
+}
+
+static void tcp_ensure_play_clients(TcpServer *tcp) {
+    if (tcp->has_play_clients) {
+        return;
+    }
+
+    for (int i = 0; i < TCP_PLAY_CLIENTS; i++) {
+        tcp->play_clients[i] = tcp_login(tcp);
+        if (tcp->play_clients[i] == -1) {
+            fprintf(stderr, "tcp login failed\n");
+            exit(1);
+        }
+    }
+    tcp->has_play_clients = true;
+}
+
+// Sends PLAY packets one at a time, waiting for each to be handled.
+static void run_tcp_play_packet(TcpServer *tcp, uint64_t iters) {
+    tcp_ensure_play_clients(tcp);
+
+    for (uint64_t i = 0; i < iters; i++) {
+        send(tcp->play_clients[i % TCP_PLAY_CLIENTS], in.plugin_msg, in.plugin_msg_len, 0);
+        tcp_poll_until(tcp->server, &packets_received, packets_received + 1);
+    }
+}
+
+// Sends a PLAY packet from every client, then waits for all of them to be
+// handled. Timed per packet.
+static void run_tcp_play_burst(TcpServer *tcp, uint64_t iters) {
+    tcp_ensure_play_clients(tcp);
+
+    for (uint64_t i = 0; i < iters; i += TCP_PLAY_CLIENTS) {
+        uint64_t count = iters - i < TCP_PLAY_CLIENTS ? iters - i : TCP_PLAY_CLIENTS;
+        for (uint64_t j = 0; j < count; j++) {
+            send(tcp->play_clients[j], in.plugin_msg, in.plugin_msg_len, 0);
+        }
+        tcp_poll_until(tcp->server, &packets_received, packets_received + count);
+    }
+}
+
+static void run_tcp_uring_login(uint64_t iters) {
+    run_tcp_login(&in.tcp_uring, iters);
+}
+
+static void run_tcp_uring_play_packet(uint64_t iters) {
+    run_tcp_play_packet(&in.tcp_uring, iters);
+}
+
+static void run_tcp_uring_play_burst(uint64_t iters) {
+    run_tcp_play_burst(&in.tcp_uring, iters);
+}
+
+static void run_tcp_epoll_login(uint64_t iters) {
+    run_tcp_login(&in.tcp_epoll, iters);
+}
+
+static void run_tcp_epoll_play_packet(uint64_t iters) {
+    run_tcp_play_packet(&in.tcp_epoll, iters);
+}
+
+static void run_tcp_epoll_play_burst(uint64_t iters) {
+    run_tcp_play_burst(&in.tcp_epoll, iters);
+}
+
+static const Benchmark benchmarks[] = {
+    {"read_varint", run_read_varint, bytes_read_varint},
+    {"read_str", run_read_str, bytes_read_str},
+    {"write_varint", run_write_varint, bytes_read_varint},
+    {"write_str", run_write_str, bytes_read_str},
+    {"write_int", run_write_int, bytes_write_int},
+    {"write_long", run_write_long, bytes_write_long},
+    {"alloc_packet", run_alloc_packet, bytes_alloc_packet},
+    {"pkt_join_game", run_join_game, bytes_join_game},
+    {"pkt_chunk", run_chunk, bytes_chunk},
+    {"nbt_codec", run_nbt_codec, bytes_nbt_codec},
+    {"entity_moves/encode", run_encode_moves, bytes_encode_moves},
+    {"entity_moves/viewer", run_viewer_moves, bytes_viewer_moves},
+    {"verify_hmac/no_properties", run_verify_hmac_small, bytes_verify_hmac_small},
+    {"verify_hmac/textures", run_verify_hmac_large, bytes_verify_hmac_large},
+    {"loopback/login", run_loopback_login, NULL},
+    {"loopback/play_packet", run_loopback_play_packet, bytes_loopback_play_packet},
+    {"loopback/broadcast_area", run_loopback_broadcast, NULL},
+    {"tcp/uring/login", run_tcp_uring_login, NULL},
+    {"tcp/uring/play_packet", run_tcp_uring_play_packet, bytes_loopback_play_packet},
+    {"tcp/uring/play_burst", run_tcp_uring_play_burst, bytes_loopback_play_packet},
+    {"tcp/epoll/login", run_tcp_epoll_login, NULL},
+    {"tcp/epoll/play_packet", run_tcp_epoll_play_packet, bytes_loopback_play_packet},
+    {"tcp/epoll/play_burst", run_tcp_epoll_play_burst, bytes_loopback_play_packet},
+};
+
+#define NUM_BENCHMARKS ((int) (sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+typedef struct {
+    uint64_t iters;
+    int repetitions;
+    double ns_per_op[MAX_REPETITIONS];
+    double median_ns;
+    double min_ns;
+    double bytes_per_sec;
+    double allocs_per_op;
+} Result;
+
+// Starts a listening server on the given backend and an ephemeral port for the
+// tcp/ benchmarks. Returns false if the backend isn't available.
+static bool start_tcp_server(TcpServer *tcp, UniBackend backend) {
+    UniConfig config;
+    uni_default_config(&config);
+    config.backend = backend;
+    config.latency_histograms = false;
+
+    tcp->server = uni_create_with_config(0, BENCH_SECRET, NULL, &config, NULL);
+    if (tcp->server == NULL || !uni_listen(tcp->server)) {
+        return false;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(tcp->server->fd, (struct sockaddr *) &addr, &addr_len) == -1) {
+        return false;
+    }
+
+    tcp->port = ntohs(addr.sin_port);
+    return true;
+}
+
+static bool any_selected(const bool *selected, const char *prefix) {
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        if (selected[i] && strncmp(benchmarks[i].name, prefix, strlen(prefix)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void deselect(bool *selected, const char *prefix) {
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        if (strncmp(benchmarks[i].name, prefix, strlen(prefix)) == 0) {
+            selected[i] = false;
+        }
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Runs the benchmark for 'warmup_ns', using the time taken to pick an
+// iteration count so each repetition lasts about 'rep_ns'.
+static void run_benchmark(const Benchmark *bench, uint64_t warmup_ns, uint64_t rep_ns, int repetitions, Result *res) {
+    uint64_t iters = 1;
+    uint64_t warmup_iters = 0;
+    uint64_t warmup_start = uni_time_ns();
+    uint64_t elapsed = 0;
+    do {
+        bench->run(iters);
+        warmup_iters += iters;
+        elapsed = uni_time_ns() - warmup_start;
+        if (iters < (1ull << 40)) {
+            iters *= 2;
+        }
+    } while (elapsed < warmup_ns);
+
+    double warmup_ns_per_op = (double) elapsed / warmup_iters;
+    res->iters = (uint64_t) (rep_ns / warmup_ns_per_op);
+    if (res->iters == 0) {
+        res->iters = 1;
+    }
+
+    res->repetitions = repetitions;
+    uint64_t allocs_before = allocs;
+    for (int i = 0; i < repetitions; i++) {
+        uint64_t start = uni_time_ns();
+        bench->run(res->iters);
+        res->ns_per_op[i] = (double) (uni_time_ns() - start) / res->iters;
+    }
+    res->allocs_per_op = (double) (allocs - allocs_before) / ((double) res->iters * repetitions);
+
+    double sorted[MAX_REPETITIONS];
+    memcpy(sorted, res->ns_per_op, repetitions * sizeof(double));
+    qsort(sorted, repetitions, sizeof(double), compare_doubles);
+    res->min_ns = sorted[0];
+    res->median_ns = repetitions % 2 == 1
+        ? sorted[repetitions / 2]
+        : (sorted[repetitions / 2 - 1] + sorted[repetitions / 2]) / 2;
+
+    double bytes = bench->bytes_per_op ? bench->bytes_per_op() : 0;
+    res->bytes_per_sec = bytes > 0 ? bytes / (res->median_ns / 1e9) : 0;
+}
+
+static void write_json(FILE *file, const char *label, Result *results, bool *selected) {
+    fprintf(file, "{\n");
+    fprintf(file, "  \"label\": \"%s\",\n", label);
+    fprintf(file, "  \"build_type\": \"%s\",\n", UNI_BENCH_BUILD_TYPE);
+    fprintf(file, "  \"benchmarks\": [");
+
+    bool first = true;
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        if (!selected[i]) {
+            continue;
+        }
+
+        Result *res = &results[i];
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.4f, \"min_ns_per_op\": %.4f, "
+            "\"bytes_per_sec\": %.1f, \"allocs_per_op\": %.4f, \"repetitions\": [",
+            first ? "" : ",", benchmarks[i].name, (unsigned long long) res->iters, res->median_ns, res->min_ns,
+            res->bytes_per_sec, res->allocs_per_op);
+        for (int j = 0; j < res->repetitions; j++) {
+            fprintf(file, "%s%.4f", j == 0 ? "" : ", ", res->ns_per_op[j]);
+        }
+        fprintf(file, "]}");
+        first = false;
+    }
+
+    fprintf(file, "\n  ]\n}\n");
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "Usage: %s [options] [benchmark name prefix...]\n"
+        "  -w ms          warmup time per benchmark (default 200)\n"
+        "  -t ms          time per repetition (default 100)\n"
+        "  -r count       repetitions (default 10, max %d)\n"
+        "  -o file        write results as JSON to 'file'\n"
+        "  -l label       label stored in the JSON output, e.g. a commit hash\n"
+        "  -L             list benchmarks and exit\n",
+        argv0, MAX_REPETITIONS);
+}
+
+int main(int argc, char **argv) {
+    uint64_t warmup_ms = 200;
+    uint64_t rep_ms = 100;
+    int repetitions = 10;
+    const char *out_path = NULL;
+    const char *label = "";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:t:r:o:l:Lh")) != -1) {
+        switch (opt) {
+            case 'w': warmup_ms = strtoull(optarg, NULL, 10); break;
+            case 't': rep_ms = strtoull(optarg, NULL, 10); break;
+            case 'r': repetitions = atoi(optarg); break;
+            case 'o': out_path = optarg; break;
+            case 'l': label = optarg; break;
+            case 'L':
+                for (int i = 0; i < NUM_BENCHMARKS; i++) {
+                    puts(benchmarks[i].name);
+                }
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (repetitions < 1 || repetitions > MAX_REPETITIONS || rep_ms == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bool selected[NUM_BENCHMARKS];
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        selected[i] = optind == argc;
+        for (int arg = optind; arg < argc; arg++) {
+            if (strncmp(benchmarks[i].name, argv[arg], strlen(argv[arg])) == 0) {
+                selected[i] = true;
+            }
+        }
+    }
+
+    if (strcmp(UNI_BENCH_BUILD_TYPE, "Release") != 0 && strcmp(UNI_BENCH_BUILD_TYPE, "RelWithDebInfo") != 0) {
+        fprintf(stderr, "Warning: not an optimized build (CMAKE_BUILD_TYPE=\"%s\"). "
+            "Results won't be representative.\n", UNI_BENCH_BUILD_TYPE);
+    }
+
+    init_inputs();
+
+    bool need_server = false;
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        need_server |= selected[i] && strncmp(benchmarks[i].name, "loopback/", 9) == 0;
+    }
+
+    if (need_server) {
+        // The loopback benchmarks measure the cost of handling packets, not
+        // of timing it.
+        UniConfig config;
+        uni_default_config(&config);
+        config.latency_histograms = false;
+
+        in.loopback_server = uni_create_with_config(0, BENCH_SECRET, NULL, &config, NULL);
+        if (in.loopback_server == NULL) {
+            fprintf(stderr, "Couldn't create a server for the loopback benchmarks\n");
+            return 1;
+        }
+    }
+
+    if (any_selected(selected, "tcp/uring/") && !start_tcp_server(&in.tcp_uring, UNI_BACKEND_URING)) {
+        fprintf(stderr, "io_uring is unavailable, skipping the tcp/uring/ benchmarks\n");
+        deselect(selected, "tcp/uring/");
+    }
+    if (any_selected(selected, "tcp/epoll/") && !start_tcp_server(&in.tcp_epoll, UNI_BACKEND_EPOLL)) {
+        fprintf(stderr, "epoll is unavailable, skipping the tcp/epoll/ benchmarks\n");
+        deselect(selected, "tcp/epoll/");
+    }
+
+    static Result results[NUM_BENCHMARKS];
+    printf("%-28s %14s %12s %12s %14s\n", "benchmark", "iterations", "ns/op", "MB/s", "allocs/op");
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        if (!selected[i]) {
+            continue;
+        }
+
+        Result *res = &results[i];
+        run_benchmark(&benchmarks[i], warmup_ms * 1000000, rep_ms * 1000000, repetitions, res);
+        printf("%-28s %14llu %12.2f %12.1f %14.3f\n", benchmarks[i].name, (unsigned long long) res->iters,
+            res->median_ns, res->bytes_per_sec / 1e6, res->allocs_per_op);
+        fflush(stdout);
+    }
+
+    if (out_path != NULL) {
+        FILE *file = fopen(out_path, "w");
+        if (file == NULL) {
+            perror(out_path);
+            return 1;
+        }
+
+        write_json(file, label, results, selected);
+        fclose(file);
+    }
+
+    return 0;
+}
@@ -0,0 +1,827 @@
+// Synthetic Velocity client for load testing uni servers.
+//
+// Every connection goes through the same steps a Velocity proxy would take:
+// Handshake, Login Start, answering the velocity:player_info plugin request with
+// forwarding data signed using the shared secret, and then sending PLAY packets
+// at a fixed rate. Each worker thread drives its share of the connections with
+// its own io_uring instance.
+
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hmac_sha256.h"
+#include "liburing.h"
+
+#define RING_ENTRIES 1024
+#define READ_BUF_SIZE 4096
+#define WRITE_BUF_SIZE 65536
+#define TICK_NS 10000000
+#define MAX_MIX 16
+
+// uni reads PLAY packet lengths of up to two bytes, so larger packets get the
+// connection closed.
+#define MAX_PLAY_PACKET 16383
+
+#define PKT_HANDSHAKE 0x00
+#define PKT_LOGIN_START 0x00
+#define PKT_LOGIN_PLUGIN_REQ 0x04
+#define PKT_LOGIN_PLUGIN_RES 0x02
+#define PKT_LOGIN_SUCCESS 0x02
+#define PKT_PLAY_PLUGIN_MSG 0x0C
+
+#define PROTOCOL_VERSION 759
+#define FORWARDING_VERSION 1
+#define LOADGEN_CHANNEL "uni:loadgen"
+
+// Log-linear latency histogram, same layout as uni's UniHistogram.
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS 528
+
+typedef enum {
+    OP_CONNECT = 1,
+    OP_READ,
+    OP_WRITE,
+    OP_TICK,
+} Op;
+
+typedef enum {
+    CONN_IDLE,
+    CONN_CONNECTING,
+    CONN_LOGGING_IN,
+    CONN_PLAY,
+    CONN_CLOSED,
+} ConnState;
+
+typedef struct {
+    int id;
+    int size;
+    int weight;
+} MixEntry;
+
+typedef struct Worker Worker;
+
+typedef struct {
+    Worker *worker;
+    int index;
+    int fd;
+    ConnState state;
+    int pending_ops;
+
+    uint64_t connect_ns;
+    double credit;
+    unsigned mix_cursor;
+
+    char name[17];
+    unsigned char uuid[16];
+
+    unsigned char read_buf[READ_BUF_SIZE];
+    int read_len;
+
+    unsigned char *write_buf;
+    int write_len;
+    int write_inflight;
+} Conn;
+
+struct Worker {
+    int index;
+    pthread_t thread;
+    struct io_uring ring;
+    struct __kernel_timespec tick;
+
+    Conn *conns;
+    int num_conns;
+
+    uint64_t hist[HIST_BUCKETS];
+};
+
+typedef struct {
+    struct sockaddr_in addr;
+    const char *secret;
+    int connections;
+    int threads;
+    int duration_secs;
+    double rate;
+    bool reconnect;
+    bool stall;
+    int num_properties;
+    MixEntry mix[MAX_MIX];
+    int mix_len;
+    int mix_total_weight;
+} Options;
+
+static Options opts;
+static volatile bool running = true;
+
+// Filled in by main() before the workers start.
+static char texture_signature[684];
+
+static uint64_t total_logins;
+static uint64_t total_packets;
+static uint64_t total_bytes;
+static uint64_t total_errors;
+static uint64_t total_closed;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns) {
+    if (ns < (1 << HIST_SUB_BITS)) {
+        return (int) ns;
+    }
+
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - HIST_SUB_BITS;
+    int bucket = (shift + 1) * (1 << HIST_SUB_BITS) + (int) ((ns >> shift) & ((1 << HIST_SUB_BITS) - 1));
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_bucket_max(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return (uint64_t) bucket;
+    }
+
+    int shift = bucket / (1 << HIST_SUB_BITS) - 1;
+    uint64_t sub = (uint64_t) (bucket % (1 << HIST_SUB_BITS)) | (1 << HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, double percentile) {
+    uint64_t count = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        count += hist[i];
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t) (count * (percentile / 100.0));
+    if (target >= count) {
+        target = count - 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > target) {
+            return hist_bucket_max(i);
+        }
+    }
+
+    return 0;
+}
+
+static unsigned char *write_varint(unsigned char *dest, int val) {
+    unsigned int v = (unsigned int) val;
+    do {
+        unsigned char temp = v & 0b01111111;
+        v >>= 7;
+        if (v != 0) {
+            temp |= 0b10000000;
+        }
+        *dest++ = temp;
+    } while (v != 0);
+    return dest;
+}
+
+static unsigned char *write_str(unsigned char *dest, const char *str, int len) {
+    dest = write_varint(dest, len);
+    memcpy(dest, str, len);
+    return dest + len;
+}
+
+static int varint_size(int val) {
+    unsigned char buf[5];
+    return (int) (write_varint(buf, val) - buf);
+}
+
+// Reads a varint from 'buf'. Returns the number of bytes consumed, 0 if more
+// data is needed, or -1 if the varint is malformed.
+static int read_varint(const unsigned char *buf, int len, int *result) {
+    *result = 0;
+    for (int i = 0; i < 5; i++) {
+        if (i >= len) {
+            return 0;
+        }
+
+        *result |= (buf[i] & 0b01111111) << (7 * i);
+        if ((buf[i] & 0b10000000) == 0) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+static struct io_uring_sqe *get_sqe(Worker *worker) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&worker->ring);
+    while (sqe == NULL) {
+        io_uring_submit(&worker->ring);
+        sqe = io_uring_get_sqe(&worker->ring);
+    }
+    return sqe;
+}
+
+static void set_user_data(struct io_uring_sqe *sqe, void *ptr, Op op) {
+    sqe->user_data = (__u64) (uintptr_t) ptr | op;
+}
+
+static void queue_read(Conn *conn) {
+    struct io_uring_sqe *sqe = get_sqe(conn->worker);
+    io_uring_prep_recv(sqe, conn->fd, &conn->read_buf[conn->read_len], READ_BUF_SIZE - conn->read_len, 0);
+    set_user_data(sqe, conn, OP_READ);
+    conn->pending_ops++;
+}
+
+static void flush_writes(Conn *conn) {
+    if (conn->write_inflight > 0 || conn->write_len == 0) {
+        return;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(conn->worker);
+    io_uring_prep_send(sqe, conn->fd, conn->write_buf, conn->write_len, 0);
+    set_user_data(sqe, conn, OP_WRITE);
+    conn->write_inflight = conn->write_len;
+    conn->pending_ops++;
+}
+
+// Returns a pointer to 'len' bytes at the end of the connection's write buffer,
+// or NULL if the buffer is full.
+static unsigned char *reserve_write(Conn *conn, int len) {
+    if (conn->write_len + len > WRITE_BUF_SIZE) {
+        return NULL;
+    }
+
+    unsigned char *dest = &conn->write_buf[conn->write_len];
+    conn->write_len += len;
+    return dest;
+}
+
+// Appends a length-prefixed frame with the given body to the write buffer.
+static bool append_frame(Conn *conn, const unsigned char *body, int body_len) {
+    unsigned char *dest = reserve_write(conn, varint_size(body_len) + body_len);
+    if (dest == NULL) {
+        return false;
+    }
+
+    dest = write_varint(dest, body_len);
+    memcpy(dest, body, body_len);
+    return true;
+}
+
+static void start_connect(Conn *conn) {
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->fd == -1) {
+        __atomic_add_fetch(&total_errors, 1, __ATOMIC_RELAXED);
+        conn->state = CONN_CLOSED;
+        return;
+    }
+
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn->state = CONN_CONNECTING;
+    conn->read_len = 0;
+    conn->write_len = 0;
+    conn->write_inflight = 0;
+    conn->credit = 0;
+    conn->connect_ns = now_ns();
+
+    for (int i = 0; i < 16; i++) {
+        conn->uuid[i] = (unsigned char) rand();
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(conn->worker);
+    io_uring_prep_connect(sqe, conn->fd, (struct sockaddr *) &opts.addr, sizeof(opts.addr));
+    set_user_data(sqe, conn, OP_CONNECT);
+    conn->pending_ops++;
+}
+
+static void send_login(Conn *conn) {
+    unsigned char body[512];
+    unsigned char *cursor = body;
+
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &opts.addr.sin_addr, host, sizeof(host));
+
+    cursor = write_varint(cursor, PKT_HANDSHAKE);
+    cursor = write_varint(cursor, PROTOCOL_VERSION);
+    cursor = write_str(cursor, host, (int) strlen(host));
+    *cursor++ = (unsigned char) (ntohs(opts.addr.sin_port) >> 8);
+    *cursor++ = (unsigned char) ntohs(opts.addr.sin_port);
+    cursor = write_varint(cursor, 2);
+    append_frame(conn, body, (int) (cursor - body));
+
+    cursor = body;
+    cursor = write_varint(cursor, PKT_LOGIN_START);
+    cursor = write_str(cursor, conn->name, (int) strlen(conn->name));
+    *cursor++ = 0; // No signature data
+    append_frame(conn, body, (int) (cursor - body));
+
+    flush_writes(conn);
+}
+
+// Answers the velocity:player_info request with signed forwarding data.
+static bool send_plugin_res(Conn *conn, int message_id) {
+    static const char texture_value[] =
+        "ewogICJ0aW1lc3RhbXAiIDogMTY1NjI0MDAwMDAwMCwKICAicHJvZmlsZUlkIiA6ICIwMDAwMDAwMDAwMDAwMDAw"
+        "MDAwMDAwMDAwMDAwMDAwMCIsCiAgInByb2ZpbGVOYW1lIiA6ICJ1bmlfbG9hZGdlbiIsCiAgInRleHR1cmVzIiA6"
+        "IHsKICAgICJTS0lOIiA6IHsKICAgICAgInVybCIgOiAiaHR0cDovL3RleHR1cmVzLm1pbmVjcmFmdC5uZXQvdGV4"
+        "dHVyZS8wMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAwMDAw"
+        "MDAwIgogICAgfQogIH0KfQ==";
+
+    unsigned char data[4096];
+    unsigned char *cursor = data;
+
+    cursor = write_varint(cursor, FORWARDING_VERSION);
+    cursor = write_str(cursor, "127.0.0.1", 9);
+    memcpy(cursor, conn->uuid, 16);
+    cursor += 16;
+    cursor = write_str(cursor, conn->name, (int) strlen(conn->name));
+    cursor = write_varint(cursor, opts.num_properties);
+    for (int i = 0; i < opts.num_properties; i++) {
+        cursor = write_str(cursor, "textures", 8);
+        cursor = write_str(cursor, texture_value, sizeof(texture_value) - 1);
+        *cursor++ = 1;
+        cursor = write_str(cursor, texture_signature, sizeof(texture_signature));
+    }
+    int data_len = (int) (cursor - data);
+
+    unsigned char body[4096 + 64];
+    cursor = body;
+    cursor = write_varint(cursor, PKT_LOGIN_PLUGIN_RES);
+    cursor = write_varint(cursor, message_id);
+    *cursor++ = 1; // Understood
+    hmac_sha256(opts.secret, strlen(opts.secret), data, data_len, cursor, 32);
+    cursor += 32;
+    memcpy(cursor, data, data_len);
+    cursor += data_len;
+
+    if (!append_frame(conn, body, (int) (cursor - body))) {
+        return false;
+    }
+
+    flush_writes(conn);
+    return true;
+}
+
+// Appends the PLAY packets which are due to the write buffer.
+static void send_play_packets(Conn *conn, double elapsed_secs) {
+    conn->credit += opts.rate * elapsed_secs;
+
+    unsigned char body[WRITE_BUF_SIZE];
+    while (conn->credit >= 1) {
+        // Weighted round robin over the mix.
+        unsigned slot = conn->mix_cursor++ % (unsigned) opts.mix_total_weight;
+        MixEntry *entry = &opts.mix[0];
+        for (int i = 0; i < opts.mix_len; i++) {
+            if (slot < (unsigned) opts.mix[i].weight) {
+                entry = &opts.mix[i];
+                break;
+            }
+            slot -= opts.mix[i].weight;
+        }
+
+        unsigned char *cursor = write_varint(body, entry->id);
+        if (entry->id == PKT_PLAY_PLUGIN_MSG) {
+            cursor = write_str(cursor, LOADGEN_CHANNEL, sizeof(LOADGEN_CHANNEL) - 1);
+        }
+        memset(cursor, 0x55, entry->size);
+        cursor += entry->size;
+
+        int len = (int) (cursor - body);
+        if (!append_frame(conn, body, len)) {
+            // The server isn't keeping up. Try again next tick.
+            break;
+        }
+
+        conn->credit -= 1;
+        __atomic_add_fetch(&total_packets, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&total_bytes, len, __ATOMIC_RELAXED);
+    }
+
+    flush_writes(conn);
+}
+
+static void close_conn(Conn *conn) {
+    if (conn->state == CONN_CLOSED || conn->state == CONN_IDLE) {
+        return;
+    }
+
+    shutdown(conn->fd, SHUT_RDWR);
+    conn->state = CONN_CLOSED;
+    __atomic_add_fetch(&total_closed, 1, __ATOMIC_RELAXED);
+}
+
+// Called once all of a closed connection's operations have completed.
+static void finish_conn(Conn *conn) {
+    close(conn->fd);
+    conn->state = CONN_IDLE;
+
+    if (opts.reconnect && running) {
+        start_connect(conn);
+    }
+}
+
+// Handles a complete frame received from the server.
+static bool handle_frame(Conn *conn, const unsigned char *body, int len) {
+    if (conn->state != CONN_LOGGING_IN) {
+        // The server may send anything in PLAY; it is only counted as read.
+        return true;
+    }
+
+    int id;
+    int n = read_varint(body, len, &id);
+    if (n <= 0) {
+        return false;
+    }
+
+    if (id == PKT_LOGIN_PLUGIN_REQ) {
+        if (opts.stall) {
+            return true;
+        }
+
+        int message_id;
+        if (read_varint(&body[n], len - n, &message_id) <= 0) {
+            return false;
+        }
+
+        return send_plugin_res(conn, message_id);
+    }
+
+    if (id == PKT_LOGIN_SUCCESS) {
+        Worker *worker = conn->worker;
+        worker->hist[hist_bucket(now_ns() - conn->connect_ns)]++;
+        __atomic_add_fetch(&total_logins, 1, __ATOMIC_RELAXED);
+        conn->state = CONN_PLAY;
+        return true;
+    }
+
+    return false;
+}
+
+static void handle_read(Conn *conn, int res) {
+    if (res <= 0 || conn->state == CONN_CLOSED) {
+        if (res < 0) {
+            __atomic_add_fetch(&total_errors, 1, __ATOMIC_RELAXED);
+        }
+        close_conn(conn);
+        return;
+    }
+
+    conn->read_len += res;
+
+    int offset = 0;
+    while (offset < conn->read_len) {
+        int len;
+        int n = read_varint(&conn->read_buf[offset], conn->read_len - offset, &len);
+        if (n < 0 || len < 0 || len > READ_BUF_SIZE - 5) {
+            // Frames too large for the buffer are never sent during login, and
+            // PLAY frames don't matter. Drop whatever was received.
+            if (conn->state == CONN_PLAY) {
+                offset = conn->read_len;
+                break;
+            }
+            close_conn(conn);
+            return;
+        }
+
+        if (n == 0 || offset + n + len > conn->read_len) {
+            break;
+        }
+
+        if (!handle_frame(conn, &conn->read_buf[offset + n], len)) {
+            __atomic_add_fetch(&total_errors, 1, __ATOMIC_RELAXED);
+            close_conn(conn);
+            return;
+        }
+
+        offset += n + len;
+    }
+
+    memmove(conn->read_buf, &conn->read_buf[offset], conn->read_len - offset);
+    conn->read_len -= offset;
+    queue_read(conn);
+}
+
+static void handle_write(Conn *conn, int res) {
+    if (res <= 0) {
+        __atomic_add_fetch(&total_errors, 1, __ATOMIC_RELAXED);
+        conn->write_inflight = 0;
+        close_conn(conn);
+        return;
+    }
+
+    memmove(conn->write_buf, &conn->write_buf[res], conn->write_len - res);
+    conn->write_len -= res;
+    conn->write_inflight = 0;
+
+    if (conn->state != CONN_CLOSED) {
+        flush_writes(conn);
+    }
+}
+
+static void queue_tick(Worker *worker) {
+    worker->tick.tv_sec = 0;
+    worker->tick.tv_nsec = TICK_NS;
+
+    struct io_uring_sqe *sqe = get_sqe(worker);
+    io_uring_prep_timeout(sqe, &worker->tick, 0, 0);
+    set_user_data(sqe, worker, OP_TICK);
+}
+
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+
+    if (io_uring_queue_init(RING_ENTRIES, &worker->ring, 0) < 0) {
+        fprintf(stderr, "worker %d: io_uring_queue_init failed\n", worker->index);
+        return NULL;
+    }
+
+    for (int i = 0; i < worker->num_conns; i++) {
+        start_connect(&worker->conns[i]);
+    }
+    queue_tick(worker);
+
+    uint64_t last_tick = now_ns();
+
+    while (running) {
+        io_uring_submit_and_wait(&worker->ring, 1);
+
+        unsigned head;
+        unsigned count = 0;
+        struct io_uring_cqe *cqe;
+        io_uring_for_each_cqe(&worker->ring, head, cqe) {
+            count++;
+
+            Op op = (Op) (cqe->user_data & 7);
+            void *ptr = (void *) (uintptr_t) (cqe->user_data & ~(__u64) 7);
+
+            if (op == OP_TICK) {
+                uint64_t now = now_ns();
+                double elapsed = (now - last_tick) / 1e9;
+                last_tick = now;
+
+                for (int i = 0; i < worker->num_conns; i++) {
+                    if (worker->conns[i].state == CONN_PLAY) {
+                        send_play_packets(&worker->conns[i], elapsed);
+                    }
+                }
+                queue_tick(worker);
+                continue;
+            }
+
+            Conn *conn = ptr;
+            conn->pending_ops--;
+
+            switch (op) {
+                case OP_CONNECT:
+                    if (cqe->res < 0 || conn->state == CONN_CLOSED) {
+                        __atomic_add_fetch(&total_errors, 1, __ATOMIC_RELAXED);
+                        close_conn(conn);
+                    } else {
+                        conn->state = CONN_LOGGING_IN;
+                        queue_read(conn);
+                        send_login(conn);
+                    }
+                    break;
+
+                case OP_READ:
+                    handle_read(conn, cqe->res);
+                    break;
+
+                case OP_WRITE:
+                    handle_write(conn, cqe->res);
+                    break;
+
+                case OP_TICK:
+                    break;
+            }
+
+            if (conn->state == CONN_CLOSED && conn->pending_ops == 0) {
+                finish_conn(conn);
+            }
+        }
+
+        io_uring_cq_advance(&worker->ring, count);
+    }
+
+    for (int i = 0; i < worker->num_conns; i++) {
+        if (worker->conns[i].state != CONN_IDLE) {
+            close(worker->conns[i].fd);
+        }
+    }
+
+    io_uring_queue_exit(&worker->ring);
+    return NULL;
+}
+
+// Parses a packet mix of the form "id:size[:weight],...", e.g. "0x0C:64:3,0x14:8".
+static bool parse_mix(const char *spec) {
+    opts.mix_len = 0;
+    opts.mix_total_weight = 0;
+
+    char *copy = strdup(spec);
+    char *save;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if (opts.mix_len == MAX_MIX) {
+            free(copy);
+            return false;
+        }
+
+        MixEntry *entry = &opts.mix[opts.mix_len];
+        entry->weight = 1;
+        if (sscanf(tok, "%i:%i:%i", &entry->id, &entry->size, &entry->weight) < 2 ||
+            entry->id < 0 || entry->size < 0 || entry->weight < 1) {
+            free(copy);
+            return false;
+        }
+
+        int body_len = varint_size(entry->id) + entry->size;
+        if (entry->id == PKT_PLAY_PLUGIN_MSG) {
+            body_len += varint_size(sizeof(LOADGEN_CHANNEL) - 1) + sizeof(LOADGEN_CHANNEL) - 1;
+        }
+        if (entry->size > MAX_PLAY_PACKET || body_len > MAX_PLAY_PACKET) {
+            free(copy);
+            return false;
+        }
+
+        opts.mix_total_weight += entry->weight;
+        opts.mix_len++;
+    }
+
+    free(copy);
+    return opts.mix_len > 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -H host        server address (default 127.0.0.1)\n"
+        "  -p port        server port (default 25566)\n"
+        "  -s secret      Velocity forwarding secret (default your-forwarding-secret)\n"
+        "  -c count       concurrent connections (default 100)\n"
+        "  -t threads     worker threads (default 1)\n"
+        "  -d seconds     test duration (default 10)\n"
+        "  -r rate        PLAY packets per second per connection (default 20)\n"
+        "  -m mix         PLAY packet mix as id:size[:weight],... (default 0x0C:32)\n"
+        "                 packets may be up to %d bytes including the id\n"
+        "                 0x0C packets are plugin messages on channel " LOADGEN_CHANNEL "\n"
+        "  -P count       Mojang properties sent per login (default 1)\n"
+        "  -R             reconnect whenever a connection is closed\n"
+        "  -S             never answer the plugin request, so that every connection\n"
+        "                 runs into the server's login timeout, all at once if the\n"
+        "                 server's admission limits are disabled\n",
+        argv0, MAX_PLAY_PACKET);
+}
+
+int main(int argc, char **argv) {
+    memset(&opts, 0, sizeof(opts));
+    opts.addr.sin_family = AF_INET;
+    opts.addr.sin_port = htons(25566);
+    inet_pton(AF_INET, "127.0.0.1", &opts.addr.sin_addr);
+    opts.secret = "your-forwarding-secret";
+    opts.connections = 100;
+    opts.threads = 1;
+    opts.duration_secs = 10;
+    opts.rate = 20;
+    opts.num_properties = 1;
+    parse_mix("0x0C:32");
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:s:c:t:d:r:m:P:RSh")) != -1) {
+        switch (opt) {
+            case 'H':
+                if (inet_pton(AF_INET, optarg, &opts.addr.sin_addr) != 1) {
+                    fprintf(stderr, "Invalid IPv4 address: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p': opts.addr.sin_port = htons((uint16_t) atoi(optarg)); break;
+            case 's': opts.secret = optarg; break;
+            case 'c': opts.connections = atoi(optarg); break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 'd': opts.duration_secs = atoi(optarg); break;
+            case 'r': opts.rate = atof(optarg); break;
+            case 'm':
+                if (!parse_mix(optarg)) {
+                    fprintf(stderr, "Invalid packet mix: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P': opts.num_properties = atoi(optarg); break;
+            case 'R': opts.reconnect = true; break;
+            case 'S': opts.stall = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (opts.connections < 1 || opts.threads < 1 || opts.num_properties < 0 || opts.num_properties > 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.threads > opts.connections) {
+        opts.threads = opts.connections;
+    }
+
+    memset(texture_signature, 'A', sizeof(texture_signature));
+
+    // Each connection needs a descriptor, which the default soft limit often
+    // doesn't allow for large bursts.
+    struct rlimit limit;
+    rlim_t wanted = (rlim_t) opts.connections + 64;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < wanted) {
+        limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    Worker *workers = calloc(opts.threads, sizeof(Worker));
+    Conn *conns = calloc(opts.connections, sizeof(Conn));
+    for (int i = 0; i < opts.connections; i++) {
+        conns[i].index = i;
+        conns[i].state = CONN_IDLE;
+        conns[i].write_buf = malloc(WRITE_BUF_SIZE);
+        snprintf(conns[i].name, sizeof(conns[i].name), "lg%d", i);
+    }
+
+    int per_worker = opts.connections / opts.threads;
+    int extra = opts.connections % opts.threads;
+    int next = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        workers[i].index = i;
+        workers[i].conns = &conns[next];
+        workers[i].num_conns = per_worker + (i < extra ? 1 : 0);
+        for (int j = 0; j < workers[i].num_conns; j++) {
+            workers[i].conns[j].worker = &workers[i];
+        }
+        next += workers[i].num_conns;
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+
+    printf("%6s %10s %12s %12s %8s %8s\n", "time", "logins/s", "packets/s", "MB/s", "errors", "closed");
+
+    uint64_t start = now_ns();
+    uint64_t prev_logins = 0, prev_packets = 0, prev_bytes = 0;
+    for (int sec = 1; sec <= opts.duration_secs; sec++) {
+        sleep(1);
+
+        uint64_t logins = __atomic_load_n(&total_logins, __ATOMIC_RELAXED);
+        uint64_t packets = __atomic_load_n(&total_packets, __ATOMIC_RELAXED);
+        uint64_t bytes = __atomic_load_n(&total_bytes, __ATOMIC_RELAXED);
+        printf("%5ds %10lu %12lu %12.2f %8lu %8lu\n", sec,
+            (unsigned long) (logins - prev_logins), (unsigned long) (packets - prev_packets),
+            (bytes - prev_bytes) / 1e6,
+            (unsigned long) __atomic_load_n(&total_errors, __ATOMIC_RELAXED),
+            (unsigned long) __atomic_load_n(&total_closed, __ATOMIC_RELAXED));
+        fflush(stdout);
+
+        prev_logins = logins;
+        prev_packets = packets;
+        prev_bytes = bytes;
+    }
+
+    running = false;
+    for (int i = 0; i < opts.threads; i++) {
+        // Workers wake up at least once per tick.
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+
+    uint64_t hist[HIST_BUCKETS] = {0};
+    for (int i = 0; i < opts.threads; i++) {
+        for (int j = 0; j < HIST_BUCKETS; j++) {
+            hist[j] += workers[i].hist[j];
+        }
+    }
+
+    printf("\n");
+    printf("logins:      %lu (%.1f/s)\n", (unsigned long) total_logins, total_logins / elapsed);
+    printf("packets:     %lu (%.1f/s)\n", (unsigned long) total_packets, total_packets / elapsed);
+    printf("errors:      %lu\n", (unsigned long) total_errors);
+    printf("closed:      %lu\n", (unsigned long) total_closed);
+    printf("login latency (connect -> Login Success):\n");
+    printf("  p50 %8.3f ms\n", hist_percentile(hist, 50) / 1e6);
+    printf("  p90 %8.3f ms\n", hist_percentile(hist, 90) / 1e6);
+    printf("  p99 %8.3f ms\n", hist_percentile(hist, 99) / 1e6);
+    printf("  max %8.3f ms\n", hist_percentile(hist, 100) / 1e6);
+
+    return total_errors > 0 ? 2 : 0;
+}
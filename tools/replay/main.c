@@ -0,0 +1,506 @@
+// Replays a capture written by a server with UniConfig.capture_path set.
+//
+// Every captured connection becomes a loopback connection to a fresh server,
+// and its frames are fed back through the packet handlers in their original
+// order, either at the pace they were recorded or as fast as possible. The
+// Velocity message ID in each plugin response is rewritten to the one the
+// replaying server asked for; the forwarding data's signature is still checked,
+// so the server's secret has to be passed with -s. A connection whose records
+// the server had to drop is closed at the gap, and the rest of its frames are
+// skipped.
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "uni.h"
+#include "uni_capture.h"
+#include "uni_loopback.h"
+
+#define PKT_LOGIN_PLUGIN_REQ 0x04
+#define PKT_LOGIN_PLUGIN_RES 0x02
+
+typedef struct {
+    uint64_t id;
+    bool used;
+
+    UniLoopback *client;
+
+    // Set once the connection logged in. Released when the capture says the
+    // connection was closed.
+    UniConnection *player;
+
+    // Frames replayed so far. The third is the plugin response.
+    int frames;
+
+    // Message ID of the plugin request the replaying server sent, or -1 if it
+    // hasn't been received yet.
+    int plugin_req_id;
+} Conn;
+
+// Open connections by capture connection ID, in a hash table with linear
+// probing. IDs are only unique within a server's lifetime and can be
+// arbitrarily large, so only connections which are open take up space.
+static Conn *conns;
+static uint64_t conns_cap;
+static uint64_t num_conns;
+
+// The connection whose frame is being handled.
+static Conn *current_conn;
+
+static uint64_t joins;
+static uint64_t packets_received;
+
+void *uni_on_login(void *server, UniConnection *conn, UniLoginData *data) {
+    current_conn->player = conn;
+    return conn;
+}
+
+void uni_on_join(void *server, void *player) {
+    joins++;
+}
+
+bool uni_on_packet_received(void *server, void *player, int packet_id, void *pkt_struct) {
+    packets_received++;
+    return true;
+}
+
+void uni_on_write_finish(void *user_ptr) {
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline) {
+    uint64_t now = now_ns();
+    if (now >= deadline) {
+        return;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = (deadline - now) / 1000000000;
+    ts.tv_nsec = (deadline - now) % 1000000000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+// Reads an unsigned LEB128 value. Returns false at the end of the file.
+static bool read_uvarint(FILE *file, uint64_t *result) {
+    *result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) {
+            return false;
+        }
+
+        *result |= (uint64_t) (byte & 0b01111111) << shift;
+        if ((byte & 0b10000000) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decodes a protocol varint from 'buf'. Returns the number of bytes used, or 0
+// if it is incomplete or malformed.
+static int decode_varint(const unsigned char *buf, int len, int *result) {
+    *result = 0;
+    for (int i = 0; i < 5 && i < len; i++) {
+        *result |= (buf[i] & 0b01111111) << (7 * i);
+        if ((buf[i] & 0b10000000) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static unsigned char *encode_varint(unsigned char *dest, int val) {
+    unsigned int v = (unsigned int) val;
+    do {
+        unsigned char temp = v & 0b01111111;
+        v >>= 7;
+        if (v != 0) {
+            temp |= 0b10000000;
+        }
+        *dest++ = temp;
+    } while (v != 0);
+    return dest;
+}
+
+static uint64_t conn_slot(uint64_t id) {
+    return (id * 0x9E3779B97F4A7C15ull >> 32) & (conns_cap - 1);
+}
+
+// Returns the open connection with the given ID, or NULL.
+static Conn *find_conn(uint64_t id) {
+    if (conns_cap == 0) {
+        return NULL;
+    }
+
+    for (uint64_t slot = conn_slot(id); conns[slot].used; slot = (slot + 1) & (conns_cap - 1)) {
+        if (conns[slot].id == id) {
+            return &conns[slot];
+        }
+    }
+    return NULL;
+}
+
+// Returns the connection with the given ID, adding an empty one if it isn't
+// open. The table is kept at most half full.
+static Conn *add_conn(uint64_t id) {
+    Conn *conn = find_conn(id);
+    if (conn != NULL) {
+        return conn;
+    }
+
+    if ((num_conns + 1) * 2 > conns_cap) {
+        Conn *old = conns;
+        uint64_t old_cap = conns_cap;
+
+        conns_cap = old_cap == 0 ? 1024 : old_cap * 2;
+        conns = calloc(conns_cap, sizeof(Conn));
+        if (conns == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+
+        for (uint64_t i = 0; i < old_cap; i++) {
+            if (old[i].used) {
+                uint64_t slot = conn_slot(old[i].id);
+                while (conns[slot].used) {
+                    slot = (slot + 1) & (conns_cap - 1);
+                }
+                conns[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    uint64_t slot = conn_slot(id);
+    while (conns[slot].used) {
+        slot = (slot + 1) & (conns_cap - 1);
+    }
+
+    conn = &conns[slot];
+    memset(conn, 0, sizeof(Conn));
+    conn->id = id;
+    conn->used = true;
+    num_conns++;
+    return conn;
+}
+
+// Removes a connection from the table, moving later entries of its probe
+// chain back so lookups don't stop early.
+static void remove_conn(Conn *conn) {
+    uint64_t mask = conns_cap - 1;
+    uint64_t hole = (uint64_t) (conn - conns);
+    conns[hole].used = false;
+    num_conns--;
+
+    for (uint64_t slot = (hole + 1) & mask; conns[slot].used; slot = (slot + 1) & mask) {
+        // Entries whose home slot lies cyclically in (hole, slot] stay.
+        uint64_t home = conn_slot(conns[slot].id);
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            conns[hole] = conns[slot];
+            conns[slot].used = false;
+            hole = slot;
+        }
+    }
+}
+
+// Discards what the server sent to the connection, apart from the ID of its
+// plugin request.
+static void drain(Conn *conn) {
+    unsigned char buf[4096];
+    int len;
+    while ((len = uni_loopback_recv(conn->client, buf, sizeof(buf))) > 0) {
+        if (conn->plugin_req_id != -1) {
+            continue;
+        }
+
+        // The plugin request is the first packet the server sends.
+        int frame_len, id, message_id;
+        int offset = decode_varint(buf, len, &frame_len);
+        int n = offset > 0 ? decode_varint(&buf[offset], len - offset, &id) : 0;
+        if (n > 0 && id == PKT_LOGIN_PLUGIN_REQ) {
+            offset += n;
+            if (decode_varint(&buf[offset], len - offset, &message_id) > 0) {
+                conn->plugin_req_id = message_id;
+            }
+        }
+    }
+}
+
+// Sends a captured frame to the server, re-adding the length prefix.
+static void send_frame(Conn *conn, unsigned char *frame, int len) {
+    static unsigned char *out;
+    static int out_cap;
+
+    int id;
+    int id_len = decode_varint(frame, len, &id);
+    if (conn->frames == 2 && id_len > 0 && id == PKT_LOGIN_PLUGIN_RES && conn->plugin_req_id != -1) {
+        int old_message_id;
+        int message_id_len = decode_varint(&frame[id_len], len - id_len, &old_message_id);
+        if (message_id_len > 0) {
+            unsigned char body_start[16];
+            unsigned char *cursor = encode_varint(body_start, id);
+            cursor = encode_varint(cursor, conn->plugin_req_id);
+            int new_prefix_len = (int) (cursor - body_start);
+            int rest_len = len - id_len - message_id_len;
+
+            int needed = 5 + new_prefix_len + rest_len;
+            if (needed > out_cap) {
+                out_cap = needed;
+                out = realloc(out, out_cap);
+            }
+
+            cursor = encode_varint(out, new_prefix_len + rest_len);
+            memcpy(cursor, body_start, new_prefix_len);
+            memcpy(cursor + new_prefix_len, &frame[id_len + message_id_len], rest_len);
+            uni_loopback_send(conn->client, out, (int) (cursor - out) + new_prefix_len + rest_len);
+            return;
+        }
+    }
+
+    if (len + 5 > out_cap) {
+        out_cap = len + 5;
+        out = realloc(out, out_cap);
+    }
+
+    unsigned char *cursor = encode_varint(out, len);
+    memcpy(cursor, frame, len);
+    uni_loopback_send(conn->client, out, (int) (cursor - out) + len);
+}
+
+// Closes the client's end of the connection and lets go of the player.
+static void close_conn(Conn *conn) {
+    if (conn->player != NULL) {
+        uni_release(conn->player);
+        conn->player = NULL;
+    }
+
+    if (conn->client != NULL) {
+        uni_loopback_close(conn->client);
+        conn->client = NULL;
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "Usage: %s [options] <capture file>\n"
+        "  -s secret      Velocity forwarding secret of the captured server\n"
+        "                 (default your-forwarding-secret)\n"
+        "  -x speed       replay speed relative to the capture, e.g. 2 for twice\n"
+        "                 as fast (default 1)\n"
+        "  -m             replay as fast as possible\n"
+        "  -n count       repeat the capture 'count' times (default 1)\n",
+        argv0);
+}
+
+int main(int argc, char **argv) {
+    const char *secret = "your-forwarding-secret";
+    double speed = 1;
+    bool max_speed = false;
+    int repeat = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:x:mn:h")) != -1) {
+        switch (opt) {
+            case 's': secret = optarg; break;
+            case 'x': speed = atof(optarg); break;
+            case 'm': max_speed = true; break;
+            case 'n': repeat = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || speed <= 0 || repeat < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    unsigned char header[UNI_CAPTURE_HEADER_LEN];
+    if (
+        fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        memcmp(header, UNI_CAPTURE_MAGIC, UNI_CAPTURE_MAGIC_LEN) != 0 ||
+        header[6] < 1 || header[6] > UNI_CAPTURE_VERSION
+    ) {
+        fprintf(stderr, "%s is not a capture of version %d or below\n", argv[optind], UNI_CAPTURE_VERSION);
+        return 1;
+    }
+
+    UniConfig config;
+    uni_default_config(&config);
+    UniServer *server = uni_create_with_config(0, secret, NULL, &config, NULL);
+    if (server == NULL) {
+        fprintf(stderr, "Couldn't create a server\n");
+        return 1;
+    }
+
+    uint64_t *latencies = NULL;
+    uint64_t num_latencies = 0;
+    uint64_t latencies_cap = 0;
+
+    uint64_t frames = 0;
+    uint64_t frame_bytes = 0;
+    uint64_t opened = 0;
+    uint64_t gaps = 0;
+    unsigned char *frame = NULL;
+    uint64_t frame_cap = 0;
+
+    uint64_t start = now_ns();
+    for (int round = 0; round < repeat; round++) {
+        fseek(file, UNI_CAPTURE_HEADER_LEN, SEEK_SET);
+
+        uint64_t round_start = now_ns();
+        uint64_t capture_time = 0;
+        int type;
+        while ((type = fgetc(file)) != EOF) {
+            uint64_t delta, id, len = 0;
+            if (!read_uvarint(file, &delta) || !read_uvarint(file, &id)) {
+                fprintf(stderr, "Truncated record\n");
+                break;
+            }
+
+            if (type == UNI_CAPTURE_FRAME) {
+                if (!read_uvarint(file, &len)) {
+                    fprintf(stderr, "Truncated record\n");
+                    break;
+                }
+
+                if (len > frame_cap) {
+                    frame_cap = len;
+                    frame = realloc(frame, frame_cap);
+                }
+
+                if (fread(frame, 1, len, file) != len) {
+                    fprintf(stderr, "Truncated frame\n");
+                    break;
+                }
+            }
+
+            capture_time += delta;
+            if (!max_speed) {
+                sleep_until(round_start + (uint64_t) (capture_time / speed));
+            }
+
+            Conn *conn = type == UNI_CAPTURE_OPEN ? add_conn(id) : find_conn(id);
+            switch (type) {
+                case UNI_CAPTURE_OPEN:
+                    close_conn(conn);
+                    conn->client = uni_loopback_connect(server);
+                    conn->frames = 0;
+                    conn->plugin_req_id = -1;
+                    opened++;
+                    uni_loopback_run(server, 0);
+                    break;
+
+                case UNI_CAPTURE_FRAME: {
+                    if (conn == NULL || conn->client == NULL) {
+                        // The capture started after this connection was
+                        // opened.
+                        break;
+                    }
+
+                    current_conn = conn;
+                    uint64_t frame_start = now_ns();
+                    send_frame(conn, frame, (int) len);
+                    uni_loopback_run(server, 0);
+                    uint64_t elapsed = now_ns() - frame_start;
+
+                    drain(conn);
+                    conn->frames++;
+                    frames++;
+                    frame_bytes += len;
+
+                    if (num_latencies == latencies_cap) {
+                        latencies_cap = latencies_cap == 0 ? 4096 : latencies_cap * 2;
+                        latencies = realloc(latencies, latencies_cap * sizeof(uint64_t));
+                    }
+                    latencies[num_latencies++] = elapsed;
+                    break;
+                }
+
+                case UNI_CAPTURE_CLOSE:
+                    if (conn != NULL) {
+                        close_conn(conn);
+                        remove_conn(conn);
+                        uni_loopback_run(server, 0);
+                    }
+                    break;
+
+                case UNI_CAPTURE_GAP:
+                    // Replaying past the gap would feed the server a broken
+                    // stream.
+                    if (conn != NULL) {
+                        if (conn->client != NULL) {
+                            gaps++;
+                        }
+                        close_conn(conn);
+                        remove_conn(conn);
+                        uni_loopback_run(server, 0);
+                    }
+                    break;
+
+                default:
+                    fprintf(stderr, "Unknown record type %d\n", type);
+                    return 1;
+            }
+        }
+
+        // Connections still open at the end of the capture are closed before
+        // the next round.
+        for (uint64_t i = 0; i < conns_cap; i++) {
+            if (conns[i].used) {
+                close_conn(&conns[i]);
+                conns[i].used = false;
+            }
+        }
+        num_conns = 0;
+        uni_loopback_run(server, 0);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("connections:  %llu\n", (unsigned long long) opened);
+    printf("logins:       %llu\n", (unsigned long long) joins);
+    printf("frames:       %llu (%.1f MB)\n", (unsigned long long) frames, frame_bytes / 1e6);
+    printf("play packets: %llu\n", (unsigned long long) packets_received);
+    if (gaps > 0) {
+        printf("cut short:    %llu connections (records dropped while capturing)\n", (unsigned long long) gaps);
+    }
+    printf("elapsed:      %.3f s (%.0f frames/s)\n", elapsed, frames / elapsed);
+
+    if (num_latencies > 0) {
+        qsort(latencies, num_latencies, sizeof(uint64_t), compare_u64);
+        printf("time to handle a frame:\n");
+        printf("  p50 %10.3f us\n", latencies[num_latencies / 2] / 1e3);
+        printf("  p90 %10.3f us\n", latencies[num_latencies * 90 / 100] / 1e3);
+        printf("  p99 %10.3f us\n", latencies[num_latencies * 99 / 100] / 1e3);
+        printf("  max %10.3f us\n", latencies[num_latencies - 1] / 1e3);
+    }
+
+    uni_free(server);
+    return 0;
+}